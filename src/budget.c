@@ -0,0 +1,257 @@
+/*
+ * budget.c
+ * Implementation of the memory budget.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "budget.h"
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "shm.h"
+#include "stats.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define BUDGET_HOLDERS 16384 // Processes whose charges are told apart
+#define BUDGET_PROBE 8 // Number of slots searched for a process or a free slot
+
+struct budget_holder {
+    pid_t pid; // 0 if the slot is unused
+    size_t held; // Bytes the process has charged and not given back
+};
+
+struct budget {
+    shm_lock_t lock;
+    bool verbose;
+    struct stats *stats;
+    struct shm_region region;
+    size_t limit;
+    size_t used, peak;    // Bytes charged now, and the most at once
+    unsigned long refused; // Charges that did not fit
+    struct budget_holder holders[BUDGET_HOLDERS];
+};
+
+/*
+ * Find the slot for the charges of a process, taking over a free one if it
+ * has none. A slot is free if it is unused or its process holds nothing.
+ * Returns NULL if there is no room, in which case the process's charges are
+ * only counted in the total.
+ * Called with the lock held.
+ */
+static struct budget_holder *
+budget_holder(struct budget *budget, pid_t pid)
+{
+    uint32_t const hash = (uint32_t)pid * 0x9e3779b1U;
+
+    struct budget_holder *victim = NULL;
+
+    for (size_t i = 0; i < BUDGET_PROBE; ++i) {
+        struct budget_holder * const h =
+            &budget->holders[(hash + i) % BUDGET_HOLDERS];
+
+        if (h->pid == pid)
+            return h;
+        if (victim == NULL && (h->pid == 0 || h->held == 0))
+            victim = h;
+    }
+
+    if (victim != NULL) {
+        victim->pid = pid;
+        victim->held = 0;
+    }
+
+    return victim;
+}
+
+struct budget *
+budget_create(size_t limit, struct stats *stats, bool verbose)
+{
+    struct shm_region region;
+    struct budget *budget;
+
+    if (shm_create(&region, "proxy-budget", sizeof *budget) == FAILURE)
+        return NULL;
+
+    budget = region.base;
+    atomic_flag_clear(&budget->lock);
+    budget->verbose = verbose;
+    budget->stats = stats;
+    budget->region = region;
+    budget->limit = limit;
+
+    stats_set(stats, STATS_MEMORY, 0);
+    stats_set(stats, STATS_MEMORY_PEAK, 0);
+
+    if (verbose)
+        fprintf(stderr, "budgeting %zu bytes of memory\n", limit);
+
+    return budget;
+}
+
+void
+budget_destroy(struct budget *budget)
+{
+    struct shm_region region = budget->region;
+
+    shm_destroy(&region);
+}
+
+bool
+budget_charge(struct budget *budget, size_t len)
+{
+    bool fits;
+
+    if (budget == NULL)
+        return true;
+
+    shm_lock(&budget->lock);
+    fits = len <= budget->limit - budget->used;
+    if (fits) {
+        struct budget_holder * const h = budget_holder(budget, getpid());
+
+        if (h != NULL)
+            h->held += len;
+        budget->used += len;
+        if (budget->used > budget->peak) {
+            budget->peak = budget->used;
+            stats_set(budget->stats, STATS_MEMORY_PEAK, budget->peak);
+        }
+        stats_set(budget->stats, STATS_MEMORY, budget->used);
+    }
+    else
+        ++budget->refused;
+    shm_unlock(&budget->lock);
+
+    if (!fits && budget->verbose)
+        fprintf(stderr, "budget_charge(): %zu bytes do not fit\n", len);
+
+    return fits;
+}
+
+void
+budget_release(struct budget *budget, size_t len)
+{
+    struct budget_holder *h;
+
+    if (budget == NULL)
+        return;
+
+    shm_lock(&budget->lock);
+    h = budget_holder(budget, getpid());
+    if (h != NULL)
+        h->held -= len < h->held ? len : h->held;
+    budget->used -= len < budget->used ? len : budget->used;
+    stats_set(budget->stats, STATS_MEMORY, budget->used);
+    shm_unlock(&budget->lock);
+}
+
+void
+budget_adopt(struct budget *budget, pid_t parent, size_t len)
+{
+    struct budget_holder *from, *to;
+
+    if (budget == NULL)
+        return;
+
+    shm_lock(&budget->lock);
+    from = budget_holder(budget, parent);
+    if (from != NULL)
+        from->held -= len < from->held ? len : from->held;
+    to = budget_holder(budget, getpid());
+    if (to != NULL)
+        to->held += len;
+    shm_unlock(&budget->lock);
+}
+
+void
+budget_reclaim(struct budget *budget)
+{
+    size_t reclaimed = 0;
+
+    if (budget == NULL)
+        return;
+
+    // Processes are looked for without the lock: only a live process changes
+    // its own slot, and a slot is only taken over once it holds nothing.
+    for (size_t i = 0; i < BUDGET_HOLDERS; ++i) {
+        struct budget_holder * const h = &budget->holders[i];
+        pid_t const pid = h->pid;
+
+        if (pid == 0 || h->held == 0
+            || kill(pid, 0) == SUCCESS || errno != ESRCH)
+            continue;
+
+        shm_lock(&budget->lock);
+        if (h->pid == pid) {
+            reclaimed += h->held;
+            budget->used -= h->held < budget->used ? h->held : budget->used;
+            h->held = 0;
+        }
+        stats_set(budget->stats, STATS_MEMORY, budget->used);
+        shm_unlock(&budget->lock);
+    }
+
+    if (reclaimed > 0 && budget->verbose)
+        fprintf(stderr, "budget_reclaim(): %zu bytes given back for processes "
+                "that are gone\n", reclaimed);
+}
+
+enum budget_pressure
+budget_pressure(struct budget *budget)
+{
+    size_t used, limit;
+
+    if (budget == NULL)
+        return BUDGET_RELAXED;
+
+    shm_lock(&budget->lock);
+    used = budget->used;
+    limit = budget->limit;
+    shm_unlock(&budget->lock);
+
+    if (used >= limit / 20 * 19)
+        return BUDGET_SHED;
+    if (used >= limit / 10 * 9)
+        return BUDGET_THROTTLE;
+    if (used >= limit / 4 * 3)
+        return BUDGET_SHRINK;
+    return BUDGET_RELAXED;
+}
+
+void
+budget_report(struct budget const *budget)
+{
+    fprintf(stderr, "memory budget %zu bytes, %zu charged, %zu at most, "
+            "%lu charges refused\n",
+            budget->limit, budget->used, budget->peak, budget->refused);
+}
@@ -0,0 +1,114 @@
+/*
+ * budget.h
+ * Interface to the memory budget shared by the proxy processes.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _budget_h_
+#define _budget_h_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * The memory the proxy holds on behalf of its connections is charged to a
+ * budget in shared memory, so that all the child processes draw on the same
+ * limit: each connection is charged for its socket and relay buffers while it
+ * is open, and each body spooled in memory while it is held.
+ *
+ * As the budget runs low, the proxy gives things up in stages, cheapest first.
+ * At BUDGET_SHRINK, responses are no longer added to the cache. At
+ * BUDGET_THROTTLE, bodies are no longer spooled, so responses are read from
+ * servers only as fast as clients take them, and new server connections are
+ * given small receive buffers. At BUDGET_SHED, requests are turned away, as is
+ * a connection whose charge would not fit in what is left.
+ *
+ * The most ever charged at once is kept as a high-water mark, and both levels
+ * are published as gauges in the statistics.
+ *
+ * Charges are also counted for the process that made them, so that what a
+ * process killed before it could give them back still held can be reclaimed.
+ *
+ * A NULL budget is unlimited.
+ */
+
+enum budget_pressure {
+    BUDGET_RELAXED,
+    BUDGET_SHRINK,   // Three quarters of the budget is charged
+    BUDGET_THROTTLE, // Nine tenths
+    BUDGET_SHED      // Nineteen twentieths
+};
+
+struct budget;
+struct stats;
+
+/*
+ * Create a budget of limit bytes, publishing its levels in stats.
+ * Returns NULL on failure.
+ */
+struct budget *budget_create(size_t limit, struct stats *stats, bool verbose);
+
+/*
+ * Release the shared budget.
+ */
+void budget_destroy(struct budget *budget);
+
+/*
+ * Charge len bytes to the budget.
+ * Returns false if they do not fit, in which case nothing is charged.
+ */
+bool budget_charge(struct budget *budget, size_t len);
+
+/*
+ * Give back len bytes charged earlier.
+ */
+void budget_release(struct budget *budget, size_t len);
+
+/*
+ * Take over len bytes the parent process charged for this one before forking
+ * it, so that they are given back should this process be killed.
+ */
+void budget_adopt(struct budget *budget, pid_t parent, size_t len);
+
+/*
+ * Give back what processes that are gone still held, such as workers killed
+ * by a signal. Only the master calls this, after burying its children.
+ */
+void budget_reclaim(struct budget *budget);
+
+/*
+ * How much of the budget is charged.
+ */
+enum budget_pressure budget_pressure(struct budget *budget);
+
+/*
+ * Print the levels of the budget to stderr.
+ */
+void budget_report(struct budget const *budget);
+
+#endif // _budget_h_
@@ -0,0 +1,778 @@
+/*
+ * cache.c
+ * Implementation of the shared response cache.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "cache.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+/* Followers sleep on a futex in the shared entry. */
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "shm.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define CACHE_PROBE 8 // Number of slots searched for a key or a victim.
+#define CACHE_WAIT_SECONDS 1 // How often a follower checks the filler is alive.
+
+enum cache_state {
+    CACHE_EMPTY,    // Unused slot
+    CACHE_PENDING,  // Filler is waiting for the response headers
+    CACHE_FILLING,  // Filler is appending the response to the file
+    CACHE_COMPLETE  // The whole response is in the file
+};
+
+struct cache_entry {
+    _Atomic uint32_t state;
+    _Atomic uint32_t seq; // Bumped (and futex woken) on every state change
+    _Atomic uint64_t generation;
+    _Atomic size_t available;
+    uint64_t hash;
+    pid_t filler;
+    pid_t revalidator; // Process revalidating a stale object, or 0
+    time_t expires, last_used;
+    long lifetime, stale_while_revalidate;
+    size_t header_len, total;
+    size_t keylen;
+    char key[CACHE_KEY_MAX];
+    char etag[CACHE_VALIDATOR_MAX], last_modified[CACHE_VALIDATOR_MAX];
+};
+
+struct cache {
+    // Checked before another build of the proxy attaches to the index.
+    size_t header_size, entry_size;
+    shm_lock_t lock;
+    bool verbose;
+    uint64_t generation;
+    size_t nentries, max_object;
+    struct shm_region region;
+    char dir[PATH_MAX];
+    struct cache_entry entries[];
+};
+
+/*
+ * FNV-1a, good enough to spread URLs over the table.
+ */
+static uint64_t
+cache_hash(char const *key, size_t keylen)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < keylen; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static void
+cache_path(struct cache const *cache, uint64_t hash, uint64_t generation,
+           char *path, size_t pathlen)
+{
+    snprintf(path, pathlen, "%s/%016llx.%llu", cache->dir,
+             (unsigned long long)hash, (unsigned long long)generation);
+}
+
+static void
+cache_wake(struct cache_entry *entry)
+{
+    atomic_fetch_add_explicit(&entry->seq, 1, memory_order_release);
+#ifdef __linux__
+    syscall(SYS_futex, &entry->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void
+cache_sleep(struct cache_entry *entry, uint32_t seq)
+{
+#ifdef __linux__
+    struct timespec const timeout = { CACHE_WAIT_SECONDS, 0 };
+
+    syscall(SYS_futex, &entry->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+#else
+    struct timespec const timeout = { 0, 1000000 };
+
+    (void)seq;
+    nanosleep(&timeout, NULL);
+#endif
+}
+
+struct cache *
+cache_create(char const *dir, size_t nentries, size_t max_object, bool verbose)
+{
+    struct shm_region region;
+    struct cache *cache;
+
+    if (strlen(dir) >= sizeof cache->dir) {
+        fprintf(stderr, "cache_create(): cache directory name too long\n");
+        return NULL;
+    }
+
+    if (mkdir(dir, 0700) == FAILURE && errno != EEXIST) {
+        perror("cache_create(): failed to create cache directory");
+        return NULL;
+    }
+
+    if (shm_create(&region, "proxy-cache",
+                   sizeof *cache + nentries * sizeof cache->entries[0])
+        == FAILURE)
+        return NULL;
+
+    cache = region.base;
+    cache->header_size = sizeof *cache;
+    cache->entry_size = sizeof cache->entries[0];
+    atomic_flag_clear(&cache->lock);
+    cache->verbose = verbose;
+    cache->nentries = nentries;
+    cache->max_object = max_object;
+    cache->region = region;
+    strcpy(cache->dir, dir);
+
+    if (verbose)
+        fprintf(stderr, "caching up to %zu objects in %s\n", nentries, dir);
+
+    return cache;
+}
+
+struct cache *
+cache_attach(int fd, char const *dir, size_t nentries, size_t max_object,
+             bool verbose)
+{
+    struct shm_region region;
+    struct cache *cache;
+
+    if (shm_attach(&region, fd) == FAILURE)
+        return NULL;
+
+    cache = region.base;
+    if (region.len < sizeof *cache
+        || cache->header_size != sizeof *cache
+        || cache->entry_size != sizeof cache->entries[0]
+        || region.len < sizeof *cache + nentries * sizeof cache->entries[0]
+        || cache->nentries != nentries
+        || cache->max_object != max_object
+        || strcmp(cache->dir, dir) != 0) {
+        if (verbose)
+            fputs("cache_attach(): the cache was set up differently\n",
+                  stderr);
+        shm_destroy(&region);
+        return NULL;
+    }
+
+    // This process owns the index now.
+    cache->verbose = verbose;
+    cache->region = region;
+
+    if (verbose)
+        fprintf(stderr, "took over the cache of %zu objects in %s\n",
+                nentries, dir);
+
+    return cache;
+}
+
+int
+cache_fd(struct cache const *cache)
+{
+    return cache->region.fd;
+}
+
+void
+cache_destroy(struct cache *cache)
+{
+    struct shm_region region = cache->region;
+
+    shm_destroy(&region);
+}
+
+size_t
+cache_max_object(struct cache const *cache)
+{
+    return cache->max_object;
+}
+
+static bool
+process_alive(pid_t pid)
+{
+    return kill(pid, 0) != FAILURE || errno != ESRCH;
+}
+
+/*
+ * Whether the filler of an entry is still at work on it. The filler holds a
+ * lock on the entry's file, which the kernel drops as soon as the filler
+ * exits, unlike its pid, which stays taken by a zombie until the master
+ * buries it and may then be reused. Only before the file is created does
+ * the pid have to do.
+ * It opens a file, so it is called without the lock held.
+ */
+static bool
+filler_alive(struct cache const *cache, uint64_t hash, uint64_t generation,
+             pid_t filler)
+{
+    char path[PATH_MAX];
+    bool alive;
+    int fd;
+
+    cache_path(cache, hash, generation, path, sizeof path);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == FAILURE)
+        return errno == ENOENT && process_alive(filler);
+
+    alive = flock(fd, LOCK_SH | LOCK_NB) == FAILURE && errno == EWOULDBLOCK;
+    close(fd);
+
+    return alive;
+}
+
+/*
+ * Give the caller a handle on an entry it will read from.
+ * Called with the lock held.
+ */
+static void
+cache_hold(struct cache_entry *entry, time_t now, struct cache_object *obj)
+{
+    entry->last_used = now;
+    obj->entry = entry;
+    obj->generation = atomic_load_explicit(&entry->generation,
+                                           memory_order_relaxed);
+    strcpy(obj->etag, entry->etag);
+    strcpy(obj->last_modified, entry->last_modified);
+}
+
+/*
+ * Make the caller the filler of an entry, discarding whatever it held.
+ * The path of the discarded file is stored in old_path, to be unlinked once
+ * the lock is released.
+ * Called with the lock held.
+ */
+static void
+cache_claim(struct cache *cache, struct cache_entry *entry, uint64_t hash,
+            char const *key, size_t keylen, time_t now,
+            struct cache_object *obj, char *old_path, size_t pathlen)
+{
+    if (atomic_load_explicit(&entry->state, memory_order_relaxed)
+        != CACHE_EMPTY)
+        cache_path(cache, entry->hash,
+                   atomic_load_explicit(&entry->generation,
+                                        memory_order_relaxed),
+                   old_path, pathlen);
+
+    if (entry->keylen != keylen || memcmp(entry->key, key, keylen) != SUCCESS) {
+        entry->hash = hash;
+        entry->keylen = keylen;
+        memcpy(entry->key, key, keylen);
+    }
+    entry->filler = getpid();
+    entry->revalidator = 0;
+    entry->expires = 0;
+    entry->last_used = now;
+    entry->lifetime = entry->stale_while_revalidate = 0;
+    entry->header_len = entry->total = 0;
+    entry->etag[0] = entry->last_modified[0] = '\0';
+    atomic_store_explicit(&entry->available, 0, memory_order_relaxed);
+    atomic_store_explicit(&entry->generation, ++cache->generation,
+                          memory_order_relaxed);
+    atomic_store_explicit(&entry->state, CACHE_PENDING, memory_order_release);
+
+    memset(obj, 0, sizeof *obj);
+    obj->fd = FAILURE;
+    obj->entry = entry;
+    obj->generation = cache->generation;
+}
+
+/*
+ * Create the file for an entry the caller just claimed.
+ * Anyone following the entry waits for the filler to publish the response
+ * headers, by which time the file exists.
+ */
+static int
+cache_open_fill(struct cache *cache, struct cache_object *obj)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 4];
+
+    cache_path(cache, obj->entry->hash, obj->generation, path, sizeof path);
+    snprintf(tmp, sizeof tmp, "%s.new", path);
+    obj->fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (obj->fd == FAILURE) {
+        perror("cache_open_fill(): failed to create cache file");
+        cache_fill_abort(cache, obj);
+        return FAILURE;
+    }
+
+    // Held until the fill ends or the filler dies, see filler_alive(). The
+    // file only gets its name once locked, so it is never seen unlocked.
+    if (flock(obj->fd, LOCK_EX | LOCK_NB) == FAILURE
+        || rename(tmp, path) == FAILURE) {
+        perror("cache_open_fill(): failed to lock and name cache file");
+        unlink(tmp);
+        cache_fill_abort(cache, obj);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+enum cache_lookup
+cache_lookup(struct cache *cache, char const *key, size_t keylen,
+             struct cache_object *obj)
+{
+    uint64_t const hash = cache_hash(key, keylen);
+
+    struct cache_entry *entry, *victim;
+    enum cache_lookup result;
+    char old_path[PATH_MAX];
+    uint32_t state, seq;
+    time_t now;
+
+    if (keylen > CACHE_KEY_MAX)
+        return CACHE_BYPASS;
+
+    memset(obj, 0, sizeof *obj);
+    obj->fd = FAILURE;
+
+retry:
+    now = time(NULL);
+    entry = victim = NULL;
+    result = CACHE_BYPASS;
+    old_path[0] = '\0';
+
+    shm_lock(&cache->lock);
+
+    for (size_t i = 0; i < CACHE_PROBE; ++i) {
+        struct cache_entry *e = &cache->entries[(hash + i) % cache->nentries];
+
+        state = atomic_load_explicit(&e->state, memory_order_acquire);
+
+        if (state != CACHE_EMPTY
+            && e->hash == hash && e->keylen == keylen
+            && memcmp(e->key, key, keylen) == SUCCESS) {
+            entry = e;
+            break;
+        }
+
+        // Prefer an empty slot, otherwise the least recently used object.
+        if (state == CACHE_EMPTY) {
+            if (victim == NULL
+                || atomic_load_explicit(&victim->state, memory_order_relaxed)
+                   != CACHE_EMPTY)
+                victim = e;
+        }
+        else if (state == CACHE_COMPLETE && e->revalidator == 0) {
+            if (victim == NULL
+                || (atomic_load_explicit(&victim->state, memory_order_relaxed)
+                    == CACHE_COMPLETE
+                    && e->last_used < victim->last_used))
+                victim = e;
+        }
+    }
+
+    if (entry != NULL) {
+        state = atomic_load_explicit(&entry->state, memory_order_acquire);
+
+        if (state != CACHE_COMPLETE) {
+            uint64_t const generation =
+                atomic_load_explicit(&entry->generation, memory_order_relaxed);
+            pid_t const filler = entry->filler;
+            bool alive;
+
+            // Look for the filler's lock without holding ours, and look
+            // again if the entry moved on meanwhile.
+            shm_unlock(&cache->lock);
+            alive = filler_alive(cache, hash, generation, filler);
+            shm_lock(&cache->lock);
+            if (atomic_load_explicit(&entry->generation, memory_order_relaxed)
+                != generation
+                || atomic_load_explicit(&entry->state, memory_order_acquire)
+                   != state) {
+                shm_unlock(&cache->lock);
+                goto retry;
+            }
+
+            if (alive) {
+                // In flight: follow it.
+                cache_hold(entry, now, obj);
+                result = CACHE_HIT;
+                goto unlock;
+            }
+            // The filler died: fill it again in place.
+        }
+        else if (now < entry->expires) {
+            cache_hold(entry, now, obj);
+            result = CACHE_HIT;
+            goto unlock;
+        }
+        else if (entry->revalidator != 0
+                 && process_alive(entry->revalidator)) {
+            if (now < entry->expires + entry->stale_while_revalidate) {
+                cache_hold(entry, now, obj);
+                result = CACHE_HIT;
+                goto unlock;
+            }
+            // Wait for the revalidation to finish, then look again.
+            seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+            shm_unlock(&cache->lock);
+            cache_sleep(entry, seq);
+            goto retry;
+        }
+        else if (now < entry->expires + entry->stale_while_revalidate
+                 || entry->etag[0] != '\0'
+                 || entry->last_modified[0] != '\0') {
+            cache_hold(entry, now, obj);
+            entry->revalidator = getpid();
+            result = now < entry->expires + entry->stale_while_revalidate
+                ? CACHE_REFRESH : CACHE_STALE;
+            goto unlock;
+        }
+        // Stale and nothing to revalidate with: fill it again in place.
+
+        victim = entry;
+    }
+
+    if (victim == NULL)
+        goto unlock;
+
+    cache_claim(cache, victim, hash, key, keylen, now,
+                obj, old_path, sizeof old_path);
+    result = CACHE_MISS;
+
+unlock:
+    shm_unlock(&cache->lock);
+
+    if (old_path[0] != '\0')
+        unlink(old_path);
+
+    if (cache->verbose && result == CACHE_STALE)
+        fprintf(stderr, "cache revalidate: %.*s\n", (int)keylen, key);
+    else if (cache->verbose && result == CACHE_REFRESH)
+        fprintf(stderr, "cache refresh: %.*s\n", (int)keylen, key);
+
+    if (result != CACHE_MISS)
+        return result;
+
+    if (cache_open_fill(cache, obj) == FAILURE)
+        return CACHE_BYPASS;
+
+    if (cache->verbose)
+        fprintf(stderr, "cache miss: %.*s\n", (int)keylen, key);
+
+    return CACHE_MISS;
+}
+
+/*
+ * Drop an entry whose filler went away without finishing.
+ */
+static void
+cache_reclaim(struct cache *cache, struct cache_object *obj)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    char path[PATH_MAX] = "";
+
+    shm_lock(&cache->lock);
+    if (atomic_load_explicit(&entry->generation, memory_order_relaxed)
+        == obj->generation
+        && atomic_load_explicit(&entry->state, memory_order_relaxed)
+           != CACHE_COMPLETE) {
+        cache_path(cache, entry->hash, obj->generation, path, sizeof path);
+        atomic_store_explicit(&entry->state, CACHE_EMPTY,
+                              memory_order_release);
+    }
+    shm_unlock(&cache->lock);
+
+    if (path[0] != '\0') {
+        unlink(path);
+        cache_wake(entry);
+    }
+}
+
+ssize_t
+cache_wait(struct cache *cache, struct cache_object *obj, size_t offset)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    char path[PATH_MAX];
+
+    if (obj->complete)
+        return obj->total;
+
+    for (;;) {
+        uint32_t const seq =
+            atomic_load_explicit(&entry->seq, memory_order_acquire);
+        uint32_t const state =
+            atomic_load_explicit(&entry->state, memory_order_acquire);
+        size_t const available =
+            atomic_load_explicit(&entry->available, memory_order_acquire);
+
+        if (atomic_load_explicit(&entry->generation, memory_order_acquire)
+            != obj->generation
+            || state == CACHE_EMPTY)
+            return FAILURE; // abandoned
+
+        if (state != CACHE_PENDING) {
+            if (obj->fd == FAILURE) {
+                obj->header_len = entry->header_len;
+                obj->total = entry->total;
+                cache_path(cache, entry->hash, obj->generation,
+                           path, sizeof path);
+                obj->fd = open(path, O_RDONLY | O_CLOEXEC);
+                if (obj->fd == FAILURE)
+                    return FAILURE; // evicted under us
+                if (cache->verbose)
+                    fprintf(stderr, "cache %s: %.*s\n",
+                            state == CACHE_COMPLETE ? "hit" : "follow",
+                            (int)entry->keylen, entry->key);
+            }
+            if (state == CACHE_COMPLETE) {
+                obj->complete = true;
+                return obj->total;
+            }
+            if (available > offset)
+                return available;
+        }
+
+        cache_sleep(entry, seq);
+
+        // A filler that finished has let go of its lock too, so a missing
+        // lock only means it died if the fill is still unfinished after.
+        if (!filler_alive(cache, entry->hash, obj->generation, entry->filler)
+            && atomic_load_explicit(&entry->generation, memory_order_acquire)
+               == obj->generation
+            && atomic_load_explicit(&entry->state, memory_order_acquire)
+               != CACHE_COMPLETE) {
+            cache_reclaim(cache, obj);
+            return FAILURE;
+        }
+    }
+}
+
+void
+cache_release(struct cache_object *obj)
+{
+    if (obj->fd != FAILURE)
+        close(obj->fd);
+    obj->fd = FAILURE;
+    obj->entry = NULL;
+}
+
+/*
+ * Store a validator if it fits, otherwise forget it.
+ */
+static void
+cache_validator(char *dst, struct iostring src)
+{
+    if (src.len < CACHE_VALIDATOR_MAX) {
+        memcpy(dst, src.p, src.len);
+        dst[src.len] = '\0';
+    }
+    else
+        dst[0] = '\0';
+}
+
+/*
+ * Update the freshness and validators of an entry from response headers.
+ */
+static void
+cache_update_meta(struct cache_entry *entry, struct cache_meta const *meta)
+{
+    if (meta->lifetime >= 0)
+        entry->lifetime = meta->lifetime;
+    if (meta->stale_while_revalidate >= 0)
+        entry->stale_while_revalidate = meta->stale_while_revalidate;
+    entry->expires = time(NULL) + entry->lifetime;
+
+    if (meta->etag.len != 0)
+        cache_validator(entry->etag, meta->etag);
+    if (meta->last_modified.len != 0)
+        cache_validator(entry->last_modified, meta->last_modified);
+}
+
+void
+cache_fill_start(struct cache *cache, struct cache_object *obj,
+                 struct cache_meta const *meta)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    (void)cache;
+
+    obj->header_len = entry->header_len = meta->header_len;
+    obj->total = entry->total = meta->total;
+    cache_update_meta(entry, meta);
+    atomic_store_explicit(&entry->state, CACHE_FILLING, memory_order_release);
+    cache_wake(entry);
+}
+
+void
+cache_fill_progress(struct cache *cache, struct cache_object *obj,
+                    size_t available)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    (void)cache;
+
+    atomic_store_explicit(&entry->available, available, memory_order_release);
+    cache_wake(entry);
+}
+
+void
+cache_fill_finish(struct cache *cache, struct cache_object *obj)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    atomic_store_explicit(&entry->available, obj->total, memory_order_relaxed);
+    atomic_store_explicit(&entry->state, CACHE_COMPLETE, memory_order_release);
+    cache_wake(entry);
+
+    if (cache->verbose)
+        fprintf(stderr, "cached %zu bytes: %.*s\n",
+                obj->total, (int)entry->keylen, entry->key);
+
+    cache_release(obj);
+}
+
+void
+cache_fill_abort(struct cache *cache, struct cache_object *obj)
+{
+    if (cache->verbose)
+        fprintf(stderr, "cache fill abandoned: %.*s\n",
+                (int)obj->entry->keylen, obj->entry->key);
+
+    cache_reclaim(cache, obj);
+    cache_release(obj);
+}
+
+void
+cache_adopt(struct cache *cache, struct cache_object *obj)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    shm_lock(&cache->lock);
+    if (atomic_load_explicit(&entry->generation, memory_order_relaxed)
+        == obj->generation) {
+        // Only complete objects are revalidated.
+        if (atomic_load_explicit(&entry->state, memory_order_relaxed)
+            == CACHE_COMPLETE)
+            entry->revalidator = getpid();
+        else
+            entry->filler = getpid();
+    }
+    shm_unlock(&cache->lock);
+}
+
+void
+cache_follow(struct cache_object *obj)
+{
+    if (obj->fd != FAILURE)
+        close(obj->fd);
+    obj->fd = FAILURE;
+    obj->complete = false;
+}
+
+void
+cache_revalidated(struct cache *cache, struct cache_object *obj,
+                  struct cache_meta const *meta)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    shm_lock(&cache->lock);
+    if (atomic_load_explicit(&entry->generation, memory_order_relaxed)
+        == obj->generation) {
+        cache_update_meta(entry, meta);
+        entry->revalidator = 0;
+    }
+    shm_unlock(&cache->lock);
+
+    cache_wake(entry);
+
+    if (cache->verbose)
+        fprintf(stderr, "cache revalidated: %.*s\n",
+                (int)entry->keylen, entry->key);
+}
+
+int
+cache_refill(struct cache *cache, struct cache_object *obj)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    char old_path[PATH_MAX] = "";
+    bool claimed = false;
+
+    if (obj->fd != FAILURE)
+        close(obj->fd);
+
+    shm_lock(&cache->lock);
+    if (atomic_load_explicit(&entry->generation, memory_order_relaxed)
+        == obj->generation) {
+        cache_claim(cache, entry, entry->hash, entry->key, entry->keylen,
+                    time(NULL), obj, old_path, sizeof old_path);
+        claimed = true;
+    }
+    shm_unlock(&cache->lock);
+
+    if (!claimed) {
+        obj->fd = FAILURE;
+        cache_release(obj);
+        return FAILURE;
+    }
+
+    if (old_path[0] != '\0')
+        unlink(old_path);
+
+    cache_wake(entry);
+
+    return cache_open_fill(cache, obj);
+}
+
+void
+cache_revalidate_abort(struct cache *cache, struct cache_object *obj)
+{
+    struct cache_entry * const entry = obj->entry;
+
+    shm_lock(&cache->lock);
+    if (atomic_load_explicit(&entry->generation, memory_order_relaxed)
+        == obj->generation)
+        entry->revalidator = 0;
+    shm_unlock(&cache->lock);
+
+    cache_wake(entry);
+    cache_release(obj);
+}
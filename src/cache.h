@@ -0,0 +1,214 @@
+/*
+ * cache.h
+ * Interface to the shared response cache.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _cache_h_
+#define _cache_h_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "iostring.h"
+
+/*
+ * The cache index lives in shared memory so that every child process sees the
+ * same entries. Response bytes are stored in files under the cache directory,
+ * exactly as they were received from the server (status line, headers, body).
+ *
+ * An entry is created by the first child to miss on a key. That child becomes
+ * the filler: it fetches the response and appends it to the entry's file.
+ * Any other child looking up the same key while the fill is in progress
+ * follows the file as it grows instead of going to the server itself.
+ *
+ * Once an object goes stale, the first child to look it up revalidates it with
+ * the server. If the server confirms the object has not changed, the object is
+ * refreshed in place; otherwise the new response replaces it.
+ */
+
+#define CACHE_KEY_MAX 512
+#define CACHE_VALIDATOR_MAX 128
+
+struct cache;
+struct cache_entry;
+
+/*
+ * What the filler learns about an object from the response headers.
+ */
+struct cache_meta {
+    size_t header_len, total;
+    long lifetime; // seconds the object stays fresh, -1 to keep the old value
+    long stale_while_revalidate; // seconds it may be served stale meanwhile
+    struct iostring etag, last_modified; // validators, may be empty
+};
+
+/*
+ * A handle on a cache entry held by one child process.
+ * The header_len and total fields are valid once cache_wait() has returned
+ * a value other than FAILURE (or immediately for the filler).
+ */
+struct cache_object {
+    struct cache_entry *entry;
+    uint64_t generation;
+    int fd;
+    bool complete;
+    size_t header_len, total;
+    // Validators for a conditional request, nul-terminated or empty.
+    char etag[CACHE_VALIDATOR_MAX], last_modified[CACHE_VALIDATOR_MAX];
+};
+
+enum cache_lookup {
+    CACHE_BYPASS, CACHE_HIT, CACHE_MISS, CACHE_STALE, CACHE_REFRESH
+};
+
+/*
+ * Create a cache storing its objects in dir, indexing at most nentries
+ * objects of at most max_object bytes each.
+ * Returns NULL on failure.
+ */
+struct cache *cache_create(char const *dir, size_t nentries, size_t max_object,
+                           bool verbose);
+
+/*
+ * Take over the cache of another proxy process, whose shared index was handed
+ * over as fd (see cache_fd()). The caller owns the cache from then on, though
+ * the other process's children may still use it.
+ * The cache must have been created by the same build of the proxy with the
+ * same dir, nentries and max_object. Returns NULL if it was not.
+ * The file descriptor is closed on failure.
+ */
+struct cache *cache_attach(int fd, char const *dir, size_t nentries,
+                           size_t max_object, bool verbose);
+
+/*
+ * The file descriptor of the shared index, to hand to another process.
+ */
+int cache_fd(struct cache const *cache);
+
+/*
+ * Release the shared index. Cached files are left in place.
+ */
+void cache_destroy(struct cache *cache);
+
+/*
+ * The largest object the cache will accept.
+ */
+size_t cache_max_object(struct cache const *cache);
+
+/*
+ * Look up key in the cache.
+ * CACHE_HIT: the object is cached or being filled by another child;
+ *   use cache_wait() to learn how much of it can be read from obj->fd.
+ * CACHE_MISS: the caller is now the filler for key and must finish the
+ *   fill with cache_fill_start()/cache_fill_finish() or cache_fill_abort().
+ * CACHE_STALE: the object is stale and the caller is now the one to
+ *   revalidate it, finishing with cache_revalidated(), cache_refill() or
+ *   cache_revalidate_abort().
+ * CACHE_REFRESH: the object is stale but may still be served as if it were a
+ *   hit, and the caller is to revalidate it in the background as above.
+ * CACHE_BYPASS: the cache cannot be used for this key.
+ */
+enum cache_lookup cache_lookup(struct cache *cache,
+                               char const *key, size_t keylen,
+                               struct cache_object *obj);
+
+/*
+ * Wait until more than offset bytes of the object are available.
+ * Returns the number of bytes that can be read from obj->fd, which equals
+ * obj->total once the object is complete.
+ * Returns -1 if the fill was abandoned. If nothing was sent to the client yet,
+ * the caller may forward the request to the server itself.
+ */
+ssize_t cache_wait(struct cache *cache, struct cache_object *obj, size_t offset);
+
+/*
+ * Close the caller's handle on a cached object.
+ */
+void cache_release(struct cache_object *obj);
+
+/*
+ * Publish the layout and freshness of the object being filled.
+ * The first header_len bytes of the object are the status line and headers,
+ * total is the size of the complete object.
+ */
+void cache_fill_start(struct cache *cache, struct cache_object *obj,
+                      struct cache_meta const *meta);
+
+/*
+ * Publish that the first available bytes of the object have been written.
+ */
+void cache_fill_progress(struct cache *cache, struct cache_object *obj,
+                         size_t available);
+
+/*
+ * Mark the object complete and release the filler's handle.
+ */
+void cache_fill_finish(struct cache *cache, struct cache_object *obj);
+
+/*
+ * Discard the object and release the filler's handle.
+ * Followers are woken and see the fill as abandoned.
+ */
+void cache_fill_abort(struct cache *cache, struct cache_object *obj);
+
+/*
+ * Take over filling or revalidating obj in this process, e.g. after forking.
+ */
+void cache_adopt(struct cache *cache, struct cache_object *obj);
+
+/*
+ * Turn a fill handle into one for reading, as after a CACHE_HIT, once the fill
+ * has been handed to another process with cache_adopt().
+ */
+void cache_follow(struct cache_object *obj);
+
+/*
+ * The server confirmed the stale object is still valid.
+ * Its freshness and validators are updated from meta, and the caller's handle
+ * may then be used as if the lookup was a hit.
+ */
+void cache_revalidated(struct cache *cache, struct cache_object *obj,
+                       struct cache_meta const *meta);
+
+/*
+ * The server sent a new response in place of the stale object.
+ * The caller's handle becomes a fill handle, as after a CACHE_MISS.
+ * Returns -1 (and releases the handle) if the object cannot be refilled.
+ */
+int cache_refill(struct cache *cache, struct cache_object *obj);
+
+/*
+ * Give up revalidating obj and release the caller's handle.
+ * The stale object is left in the cache for someone else to try.
+ */
+void cache_revalidate_abort(struct cache *cache, struct cache_object *obj);
+
+#endif // _cache_h_
@@ -0,0 +1,77 @@
+/*
+ * fds.c
+ * Implementation of closing the file descriptors a child process must not
+ * keep.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "fds.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+void
+close_fds(int lo, int hi)
+{
+    DIR *dir;
+    long max;
+
+#ifdef CLOSE_RANGE_CLOEXEC
+    if (close_range(lo, hi == FAILURE ? ~0U : (unsigned)hi, 0) == SUCCESS)
+        return;
+#endif
+
+    if (hi == FAILURE) {
+        // Only the ones that are open, if the kernel can say which.
+        dir = opendir("/proc/self/fd");
+        if (dir != NULL) {
+            int const skip = dirfd(dir);
+
+            struct dirent *entry;
+
+            while ((entry = readdir(dir)) != NULL) {
+                int fd;
+
+                if (entry->d_name[0] == '.')
+                    continue;
+                fd = atoi(entry->d_name);
+                if (fd >= lo && fd != skip)
+                    close(fd);
+            }
+            closedir(dir);
+            return;
+        }
+
+        max = sysconf(_SC_OPEN_MAX);
+        hi = max == FAILURE ? 1023 : max - 1;
+    }
+
+    for (int fd = lo; fd <= hi; ++fd)
+        close(fd);
+}
@@ -0,0 +1,1742 @@
+/*
+ * h2.c
+ * Implementation of the HTTP/2 server for client connections.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "h2.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hpack.h"
+#include "http.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define FRAME_HEADER_LEN 9
+#define FRAME_MAX 16384 // Largest frame payload, either way
+#define BLOCK_MAX (64 * 1024) // Largest header block, continuations included
+#define HEAD_MAX (REQUEST_LINE_MIN_BUFLEN * 2) // As much as a worker reads
+#define CONTENT_LENGTH_MAX 40 // Room for a Content-Length field to be added
+#define WINDOW 65535 // Initial flow control window
+#define WINDOW_MAX 0x7fffffff
+#define RX_BUFLEN (32 * 1024) // Response read ahead from a worker
+#define OUT_BUFLEN (64 * 1024) // Frames batched for the client
+#define IDLE_WORKERS 32 // Workers kept for later streams
+#define LINGER_MS 1000 // For the client to close after a GOAWAY
+#define ABANDONED_MAX 64 // Streams closed early whose late frames are dropped
+
+enum frame_type {
+    FRAME_DATA, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM,
+    FRAME_SETTINGS, FRAME_PUSH_PROMISE, FRAME_PING, FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE, FRAME_CONTINUATION
+};
+
+enum frame_flag {
+    FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20
+};
+
+enum h2_error {
+    ERROR_NONE, ERROR_PROTOCOL, ERROR_INTERNAL, ERROR_FLOW_CONTROL,
+    ERROR_SETTINGS_TIMEOUT, ERROR_STREAM_CLOSED, ERROR_FRAME_SIZE,
+    ERROR_REFUSED_STREAM, ERROR_CANCEL, ERROR_COMPRESSION, ERROR_CONNECT,
+    ERROR_ENHANCE_YOUR_CALM
+};
+
+enum h2_setting {
+    SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH,
+    SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_INITIAL_WINDOW_SIZE,
+    SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+/*
+ * A request being decoded from a header block.
+ */
+struct request {
+    struct iostring method, scheme, authority, path, host;
+    long long content_length; // -1 if absent
+    bool regular;   // A regular field was seen, so no more pseudo-fields
+    bool malformed; // The stream is to be reset
+    size_t pseudo_len, fields_len, cookie_len;
+    char pseudo[HEAD_MAX]; // Values of the pseudo-header fields and Host
+    char fields[HEAD_MAX]; // Other fields, formatted for HTTP/1.1
+    char cookie[HEAD_MAX]; // Cookie crumbs, joined back together
+};
+
+struct stream {
+    uint32_t id;
+    int fd;              // Worker serving the stream, or -1
+    bool reused;         // fd was an idle worker
+    bool eof;            // The worker is done sending
+    bool keep;           // The worker may serve another stream
+    bool head;           // A HEAD request, whose response has no body
+    bool body;           // The request has a body
+    bool counting;       // The body is held until its length is known
+    bool end_stream;     // The client has sent the whole request
+    long long body_left; // Request body still to come, if not counting
+    unsigned char *tx;   // Request for the worker
+    size_t tx_size, tx_off, tx_len;
+    size_t tx_head;      // Bytes of the head not yet written
+    size_t credit;       // Body taken by the worker, not yet given back
+    int64_t recv_window; // Body the client may still send
+    int64_t send_window; // Response body that may still be sent
+    bool head_sent;      // The response HEADERS were sent
+    long long body_out;  // Response body still to send
+    size_t received;     // Response bytes read from the worker in all
+    size_t rx_len;
+    char rx[RX_BUFLEN];  // Response read from the worker
+};
+
+struct h2_session {
+    struct h2_server const *server;
+    int fd;
+    bool verbose;
+    bool broken;          // Nothing more is sent to the client
+    bool lost;            // The connection to the client failed
+    bool closing;         // No more streams are taken
+    bool goaway;          // GOAWAY was sent
+    bool settings;        // The client's first SETTINGS arrived
+    size_t preface;       // Bytes of the client preface still to come
+    struct hpack_table decoder, encoder;
+    uint32_t last_stream; // Highest stream opened by the client
+    int64_t send_window;  // For all of the response bodies
+    uint32_t initial_window; // For each stream's response body
+    uint32_t block_stream; // Stream with an unfinished header block, or 0
+    bool block_end_stream; // Its HEADERS ended the stream
+    size_t block_len;
+    unsigned nstreams, next;
+    struct stream **streams;
+    unsigned nidle;
+    int idle[IDLE_WORKERS]; // Workers waiting for a stream
+    // Streams closed before the client finished sending on them, most
+    // recent last, whose frames may still be on their way.
+    uint32_t abandoned[ABANDONED_MAX];
+    unsigned next_abandoned;
+    size_t in_len, out_len;
+    unsigned char in[2 * (FRAME_HEADER_LEN + FRAME_MAX)];
+    unsigned char out[OUT_BUFLEN];
+    unsigned char block[BLOCK_MAX]; // From the client
+    unsigned char encoded[BLOCK_MAX]; // For the client
+    struct request request;
+};
+
+static void
+put32(unsigned char *p, uint32_t n)
+{
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+static uint32_t
+get32(unsigned char const *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Send everything batched for the client.
+ */
+static void
+flush(struct h2_session *s)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (!s->broken && off < s->out_len) {
+        n = write(s->fd, s->out + off, s->out_len - off);
+        if (n == FAILURE && errno == EINTR)
+            continue;
+        if (n == FAILURE) {
+            if (s->verbose)
+                perror("h2: failed to send to client");
+            s->broken = s->lost = true;
+            break;
+        }
+        off += n;
+    }
+
+    s->out_len = 0;
+}
+
+/*
+ * Batch a frame for the client. The payload is at most FRAME_MAX bytes.
+ */
+static void
+put_frame(struct h2_session *s, enum frame_type type, unsigned flags,
+          uint32_t id, void const *payload, size_t len)
+{
+    unsigned char *p;
+
+    if (sizeof s->out - s->out_len < FRAME_HEADER_LEN + len)
+        flush(s);
+    if (s->broken)
+        return;
+
+    p = s->out + s->out_len;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id);
+    if (len > 0)
+        memcpy(p + FRAME_HEADER_LEN, payload, len);
+    s->out_len += FRAME_HEADER_LEN + len;
+}
+
+static void
+put_u32_frame(struct h2_session *s, enum frame_type type, uint32_t id,
+              uint32_t n)
+{
+    unsigned char payload[4];
+
+    put32(payload, n);
+    put_frame(s, type, 0, id, payload, sizeof payload);
+}
+
+static void
+send_goaway(struct h2_session *s, enum h2_error code)
+{
+    unsigned char payload[8];
+
+    if (s->goaway)
+        return;
+
+    put32(payload, s->last_stream);
+    put32(payload + 4, code);
+    put_frame(s, FRAME_GOAWAY, 0, 0, payload, sizeof payload);
+    s->goaway = s->closing = true;
+}
+
+/*
+ * Tell the client the connection is beyond repair, and stop talking to it.
+ */
+static int
+connection_error(struct h2_session *s, enum h2_error code, char const *why)
+{
+    if (s->verbose)
+        fprintf(stderr, "h2: connection error %d (%s)\n", code, why);
+
+    send_goaway(s, code);
+    flush(s);
+    s->broken = true;
+
+    return FAILURE;
+}
+
+static struct stream *
+find_stream(struct h2_session *s, uint32_t id)
+{
+    for (unsigned i = 0; i < s->nstreams; ++i)
+        if (s->streams[i]->id == id)
+            return s->streams[i];
+
+    return NULL;
+}
+
+/*
+ * Let go of a stream's worker, keeping it for another stream if it can take
+ * one.
+ */
+static void
+release_worker(struct h2_session *s, struct stream *st)
+{
+    if (st->fd == FAILURE)
+        return;
+
+    if (st->keep && !st->eof && st->tx_off == st->tx_len
+        && s->nidle < IDLE_WORKERS)
+        s->idle[s->nidle++] = st->fd;
+    else
+        close(st->fd);
+    st->fd = FAILURE;
+}
+
+/*
+ * Remember a stream closed before the client was done with it, so that the
+ * frames it sent meanwhile can be told from a protocol error.
+ */
+static void
+abandon_stream(struct h2_session *s, uint32_t id)
+{
+    s->abandoned[s->next_abandoned++ % ABANDONED_MAX] = id;
+}
+
+static bool
+was_abandoned(struct h2_session *s, uint32_t id)
+{
+    for (unsigned i = 0; i < ABANDONED_MAX; ++i)
+        if (s->abandoned[i] == id)
+            return true;
+
+    return false;
+}
+
+/*
+ * Turn down a stream before it is opened.
+ */
+static void
+refuse_stream(struct h2_session *s, uint32_t id, enum h2_error code)
+{
+    put_u32_frame(s, FRAME_RST_STREAM, id, code);
+    abandon_stream(s, id);
+}
+
+static void
+close_stream(struct h2_session *s, struct stream *st)
+{
+    if (!st->end_stream)
+        abandon_stream(s, st->id);
+
+    release_worker(s, st);
+
+    for (unsigned i = 0; i < s->nstreams; ++i)
+        if (s->streams[i] == st) {
+            s->streams[i] = s->streams[--s->nstreams];
+            break;
+        }
+
+    free(st->tx);
+    free(st);
+}
+
+static void
+reset_stream(struct h2_session *s, struct stream *st, enum h2_error code)
+{
+    if (s->verbose)
+        fprintf(stderr, "h2: resetting stream %u (error %d)\n", st->id, code);
+
+    put_u32_frame(s, FRAME_RST_STREAM, st->id, code);
+    st->keep = false;
+    close_stream(s, st);
+}
+
+/*
+ * Answer a stream with an error instead of the worker's response.
+ * The response is sent on from the receive buffer like any other.
+ */
+static void
+respond_error(struct h2_session *s, struct stream *st,
+              enum http_status_code status)
+{
+    struct http_error const * const e = &http_errors[status];
+
+    if (st->head_sent) {
+        reset_stream(s, st, ERROR_INTERNAL);
+        return;
+    }
+
+    if (st->fd != FAILURE)
+        close(st->fd);
+    st->fd = FAILURE;
+    st->eof = true;
+    st->keep = false;
+    st->rx_len = snprintf(st->rx, sizeof st->rx,
+                          "HTTP/1.1 %.*s %.*s\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: %.*s\r\n\r\n%.*s",
+                          (int)e->status.len, e->status.p,
+                          (int)e->reason.len, e->reason.p,
+                          (int)e->content_length.len, e->content_length.p,
+                          (int)e->body.len, e->body.p);
+}
+
+/*
+ * Take an idle worker that is still there, or start a new one.
+ */
+static int
+take_worker(struct h2_session *s, struct stream *st, bool fresh)
+{
+    int fd;
+
+    while (!fresh && s->nidle > 0) {
+        struct pollfd pfd = { .fd = s->idle[--s->nidle], .events = POLLIN };
+
+        // An idle worker has nothing to say, unless it has gone.
+        if (poll(&pfd, 1, 0) == 0) {
+            st->fd = pfd.fd;
+            st->reused = true;
+            return SUCCESS;
+        }
+        close(pfd.fd);
+    }
+
+    fd = s->server->spawn(s->server->ctx, s);
+    if (fd == FAILURE)
+        return FAILURE;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    st->fd = fd;
+    st->reused = false;
+
+    return SUCCESS;
+}
+
+/*
+ * Hand a complete request head to a worker.
+ */
+static void
+dispatch(struct h2_session *s, struct stream *st)
+{
+    if (take_worker(s, st, false) == FAILURE) {
+        if (s->verbose)
+            fprintf(stderr, "h2: no worker for stream %u\n", st->id);
+        respond_error(s, st, SERVICE_UNAVAILABLE);
+    }
+}
+
+/*
+ * The whole body of a request without a Content-Length is in: add one, so the
+ * worker knows where the request ends.
+ */
+static void
+finish_counting(struct h2_session *s, struct stream *st)
+{
+    size_t const body = st->tx_len - st->tx_head;
+
+    char field[CONTENT_LENGTH_MAX];
+    int n;
+
+    n = snprintf(field, sizeof field, "Content-Length: %zu\r\n\r\n", body);
+    memmove(st->tx + st->tx_head + n, st->tx + st->tx_head, body);
+    memcpy(st->tx + st->tx_head, field, n);
+    st->tx_head += n;
+    st->tx_len += n;
+    st->counting = false;
+
+    dispatch(s, st);
+}
+
+/*
+ * Check the characters of a field (RFC 7540 8.1.2), which must not let it
+ * spill into another once written out for HTTP/1.1.
+ */
+static bool
+valid_field(struct iostring name, struct iostring value)
+{
+    if (name.len == 0)
+        return false;
+
+    for (size_t i = name.p[0] == ':' ? 1 : 0; i < name.len; ++i) {
+        unsigned char const c = name.p[i];
+        if (c <= ' ' || c >= 0x7f || c == ':' || isupper(c))
+            return false;
+    }
+
+    for (size_t i = 0; i < value.len; ++i)
+        if (value.p[i] == '\r' || value.p[i] == '\n' || value.p[i] == '\0')
+            return false;
+
+    return true;
+}
+
+static bool
+name_is(struct iostring name, char const *s)
+{
+    return name.len == strlen(s) && memcmp(name.p, s, name.len) == SUCCESS;
+}
+
+/*
+ * Keep a copy of a pseudo-header field value.
+ */
+static void
+keep_pseudo(struct request *r, struct iostring *field, struct iostring value)
+{
+    if (field->p != NULL
+        || sizeof r->pseudo - r->pseudo_len < value.len) {
+        r->malformed = true;
+        return;
+    }
+
+    field->p = r->pseudo + r->pseudo_len;
+    field->len = value.len;
+    memcpy(field->p, value.p, value.len);
+    r->pseudo_len += value.len;
+}
+
+static void
+append(char *buf, size_t size, size_t *len, bool *overflow,
+       void const *p, size_t n)
+{
+    if (size - *len < n) {
+        *overflow = true;
+        return;
+    }
+    memcpy(buf + *len, p, n);
+    *len += n;
+}
+
+/*
+ * Collect a field of a request (hpack_field_fn).
+ */
+static void
+request_field(void *ctx, struct iostring name, struct iostring value)
+{
+    struct request * const r = ctx;
+
+    if (r->malformed)
+        return;
+
+    if (!valid_field(name, value)) {
+        r->malformed = true;
+        return;
+    }
+
+    if (name.p[0] == ':') {
+        if (r->regular)
+            r->malformed = true;
+        else if (name_is(name, ":method"))
+            keep_pseudo(r, &r->method, value);
+        else if (name_is(name, ":scheme"))
+            keep_pseudo(r, &r->scheme, value);
+        else if (name_is(name, ":authority"))
+            keep_pseudo(r, &r->authority, value);
+        else if (name_is(name, ":path"))
+            keep_pseudo(r, &r->path, value);
+        else
+            r->malformed = true;
+        return;
+    }
+
+    r->regular = true;
+
+    // Fields about the connection mean nothing to the worker's.
+    if (name_is(name, "connection") || name_is(name, "keep-alive")
+        || name_is(name, "proxy-connection") || name_is(name, "upgrade")
+        || name_is(name, "transfer-encoding") || name_is(name, "te")
+        || name_is(name, "http2-settings")
+        // The body is already on its way.
+        || name_is(name, "expect"))
+        return;
+
+    if (name_is(name, "host")) {
+        if (r->host.p == NULL)
+            keep_pseudo(r, &r->host, value);
+        return;
+    }
+
+    if (name_is(name, "cookie")) {
+        if (r->cookie_len > 0)
+            append(r->cookie, sizeof r->cookie, &r->cookie_len,
+                   &r->malformed, "; ", 2);
+        append(r->cookie, sizeof r->cookie, &r->cookie_len, &r->malformed,
+               value.p, value.len);
+        return;
+    }
+
+    if (name_is(name, "content-length")) {
+        char digits[24], *end;
+        long long n;
+
+        if (value.len == 0 || value.len >= sizeof digits) {
+            r->malformed = true;
+            return;
+        }
+        memcpy(digits, value.p, value.len);
+        digits[value.len] = '\0';
+        n = strtoll(digits, &end, 10);
+        if (*end != '\0' || n < 0
+            || (r->content_length != FAILURE && r->content_length != n)) {
+            r->malformed = true;
+            return;
+        }
+        r->content_length = n;
+    }
+
+    append(r->fields, sizeof r->fields, &r->fields_len, &r->malformed,
+           name.p, name.len);
+    append(r->fields, sizeof r->fields, &r->fields_len, &r->malformed, ": ", 2);
+    append(r->fields, sizeof r->fields, &r->fields_len, &r->malformed,
+           value.p, value.len);
+    append(r->fields, sizeof r->fields, &r->fields_len, &r->malformed,
+           "\r\n", 2);
+}
+
+/*
+ * Ignore the fields of trailers (hpack_field_fn), as HTTP/1.1 requests with
+ * a Content-Length cannot carry them.
+ */
+static void
+ignore_field(void *ctx, struct iostring name, struct iostring value)
+{
+}
+
+static struct stream *
+new_stream(struct h2_session *s, uint32_t id, size_t tx_size)
+{
+    struct stream *st;
+
+    st = malloc(sizeof *st);
+    if (st == NULL) {
+        perror("h2: failed to allocate a stream");
+        return NULL;
+    }
+    memset(st, 0, offsetof(struct stream, rx));
+    st->tx = malloc(tx_size);
+    if (st->tx == NULL) {
+        perror("h2: failed to allocate a stream buffer");
+        free(st);
+        return NULL;
+    }
+    st->id = id;
+    st->fd = FAILURE;
+    st->keep = true;
+    st->tx_size = tx_size;
+    st->recv_window = WINDOW;
+    st->send_window = s->initial_window;
+    s->streams[s->nstreams++] = st;
+
+    return st;
+}
+
+/*
+ * Open a stream for a request decoded from a header block, and format it for
+ * a worker as HTTP/1.1.
+ */
+static void
+open_stream(struct h2_session *s, uint32_t id, bool end_stream)
+{
+    struct request * const r = &s->request;
+    struct iostring const authority = r->authority.p != NULL
+        ? r->authority : r->host;
+
+    struct stream *st;
+    char *p;
+    int n;
+
+    if (r->malformed || r->method.p == NULL || r->path.p == NULL
+        || authority.p == NULL || authority.len == 0
+        || (s->server->absolute && r->scheme.p == NULL)
+        || (end_stream && r->content_length > 0)) {
+        if (s->verbose)
+            fprintf(stderr, "h2: malformed request on stream %u\n", id);
+        refuse_stream(s, id, ERROR_PROTOCOL);
+        return;
+    }
+
+    st = new_stream(s, id, HEAD_MAX + (end_stream ? 0 : WINDOW));
+    if (st == NULL) {
+        refuse_stream(s, id, ERROR_REFUSED_STREAM);
+        return;
+    }
+
+    st->head = name_is(r->method, "HEAD");
+    st->end_stream = end_stream;
+    st->body = !end_stream;
+
+    // Room is left for a Content-Length, should the body need counting.
+    p = (char *)st->tx;
+    n = snprintf(p, HEAD_MAX - CONTENT_LENGTH_MAX,
+                 "%.*s %.*s%s%.*s%.*s HTTP/1.1\r\nHost: %.*s\r\n%.*s",
+                 (int)r->method.len, r->method.p,
+                 (int)(s->server->absolute ? r->scheme.len : 0), r->scheme.p,
+                 s->server->absolute ? "://" : "",
+                 (int)(s->server->absolute ? authority.len : 0), authority.p,
+                 (int)r->path.len, r->path.p,
+                 (int)authority.len, authority.p,
+                 (int)r->fields_len, r->fields);
+    if (n >= HEAD_MAX - CONTENT_LENGTH_MAX) {
+        respond_error(s, st, BAD_REQUEST);
+        return;
+    }
+    if (r->cookie_len > 0)
+        n += snprintf(p + n, HEAD_MAX - CONTENT_LENGTH_MAX - n,
+                      "Cookie: %.*s\r\n", (int)r->cookie_len, r->cookie);
+    if (n >= HEAD_MAX - CONTENT_LENGTH_MAX) {
+        respond_error(s, st, BAD_REQUEST);
+        return;
+    }
+
+    st->counting = !end_stream && r->content_length == FAILURE;
+    st->body_left = end_stream ? 0 : r->content_length;
+    if (!st->counting)
+        n += snprintf(p + n, CONTENT_LENGTH_MAX, "\r\n");
+    st->tx_len = st->tx_head = n;
+
+    if (!st->counting)
+        dispatch(s, st);
+}
+
+/*
+ * Open stream 1 for the request that asked to upgrade the connection.
+ */
+static void
+open_upgrade_stream(struct h2_session *s, struct iostring head)
+{
+    struct stream *st;
+
+    s->last_stream = 1;
+
+    st = new_stream(s, 1, head.len);
+    if (st == NULL)
+        return;
+
+    memcpy(st->tx, head.p, head.len);
+    st->tx_len = st->tx_head = head.len;
+    st->head = head.len > 5 && strncmp(head.p, "HEAD ", 5) == SUCCESS;
+    st->end_stream = true;
+
+    dispatch(s, st);
+}
+
+/*
+ * A header block is complete.
+ */
+static int
+finish_block(struct h2_session *s)
+{
+    uint32_t const id = s->block_stream;
+    bool const end_stream = s->block_end_stream;
+    struct stream * const st = find_stream(s, id);
+
+    s->block_stream = 0;
+
+    if (st != NULL) {
+        // Trailers
+        if (hpack_decode(&s->decoder, s->block, s->block_len, ignore_field,
+                         NULL) == FAILURE)
+            return connection_error(s, ERROR_COMPRESSION, "bad trailers");
+        if (st->end_stream) {
+            reset_stream(s, st, ERROR_STREAM_CLOSED);
+            return SUCCESS;
+        }
+        if (!end_stream || (!st->counting && st->body_left != 0)) {
+            reset_stream(s, st, ERROR_PROTOCOL);
+            return SUCCESS;
+        }
+        st->end_stream = true;
+        if (st->counting)
+            finish_counting(s, st);
+        return SUCCESS;
+    }
+
+    // Trailers for a stream closed early are dropped, once the decoder has
+    // seen them.
+    if (id % 2 == 1 && id <= s->last_stream && was_abandoned(s, id))
+        return hpack_decode(&s->decoder, s->block, s->block_len, ignore_field,
+                            NULL) == FAILURE
+            ? connection_error(s, ERROR_COMPRESSION, "bad trailers")
+            : SUCCESS;
+    if (id % 2 == 0 || id <= s->last_stream)
+        return connection_error(s, ERROR_PROTOCOL, "HEADERS on a closed stream");
+
+    memset(&s->request, 0, offsetof(struct request, pseudo));
+    s->request.content_length = FAILURE;
+    if (hpack_decode(&s->decoder, s->block, s->block_len, request_field,
+                     &s->request) == FAILURE)
+        return connection_error(s, ERROR_COMPRESSION, "bad header block");
+
+    s->last_stream = id;
+
+    if (s->closing || s->nstreams == s->server->max_streams) {
+        refuse_stream(s, id, ERROR_REFUSED_STREAM);
+        return SUCCESS;
+    }
+
+    open_stream(s, id, end_stream);
+
+    return SUCCESS;
+}
+
+/*
+ * Add to the header block being received.
+ */
+static int
+add_block(struct h2_session *s, unsigned char const *p, size_t len,
+          unsigned flags)
+{
+    if (sizeof s->block - s->block_len < len)
+        return connection_error(s, ERROR_ENHANCE_YOUR_CALM,
+                                "header block too large");
+
+    memcpy(s->block + s->block_len, p, len);
+    s->block_len += len;
+
+    return flags & FLAG_END_HEADERS ? finish_block(s) : SUCCESS;
+}
+
+/*
+ * Strip the padding from a frame's payload.
+ */
+static int
+unpad(unsigned flags, unsigned char const **p, size_t *len)
+{
+    size_t pad;
+
+    if (!(flags & FLAG_PADDED))
+        return SUCCESS;
+    if (*len == 0)
+        return FAILURE;
+
+    pad = **p;
+    ++*p;
+    --*len;
+    if (pad > *len)
+        return FAILURE;
+    *len -= pad;
+
+    return SUCCESS;
+}
+
+static int
+handle_data(struct h2_session *s, unsigned flags, uint32_t id,
+            unsigned char const *p, size_t len)
+{
+    size_t const frame_len = len;
+
+    struct stream *st;
+
+    if (id == 0)
+        return connection_error(s, ERROR_PROTOCOL, "DATA on stream 0");
+    if (unpad(flags, &p, &len) == FAILURE)
+        return connection_error(s, ERROR_PROTOCOL, "bad padding");
+
+    // The connection window is given back at once: the streams' windows
+    // are what hold the client back.
+    if (frame_len > 0)
+        put_u32_frame(s, FRAME_WINDOW_UPDATE, 0, frame_len);
+
+    st = find_stream(s, id);
+    if (st == NULL) {
+        if (id > s->last_stream)
+            return connection_error(s, ERROR_PROTOCOL, "DATA on idle stream");
+        // The rest of a body the client sent before it learned the stream
+        // was closed.
+        if (!was_abandoned(s, id))
+            put_u32_frame(s, FRAME_RST_STREAM, id, ERROR_STREAM_CLOSED);
+        return SUCCESS;
+    }
+    if (st->end_stream) {
+        reset_stream(s, st, ERROR_STREAM_CLOSED);
+        return SUCCESS;
+    }
+
+    st->recv_window -= frame_len;
+    if (st->recv_window < 0) {
+        reset_stream(s, st, ERROR_FLOW_CONTROL);
+        return SUCCESS;
+    }
+    st->credit += frame_len - len;
+
+    if (!st->counting) {
+        if ((long long)len > st->body_left) {
+            reset_stream(s, st, ERROR_PROTOCOL);
+            return SUCCESS;
+        }
+        st->body_left -= len;
+    }
+
+    if (st->fd == FAILURE && !st->counting) {
+        // Answered already; the rest of the body is not wanted.
+        st->credit += len;
+        len = 0;
+    }
+
+    if (st->tx_size - st->tx_len < len) {
+        memmove(st->tx, st->tx + st->tx_off, st->tx_len - st->tx_off);
+        st->tx_len -= st->tx_off;
+        st->tx_off = 0;
+    }
+    memcpy(st->tx + st->tx_len, p, len);
+    st->tx_len += len;
+
+    if (flags & FLAG_END_STREAM) {
+        st->end_stream = true;
+        if (st->counting)
+            finish_counting(s, st);
+        else if (st->body_left != 0)
+            reset_stream(s, st, ERROR_PROTOCOL);
+    }
+    else if (st->counting && st->recv_window == 0) {
+        // No room left to count the body in.
+        st->counting = false;
+        respond_error(s, st, BAD_REQUEST);
+    }
+
+    return SUCCESS;
+}
+
+static int
+handle_headers(struct h2_session *s, unsigned flags, uint32_t id,
+               unsigned char const *p, size_t len)
+{
+    if (id == 0)
+        return connection_error(s, ERROR_PROTOCOL, "HEADERS on stream 0");
+    if (unpad(flags, &p, &len) == FAILURE)
+        return connection_error(s, ERROR_PROTOCOL, "bad padding");
+
+    // Priorities are not kept.
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5)
+            return connection_error(s, ERROR_FRAME_SIZE, "short HEADERS");
+        p += 5;
+        len -= 5;
+    }
+
+    s->block_stream = id;
+    s->block_end_stream = flags & FLAG_END_STREAM;
+    s->block_len = 0;
+
+    return add_block(s, p, len, flags);
+}
+
+/*
+ * Apply settings from the client, from a SETTINGS frame or an upgrade.
+ */
+static int
+apply_settings(struct h2_session *s, unsigned char const *p, size_t len)
+{
+    for (; len >= 6; p += 6, len -= 6) {
+        unsigned const id = p[0] << 8 | p[1];
+        uint32_t const value = get32(p + 2);
+
+        switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpack_resize(&s->encoder, value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+                return connection_error(s, ERROR_PROTOCOL, "ENABLE_PUSH");
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > WINDOW_MAX)
+                return connection_error(s, ERROR_FLOW_CONTROL,
+                                        "INITIAL_WINDOW_SIZE");
+            for (unsigned i = 0; i < s->nstreams; ++i)
+                s->streams[i]->send_window += (int64_t)value
+                    - s->initial_window;
+            s->initial_window = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < FRAME_MAX || value > 0xffffff)
+                return connection_error(s, ERROR_PROTOCOL, "MAX_FRAME_SIZE");
+            // Larger frames are allowed, but not needed.
+            break;
+        default:
+            break;
+        }
+    }
+
+    return SUCCESS;
+}
+
+static int
+handle_settings(struct h2_session *s, unsigned flags, uint32_t id,
+                unsigned char const *p, size_t len)
+{
+    if (id != 0)
+        return connection_error(s, ERROR_PROTOCOL, "SETTINGS on a stream");
+
+    if (flags & FLAG_ACK)
+        return len == 0 ? SUCCESS
+            : connection_error(s, ERROR_FRAME_SIZE, "SETTINGS ACK with data");
+
+    if (len % 6 != 0)
+        return connection_error(s, ERROR_FRAME_SIZE, "bad SETTINGS");
+
+    if (apply_settings(s, p, len) == FAILURE)
+        return FAILURE;
+
+    put_frame(s, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+
+    return SUCCESS;
+}
+
+static int
+handle_window_update(struct h2_session *s, uint32_t id,
+                     unsigned char const *p, size_t len)
+{
+    uint32_t increment;
+    struct stream *st;
+
+    if (len != 4)
+        return connection_error(s, ERROR_FRAME_SIZE, "bad WINDOW_UPDATE");
+
+    increment = get32(p) & WINDOW_MAX;
+
+    if (id == 0) {
+        if (increment == 0)
+            return connection_error(s, ERROR_PROTOCOL, "WINDOW_UPDATE of 0");
+        s->send_window += increment;
+        if (s->send_window > WINDOW_MAX)
+            return connection_error(s, ERROR_FLOW_CONTROL,
+                                    "connection window overflow");
+        return SUCCESS;
+    }
+
+    st = find_stream(s, id);
+    if (st == NULL)
+        return SUCCESS;
+
+    if (increment == 0)
+        reset_stream(s, st, ERROR_PROTOCOL);
+    else if ((st->send_window += increment) > WINDOW_MAX)
+        reset_stream(s, st, ERROR_FLOW_CONTROL);
+
+    return SUCCESS;
+}
+
+/*
+ * Act on a frame from the client.
+ */
+static int
+handle_frame(struct h2_session *s, unsigned type, unsigned flags, uint32_t id,
+             unsigned char const *p, size_t len)
+{
+    struct stream *st;
+
+    // A header block must not be interleaved with other frames.
+    if (s->block_stream != 0
+        && (type != FRAME_CONTINUATION || id != s->block_stream))
+        return connection_error(s, ERROR_PROTOCOL, "expected CONTINUATION");
+
+    if (!s->settings && type != FRAME_SETTINGS)
+        return connection_error(s, ERROR_PROTOCOL, "expected SETTINGS");
+    s->settings = true;
+
+    switch (type) {
+    case FRAME_DATA:
+        return handle_data(s, flags, id, p, len);
+
+    case FRAME_HEADERS:
+        return handle_headers(s, flags, id, p, len);
+
+    case FRAME_CONTINUATION:
+        if (s->block_stream == 0)
+            return connection_error(s, ERROR_PROTOCOL,
+                                    "unexpected CONTINUATION");
+        return add_block(s, p, len, flags);
+
+    case FRAME_PRIORITY:
+        if (id == 0)
+            return connection_error(s, ERROR_PROTOCOL, "PRIORITY on stream 0");
+        if (len != 5)
+            return connection_error(s, ERROR_FRAME_SIZE, "bad PRIORITY");
+        return SUCCESS;
+
+    case FRAME_RST_STREAM:
+        if (id == 0)
+            return connection_error(s, ERROR_PROTOCOL, "RST_STREAM on stream 0");
+        if (len != 4)
+            return connection_error(s, ERROR_FRAME_SIZE, "bad RST_STREAM");
+        if (id > s->last_stream)
+            return connection_error(s, ERROR_PROTOCOL,
+                                    "RST_STREAM on idle stream");
+        st = find_stream(s, id);
+        if (st != NULL) {
+            if (s->verbose)
+                fprintf(stderr, "h2: stream %u reset by client\n", id);
+            st->keep = false;
+            close_stream(s, st);
+        }
+        return SUCCESS;
+
+    case FRAME_SETTINGS:
+        return handle_settings(s, flags, id, p, len);
+
+    case FRAME_PUSH_PROMISE:
+        return connection_error(s, ERROR_PROTOCOL, "PUSH_PROMISE from client");
+
+    case FRAME_PING:
+        if (id != 0)
+            return connection_error(s, ERROR_PROTOCOL, "PING on a stream");
+        if (len != 8)
+            return connection_error(s, ERROR_FRAME_SIZE, "bad PING");
+        if (!(flags & FLAG_ACK))
+            put_frame(s, FRAME_PING, FLAG_ACK, 0, p, len);
+        return SUCCESS;
+
+    case FRAME_GOAWAY:
+        if (id != 0)
+            return connection_error(s, ERROR_PROTOCOL, "GOAWAY on a stream");
+        // Streams already open are finished.
+        s->closing = true;
+        return SUCCESS;
+
+    case FRAME_WINDOW_UPDATE:
+        return handle_window_update(s, id, p, len);
+
+    default:
+        // Unknown frames are ignored.
+        return SUCCESS;
+    }
+}
+
+/*
+ * Act on the frames received in full so far.
+ */
+static int
+process_input(struct h2_session *s)
+{
+    unsigned char *p = s->in;
+    size_t len = s->in_len;
+    int res = SUCCESS;
+
+    if (s->preface > 0) {
+        size_t const n = len < s->preface ? len : s->preface;
+
+        if (memcmp(p, H2_PREFACE + H2_PREFACE_LEN - s->preface, n) != 0)
+            return connection_error(s, ERROR_PROTOCOL, "bad preface");
+        s->preface -= n;
+        p += n;
+        len -= n;
+    }
+
+    while (res == SUCCESS && len >= FRAME_HEADER_LEN) {
+        size_t const frame_len = p[0] << 16 | p[1] << 8 | p[2];
+
+        if (frame_len > FRAME_MAX)
+            return connection_error(s, ERROR_FRAME_SIZE, "frame too large");
+        if (len < FRAME_HEADER_LEN + frame_len)
+            break;
+
+        res = handle_frame(s, p[3], p[4], get32(p + 5) & WINDOW_MAX,
+                           p + FRAME_HEADER_LEN, frame_len);
+        p += FRAME_HEADER_LEN + frame_len;
+        len -= FRAME_HEADER_LEN + frame_len;
+    }
+
+    memmove(s->in, p, len);
+    s->in_len = len;
+
+    return res;
+}
+
+/*
+ * Fields of a response that change from one to the next, and so are not worth
+ * a place in the client's table.
+ */
+static bool
+volatile_field(struct iostring name)
+{
+    static char const * const names[] = {
+        "age", "content-length", "content-range", "date", "etag", "expires",
+        "last-modified", "set-cookie",
+    };
+
+    for (size_t i = 0; i < sizeof names / sizeof names[0]; ++i)
+        if (name_is(name, names[i]))
+            return true;
+
+    return false;
+}
+
+/*
+ * Send a header block in a HEADERS frame and as many CONTINUATION frames as
+ * it takes.
+ */
+static void
+send_block(struct h2_session *s, uint32_t id, unsigned char const *block,
+           size_t len, bool end_stream)
+{
+    enum frame_type type = FRAME_HEADERS;
+    unsigned flags = end_stream ? FLAG_END_STREAM : 0;
+
+    for (;;) {
+        size_t const n = len < FRAME_MAX ? len : FRAME_MAX;
+
+        if (n == len)
+            flags |= FLAG_END_HEADERS;
+        put_frame(s, type, flags, id, block, n);
+        if (n == len)
+            break;
+        block += n;
+        len -= n;
+        type = FRAME_CONTINUATION;
+        flags = 0;
+    }
+}
+
+/*
+ * A response head did not fit in a header block. Some of its fields may have
+ * been added to the encoder's table already, so the client's table would no
+ * longer match it.
+ */
+static int
+too_large(struct h2_session *s)
+{
+    return connection_error(s, ERROR_INTERNAL, "response head too large");
+}
+
+/*
+ * Turn the head of a worker's response into a header block and send it.
+ * Returns FAILURE if the head is not valid, or if it is too large, which
+ * breaks the connection.
+ */
+static int
+send_head(struct h2_session *s, struct stream *st, size_t head_len)
+{
+    char * const end = st->rx + head_len;
+
+    struct http_status_line const statline =
+        parse_http_status_line(st->rx, head_len, false);
+    long long content_length = 0;
+    unsigned char * const block = s->encoded;
+    size_t n = head_len, len = 0;
+    ssize_t res;
+    int status;
+    char *p;
+
+    if (!statline.valid || statline.status_code.len != 3)
+        return FAILURE;
+
+    status = strtol(statline.status_code.p, NULL, 10);
+    if (status >= 400)
+        st->keep = false;
+
+    res = hpack_encode_start(&s->encoder, block, sizeof s->encoded);
+    if (res == FAILURE)
+        return too_large(s);
+    len += res;
+    res = hpack_encode(&s->encoder, block + len, sizeof s->encoded - len,
+                       (struct iostring){ ":status", 7 },
+                       statline.status_code, true);
+    if (res == FAILURE)
+        return too_large(s);
+    len += res;
+
+    n -= statline.end - st->rx;
+    p = statline.end;
+
+    for (struct http_header_field field;
+         p < end && *p != '\r';
+         n -= field.end - p, p = field.end) {
+        struct iostring name;
+
+        field = parse_http_header_field(p, n, false);
+        if (!field.valid)
+            continue;
+
+        name = field.field_name;
+        for (size_t i = 0; i < name.len; ++i)
+            name.p[i] = tolower((unsigned char)name.p[i]);
+
+        if (name_is(name, "connection")) {
+            if (http_list_has(field.field_value, (struct iostring){ "close", 5 }))
+                st->keep = false;
+            continue;
+        }
+        if (name_is(name, "keep-alive") || name_is(name, "proxy-connection")
+            || name_is(name, "transfer-encoding") || name_is(name, "upgrade"))
+            continue;
+        if (name_is(name, "content-length"))
+            content_length = strtoll(field.field_value.p, NULL, 10);
+
+        res = hpack_encode(&s->encoder, block + len, sizeof s->encoded - len,
+                           name, field.field_value, !volatile_field(name));
+        if (res == FAILURE)
+            return too_large(s);
+        len += res;
+    }
+
+    st->body_out = st->head || status == 204 || status == 304
+        ? 0 : content_length;
+    if (st->head)
+        // The worker went by the Content-Length.
+        st->keep = false;
+
+    send_block(s, st->id, block, len, st->body_out == 0);
+    st->head_sent = true;
+
+    return SUCCESS;
+}
+
+/*
+ * Find the end of a response head in the receive buffer.
+ * Returns its length, or 0 if it is not all there yet.
+ */
+static size_t
+head_length(struct stream *st)
+{
+    char const *end = memmem(st->rx, st->rx_len, "\r\n\r\n", 4);
+
+    return end == NULL ? 0 : end + 4 - st->rx;
+}
+
+static void
+consume(struct stream *st, size_t n)
+{
+    memmove(st->rx, st->rx + n, st->rx_len - n);
+    st->rx_len -= n;
+}
+
+/*
+ * The worker went before the response was done: try again with a fresh one
+ * if the request allows, otherwise fail the stream.
+ */
+static void
+worker_lost(struct h2_session *s, struct stream *st)
+{
+    if (st->received == 0 && st->reused && !st->body) {
+        if (s->verbose)
+            fprintf(stderr, "h2: retrying stream %u\n", st->id);
+        close(st->fd);
+        st->fd = FAILURE;
+        st->eof = false;
+        st->tx_off = 0;
+        st->tx_head = st->tx_len;
+        if (take_worker(s, st, true) == SUCCESS)
+            return;
+        respond_error(s, st, SERVICE_UNAVAILABLE);
+        return;
+    }
+
+    respond_error(s, st, BAD_GATEWAY);
+}
+
+/*
+ * Move a stream along as far as it can go for now.
+ * Returns false if the stream is finished and was closed.
+ */
+static bool
+pump_stream(struct h2_session *s, struct stream *st)
+{
+    size_t head_len;
+    ssize_t n;
+
+    if (st->fd != FAILURE && !st->eof && st->tx_off < st->tx_len) {
+        n = write(st->fd, st->tx + st->tx_off, st->tx_len - st->tx_off);
+        if (n > 0) {
+            size_t const head = (size_t)n < st->tx_head ? n : st->tx_head;
+
+            st->tx_head -= head;
+            st->credit += n - head;
+            st->tx_off += n;
+            // A request without a body is kept whole, to try again with.
+            if (st->body && st->tx_off == st->tx_len)
+                st->tx_off = st->tx_len = 0;
+        }
+        else if (n == FAILURE && errno != EAGAIN && errno != EINTR)
+            st->eof = true;
+    }
+
+    // Let the client send more of the body as the worker takes it.
+    if (st->credit > 0 && !st->end_stream && !st->counting) {
+        put_u32_frame(s, FRAME_WINDOW_UPDATE, st->id, st->credit);
+        st->recv_window += st->credit;
+        st->credit = 0;
+    }
+
+    while (!st->head_sent) {
+        head_len = head_length(st);
+        if (head_len == 0) {
+            if (st->eof && st->rx_len == 0)
+                worker_lost(s, st);
+            else if (st->eof || st->rx_len == sizeof st->rx)
+                respond_error(s, st, BAD_GATEWAY);
+            else
+                return true;
+            // The retry may have produced nothing yet.
+            if (st->fd != FAILURE)
+                return true;
+            continue;
+        }
+        // Interim responses are not passed on.
+        if (st->rx[9] == '1' && head_len > 12) {
+            consume(st, head_len);
+            continue;
+        }
+        if (send_head(s, st, head_len) == FAILURE) {
+            if (s->broken)
+                return true;
+            respond_error(s, st, BAD_GATEWAY);
+            continue;
+        }
+        consume(st, head_len);
+        if ((long long)st->rx_len > st->body_out) {
+            // More than the response holds, the worker is out of step.
+            st->keep = false;
+            st->rx_len = st->body_out;
+        }
+    }
+
+    while (st->body_out > 0 && st->rx_len > 0
+           && st->send_window > 0 && s->send_window > 0) {
+        size_t len = st->rx_len;
+
+        if ((long long)len > st->body_out)
+            len = st->body_out;
+        if ((int64_t)len > st->send_window)
+            len = st->send_window;
+        if ((int64_t)len > s->send_window)
+            len = s->send_window;
+        if (len > FRAME_MAX)
+            len = FRAME_MAX;
+
+        st->body_out -= len;
+        st->send_window -= len;
+        s->send_window -= len;
+        put_frame(s, FRAME_DATA, st->body_out == 0 ? FLAG_END_STREAM : 0,
+                  st->id, st->rx, len);
+        consume(st, len);
+    }
+    if (st->rx_len > st->body_out) {
+        st->keep = false;
+        st->rx_len = st->body_out;
+    }
+
+    if (st->body_out > 0) {
+        if (st->eof && st->rx_len == 0) {
+            reset_stream(s, st, ERROR_INTERNAL);
+            return false;
+        }
+        return true;
+    }
+
+    // The response is complete. If the request is not, the client can stop.
+    if (!st->end_stream || st->counting) {
+        put_u32_frame(s, FRAME_RST_STREAM, st->id, ERROR_NONE);
+        st->keep = false;
+    }
+    close_stream(s, st);
+
+    return false;
+}
+
+/*
+ * Move every stream along, taking turns at the front.
+ */
+static void
+pump_streams(struct h2_session *s)
+{
+    unsigned const n = s->nstreams;
+
+    struct stream *streams[n + 1]; // Never of length 0
+
+    memcpy(streams, s->streams, n * sizeof *streams);
+
+    for (unsigned i = 0; i < n && !s->broken; ++i)
+        pump_stream(s, streams[(s->next + i) % n]);
+
+    ++s->next;
+}
+
+/*
+ * Read what a worker sent.
+ */
+static void
+read_worker(struct stream *st)
+{
+    ssize_t n;
+
+    n = read(st->fd, st->rx + st->rx_len, sizeof st->rx - st->rx_len);
+    if (n > 0) {
+        st->rx_len += n;
+        st->received += n;
+    }
+    else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        st->eof = true;
+}
+
+/*
+ * Whether a stream is held up by the client's flow control windows.
+ */
+static bool
+stalled(struct h2_session *s, struct stream *st)
+{
+    return st->head_sent && st->rx_len > 0
+        && (st->send_window <= 0 || s->send_window <= 0);
+}
+
+/*
+ * Decode the base64url value of an HTTP2-Settings field.
+ * Returns the length of the settings, or FAILURE.
+ */
+static ssize_t
+decode_settings(struct iostring value, unsigned char *buf, size_t size)
+{
+    static char const alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+    uint32_t acc = 0;
+    unsigned bits = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < value.len && value.p[i] != '='; ++i) {
+        char const * const c = memchr(alphabet, value.p[i], 64);
+
+        if (c == NULL)
+            return FAILURE;
+        acc = acc << 6 | (c - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == size)
+                return FAILURE;
+            buf[n++] = acc >> bits;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Send the server's connection preface.
+ */
+static void
+send_preface(struct h2_session *s)
+{
+    unsigned char settings[12];
+    uint32_t const window = (uint64_t)WINDOW * s->server->max_streams
+        > WINDOW_MAX ? WINDOW_MAX : WINDOW * s->server->max_streams;
+
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, s->server->max_streams);
+    settings[6] = 0;
+    settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(settings + 8, HEAD_MAX);
+    put_frame(s, FRAME_SETTINGS, 0, 0, settings, sizeof settings);
+
+    // Room for every stream to send a window's worth of body at once.
+    if (window > WINDOW)
+        put_u32_frame(s, FRAME_WINDOW_UPDATE, 0, window - WINDOW);
+}
+
+static void
+session_free(struct h2_session *s)
+{
+    while (s->nstreams > 0) {
+        s->streams[0]->keep = false;
+        close_stream(s, s->streams[0]);
+    }
+    for (unsigned i = 0; i < s->nidle; ++i)
+        close(s->idle[i]);
+    hpack_free(&s->decoder);
+    hpack_free(&s->encoder);
+    free(s->streams);
+    free(s);
+}
+
+void
+h2_abandon(struct h2_session *s)
+{
+    close(s->fd);
+    for (unsigned i = 0; i < s->nstreams; ++i)
+        if (s->streams[i]->fd != FAILURE)
+            close(s->streams[i]->fd);
+    for (unsigned i = 0; i < s->nidle; ++i)
+        close(s->idle[i]);
+}
+
+/*
+ * Wait for the client or the workers to have something for the session.
+ * Returns FAILURE if the connection is to be closed.
+ */
+static int
+await_session(struct h2_session *s)
+{
+    unsigned const nstreams = s->nstreams;
+    int const drain_fd = s->server->drain_fd;
+
+    struct pollfd fds[nstreams + 2];
+    unsigned timeout = nstreams == 0
+        ? s->server->idle_timeout : s->server->stall_timeout;
+    int res;
+    ssize_t n;
+
+    fds[0] = (struct pollfd){ .fd = s->fd, .events = POLLIN };
+    fds[1] = (struct pollfd){
+        .fd = s->closing ? FAILURE : drain_fd,
+        .events = POLLIN,
+    };
+    for (unsigned i = 0; i < nstreams; ++i) {
+        struct stream * const st = s->streams[i];
+        short const events =
+            (st->rx_len < sizeof st->rx ? POLLIN : 0)
+            | (st->tx_off < st->tx_len ? POLLOUT : 0);
+
+        fds[i + 2] = (struct pollfd){
+            .fd = st->fd == FAILURE || st->eof || events == 0
+                ? FAILURE : st->fd,
+            .events = events,
+        };
+    }
+
+    do
+        res = poll(fds, nstreams + 2, timeout);
+    while (res == FAILURE && errno == EINTR);
+
+    if (res == FAILURE) {
+        perror("h2: failed to poll");
+        return FAILURE;
+    }
+
+    if (res == 0) {
+        bool stall = nstreams == 0;
+
+        // Workers time out on their own; only the client is waited on here.
+        for (unsigned i = 0; i < nstreams; ++i)
+            stall = stall || stalled(s, s->streams[i]);
+        if (stall) {
+            if (s->verbose)
+                fputs("h2: closing idle connection\n", stderr);
+            send_goaway(s, ERROR_NONE);
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+
+    if (fds[0].revents != 0) {
+        n = read(s->fd, s->in + s->in_len, sizeof s->in - s->in_len);
+        if (n <= 0) {
+            if (s->verbose)
+                fputs(n == 0 ? "h2: connection closed by client\n"
+                             : "h2: failed to receive from client\n", stderr);
+            s->broken = s->lost = true;
+            return FAILURE;
+        }
+        s->in_len += n;
+    }
+
+    // Draining finishes the streams already open.
+    if (fds[1].revents != 0) {
+        if (s->verbose)
+            fputs("h2: draining connection\n", stderr);
+        send_goaway(s, ERROR_NONE);
+    }
+
+    for (unsigned i = 0; i < nstreams; ++i)
+        if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+            read_worker(s->streams[i]);
+
+    return SUCCESS;
+}
+
+/*
+ * Wait a moment for the client to close its end after a GOAWAY.
+ * Closing with frames from the client still unread would reset the
+ * connection, which could cost the client the GOAWAY.
+ */
+static void
+linger(struct h2_session *s)
+{
+    struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+    struct timespec start, now;
+    int elapsed = 0;
+
+    if (shutdown(s->fd, SHUT_WR) == FAILURE)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (elapsed < LINGER_MS && poll(&pfd, 1, LINGER_MS - elapsed) > 0
+           && read(s->fd, s->in, sizeof s->in) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000
+            + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+}
+
+int
+h2_serve(struct h2_server const *server, int fd, char const *buf, size_t len,
+         struct iostring upgrade, struct iostring settings)
+{
+    struct h2_session *s;
+    int res = SUCCESS;
+
+    s = malloc(sizeof *s);
+    if (s == NULL) {
+        perror("h2_serve(): failed to allocate a session");
+        return FAILURE;
+    }
+    memset(s, 0, offsetof(struct h2_session, in));
+    s->streams = calloc(server->max_streams, sizeof *s->streams);
+    if (s->streams == NULL) {
+        perror("h2_serve(): failed to allocate streams");
+        free(s);
+        return FAILURE;
+    }
+    s->server = server;
+    s->fd = fd;
+    s->verbose = server->verbose;
+    s->preface = H2_PREFACE_LEN;
+    s->send_window = WINDOW;
+    s->initial_window = WINDOW;
+    hpack_init(&s->decoder);
+    hpack_init(&s->encoder);
+
+    if (s->verbose)
+        fputs("h2: serving HTTP/2\n", stderr);
+
+    if (upgrade.len > 0) {
+        unsigned char payload[FRAME_MAX];
+        ssize_t const n = decode_settings(settings, payload, sizeof payload);
+
+        if (n == FAILURE || n % 6 != 0
+            || apply_settings(s, payload, n) == FAILURE) {
+            if (s->verbose)
+                fputs("h2: bad HTTP2-Settings\n", stderr);
+            session_free(s);
+            return FAILURE;
+        }
+    }
+
+    send_preface(s);
+
+    if (upgrade.len > 0)
+        open_upgrade_stream(s, upgrade);
+
+    if (len > sizeof s->in)
+        len = sizeof s->in;
+    memcpy(s->in, buf, len);
+    s->in_len = len;
+
+    for (;;) {
+        if (process_input(s) == FAILURE)
+            res = FAILURE;
+        pump_streams(s);
+        flush(s);
+        if (s->broken || (s->closing && s->nstreams == 0))
+            break;
+        if (await_session(s) == FAILURE)
+            break;
+    }
+
+    send_goaway(s, ERROR_NONE);
+    flush(s);
+    if (!s->lost)
+        linger(s);
+
+    session_free(s);
+
+    return res;
+}
@@ -0,0 +1,96 @@
+/*
+ * h2.h
+ * Interface to the HTTP/2 server for client connections.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _h2_h_
+#define _h2_h_
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "iostring.h"
+
+/*
+ * An HTTP/2 connection (RFC 7540) carries many requests at once, each on a
+ * stream of its own, with the header fields compressed with HPACK.
+ *
+ * Rather than teach the rest of the proxy about streams, each stream is
+ * turned back into an HTTP/1.1 request and handed to a stream worker: a child
+ * process running the usual HTTP/1.1 proxy on one end of a socket pair. The
+ * response it sends back is turned into HTTP/2 frames for the client. Workers
+ * are kept for further streams once they finish, the way a kept-alive
+ * connection would be, so only the peak of concurrent streams costs a fork.
+ *
+ * Both directions are flow controlled for each stream: the client may only
+ * send as much of a request body as the worker has taken, and a worker's
+ * response is only read as fast as the client's windows let it be sent on.
+ *
+ * The connection is served in one process with blocking writes to the client
+ * and non-blocking I/O with the workers, all driven by poll(2).
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+struct h2_session;
+
+struct h2_server {
+    // Start a stream worker, returning the file descriptor of this end of its
+    // connection, or -1 if there is no room for one. The child process must
+    // call h2_abandon() on the session first thing.
+    int (*spawn)(void *ctx, struct h2_session *session);
+    void *ctx;
+    int drain_fd;          // Hangs up when the connection is to be finished
+    unsigned idle_timeout; // Milliseconds to keep an idle connection open
+    unsigned stall_timeout; // Milliseconds to wait on a client with streams
+    unsigned max_streams;  // Concurrent streams allowed on a connection
+    bool absolute;         // Requests are sent with absolute URIs
+    bool verbose;
+};
+
+/*
+ * Serve an HTTP/2 connection on fd until it is closed.
+ * The len bytes in buf were already read from the connection, starting with
+ * the client connection preface.
+ * A connection upgraded from HTTP/1.1 (h2c) starts with the head of the
+ * request that asked for the upgrade, which becomes stream 1, and the value
+ * of its HTTP2-Settings field. Otherwise upgrade.len is 0.
+ * Returns -1 if the connection was closed because of an error, otherwise 0.
+ * The caller still owns fd.
+ */
+int h2_serve(struct h2_server const *server, int fd,
+             char const *buf, size_t len,
+             struct iostring upgrade, struct iostring settings);
+
+/*
+ * Close the session's file descriptors in a forked child process, so it does
+ * not keep the connection or other workers open.
+ */
+void h2_abandon(struct h2_session *session);
+
+#endif // _h2_h_
@@ -0,0 +1,521 @@
+/*
+ * health.c
+ * Implementation of the upstream health checks.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "health.h"
+
+#include <netdb.h>
+#include <poll.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fds.h"
+#include "shm.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define HEALTH_PROBE 8 // Number of slots searched for an address.
+#define HEALTH_MAX_FAILURES 3 // Connection failures in a row before ejection
+#define HEALTH_MAX_5XX 5 // 5xx responses in a row before ejection
+#define HEALTH_LATENCY_SAMPLES 5 // Responses timed before judging latency
+#define HEALTH_LATENCY_WEIGHT 0.2 // Weight of a new sample in the average
+#define HEALTH_BACKOFF_MAX 6 // At most 2^6 times the first ejection time
+#define PROBE_TIMEOUT_MS 1000
+
+/*
+ * What an address was last ejected for, and so what can bring it back early.
+ */
+enum health_cause {
+    CAUSE_NONE,
+    CAUSE_CONNECT, // a working connection
+    CAUSE_ERRORS,  // a good response to an HTTP probe
+    CAUSE_LATENCY  // nothing but the end of the backoff period
+};
+
+struct health_entry {
+    struct sockaddr_storage addr;
+    socklen_t addrlen; // 0 if the slot is unused
+    unsigned failures, errors, samples;
+    unsigned ejections; // Ejections since the address last recovered
+    enum health_cause cause;
+    double latency; // Moving average, in seconds
+    double ejected_until;
+    double period; // Length of the last ejection, also the clean time needed
+    double last_used;
+};
+
+struct health {
+    shm_lock_t lock;
+    bool verbose;
+    struct health_config config;
+    char probe_path[256];
+    size_t naddrs;
+    struct shm_region region;
+    struct health_entry entries[];
+};
+
+static double
+health_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * FNV-1a over the address bytes.
+ */
+static uint64_t
+health_hash(struct sockaddr const *addr, socklen_t addrlen)
+{
+    unsigned char const *p = (unsigned char const *)addr;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (socklen_t i = 0; i < addrlen; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/*
+ * Print an address for the verbose log.
+ */
+static void
+health_log(struct health const *health, struct health_entry const *entry,
+           char const *what)
+{
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+
+    if (!health->verbose)
+        return;
+
+    if (getnameinfo((struct sockaddr const *)&entry->addr, entry->addrlen,
+                    host, sizeof host, port, sizeof port,
+                    NI_NUMERICHOST | NI_NUMERICSERV) != SUCCESS)
+        strcpy(host, "?"), strcpy(port, "?");
+
+    fprintf(stderr, "upstream %s port %s %s\n", host, port, what);
+}
+
+struct health *
+health_create(size_t naddrs, struct health_config const *config, bool verbose)
+{
+    struct shm_region region;
+    struct health *health;
+
+    if (config->probe_path != NULL
+        && strlen(config->probe_path) >= sizeof health->probe_path) {
+        fputs("health_create(): probe path too long\n", stderr);
+        return NULL;
+    }
+
+    if (shm_create(&region, "proxy-health",
+                   sizeof *health + naddrs * sizeof health->entries[0])
+        == FAILURE)
+        return NULL;
+
+    health = region.base;
+    atomic_flag_clear(&health->lock);
+    health->verbose = verbose;
+    health->config = *config;
+    if (config->probe_path != NULL) {
+        strcpy(health->probe_path, config->probe_path);
+        health->config.probe_path = health->probe_path;
+    }
+    health->naddrs = naddrs;
+    health->region = region;
+
+    return health;
+}
+
+void
+health_destroy(struct health *health)
+{
+    struct shm_region region = health->region;
+
+    shm_destroy(&region);
+}
+
+/*
+ * Find the entry for an address, adding it if it is new and create is true.
+ * Only entries not currently ejected are replaced, least recently used first.
+ * Returns NULL if the address is not (and cannot be) in the table.
+ * Called with the lock held.
+ */
+static struct health_entry *
+health_find(struct health *health, struct sockaddr const *addr,
+            socklen_t addrlen, double now, bool create)
+{
+    uint64_t const hash = health_hash(addr, addrlen);
+
+    struct health_entry *victim = NULL;
+
+    if (addrlen > sizeof victim->addr)
+        return NULL;
+
+    for (size_t i = 0; i < HEALTH_PROBE; ++i) {
+        struct health_entry * const e =
+            &health->entries[(hash + i) % health->naddrs];
+
+        if (e->addrlen == addrlen && memcmp(&e->addr, addr, addrlen) == SUCCESS) {
+            e->last_used = now;
+            return e;
+        }
+
+        if (e->addrlen == 0) {
+            if (victim == NULL || victim->addrlen != 0)
+                victim = e;
+        }
+        else if (e->ejected_until <= now
+                 && (victim == NULL
+                     || (victim->addrlen != 0
+                         && e->last_used < victim->last_used)))
+            victim = e;
+    }
+
+    if (!create || victim == NULL)
+        return NULL;
+
+    memset(victim, 0, sizeof *victim);
+    memcpy(&victim->addr, addr, addrlen);
+    victim->addrlen = addrlen;
+    victim->last_used = now;
+
+    return victim;
+}
+
+/*
+ * Take an address out of service for its backoff period.
+ * Called with the lock held.
+ */
+static void
+health_eject(struct health *health, struct health_entry *entry, double now,
+             enum health_cause cause, char const *why)
+{
+    unsigned const backoff = entry->ejections < HEALTH_BACKOFF_MAX
+        ? entry->ejections : HEALTH_BACKOFF_MAX;
+
+    entry->period = (double)(health->config.eject_time << backoff);
+    entry->ejected_until = now + entry->period;
+    entry->cause = cause;
+    ++entry->ejections;
+    entry->failures = entry->errors = entry->samples = 0;
+    entry->latency = 0;
+
+    health_log(health, entry, why);
+}
+
+/*
+ * Whether the address is back from an ejection, but has not yet gone a whole
+ * backoff period without failing again.
+ * Called with the lock held.
+ */
+static bool
+health_on_probation(struct health *health, struct health_entry *entry,
+                    double now)
+{
+    if (entry->ejections == 0)
+        return false;
+
+    if (now < entry->ejected_until + entry->period)
+        return true;
+
+    // Clean for long enough: the next ejection starts the backoff over.
+    health_log(health, entry, "recovered");
+    entry->ejections = 0;
+    entry->cause = CAUSE_NONE;
+
+    return false;
+}
+
+/*
+ * The address no longer shows what it was ejected for, so it can end its
+ * ejection early. The backoff stays until the address has been clean for
+ * long enough.
+ * Called with the lock held.
+ */
+static void
+health_recover(struct health *health, struct health_entry *entry, double now,
+               enum health_cause cause)
+{
+    if (entry->ejected_until <= now || entry->cause != cause)
+        return;
+
+    health_log(health, entry, "back in service");
+    entry->ejected_until = now;
+}
+
+int
+health_register(struct health *health, char const *host, char const *port)
+{
+    struct addrinfo *aip, hint = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    double const now = health_now();
+    int rval;
+
+    rval = getaddrinfo(host, port, &hint, &aip);
+    if (rval != SUCCESS) {
+        fprintf(stderr, "health_register(): %s: %s\n", host, gai_strerror(rval));
+        return FAILURE;
+    }
+
+    shm_lock(&health->lock);
+    for (struct addrinfo *rp = aip; rp != NULL; rp = rp->ai_next)
+        health_find(health, rp->ai_addr, rp->ai_addrlen, now, true);
+    shm_unlock(&health->lock);
+
+    freeaddrinfo(aip);
+
+    return SUCCESS;
+}
+
+bool
+health_ejected(struct health *health,
+               struct sockaddr const *addr, socklen_t addrlen)
+{
+    double const now = health_now();
+
+    struct health_entry *entry;
+    bool ejected = false;
+
+    shm_lock(&health->lock);
+    entry = health_find(health, addr, addrlen, now, false);
+    if (entry != NULL)
+        ejected = entry->ejected_until > now;
+    shm_unlock(&health->lock);
+
+    return ejected;
+}
+
+/*
+ * Record the outcome of a connection, or of an HTTP probe if answered is true.
+ */
+static void
+health_checked(struct health *health,
+               struct sockaddr const *addr, socklen_t addrlen, bool ok,
+               bool answered)
+{
+    double const now = health_now();
+
+    struct health_entry *entry;
+
+    shm_lock(&health->lock);
+    entry = health_find(health, addr, addrlen, now, true);
+    if (entry != NULL) {
+        bool const probation = health_on_probation(health, entry, now);
+
+        if (ok) {
+            entry->failures = 0;
+            health_recover(health, entry, now, CAUSE_CONNECT);
+            if (answered)
+                health_recover(health, entry, now, CAUSE_ERRORS);
+        }
+        else if (entry->ejected_until > now)
+            ; // already out of service
+        else if (++entry->failures >= HEALTH_MAX_FAILURES
+                 // Once back from an ejection, one failure is enough.
+                 || probation)
+            health_eject(health, entry, now, CAUSE_CONNECT,
+                         "ejected (connection failures)");
+    }
+    shm_unlock(&health->lock);
+}
+
+void
+health_connected(struct health *health,
+                 struct sockaddr const *addr, socklen_t addrlen, bool ok)
+{
+    health_checked(health, addr, addrlen, ok, false);
+}
+
+void
+health_response(struct health *health,
+                struct sockaddr const *addr, socklen_t addrlen,
+                int status, double latency)
+{
+    double const now = health_now();
+    double const limit = health->config.eject_latency / 1000.0;
+
+    struct health_entry *entry;
+
+    shm_lock(&health->lock);
+    entry = health_find(health, addr, addrlen, now, true);
+    if (entry != NULL) {
+        health_on_probation(health, entry, now);
+        entry->latency = entry->samples++ == 0 ? latency
+            : entry->latency * (1 - HEALTH_LATENCY_WEIGHT)
+              + latency * HEALTH_LATENCY_WEIGHT;
+
+        if (status >= 500 && ++entry->errors >= HEALTH_MAX_5XX)
+            health_eject(health, entry, now, CAUSE_ERRORS,
+                         "ejected (server errors)");
+        else if (limit > 0 && entry->samples >= HEALTH_LATENCY_SAMPLES
+                 && entry->latency > limit)
+            health_eject(health, entry, now, CAUSE_LATENCY,
+                         "ejected (latency)");
+        else if (status < 500)
+            entry->errors = 0;
+    }
+    shm_unlock(&health->lock);
+}
+
+/*
+ * Connect to an address, giving up after PROBE_TIMEOUT_MS.
+ * Returns a connected socket, or -1 on failure.
+ */
+static int
+probe_connect(struct sockaddr const *addr, socklen_t addrlen)
+{
+    struct pollfd pfd = { .events = POLLOUT };
+    int error = 0;
+    socklen_t errlen = sizeof error;
+
+    pfd.fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (pfd.fd == FAILURE)
+        return FAILURE;
+
+    if ((connect(pfd.fd, addr, addrlen) == FAILURE && errno != EINPROGRESS)
+        || poll(&pfd, 1, PROBE_TIMEOUT_MS) != 1
+        || getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &error, &errlen) == FAILURE
+        || error != 0) {
+        close(pfd.fd);
+        return FAILURE;
+    }
+
+    return pfd.fd;
+}
+
+/*
+ * Probe an address with a TCP connection, followed by an HTTP request for the
+ * probe path if there is one, which must get a 2xx or 3xx response.
+ */
+static bool
+probe(struct health const *health,
+      struct sockaddr const *addr, socklen_t addrlen)
+{
+    char buf[512];
+    struct pollfd pfd = { .events = POLLIN };
+    ssize_t len;
+    int n;
+
+    pfd.fd = probe_connect(addr, addrlen);
+    if (pfd.fd == FAILURE)
+        return false;
+
+    if (health->config.probe_path == NULL) {
+        close(pfd.fd);
+        return true;
+    }
+
+    n = snprintf(buf, sizeof buf,
+                 "GET %s HTTP/1.0\r\nConnection: close\r\n\r\n",
+                 health->config.probe_path);
+    len = write(pfd.fd, buf, n);
+    if (len == n && poll(&pfd, 1, PROBE_TIMEOUT_MS) == 1)
+        len = read(pfd.fd, buf, sizeof buf - 1);
+    else
+        len = FAILURE;
+    close(pfd.fd);
+
+    // HTTP/1.x 2xx or 3xx
+    return len >= 12 && strncmp(buf, "HTTP/1.", 7) == SUCCESS
+        && (buf[9] == '2' || buf[9] == '3');
+}
+
+/*
+ * Probe every address in the table, forever.
+ */
+static void
+prober_main(struct health *health, pid_t parent)
+{
+    while (getppid() == parent) {
+        for (size_t i = 0; i < health->naddrs; ++i) {
+            struct health_entry * const e = &health->entries[i];
+
+            struct sockaddr_storage addr;
+            socklen_t addrlen;
+            bool ok;
+
+            shm_lock(&health->lock);
+            addrlen = e->addrlen;
+            memcpy(&addr, &e->addr, sizeof addr);
+            shm_unlock(&health->lock);
+
+            if (addrlen == 0)
+                continue;
+
+            ok = probe(health, (struct sockaddr *)&addr, addrlen);
+            health_checked(health, (struct sockaddr *)&addr, addrlen, ok,
+                           health->config.probe_path != NULL);
+        }
+
+        sleep(health->config.probe_interval);
+    }
+}
+
+pid_t
+health_start_prober(struct health *health)
+{
+    pid_t const parent = getpid();
+
+    pid_t pid;
+
+    if (health->config.probe_interval == 0)
+        return 0;
+
+    pid = fork();
+    switch (pid) {
+    case -1:
+        perror("health_start_prober(): failed to fork a child process");
+        return FAILURE;
+    case 0:
+        // The shared table stays mapped, the listening socket must not stay open.
+        close_fds(STDERR_FILENO + 1, FAILURE);
+        signal(SIGPIPE, SIG_IGN);
+        if (health->verbose)
+            fprintf(stderr, "probing upstreams every %u seconds\n",
+                    health->config.probe_interval);
+        prober_main(health, parent);
+        exit(EXIT_SUCCESS);
+    default:
+        return pid;
+    }
+}
@@ -0,0 +1,114 @@
+/*
+ * health.h
+ * Interface to the upstream health checks.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _health_h_
+#define _health_h_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * The health of every upstream address the proxy connects to is tracked in a
+ * table in shared memory, so that what one child process learns about an
+ * address spares the others.
+ *
+ * Addresses are checked passively, by counting failed connections and 5xx
+ * responses and keeping a moving average of response latency, and actively,
+ * by a prober process connecting to each address in turn.
+ *
+ * An address that fails too often, or is too slow, is ejected: connection
+ * attempts skip it until its backoff period is over, or until it shows it no
+ * longer fails the way it was ejected for (a probe connects to an address that
+ * refused connections, an HTTP probe is answered by one that sent 5xx errors).
+ * The period doubles every time the address is ejected again before it has
+ * gone as long as its last period without being ejected.
+ */
+
+struct health;
+
+/*
+ * Settings for the health checks.
+ */
+struct health_config {
+    unsigned eject_time;    // seconds an address is ejected at first
+    unsigned eject_latency; // milliseconds of average latency, 0 for no limit
+    unsigned probe_interval; // seconds between active probes, 0 for none
+    char const *probe_path; // for HTTP probes, or NULL for TCP connects only
+};
+
+/*
+ * Create a table tracking at most naddrs upstream addresses.
+ * Returns NULL on failure.
+ */
+struct health *health_create(size_t naddrs, struct health_config const *config,
+                             bool verbose);
+
+/*
+ * Release the shared table.
+ */
+void health_destroy(struct health *health);
+
+/*
+ * Add the addresses of a host to the table, so that they are probed even
+ * before the first connection to them.
+ * Returns -1 if the host could not be resolved, 0 otherwise.
+ */
+int health_register(struct health *health, char const *host, char const *port);
+
+/*
+ * Whether connection attempts should skip an address.
+ */
+bool health_ejected(struct health *health,
+                    struct sockaddr const *addr, socklen_t addrlen);
+
+/*
+ * Record the outcome of an attempt to connect to an address.
+ */
+void health_connected(struct health *health,
+                      struct sockaddr const *addr, socklen_t addrlen, bool ok);
+
+/*
+ * Record the status code of a response from an address, and the seconds
+ * between sending the request and receiving the response.
+ */
+void health_response(struct health *health,
+                     struct sockaddr const *addr, socklen_t addrlen,
+                     int status, double latency);
+
+/*
+ * Start the prober process, if active probes are configured.
+ * The prober exits by itself once its parent is gone.
+ * Returns the pid of the prober, 0 if there is none, or -1 on failure.
+ */
+pid_t health_start_prober(struct health *health);
+
+#endif // _health_h_
@@ -0,0 +1,703 @@
+/*
+ * hpack.c
+ * Implementation of the HPACK header compression used by HTTP/2.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "hpack.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define HUFFMAN_SYMBOLS 257 // 256 octets and EOS
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_LEN 30 // Bits in the longest code
+#define HPACK_INT_MAX (1 << 24) // Larger integers are not decoded
+
+#define STATIC_FIELD(name, value) \
+    { { name, sizeof name - 1 }, { value, sizeof value - 1 } }
+
+/*
+ * The static table of RFC 7541 Appendix A. Index 1 is the first entry.
+ */
+static struct {
+    struct iostring name, value;
+} const static_table[] = {
+    STATIC_FIELD(":authority", ""),
+    STATIC_FIELD(":method", "GET"),
+    STATIC_FIELD(":method", "POST"),
+    STATIC_FIELD(":path", "/"),
+    STATIC_FIELD(":path", "/index.html"),
+    STATIC_FIELD(":scheme", "http"),
+    STATIC_FIELD(":scheme", "https"),
+    STATIC_FIELD(":status", "200"),
+    STATIC_FIELD(":status", "204"),
+    STATIC_FIELD(":status", "206"),
+    STATIC_FIELD(":status", "304"),
+    STATIC_FIELD(":status", "400"),
+    STATIC_FIELD(":status", "404"),
+    STATIC_FIELD(":status", "500"),
+    STATIC_FIELD("accept-charset", ""),
+    STATIC_FIELD("accept-encoding", "gzip, deflate"),
+    STATIC_FIELD("accept-language", ""),
+    STATIC_FIELD("accept-ranges", ""),
+    STATIC_FIELD("accept", ""),
+    STATIC_FIELD("access-control-allow-origin", ""),
+    STATIC_FIELD("age", ""),
+    STATIC_FIELD("allow", ""),
+    STATIC_FIELD("authorization", ""),
+    STATIC_FIELD("cache-control", ""),
+    STATIC_FIELD("content-disposition", ""),
+    STATIC_FIELD("content-encoding", ""),
+    STATIC_FIELD("content-language", ""),
+    STATIC_FIELD("content-length", ""),
+    STATIC_FIELD("content-location", ""),
+    STATIC_FIELD("content-range", ""),
+    STATIC_FIELD("content-type", ""),
+    STATIC_FIELD("cookie", ""),
+    STATIC_FIELD("date", ""),
+    STATIC_FIELD("etag", ""),
+    STATIC_FIELD("expect", ""),
+    STATIC_FIELD("expires", ""),
+    STATIC_FIELD("from", ""),
+    STATIC_FIELD("host", ""),
+    STATIC_FIELD("if-match", ""),
+    STATIC_FIELD("if-modified-since", ""),
+    STATIC_FIELD("if-none-match", ""),
+    STATIC_FIELD("if-range", ""),
+    STATIC_FIELD("if-unmodified-since", ""),
+    STATIC_FIELD("last-modified", ""),
+    STATIC_FIELD("link", ""),
+    STATIC_FIELD("location", ""),
+    STATIC_FIELD("max-forwards", ""),
+    STATIC_FIELD("proxy-authenticate", ""),
+    STATIC_FIELD("proxy-authorization", ""),
+    STATIC_FIELD("range", ""),
+    STATIC_FIELD("referer", ""),
+    STATIC_FIELD("refresh", ""),
+    STATIC_FIELD("retry-after", ""),
+    STATIC_FIELD("server", ""),
+    STATIC_FIELD("set-cookie", ""),
+    STATIC_FIELD("strict-transport-security", ""),
+    STATIC_FIELD("transfer-encoding", ""),
+    STATIC_FIELD("user-agent", ""),
+    STATIC_FIELD("vary", ""),
+    STATIC_FIELD("via", ""),
+    STATIC_FIELD("www-authenticate", ""),
+};
+
+#define STATIC_FIELDS (sizeof static_table / sizeof static_table[0])
+
+/*
+ * The Huffman code of RFC 7541 Appendix B, by symbol. Symbol 256 is EOS.
+ */
+static struct huffman_code {
+    uint32_t code;
+    uint8_t len;
+} const huffman_codes[HUFFMAN_SYMBOLS] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+    { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+    { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+    { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 }, { 0x1ff9, 13 },
+    { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 }, { 0x3fa, 10 }, { 0x3fb, 10 },
+    { 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 },
+    { 0x18, 6 }, { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 },
+    { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 }, { 0x1e, 6 }, { 0x1f, 6 },
+    { 0x5c, 7 }, { 0xfb, 8 }, { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 },
+    { 0x3fc, 10 }, { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+    { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 }, { 0x63, 7 },
+    { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 },
+    { 0x69, 7 }, { 0x6a, 7 }, { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 },
+    { 0x6e, 7 }, { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 },
+    { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 }, { 0x7ffd, 15 }, { 0x3, 5 },
+    { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 }, { 0x28, 6 }, { 0x29, 6 },
+    { 0x2a, 6 }, { 0x7, 5 }, { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+    { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 }, { 0x79, 7 }, { 0x7a, 7 },
+    { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 },
+    { 0xffffffc, 28 }, { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 },
+    { 0xfffe8, 20 }, { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 },
+    { 0x7fffd9, 23 }, { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 },
+    { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 },
+    { 0x7fffdf, 23 }, { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 },
+    { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 },
+    { 0x7fffe3, 23 }, { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 },
+    { 0x7fffe5, 23 }, { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 },
+    { 0xffffef, 24 }, { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 },
+    { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 },
+    { 0x1fffde, 21 }, { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 },
+    { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 },
+    { 0x7fffec, 23 }, { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 },
+    { 0x1fffe2, 21 }, { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 },
+    { 0x7fffef, 23 }, { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 },
+    { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 },
+    { 0x7ffff1, 23 }, { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 },
+    { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 },
+    { 0x1ffffec, 25 }, { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 },
+    { 0x7ffffde, 27 }, { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 },
+    { 0x1ffffed, 25 }, { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 },
+    { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 },
+    { 0xfffff2, 24 }, { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 },
+    { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 },
+    { 0x7ffffe5, 27 }, { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 },
+    { 0x1fffe6, 21 }, { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 },
+    { 0x7ffff3, 23 }, { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 },
+    { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 },
+    { 0x7ffff4, 23 }, { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 },
+    { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 },
+    { 0x7ffffea, 27 }, { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 },
+    { 0x7ffffed, 27 }, { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 },
+    { 0x3ffffee, 26 }, { 0x3fffffff, 30 },
+};
+
+/*
+ * The code is canonical: the codes of each length are consecutive, starting
+ * at huffman_first, and stand for the symbols from huffman_offset on in
+ * huffman_symbols.
+ */
+static uint32_t const huffman_first[HUFFMAN_MAX_LEN + 1] = {
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c, 0xf8, 0x1fc, 0x3f8, 0x7fa, 0xffa,
+    0x1ff8, 0x3ffc, 0x7ffc, 0xfffe, 0x1fffc, 0x3fff8, 0x7fff0, 0xfffe6,
+    0x1fffdc, 0x3fffd2, 0x7fffd8, 0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde,
+    0xfffffe2, 0x1ffffffe, 0x3ffffffc,
+};
+static uint16_t const huffman_count[HUFFMAN_MAX_LEN + 1] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26,
+    29, 12, 4, 15, 19, 29, 0, 4,
+};
+static uint16_t const huffman_offset[HUFFMAN_MAX_LEN + 1] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 74, 74, 79, 82, 84, 90, 92, 95, 95, 95, 95,
+    98, 106, 119, 145, 174, 186, 190, 205, 224, 253, 253,
+};
+static uint16_t const huffman_symbols[HUFFMAN_SYMBOLS] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53,
+    54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114,
+    117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82,
+    83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44,
+    59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93, 126,
+    94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226,
+    153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132,
+    133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181, 185,
+    186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140,
+    141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175,
+    180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171,
+    206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+    210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221,
+    222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29,
+    30, 31, 127, 220, 249, 10, 13, 22, 256,
+};
+
+void
+hpack_init(struct hpack_table *table)
+{
+    memset(table, 0, sizeof *table);
+    table->max_size = HPACK_TABLE_SIZE;
+}
+
+/*
+ * The field at a dynamic table index, 0 being the newest.
+ */
+static struct hpack_field *
+table_field(struct hpack_table *table, size_t i)
+{
+    return &table->fields[(table->first + i) % HPACK_TABLE_FIELDS];
+}
+
+static size_t
+field_size(size_t name_len, size_t value_len)
+{
+    return name_len + value_len + HPACK_FIELD_OVERHEAD;
+}
+
+/*
+ * Drop the oldest fields until the table fits in size bytes.
+ */
+static void
+table_evict(struct hpack_table *table, size_t size)
+{
+    while (table->count > 0 && table->size > size) {
+        struct hpack_field * const field = table_field(table,
+                                                       table->count - 1);
+
+        table->size -= field_size(field->name_len, field->value_len);
+        free(field->name);
+        field->name = field->value = NULL;
+        --table->count;
+    }
+}
+
+void
+hpack_free(struct hpack_table *table)
+{
+    table_evict(table, 0);
+}
+
+/*
+ * Add a field to the table, evicting older fields to make room for it.
+ * A field larger than the whole table just empties it.
+ * Returns FAILURE if the field could not be copied.
+ */
+static int
+table_insert(struct hpack_table *table,
+             struct iostring name, struct iostring value)
+{
+    size_t const size = field_size(name.len, value.len);
+
+    struct hpack_field *field;
+    char *copy;
+
+    if (size > table->max_size) {
+        table_evict(table, 0);
+        return SUCCESS;
+    }
+
+    // Copied first: the name may be that of a field about to be evicted.
+    copy = malloc(name.len + value.len + 1);
+    if (copy == NULL) {
+        perror("hpack: failed to allocate a table field");
+        return FAILURE;
+    }
+    memcpy(copy, name.p, name.len);
+    memcpy(copy + name.len, value.p, value.len);
+
+    table_evict(table, table->max_size - size);
+
+    table->first = (table->first + HPACK_TABLE_FIELDS - 1) % HPACK_TABLE_FIELDS;
+    ++table->count;
+    table->size += size;
+    field = table_field(table, 0);
+    field->name = copy;
+    field->name_len = name.len;
+    field->value = copy + name.len;
+    field->value_len = value.len;
+
+    return SUCCESS;
+}
+
+/*
+ * Look up an index in the static table followed by the dynamic table.
+ * Returns FAILURE if there is no such index.
+ */
+static int
+table_lookup(struct hpack_table *table, size_t index,
+             struct iostring *name, struct iostring *value)
+{
+    struct hpack_field *field;
+
+    if (index == 0)
+        return FAILURE;
+
+    if (index <= STATIC_FIELDS) {
+        *name = static_table[index - 1].name;
+        *value = static_table[index - 1].value;
+        return SUCCESS;
+    }
+
+    index -= STATIC_FIELDS + 1;
+    if (index >= table->count)
+        return FAILURE;
+
+    field = table_field(table, index);
+    *name = (struct iostring){ field->name, field->name_len };
+    *value = (struct iostring){ field->value, field->value_len };
+
+    return SUCCESS;
+}
+
+/*
+ * Decode an integer with an N-bit prefix (RFC 7541 5.1) at *p, and move *p
+ * past it.
+ */
+static int
+decode_int(unsigned char const **p, unsigned char const *end,
+           int prefix, size_t *value)
+{
+    unsigned const mask = (1 << prefix) - 1;
+
+    unsigned shift = 0;
+
+    if (*p == end)
+        return FAILURE;
+
+    *value = *(*p)++ & mask;
+    if (*value < mask)
+        return SUCCESS;
+
+    // Zero continuations leave the value alone, so the shift is what bounds
+    // them: any more than fit an integer up to HPACK_INT_MAX are refused.
+    do {
+        if (*p == end || *value > HPACK_INT_MAX || shift > 28)
+            return FAILURE;
+        *value += (size_t)(**p & 0x7f) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+
+    return *value > HPACK_INT_MAX ? FAILURE : SUCCESS;
+}
+
+/*
+ * Decode len octets of Huffman code into out, which has room for any string
+ * they could code for. Returns the length of the string, or FAILURE.
+ */
+static ssize_t
+huffman_decode(unsigned char const *in, size_t len, char *out)
+{
+    uint32_t code = 0;
+    unsigned bits = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; ++i)
+        for (int bit = 7; bit >= 0; --bit) {
+            code = code << 1 | ((in[i] >> bit) & 1);
+            if (++bits > HUFFMAN_MAX_LEN)
+                return FAILURE;
+            if (code - huffman_first[bits] < huffman_count[bits]) {
+                unsigned const symbol = huffman_symbols[huffman_offset[bits]
+                                                        + code
+                                                        - huffman_first[bits]];
+                if (symbol == HUFFMAN_EOS)
+                    return FAILURE;
+                out[n++] = symbol;
+                code = 0;
+                bits = 0;
+            }
+        }
+
+    // Padding is the start of EOS, all ones, and shorter than an octet.
+    if (bits > 7 || code != (1U << bits) - 1)
+        return FAILURE;
+
+    return n;
+}
+
+/*
+ * Decode a string literal (RFC 7541 5.2) at *p, Huffman coded strings into
+ * *scratch, and move *p past it.
+ */
+static int
+decode_string(unsigned char const **p, unsigned char const *end,
+              char **scratch, struct iostring *s)
+{
+    bool huffman;
+    size_t len;
+    ssize_t n;
+
+    if (*p == end)
+        return FAILURE;
+
+    huffman = **p & 0x80;
+    if (decode_int(p, end, 7, &len) == FAILURE || len > end - *p)
+        return FAILURE;
+
+    if (huffman) {
+        // The shortest codes are 5 bits long.
+        n = huffman_decode(*p, len, *scratch);
+        if (n == FAILURE)
+            return FAILURE;
+        *s = (struct iostring){ *scratch, n };
+        *scratch += n;
+    }
+    else
+        *s = (struct iostring){ (char *)*p, len };
+
+    *p += len;
+
+    return SUCCESS;
+}
+
+int
+hpack_decode(struct hpack_table *table,
+             unsigned char const *block, size_t len,
+             hpack_field_fn *field, void *ctx)
+{
+    unsigned char const *p = block, * const end = block + len;
+
+    struct iostring name, value;
+    size_t index, size;
+    char *scratch, *s;
+    bool fields = false;
+    int res = SUCCESS;
+
+    // Room for a field's name and value, however they are coded.
+    scratch = malloc(len * 8 / 5 + 1);
+    if (scratch == NULL) {
+        perror("hpack_decode(): failed to allocate a buffer");
+        return FAILURE;
+    }
+
+    while (p < end && res == SUCCESS) {
+        s = scratch;
+
+        if (*p & 0x80) {
+            // Indexed field
+            res = decode_int(&p, end, 7, &index);
+            if (res == SUCCESS)
+                res = table_lookup(table, index, &name, &value);
+        }
+        else if ((*p & 0xe0) == 0x20) {
+            // Dynamic table size update, only before the first field.
+            res = decode_int(&p, end, 5, &size);
+            if (res == SUCCESS && (fields || size > HPACK_TABLE_SIZE))
+                res = FAILURE;
+            if (res == SUCCESS) {
+                table->max_size = size;
+                table_evict(table, size);
+            }
+            continue;
+        }
+        else {
+            // Literal field, indexed or not
+            bool const indexed = *p & 0x40;
+
+            res = decode_int(&p, end, indexed ? 6 : 4, &index);
+            if (res == SUCCESS)
+                res = index == 0
+                    ? decode_string(&p, end, &s, &name)
+                    : table_lookup(table, index, &name, &value);
+            if (res == SUCCESS)
+                res = decode_string(&p, end, &s, &value);
+            if (res == SUCCESS) {
+                fields = true;
+                field(ctx, name, value);
+                // Inserted last, as it may evict the field named.
+                if (indexed)
+                    res = table_insert(table, name, value);
+            }
+            continue;
+        }
+
+        if (res == SUCCESS) {
+            fields = true;
+            field(ctx, name, value);
+        }
+    }
+
+    free(scratch);
+
+    return res;
+}
+
+void
+hpack_resize(struct hpack_table *table, size_t max_size)
+{
+    if (max_size > HPACK_TABLE_SIZE)
+        max_size = HPACK_TABLE_SIZE;
+    if (max_size == table->max_size)
+        return;
+
+    table->max_size = max_size;
+    table_evict(table, max_size);
+    table->resized = true;
+}
+
+/*
+ * Encode an integer with an N-bit prefix, the rest of the first octet being
+ * flags. Returns the number of octets written, or FAILURE.
+ */
+static ssize_t
+encode_int(unsigned char *buf, size_t size,
+           int prefix, unsigned char flags, size_t value)
+{
+    unsigned const mask = (1 << prefix) - 1;
+
+    size_t n = 0;
+
+    if (size == 0)
+        return FAILURE;
+
+    if (value < mask) {
+        buf[n++] = flags | value;
+        return n;
+    }
+
+    buf[n++] = flags | mask;
+    value -= mask;
+    do {
+        if (n == size)
+            return FAILURE;
+        buf[n++] = (value > 0x7f ? 0x80 : 0) | (value & 0x7f);
+        value >>= 7;
+    } while (value > 0);
+
+    return n;
+}
+
+/*
+ * Bits in the Huffman code for a string.
+ */
+static size_t
+huffman_bits(struct iostring s)
+{
+    size_t bits = 0;
+
+    for (size_t i = 0; i < s.len; ++i)
+        bits += huffman_codes[(unsigned char)s.p[i]].len;
+
+    return bits;
+}
+
+/*
+ * Encode a string literal, with the Huffman code if that is shorter.
+ * Returns the number of octets written, or FAILURE.
+ */
+static ssize_t
+encode_string(unsigned char *buf, size_t size, struct iostring s)
+{
+    size_t const huffman_len = (huffman_bits(s) + 7) / 8;
+    bool const huffman = huffman_len < s.len;
+
+    ssize_t n;
+    uint64_t acc = 0;
+    unsigned bits = 0;
+
+    n = encode_int(buf, size, 7, huffman ? 0x80 : 0,
+                   huffman ? huffman_len : s.len);
+    if (n == FAILURE || size - n < (huffman ? huffman_len : s.len))
+        return FAILURE;
+
+    if (!huffman) {
+        memcpy(buf + n, s.p, s.len);
+        return n + s.len;
+    }
+
+    for (size_t i = 0; i < s.len; ++i) {
+        struct huffman_code const code = huffman_codes[(unsigned char)s.p[i]];
+
+        acc = acc << code.len | code.code;
+        bits += code.len;
+        while (bits >= 8) {
+            bits -= 8;
+            buf[n++] = acc >> bits;
+        }
+    }
+    // Pad with the start of EOS.
+    if (bits > 0)
+        buf[n++] = (acc << (8 - bits)) | (0xff >> bits);
+
+    return n;
+}
+
+ssize_t
+hpack_encode_start(struct hpack_table *table, unsigned char *buf, size_t size)
+{
+    ssize_t n = 0;
+
+    if (table->resized) {
+        n = encode_int(buf, size, 5, 0x20, table->max_size);
+        if (n != FAILURE)
+            table->resized = false;
+    }
+
+    return n;
+}
+
+/*
+ * Find a field in the tables by name and value, or failing that by name.
+ * Returns the index, or 0 if neither was found.
+ */
+static size_t
+table_find(struct hpack_table *table,
+           struct iostring name, struct iostring value, bool *exact)
+{
+    size_t found = 0;
+
+    *exact = false;
+
+    for (size_t i = 0; i < STATIC_FIELDS; ++i)
+        if (static_table[i].name.len == name.len
+            && memcmp(static_table[i].name.p, name.p, name.len) == 0) {
+            if (static_table[i].value.len == value.len
+                && memcmp(static_table[i].value.p, value.p, value.len) == 0) {
+                *exact = true;
+                return i + 1;
+            }
+            if (found == 0)
+                found = i + 1;
+        }
+
+    for (size_t i = 0; i < table->count; ++i) {
+        struct hpack_field const * const field = table_field(table, i);
+
+        if (field->name_len == name.len
+            && memcmp(field->name, name.p, name.len) == 0) {
+            if (field->value_len == value.len
+                && memcmp(field->value, value.p, value.len) == 0) {
+                *exact = true;
+                return STATIC_FIELDS + 1 + i;
+            }
+            if (found == 0)
+                found = STATIC_FIELDS + 1 + i;
+        }
+    }
+
+    return found;
+}
+
+ssize_t
+hpack_encode(struct hpack_table *table, unsigned char *buf, size_t size,
+             struct iostring name, struct iostring value, bool index)
+{
+    bool exact;
+    size_t const found = table_find(table, name, value, &exact);
+
+    ssize_t n, n1;
+
+    if (exact)
+        return encode_int(buf, size, 7, 0x80, found);
+
+    // Indexed literals are added to the table, plain ones are not.
+    n = index ? encode_int(buf, size, 6, 0x40, found)
+              : encode_int(buf, size, 4, 0x00, found);
+    if (n == FAILURE)
+        return FAILURE;
+
+    if (found == 0) {
+        n1 = encode_string(buf + n, size - n, name);
+        if (n1 == FAILURE)
+            return FAILURE;
+        n += n1;
+    }
+
+    n1 = encode_string(buf + n, size - n, value);
+    if (n1 == FAILURE)
+        return FAILURE;
+    n += n1;
+
+    if (index && table_insert(table, name, value) == FAILURE)
+        return FAILURE;
+
+    return n;
+}
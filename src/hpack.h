@@ -0,0 +1,122 @@
+/*
+ * hpack.h
+ * Interface to the HPACK header compression used by HTTP/2.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _hpack_h_
+#define _hpack_h_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "iostring.h"
+
+/*
+ * HPACK (RFC 7541) compresses the header fields of HTTP/2 messages against a
+ * static table of common fields and a dynamic table of fields seen earlier on
+ * the same connection. Each direction of a connection has its own dynamic
+ * table, kept the same at both ends by applying the same insertions in the
+ * same order, so every header block must be decoded, even one whose message
+ * is refused.
+ *
+ * Strings may be Huffman coded. The decoder handles both forms, and the
+ * encoder uses the Huffman code whenever it is shorter.
+ */
+
+#define HPACK_TABLE_SIZE 4096 // Default and largest dynamic table, in bytes
+#define HPACK_FIELD_OVERHEAD 32 // Counted for each field in the table
+#define HPACK_TABLE_FIELDS (HPACK_TABLE_SIZE / HPACK_FIELD_OVERHEAD)
+
+struct hpack_field {
+    char *name, *value; // One allocation, the value following the name
+    size_t name_len, value_len;
+};
+
+/*
+ * A dynamic table, as a ring of fields with the newest first.
+ */
+struct hpack_table {
+    struct hpack_field fields[HPACK_TABLE_FIELDS];
+    size_t first, count; // Slot of the newest field, and the number of fields
+    size_t size;         // Bytes the fields count for
+    size_t max_size;     // Most bytes the fields may count for
+    bool resized;        // The encoder has yet to signal the new max_size
+};
+
+/*
+ * Called for each field decoded from a header block. The strings are only
+ * valid during the call.
+ */
+typedef void hpack_field_fn(void *ctx, struct iostring name,
+                            struct iostring value);
+
+/*
+ * Start a dynamic table out empty, with room for HPACK_TABLE_SIZE bytes.
+ */
+void hpack_init(struct hpack_table *table);
+
+/*
+ * Free the fields in a dynamic table.
+ */
+void hpack_free(struct hpack_table *table);
+
+/*
+ * Decode a complete header block, calling field for each field in order.
+ * Returns -1 if the block is not valid, which is fatal to the connection
+ * since the table may no longer match the encoder's, otherwise 0.
+ */
+int hpack_decode(struct hpack_table *table,
+                 unsigned char const *block, size_t len,
+                 hpack_field_fn *field, void *ctx);
+
+/*
+ * Limit the encoder's table to max_size bytes, as the decoder allows in its
+ * settings. The change is signalled at the start of the next header block.
+ */
+void hpack_resize(struct hpack_table *table, size_t max_size);
+
+/*
+ * Start encoding a header block into buf.
+ * Returns the number of bytes written, or -1 if buf is too small.
+ */
+ssize_t hpack_encode_start(struct hpack_table *table,
+                           unsigned char *buf, size_t size);
+
+/*
+ * Encode a field into buf. The name must be in lower case. Fields whose
+ * values change from message to message should not be indexed, so they do not
+ * push more useful fields out of the table.
+ * Returns the number of bytes written, or -1 if buf is too small, in which
+ * case the table is left as it was.
+ */
+ssize_t hpack_encode(struct hpack_table *table,
+                     unsigned char *buf, size_t size,
+                     struct iostring name, struct iostring value, bool index);
+
+#endif // _hpack_h_
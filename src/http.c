@@ -29,8 +29,10 @@
 
 #include "http.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #define HTTP_ERROR(status, reason, reasonlen, body, bodylen, bodylenlen) \
 	{ { #status, 3 }, { reason, reasonlen }, { #bodylen, bodylenlen }, { body, bodylen } }
@@ -38,10 +40,18 @@
 struct http_error const http_errors[STATUS_COUNT] = {
 	HTTP_ERROR(400, "Bad Request", 11,
 				  "The client request is invalid", 29, 2),
+	HTTP_ERROR(404, "Not Found", 9,
+				  "The proxy has no route for the request target", 45, 2),
+	HTTP_ERROR(408, "Request Timeout", 15,
+				  "The client took too long to send a request", 42, 2),
+	HTTP_ERROR(429, "Too Many Requests", 17,
+				  "The client has sent too many requests", 37, 2),
 	HTTP_ERROR(500, "Internal Server Error", 21,
 				  "The proxy encountered an unexpected condition", 45, 2),
 	HTTP_ERROR(502, "Bad Gateway", 11,
 			   "The response from the server is invalid", 39, 2),
+	HTTP_ERROR(503, "Service Unavailable", 19,
+				  "The proxy is out of memory for more requests", 44, 2),
 	HTTP_ERROR(504, "Gateway Timeout", 15,
 				  "The server response took too long", 33, 2),
 };
@@ -425,3 +435,300 @@ debug_http_header_field(struct http_header_field reqhead)
     else
         fputs("not a valid HTTP header field\n", stderr);
 }
+
+bool
+http_header_field_is(struct http_header_field field, char const *name)
+{
+    return field.valid
+        && field.field_name.len == strlen(name)
+        && strncasecmp(name, field.field_name.p, field.field_name.len) == 0;
+}
+
+bool
+http_list_has(struct iostring list, struct iostring element)
+{
+    char *p = list.p, *end = list.p + list.len;
+
+    while (p < end) {
+        char *next = memchr(p, ',', end - p);
+        char *last = next != NULL ? next : end;
+
+        // Trim optional white space.
+        while (p < last && (*p == ' ' || *p == '\t'))
+            ++p;
+        while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+            --last;
+
+        if (last - p == element.len
+            && strncasecmp(p, element.p, element.len) == 0)
+            return true;
+
+        if (next == NULL)
+            break;
+        p = next + 1;
+    }
+
+    return false;
+}
+
+/*
+ * Cache Control
+ */
+
+/*
+ * Match a directive name at the start of s, followed by the end of the
+ * directive, an '=' or whitespace.
+ */
+static bool
+directive_is(char const *s, size_t len, char const *name)
+{
+    size_t const namelen = strlen(name);
+
+    return len >= namelen
+        && strncasecmp(s, name, namelen) == 0
+        && (len == namelen || memchr("=, \t", s[namelen], 4) != NULL);
+}
+
+void
+parse_http_cache_control(struct iostring value, struct http_cache_control *cc)
+{
+    static char const * const ws = " \t,";
+    static size_t const wslen = 3;
+
+    char *p = value.p, *end = value.p + value.len;
+
+    while (p != end) {
+        char *directive;
+        size_t len;
+
+        // Skip separators.
+        while (p != end && memchr(ws, *p, wslen) != NULL)
+            ++p;
+        if (p == end)
+            break;
+
+        directive = p;
+        while (p != end && *p != ',')
+            ++p;
+        len = p - directive;
+
+        if (directive_is(directive, len, "no-store"))
+            cc->no_store = true;
+        else if (directive_is(directive, len, "no-cache"))
+            cc->no_cache = true;
+        else if (directive_is(directive, len, "private"))
+            cc->private = true;
+        else if (directive_is(directive, len, "max-age") && len > 8)
+            cc->max_age = strtol(directive + 8, NULL, 10); // max-age=
+        else if (directive_is(directive, len, "s-maxage") && len > 9)
+            cc->s_maxage = strtol(directive + 9, NULL, 10); // s-maxage=
+        else if (directive_is(directive, len, "stale-while-revalidate")
+                 && len > 23)
+            cc->stale_while_revalidate = strtol(directive + 23, NULL, 10);
+    }
+}
+
+time_t
+parse_http_date(struct iostring value)
+{
+    char date[64];
+    struct tm tm;
+    char *end;
+
+    if (value.len >= sizeof date)
+        return -1;
+
+    memcpy(date, value.p, value.len);
+    date[value.len] = '\0';
+
+    memset(&tm, 0, sizeof tm);
+    end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0')
+        return -1;
+
+    return timegm(&tm);
+}
+
+/*
+ * Range
+ */
+
+/*
+ * Parse a decimal number, or -1 if there are no digits.
+ */
+static long long
+parse_range_bound(char **pp, char const *end)
+{
+    char *p = *pp;
+    long long n = -1;
+
+    while (p != end && *p >= '0' && *p <= '9') {
+        if (n > (LLONG_MAX - 9) / 10)
+            return -2; // too big
+        n = (n < 0 ? 0 : n * 10) + (*p - '0');
+        ++p;
+    }
+
+    *pp = p;
+    return n;
+}
+
+int
+parse_http_range(struct iostring value, struct http_range *ranges, int max)
+{
+    static char const * const unit = "bytes=";
+    static size_t const unitlen = 6;
+    static char const * const ws = " \t";
+    static size_t const wslen = 2;
+
+    char *p = value.p, *end = value.p + value.len;
+    int n = 0;
+
+    if (value.len <= unitlen || strncasecmp(p, unit, unitlen) != 0)
+        return -1;
+    p += unitlen;
+
+    while (p != end) {
+        struct http_range range;
+
+        // Skip whitespace and empty list elements.
+        while (p != end && (*p == ',' || memchr(ws, *p, wslen) != NULL))
+            ++p;
+        if (p == end)
+            break;
+
+        range.first = parse_range_bound(&p, end);
+        if (range.first == -2 || p == end || *p != '-')
+            return -1;
+        ++p; // -
+        range.last = parse_range_bound(&p, end);
+        if (range.last == -2
+            || (range.first == -1 && range.last == -1)
+            || (range.last != -1 && range.first > range.last))
+            return -1;
+
+        while (p != end && memchr(ws, *p, wslen) != NULL)
+            ++p;
+        if (p != end && *p != ',')
+            return -1;
+
+        if (n == max)
+            return -1;
+        ranges[n++] = range;
+    }
+
+    return n == 0 ? -1 : n;
+}
+
+/*
+ * Chunked Transfer Coding
+ */
+
+enum {
+    CHUNK_START,     // first hex digit of the size
+    CHUNK_SIZE,      // more hex digits of the size
+    CHUNK_EXT,       // extensions after the size
+    CHUNK_SIZE_LF,   // end of the size line
+    CHUNK_DATA,
+    CHUNK_DATA_CR,   // end of the data
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,   // start of a trailer line, or of the final CRLF
+    CHUNK_FIELD,     // rest of a trailer field
+    CHUNK_FIELD_LF,
+    CHUNK_END_LF,
+};
+
+static int
+hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+long long
+scan_http_chunked(struct http_chunked *chunked, char const *buf, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && !chunked->done) {
+        char const c = buf[i];
+        int digit;
+
+        switch (chunked->state) {
+        case CHUNK_START:
+        case CHUNK_SIZE:
+            digit = hex_digit(c);
+            if (digit >= 0) {
+                if (chunked->left > ULLONG_MAX >> 4)
+                    return -1; // too big
+                chunked->left = chunked->left << 4 | digit;
+                chunked->state = CHUNK_SIZE;
+                break;
+            }
+            if (chunked->state == CHUNK_START)
+                return -1;
+            if (c == ';' || c == ' ' || c == '\t')
+                chunked->state = CHUNK_EXT;
+            else if (c == '\r')
+                chunked->state = CHUNK_SIZE_LF;
+            else
+                return -1;
+            break;
+        case CHUNK_EXT:
+            if (c == '\r')
+                chunked->state = CHUNK_SIZE_LF;
+            else if (c == '\n')
+                return -1;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            chunked->state = chunked->left == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+            break;
+        case CHUNK_DATA: {
+            size_t const n = len - i < chunked->left ? len - i : chunked->left;
+
+            chunked->left -= n;
+            if (chunked->left == 0)
+                chunked->state = CHUNK_DATA_CR;
+            i += n;
+            continue;
+        }
+        case CHUNK_DATA_CR:
+            if (c != '\r')
+                return -1;
+            chunked->state = CHUNK_DATA_LF;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return -1;
+            chunked->state = CHUNK_START;
+            break;
+        case CHUNK_TRAILER:
+            chunked->state = c == '\r' ? CHUNK_END_LF : CHUNK_FIELD;
+            break;
+        case CHUNK_FIELD:
+            if (c == '\r')
+                chunked->state = CHUNK_FIELD_LF;
+            break;
+        case CHUNK_FIELD_LF:
+            if (c != '\n')
+                return -1;
+            chunked->state = CHUNK_TRAILER;
+            break;
+        case CHUNK_END_LF:
+            if (c != '\n')
+                return -1;
+            chunked->done = true;
+            break;
+        }
+        ++i;
+    }
+
+    return i;
+}
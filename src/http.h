@@ -32,6 +32,7 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "iostring.h"
 
@@ -119,12 +120,90 @@ struct http_header_field parse_http_header_field(char *buf, size_t len, bool ver
  */
 void debug_http_header_field(struct http_header_field);
 
+/*
+ * Check whether a valid header field has the given name.
+ * Field names are case-insensitive.
+ */
+bool http_header_field_is(struct http_header_field, char const *name);
+
+/*
+ * Check whether the value of a list-based header field, such as Connection,
+ * has the given element. Elements are compared case-insensitively.
+ */
+bool http_list_has(struct iostring list, struct iostring element);
+
+/*
+ * Cache Control
+ */
+
+struct http_cache_control {
+    long max_age, s_maxage, stale_while_revalidate; // -1 if not present
+    bool no_store, no_cache, private;
+};
+
+#define HTTP_CACHE_CONTROL_INIT \
+    { .max_age = -1, .s_maxage = -1, .stale_while_revalidate = -1 }
+
+/*
+ * Parse the value of a Cache-Control header field into cc.
+ * Directives already set in cc are kept, so that a message with several
+ * Cache-Control fields can be parsed one field at a time.
+ */
+void parse_http_cache_control(struct iostring value,
+                              struct http_cache_control *cc);
+
+/*
+ * Parse an HTTP-date (IMF-fixdate) such as the value of an Expires field.
+ * Returns -1 if the date is not valid.
+ */
+time_t parse_http_date(struct iostring value);
+
+/*
+ * Range
+ */
+
+#define HTTP_RANGES_MAX 16
+
+struct http_range {
+    long long first, last; // -1 if omitted, as in "-500" or "9500-"
+};
+
+/*
+ * Parse the value of a Range header field for the bytes unit.
+ * Up to max ranges are stored in ranges.
+ * Returns the number of ranges, or -1 if the value is not valid or there are
+ * too many ranges.
+ */
+int parse_http_range(struct iostring value, struct http_range *ranges, int max);
+
+/*
+ * Chunked Transfer Coding
+ */
+
+struct http_chunked {
+    int state;
+    unsigned long long left; // of the chunk being read, or its size so far
+    bool done;               // The last chunk and trailer have been seen
+};
+
+#define HTTP_CHUNKED_INIT { 0, 0, false }
+
+/*
+ * Follow a body in the chunked transfer coding through the next len bytes of
+ * it in buf, which need not hold whole chunks.
+ * Returns how many of the bytes belong to the body, fewer than len only if
+ * the body ends in buf, or -1 if the coding is not valid.
+ */
+long long scan_http_chunked(struct http_chunked *chunked,
+                            char const *buf, size_t len);
+
 /*
  * Status Code
  */
 
-enum http_status_code { BAD_REQUEST, INTERNAL_ERROR, BAD_GATEWAY,
-						TIMEOUT, STATUS_COUNT };
+enum http_status_code { BAD_REQUEST, NOT_FOUND, REQUEST_TIMEOUT,
+						TOO_MANY_REQUESTS, INTERNAL_ERROR, BAD_GATEWAY,
+						SERVICE_UNAVAILABLE, TIMEOUT, STATUS_COUNT };
 
 /*
  * Error
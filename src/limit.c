@@ -0,0 +1,332 @@
+/*
+ * limit.c
+ * Implementation of the per-client admission limits.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "limit.h"
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "shm.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define LIMIT_PROBE 8 // Number of slots searched for a client or a free slot.
+#define LIMIT_HOLDERS 16384 // Processes whose connections are told apart
+
+struct limit_entry {
+    in_addr_t addr; // INADDR_ANY if the slot is unused
+    unsigned conns;
+    double tokens;
+    double updated; // When tokens was last brought up to date
+};
+
+struct limit_holder {
+    pid_t pid; // 0 if the slot is unused
+    in_addr_t addr;
+    unsigned conns; // Connections from addr the process counted and not closed
+};
+
+struct limiter {
+    shm_lock_t lock;
+    bool verbose;
+    double rate, burst;
+    unsigned max_conns;
+    size_t nclients;
+    struct shm_region region;
+    struct limit_holder holders[LIMIT_HOLDERS];
+    struct limit_entry entries[];
+};
+
+/*
+ * Seconds on a clock shared by all the processes, which never goes back.
+ */
+static double
+limit_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct limiter *
+limiter_create(size_t nclients, double rate, double burst,
+               unsigned max_conns, bool verbose)
+{
+    struct shm_region region;
+    struct limiter *limiter;
+
+    if (shm_create(&region, "proxy-limits",
+                   sizeof *limiter + nclients * sizeof limiter->entries[0])
+        == FAILURE)
+        return NULL;
+
+    limiter = region.base;
+    atomic_flag_clear(&limiter->lock);
+    limiter->verbose = verbose;
+    limiter->rate = rate;
+    limiter->burst = burst < 1 ? 1 : burst;
+    limiter->max_conns = max_conns;
+    limiter->nclients = nclients;
+    limiter->region = region;
+
+    if (verbose) {
+        if (rate > 0)
+            fprintf(stderr, "limiting clients to %g requests/s (burst %g)\n",
+                    rate, limiter->burst);
+        if (max_conns > 0)
+            fprintf(stderr, "limiting clients to %u connections\n", max_conns);
+    }
+
+    return limiter;
+}
+
+void
+limiter_destroy(struct limiter *limiter)
+{
+    struct shm_region region = limiter->region;
+
+    shm_destroy(&region);
+}
+
+/*
+ * Bring the tokens in a bucket up to date.
+ */
+static void
+limit_refill(struct limiter const *limiter, struct limit_entry *entry,
+             double now)
+{
+    entry->tokens += (now - entry->updated) * limiter->rate;
+    if (entry->tokens > limiter->burst)
+        entry->tokens = limiter->burst;
+    entry->updated = now;
+}
+
+/*
+ * Find the entry for a client, taking over a free slot if it is new.
+ * A slot is free if it is unused or its client could be forgotten without
+ * changing anything, i.e. it has no connections and a full bucket.
+ * Returns NULL if there is no room for the client.
+ * Called with the lock held.
+ */
+static struct limit_entry *
+limit_find(struct limiter *limiter, in_addr_t addr, double now)
+{
+    uint32_t const hash = (uint32_t)addr * 0x9e3779b1U;
+
+    struct limit_entry *victim = NULL;
+
+    for (size_t i = 0; i < LIMIT_PROBE; ++i) {
+        struct limit_entry * const e =
+            &limiter->entries[(hash + i) % limiter->nclients];
+
+        if (e->addr == addr) {
+            limit_refill(limiter, e, now);
+            return e;
+        }
+
+        if (victim != NULL)
+            continue;
+        if (e->addr == INADDR_ANY)
+            victim = e;
+        else if (e->conns == 0) {
+            limit_refill(limiter, e, now);
+            if (e->tokens >= limiter->burst || limiter->rate == 0)
+                victim = e;
+        }
+    }
+
+    if (victim != NULL) {
+        victim->addr = addr;
+        victim->conns = 0;
+        victim->tokens = limiter->burst;
+        victim->updated = now;
+    }
+
+    return victim;
+}
+
+/*
+ * Find the slot for the connections a process counted from a client, taking
+ * over a free one if it has none. A slot is free if it is unused or counts no
+ * connections.
+ * Returns NULL if there is no room, in which case the connections are only
+ * counted for the client.
+ * Called with the lock held.
+ */
+static struct limit_holder *
+limit_holder(struct limiter *limiter, pid_t pid, in_addr_t addr)
+{
+    uint32_t const hash = (uint32_t)pid * 0x9e3779b1U;
+
+    struct limit_holder *victim = NULL;
+
+    for (size_t i = 0; i < LIMIT_PROBE; ++i) {
+        struct limit_holder * const h =
+            &limiter->holders[(hash + i) % LIMIT_HOLDERS];
+
+        if (h->pid == pid && h->addr == addr)
+            return h;
+        if (victim == NULL && (h->pid == 0 || h->conns == 0))
+            victim = h;
+    }
+
+    if (victim != NULL) {
+        victim->pid = pid;
+        victim->addr = addr;
+        victim->conns = 0;
+    }
+
+    return victim;
+}
+
+bool
+limiter_connect(struct limiter *limiter, struct in_addr addr)
+{
+    struct limit_entry *entry;
+    bool admit = true;
+
+    shm_lock(&limiter->lock);
+    entry = limit_find(limiter, addr.s_addr, limit_now());
+    if (entry != NULL) {
+        if (limiter->max_conns > 0 && entry->conns >= limiter->max_conns)
+            admit = false;
+        else {
+            struct limit_holder * const h =
+                limit_holder(limiter, getpid(), addr.s_addr);
+
+            if (h != NULL)
+                ++h->conns;
+            ++entry->conns;
+        }
+    }
+    shm_unlock(&limiter->lock);
+
+    if (!admit && limiter->verbose)
+        fprintf(stderr, "too many connections from %s\n", inet_ntoa(addr));
+
+    return admit;
+}
+
+void
+limiter_disconnect(struct limiter *limiter, struct in_addr addr)
+{
+    struct limit_holder *h;
+    struct limit_entry *entry;
+
+    shm_lock(&limiter->lock);
+    h = limit_holder(limiter, getpid(), addr.s_addr);
+    if (h != NULL && h->conns > 0)
+        --h->conns;
+    entry = limit_find(limiter, addr.s_addr, limit_now());
+    if (entry != NULL && entry->conns > 0)
+        --entry->conns;
+    shm_unlock(&limiter->lock);
+}
+
+void
+limiter_adopt(struct limiter *limiter, pid_t parent, struct in_addr addr)
+{
+    struct limit_holder *from, *to;
+
+    shm_lock(&limiter->lock);
+    from = limit_holder(limiter, parent, addr.s_addr);
+    if (from != NULL && from->conns > 0)
+        --from->conns;
+    to = limit_holder(limiter, getpid(), addr.s_addr);
+    if (to != NULL)
+        ++to->conns;
+    shm_unlock(&limiter->lock);
+}
+
+void
+limiter_reclaim(struct limiter *limiter)
+{
+    unsigned long reclaimed = 0;
+
+    // Processes are looked for without the lock: only a live process changes
+    // its own slots, and a slot is only taken over once it counts nothing.
+    for (size_t i = 0; i < LIMIT_HOLDERS; ++i) {
+        struct limit_holder * const h = &limiter->holders[i];
+        pid_t const pid = h->pid;
+
+        if (pid == 0 || h->conns == 0
+            || kill(pid, 0) == SUCCESS || errno != ESRCH)
+            continue;
+
+        shm_lock(&limiter->lock);
+        if (h->pid == pid) {
+            struct limit_entry * const entry =
+                limit_find(limiter, h->addr, limit_now());
+
+            if (entry != NULL)
+                entry->conns -= h->conns < entry->conns
+                    ? h->conns : entry->conns;
+            reclaimed += h->conns;
+            h->conns = 0;
+        }
+        shm_unlock(&limiter->lock);
+    }
+
+    if (reclaimed > 0 && limiter->verbose)
+        fprintf(stderr, "limiter_reclaim(): %lu connections closed for "
+                "processes that are gone\n", reclaimed);
+}
+
+bool
+limiter_request(struct limiter *limiter, struct in_addr addr)
+{
+    struct limit_entry *entry;
+    bool admit = true;
+
+    if (limiter->rate == 0)
+        return true;
+
+    shm_lock(&limiter->lock);
+    entry = limit_find(limiter, addr.s_addr, limit_now());
+    if (entry != NULL) {
+        if (entry->tokens < 1)
+            admit = false;
+        else
+            entry->tokens -= 1;
+    }
+    shm_unlock(&limiter->lock);
+
+    if (!admit && limiter->verbose)
+        fprintf(stderr, "too many requests from %s\n", inet_ntoa(addr));
+
+    return admit;
+}
@@ -0,0 +1,102 @@
+/*
+ * limit.h
+ * Interface to the per-client admission limits.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _limit_h_
+#define _limit_h_
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * Every client address has a token bucket for its requests and a count of its
+ * open connections, kept in a table in shared memory so that all the child
+ * processes serving a client charge the same bucket.
+ *
+ * A bucket holds at most burst tokens and refills at rate tokens per second.
+ * Each request takes a token, and a client with none left is turned away
+ * until the bucket refills.
+ *
+ * Clients are forgotten once they have no connections open and their bucket
+ * has refilled, so the table only needs room for the clients active at once.
+ * If it fills up anyway, new clients are let in unchecked.
+ *
+ * Connections are also counted for the process that counted them, so that
+ * those of a process killed before it could count them as closed can be.
+ */
+
+struct limiter;
+
+/*
+ * Create a limiter tracking at most nclients clients at once.
+ * A rate of 0 disables the request limit, and max_conns of 0 disables the
+ * connection limit.
+ * Returns NULL on failure.
+ */
+struct limiter *limiter_create(size_t nclients, double rate, double burst,
+                               unsigned max_conns, bool verbose);
+
+/*
+ * Release the shared table.
+ */
+void limiter_destroy(struct limiter *limiter);
+
+/*
+ * Count a new connection from addr.
+ * Returns false if the client already has too many connections open, in
+ * which case the connection is not counted.
+ */
+bool limiter_connect(struct limiter *limiter, struct in_addr addr);
+
+/*
+ * Count a connection from addr as closed.
+ */
+void limiter_disconnect(struct limiter *limiter, struct in_addr addr);
+
+/*
+ * Take over a connection from addr the parent process counted before forking
+ * this one, so that it is counted as closed should this process be killed.
+ */
+void limiter_adopt(struct limiter *limiter, pid_t parent, struct in_addr addr);
+
+/*
+ * Count the connections of processes that are gone as closed, such as those
+ * of workers killed by a signal. Only the master calls this.
+ */
+void limiter_reclaim(struct limiter *limiter);
+
+/*
+ * Take a token for a request from addr.
+ * Returns false if the client is over its request rate.
+ */
+bool limiter_request(struct limiter *limiter, struct in_addr addr);
+
+#endif // _limit_h_
@@ -27,18 +27,122 @@
   SOFTWARE.
 */
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <stdbool.h>
 
 #include "proxy.h"
 
 
+// Options without a short form.
+enum {
+    OPT_LONG = 256,
+    OPT_CACHE_ENTRIES = OPT_LONG,
+    OPT_CACHE_MAX_OBJECT,
+    OPT_RATE_LIMIT,
+    OPT_RATE_BURST,
+    OPT_MAX_CLIENT_CONNS,
+    OPT_BANDWIDTH,
+    OPT_CLIENT_BANDWIDTH,
+    OPT_HEALTH_INTERVAL,
+    OPT_HEALTH_PATH,
+    OPT_EJECT_TIME,
+    OPT_EJECT_LATENCY,
+    OPT_TLS_CERT,
+    OPT_TLS_KEY,
+    OPT_UPSTREAM_CA,
+    OPT_ZEROCOPY,
+    OPT_SPLICE_MIN,
+    OPT_SENDFILE_MIN,
+    OPT_HEADER_TIMEOUT,
+    OPT_KEEP_ALIVE_TIMEOUT,
+    OPT_CONNECT_TIMEOUT,
+    OPT_FIRST_BYTE_TIMEOUT,
+    OPT_IDLE_TIMEOUT,
+    OPT_CONTINUE_TIMEOUT,
+    OPT_BACKLOG,
+    OPT_ACCEPT_BATCH,
+    OPT_DEFER_ACCEPT,
+    OPT_FASTOPEN,
+    OPT_FASTOPEN_CONNECT,
+    OPT_NO_NODELAY,
+    OPT_NO_QUICKACK,
+    OPT_RCVBUF,
+    OPT_SNDBUF,
+    OPT_REQUEST_HEADER,
+    OPT_RESPONSE_HEADER,
+    OPT_VIA,
+    OPT_FORWARDED_FOR,
+    OPT_X_CACHE,
+    OPT_TRACE,
+    OPT_TRACE_ENTRIES,
+    OPT_TRACE_SAMPLE,
+    OPT_CPU_AFFINITY,
+    OPT_BUFFER_REQUESTS,
+    OPT_BUFFER_RESPONSES,
+    OPT_BULK_SIZE,
+    OPT_MEMORY_BUDGET,
+    OPT_HTTP2,
+    OPT_HTTP2_STREAMS,
+};
+
 static struct option const long_opts[] = {
     {"help", no_argument, NULL, 'h'},
     {"verbose", no_argument, NULL, 'v'},
+    {"cache-dir", required_argument, NULL, 'c'},
+    {"routes", required_argument, NULL, 'r'},
+    {"cache-entries", required_argument, NULL, OPT_CACHE_ENTRIES},
+    {"cache-max-object", required_argument, NULL, OPT_CACHE_MAX_OBJECT},
+    {"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+    {"rate-burst", required_argument, NULL, OPT_RATE_BURST},
+    {"max-client-conns", required_argument, NULL, OPT_MAX_CLIENT_CONNS},
+    {"bandwidth", required_argument, NULL, OPT_BANDWIDTH},
+    {"client-bandwidth", required_argument, NULL, OPT_CLIENT_BANDWIDTH},
+    {"health-interval", required_argument, NULL, OPT_HEALTH_INTERVAL},
+    {"health-path", required_argument, NULL, OPT_HEALTH_PATH},
+    {"eject-time", required_argument, NULL, OPT_EJECT_TIME},
+    {"eject-latency", required_argument, NULL, OPT_EJECT_LATENCY},
+    {"tls-cert", required_argument, NULL, OPT_TLS_CERT},
+    {"tls-key", required_argument, NULL, OPT_TLS_KEY},
+    {"upstream-ca", required_argument, NULL, OPT_UPSTREAM_CA},
+    {"zerocopy", required_argument, NULL, OPT_ZEROCOPY},
+    {"splice-min", required_argument, NULL, OPT_SPLICE_MIN},
+    {"sendfile-min", required_argument, NULL, OPT_SENDFILE_MIN},
+    {"header-timeout", required_argument, NULL, OPT_HEADER_TIMEOUT},
+    {"keep-alive-timeout", required_argument, NULL, OPT_KEEP_ALIVE_TIMEOUT},
+    {"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+    {"first-byte-timeout", required_argument, NULL, OPT_FIRST_BYTE_TIMEOUT},
+    {"idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT},
+    {"continue-timeout", required_argument, NULL, OPT_CONTINUE_TIMEOUT},
+    {"backlog", required_argument, NULL, OPT_BACKLOG},
+    {"accept-batch", required_argument, NULL, OPT_ACCEPT_BATCH},
+    {"defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT},
+    {"fastopen", required_argument, NULL, OPT_FASTOPEN},
+    {"fastopen-connect", no_argument, NULL, OPT_FASTOPEN_CONNECT},
+    {"no-nodelay", no_argument, NULL, OPT_NO_NODELAY},
+    {"no-quickack", no_argument, NULL, OPT_NO_QUICKACK},
+    {"rcvbuf", required_argument, NULL, OPT_RCVBUF},
+    {"sndbuf", required_argument, NULL, OPT_SNDBUF},
+    {"request-header", required_argument, NULL, OPT_REQUEST_HEADER},
+    {"response-header", required_argument, NULL, OPT_RESPONSE_HEADER},
+    {"via", required_argument, NULL, OPT_VIA},
+    {"forwarded-for", no_argument, NULL, OPT_FORWARDED_FOR},
+    {"x-cache", no_argument, NULL, OPT_X_CACHE},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"trace-entries", required_argument, NULL, OPT_TRACE_ENTRIES},
+    {"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+    {"cpu-affinity", no_argument, NULL, OPT_CPU_AFFINITY},
+    {"buffer-requests", required_argument, NULL, OPT_BUFFER_REQUESTS},
+    {"buffer-responses", required_argument, NULL, OPT_BUFFER_RESPONSES},
+    {"bulk-size", required_argument, NULL, OPT_BULK_SIZE},
+    {"memory-budget", required_argument, NULL, OPT_MEMORY_BUDGET},
+    {"http2", no_argument, NULL, OPT_HTTP2},
+    {"http2-streams", required_argument, NULL, OPT_HTTP2_STREAMS},
     {NULL, 0, NULL, 0}
 };
 
@@ -47,17 +151,138 @@ static void usage(char const * const progname, int status)
     static char const * const opts_desc[] = {
         "to display this usage message",
         "for verbose output",
+        "DIR to cache responses in DIR and collapse concurrent misses",
+        "FILE to run as a reverse proxy with the routes in FILE",
+        "N to index at most N cached objects (default 4096)",
+        "SIZE to cache objects of at most SIZE bytes (default 64M)",
+        "RATE to allow each client RATE requests per second",
+        "N to allow each client bursts of N requests (default RATE)",
+        "N to allow each client N connections at once",
+        "SIZE to send clients at most SIZE bytes per second in all",
+        "SIZE to send each client at most SIZE bytes per second",
+        "SECONDS to probe backends every SECONDS",
+        "PATH to probe backends with a GET request for PATH",
+        "SECONDS to eject failing backends for SECONDS at first (default 10)",
+        "MS to eject backends averaging more than MS milliseconds",
+        "FILE to accept only HTTPS, with the certificate chain in FILE",
+        "FILE to use the private key in FILE (default the --tls-cert FILE)",
+        "FILE to also trust the certificate authorities in FILE for https",
+        "SIZE to send buffers of SIZE bytes or more without copying them",
+        "SIZE to splice bodies of SIZE bytes or more (default calibrated)",
+        "SIZE to send cached spans of SIZE bytes or more with sendfile",
+        "MS to wait MS milliseconds for a request (default 5000)",
+        "MS to wait MS milliseconds for another request (default 5000)",
+        "MS to wait MS milliseconds to connect to a server (default 3000)",
+        "MS to wait MS milliseconds for a response (default 5000)",
+        "MS to wait MS milliseconds for more of a body (default 5000)",
+        "MS to wait MS milliseconds for a server to accept a body (default 1000)",
+        "N to queue N connections waiting to be accepted (default 1024)",
+        "N to accept at most N connections at a time (default 64)",
+        "SECONDS to wait SECONDS for a request before accepting (default 1)",
+        "N to allow N pending client TCP fast opens, 0 for none (default 256)",
+        "to send requests to servers in the SYN with TCP fast open",
+        "to leave Nagle's algorithm on",
+        "to leave delayed ACKs on from the start of connections",
+        "SIZE to use SIZE byte socket receive buffers",
+        "SIZE to use SIZE byte socket send buffers",
+        "RULE to add (NAME: VALUE) or remove (-NAME) request header fields",
+        "RULE to add (NAME: VALUE) or remove (-NAME) response header fields",
+        "NAME to add Via header fields naming this proxy NAME",
+        "to tell servers the client address in X-Forwarded-For",
+        "to tell clients whether a response was cached in X-Cache",
+        "FILE to trace requests, dumping the traces to FILE on SIGUSR1",
+        "N to keep the last N traces (default 4096)",
+        "N to trace one in N requests (default 1)",
+        "to run each connection on the CPU its packets arrive on",
+        "SIZE to take request bodies of up to SIZE bytes before connecting",
+        "SIZE to take response bodies of up to SIZE bytes before sending",
+        "SIZE to let transfers of SIZE bytes or more give way to shorter ones",
+        "SIZE to hold at most SIZE bytes in buffers, shedding load near it",
+        "to let clients speak HTTP/2, by prior knowledge, upgrade or ALPN",
+        "N to allow N concurrent streams on an HTTP/2 connection (default 256)",
     };
 
     printf("usage: %s [OPTIONS] PORT, where\n", progname);
     printf("  OPTIONS:\n");
     for (int i = 0; i < sizeof (long_opts) / sizeof (struct option) - 1; ++i)
-        printf("\t-%c, --%s, %s\n",
-               long_opts[i].val, long_opts[i].name, opts_desc[i]);
+        if (long_opts[i].val < OPT_LONG)
+            printf("\t-%c, --%s, %s\n",
+                   long_opts[i].val, long_opts[i].name, opts_desc[i]);
+        else
+            printf("\t--%s, %s\n", long_opts[i].name, opts_desc[i]);
 
     exit(status);
 }
 
+/*
+ * Parse a size with an optional k, M, or G suffix.
+ */
+static size_t parse_size(char const * const progname, char const *arg)
+{
+    char *end;
+    unsigned long long size;
+
+    errno = 0;
+    size = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'G': case 'g':
+        size *= 1024;
+        /* FALLTHROUGH */
+    case 'M': case 'm':
+        size *= 1024;
+        /* FALLTHROUGH */
+    case 'K': case 'k':
+        size *= 1024;
+        ++end;
+        break;
+    }
+
+    if (errno != 0 || end == arg || *end != '\0') {
+        fprintf(stderr, "invalid size: %s\n", arg);
+        usage(progname, EXIT_FAILURE);
+    }
+
+    return size;
+}
+
+/*
+ * Parse a positive rate, which may have a fraction.
+ */
+static double parse_rate(char const * const progname, char const *arg)
+{
+    char *end;
+    double rate;
+
+    errno = 0;
+    rate = strtod(arg, &end);
+
+    if (errno != 0 || end == arg || *end != '\0' || !(rate > 0)) {
+        fprintf(stderr, "invalid rate: %s\n", arg);
+        usage(progname, EXIT_FAILURE);
+    }
+
+    return rate;
+}
+
+/*
+ * Parse a positive number of milliseconds.
+ */
+static unsigned parse_timeout(char const * const progname, char const *arg)
+{
+    char *end;
+    unsigned long ms;
+
+    errno = 0;
+    ms = strtoul(arg, &end, 10);
+
+    if (errno != 0 || end == arg || *end != '\0' || ms == 0 || ms > INT_MAX) {
+        fprintf(stderr, "invalid timeout: %s\n", arg);
+        usage(progname, EXIT_FAILURE);
+    }
+
+    return ms;
+}
+
 /*
  * Main entry point.
  * Processes command-line options and arguments, then runs the proxy.
@@ -65,15 +290,212 @@ static void usage(char const * const progname, int status)
 int main(int argc, char * const argv[])
 {
     int opt;
-    uint16_t port;
-    bool verbose = false;
+    struct proxy_config config = PROXY_CONFIG_DEFAULTS;
 
-    while (-1 != (opt = getopt_long(argc, argv, "hv", long_opts, NULL))) {
+    while (-1 != (opt = getopt_long(argc, argv, "hvc:r:", long_opts, NULL))) {
         switch (opt) {
         case 'h':
             usage(argv[0], EXIT_SUCCESS);
         case 'v':
-            verbose = true;
+            config.verbose = true;
+            break;
+        case 'c':
+            config.cache_dir = optarg;
+            break;
+        case 'r':
+            config.routes_file = optarg;
+            break;
+        case OPT_CACHE_ENTRIES:
+            config.cache_entries = parse_size(argv[0], optarg);
+            if (config.cache_entries == 0) {
+                fprintf(stderr, "invalid number of cache entries: %s\n",
+                        optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_CACHE_MAX_OBJECT:
+            config.cache_max_object = parse_size(argv[0], optarg);
+            break;
+        case OPT_RATE_LIMIT:
+            config.rate_limit = parse_rate(argv[0], optarg);
+            break;
+        case OPT_RATE_BURST:
+            config.rate_burst = parse_rate(argv[0], optarg);
+            break;
+        case OPT_MAX_CLIENT_CONNS:
+            config.max_client_conns = parse_size(argv[0], optarg);
+            break;
+        case OPT_BANDWIDTH:
+            config.bandwidth = parse_size(argv[0], optarg);
+            break;
+        case OPT_CLIENT_BANDWIDTH:
+            config.client_bandwidth = parse_size(argv[0], optarg);
+            break;
+        case OPT_HEALTH_INTERVAL:
+            config.health_interval = parse_size(argv[0], optarg);
+            break;
+        case OPT_HEALTH_PATH:
+            if (optarg[0] != '/') {
+                fprintf(stderr, "invalid health check path: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            config.health_path = optarg;
+            break;
+        case OPT_EJECT_TIME:
+            config.eject_time = parse_size(argv[0], optarg);
+            if (config.eject_time == 0) {
+                fprintf(stderr, "invalid ejection time: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_EJECT_LATENCY:
+            config.eject_latency = parse_size(argv[0], optarg);
+            break;
+        case OPT_TLS_CERT:
+            config.tls_cert = optarg;
+            break;
+        case OPT_TLS_KEY:
+            config.tls_key = optarg;
+            break;
+        case OPT_UPSTREAM_CA:
+            config.upstream_ca = optarg;
+            break;
+        case OPT_ZEROCOPY:
+            config.zerocopy_min = parse_size(argv[0], optarg);
+            break;
+        case OPT_SPLICE_MIN:
+            config.splice_min = parse_size(argv[0], optarg);
+            if (config.splice_min == 0) {
+                fprintf(stderr, "invalid splice size: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_HEADER_TIMEOUT:
+            config.header_timeout = parse_timeout(argv[0], optarg);
+            break;
+        case OPT_KEEP_ALIVE_TIMEOUT:
+            config.keep_alive_timeout = parse_timeout(argv[0], optarg);
+            break;
+        case OPT_CONNECT_TIMEOUT:
+            config.connect_timeout = parse_timeout(argv[0], optarg);
+            break;
+        case OPT_FIRST_BYTE_TIMEOUT:
+            config.first_byte_timeout = parse_timeout(argv[0], optarg);
+            break;
+        case OPT_IDLE_TIMEOUT:
+            config.idle_timeout = parse_timeout(argv[0], optarg);
+            break;
+        case OPT_CONTINUE_TIMEOUT:
+            config.continue_timeout = parse_timeout(argv[0], optarg);
+            break;
+        case OPT_BACKLOG:
+            config.listen_backlog = parse_size(argv[0], optarg);
+            if (config.listen_backlog <= 0) {
+                fprintf(stderr, "invalid backlog: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_ACCEPT_BATCH:
+            config.accept_batch = parse_size(argv[0], optarg);
+            if (config.accept_batch == 0) {
+                fprintf(stderr, "invalid accept batch: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_DEFER_ACCEPT:
+            config.defer_accept = parse_size(argv[0], optarg);
+            break;
+        case OPT_FASTOPEN:
+            config.fastopen = parse_size(argv[0], optarg);
+            break;
+        case OPT_FASTOPEN_CONNECT:
+            config.fastopen_connect = true;
+            break;
+        case OPT_NO_NODELAY:
+            config.nodelay = false;
+            break;
+        case OPT_NO_QUICKACK:
+            config.quickack = false;
+            break;
+        case OPT_RCVBUF:
+            config.rcvbuf = parse_size(argv[0], optarg);
+            break;
+        case OPT_SNDBUF:
+            config.sndbuf = parse_size(argv[0], optarg);
+            break;
+        case OPT_REQUEST_HEADER:
+            if (rewrite_rule(&config.request_rules, optarg) == -1) {
+                fprintf(stderr, "invalid header rule: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_RESPONSE_HEADER:
+            if (rewrite_rule(&config.response_rules, optarg) == -1) {
+                fprintf(stderr, "invalid header rule: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_VIA:
+            if (optarg[0] == '\0' || strpbrk(optarg, " \t\r\n") != NULL) {
+                fprintf(stderr, "invalid proxy name: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            config.via = optarg;
+            break;
+        case OPT_FORWARDED_FOR:
+            config.forwarded_for = true;
+            break;
+        case OPT_X_CACHE:
+            config.x_cache = true;
+            break;
+        case OPT_TRACE:
+            config.trace_file = optarg;
+            break;
+        case OPT_TRACE_ENTRIES:
+            config.trace_entries = parse_size(argv[0], optarg);
+            if (config.trace_entries == 0) {
+                fprintf(stderr, "invalid number of traces: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_CPU_AFFINITY:
+            config.cpu_affinity = true;
+            break;
+        case OPT_BUFFER_REQUESTS:
+            config.buffer_requests = parse_size(argv[0], optarg);
+            break;
+        case OPT_BUFFER_RESPONSES:
+            config.buffer_responses = parse_size(argv[0], optarg);
+            break;
+        case OPT_BULK_SIZE:
+            config.bulk_size = parse_size(argv[0], optarg);
+            break;
+        case OPT_MEMORY_BUDGET:
+            config.memory_budget = parse_size(argv[0], optarg);
+            break;
+        case OPT_HTTP2:
+            config.http2 = true;
+            break;
+        case OPT_HTTP2_STREAMS:
+            config.http2_streams = parse_size(argv[0], optarg);
+            if (config.http2_streams == 0 || config.http2_streams > 65536) {
+                fprintf(stderr, "invalid number of streams: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_TRACE_SAMPLE:
+            config.trace_sample = parse_size(argv[0], optarg);
+            if (config.trace_sample == 0) {
+                fprintf(stderr, "invalid trace sample: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case OPT_SENDFILE_MIN:
+            config.sendfile_min = parse_size(argv[0], optarg);
+            if (config.sendfile_min == 0) {
+                fprintf(stderr, "invalid sendfile size: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
             break;
         default:
             fprintf(stderr, "invalid option: %c\n", opt);
@@ -84,13 +506,14 @@ int main(int argc, char * const argv[])
     if (argc - optind != 1)
         usage(argv[0], EXIT_FAILURE);
 
-    port = (uint16_t)atoi(argv[optind]);
-    if (port == 0) { // atoi() returns 0 and sets errno on error
+    config.port = (uint16_t)atoi(argv[optind]);
+    if (config.port == 0) { // atoi() returns 0 and sets errno on error
         fprintf(stderr, "invalid port: %s\n", argv[optind]);
         usage(argv[0], EXIT_FAILURE);
     }
 
-    run_proxy(port, verbose);
+    config.argv = argv;
+    run_proxy(&config);
 
     return EXIT_SUCCESS;
 }
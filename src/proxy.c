@@ -29,6 +29,8 @@
 
 #include "proxy.h"
 
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -36,37 +38,117 @@
 #include <sys/wait.h>
 
 #include <assert.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <netdb.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include "budget.h"
+#include "cache.h"
+#include "h2.h"
+#include "health.h"
 #include "http.h"
 #include "iostring.h"
+#include "limit.h"
+#include "rewrite.h"
+#include "route.h"
+#include "shape.h"
+#include "stats.h"
+#ifdef WITH_TLS
+#include "tls.h"
+#endif
+#include "trace.h"
+#include "transfer.h"
+#include "upgrade.h"
 #include "uri.h"
+#include "zerocopy.h"
 
 #ifdef __linux__
-/* splice(2) is only available on Linux. */
-#include <fcntl.h>
+/* splice(2) and epoll(7) are only available on Linux. */
+#include <sys/epoll.h>
+/* for TC_PRIO_BULK */
+#include <linux/pkt_sched.h>
 #else
 /* for PIPE_SIZE */
 #include <sys/pipe.h>
 #endif
 
-enum { SUCCESS = 0, FAILURE = -1 };
+enum { SUCCESS = 0, FAILURE = -1, SERVED = -2, DRAINED = -3, UPGRADED = -4 };
 
-#define LISTEN_BACKLOG 8 // FIXME: what is a good value for this?
 #define RECV_BUFLEN (REQUEST_LINE_MIN_BUFLEN*2)
+#define LIMIT_CLIENTS 4096 // Clients tracked at once by the limiter
+#define HEALTH_ADDRS 1024 // Backend addresses tracked by the health checks
+#define BULK_NICE_MAX 10 // Most a worker gives way to shorter transfers
+#define WORKER_MEMORY (256 * 1024) // Charged per worker besides socket buffers
+#define THROTTLED_RCVBUF (16 * 1024) // Server receive buffer under pressure
+#define ACCEPT_BACKOFF_MS 100 // Pause after running out of fds or memory
+
+static struct iostring const keep_alive_token = { "keep-alive", 10 };
+static struct iostring const continue_token = { "100-continue", 12 };
+static struct iostring const h2c_token = { "h2c", 3 };
+static struct iostring const chunked_token = { "chunked", 7 };
+
+// Left out of the client's fields when the cache makes a request.
+static char const * const fetch_removed[] = {
+    "-Host", "-If-Match", "-If-Modified-Since", "-If-None-Match", "-If-Range",
+    "-If-Unmodified-Since", "-Range",
+};
+
+static char const continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+static char const switching_response[] = "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+/*
+ * Options set on the connections to clients and servers.
+ */
+struct tcp_options {
+    bool nodelay;   // Disable Nagle's algorithm
+    bool quickack;  // Don't delay the first ACKs
+    bool fastopen;  // Send requests to servers in the SYN when possible
+    int rcvbuf, sndbuf; // Socket buffer sizes, 0 for the kernel's own
+    unsigned connect_timeout; // Milliseconds to wait for a connection
+};
+
+/*
+ * How long to wait in each phase of a request, in milliseconds.
+ */
+struct timeouts {
+    unsigned header;     // For the first request on a client connection
+    unsigned keep_alive; // For each request after that
+    unsigned first_byte; // For the start of a response
+    unsigned idle;       // For each read or write of a body
+    unsigned expect;     // For a server to accept a request body
+    unsigned deferred;   // A connection is held for before its request
+};
+
+/*
+ * A request that may be sent to the server again, where it lies in the
+ * receive buffer.
+ */
+struct replay {
+    bool valid;
+    struct http_request_line reqln;
+    struct uri uri;
+    char *head_end;
+    size_t len;
+};
 
 /*
  * The proxy context object contains data commonly used by proxy methods.
@@ -74,80 +156,683 @@ enum { SUCCESS = 0, FAILURE = -1 };
 struct proxy {
     bool verbose;
     int listen_fd;
+    int poll_fd;              // epoll(7) instance watching listen_fd, or -1
+    unsigned accept_batch;    // Most connections accepted per wakeup
+    int drain[2];             // Pipe the master closes to have workers finish
     int client_fd;
     int server_fd;
+    bool server_reusable;     // server_fd may be used for another request
+    bool server_keep_alive;   // The server is asked to keep server_fd open
+    bool server_http11;       // The request was sent to the server in HTTP/1.1
+    bool server_reused;       // server_fd was kept from a previous request
+    struct replay replay;     // Of the request sent on server_fd
+    char server_name[NI_MAXHOST + NI_MAXSERV]; // HOST:PORT of server_fd
+    struct router *router;    // NULL unless running as a reverse proxy
+    struct backend_ref backend; // Backend of server_fd in reverse proxy mode
+    struct health *health;    // NULL unless running as a reverse proxy
+    struct sockaddr_storage server_addr; // Address server_fd is connected to
+    socklen_t server_addrlen;
+    struct timespec sent;     // When the last request was sent to the server
+    struct tcp_options tcp;   // For client and server connections
+    struct timeouts timeouts;
     struct sockaddr_in client_addr;
+    struct limiter *limiter;  // NULL if clients are not limited
+    struct shaper *shaper;    // NULL if bandwidth is not shaped
+    struct budget *budget;    // NULL if memory is not budgeted
+    size_t connection_cost;   // Charged to the budget for each connection
+    size_t charged;           // Charged for this process's connection
+    time_t reclaimed;         // When the budget was last checked for leaks
+    struct shape_path shape;  // Classes the response is charged to
+    struct tls *tls;          // NULL unless clients connect with TLS
+    struct tls *upstream_tls; // For servers connected to with TLS
+    bool admitted;            // The limiter counts this client connection
+    struct transfer *transfer; // Picks how bodies are moved, and counts it
+    struct stats *stats;      // Counters shared by all the processes
+    struct cache *cache;      // NULL if caching is disabled
+    struct cache_object fill; // .entry is set while filling the cache
+    struct cache_object revalidate; // .entry is set while revalidating
+    struct http_range ranges[HTTP_RANGES_MAX]; // from the Range header
+    int nranges;              // 0 unless the request has a usable Range
+    struct iostring if_range; // .len is 0 unless the request has If-Range
+    size_t zerocopy_min;      // Smallest buffer sent with MSG_ZEROCOPY, or 0
+    size_t buffer_requests;   // Largest request body spooled first, or 0
+    size_t buffer_responses;  // Largest response body spooled first, or 0
+    size_t expect_body;       // Held back until the server accepts it, or 0
+    struct zerocopy zc;       // Zero-copy sends on client_fd
+    struct rewrite_rules const *request_rules, *response_rules;
+    struct rewrite_rules fetch_rules; // request_rules for the cache's requests
+    struct iostring request_fields; // Of the request being handled
+    char const *via;          // Name of this proxy in Via fields, or NULL
+    bool forwarded_for;       // Add X-Forwarded-For to requests
+    bool x_cache;             // Add X-Cache to responses
+    bool client_keep_alive;   // Tell an HTTP/1.0 client its connection is kept
+    bool cpu_affinity;        // Run workers on the CPU of their connection
+    int cpu;                  // This worker runs on, or -1 for any
+    size_t bulk_size;         // Smallest transfer that gives way, or 0
+    bool bulk;                // client_fd is queued as bulk traffic
+    int nice;                 // Nice value the proxy was started with
+    bool reniced;             // Raised for a bulk transfer, so close after it
+    struct tracer *tracer;    // NULL if requests are not traced
+    struct trace trace;       // Of the request being handled
+    uint64_t accepted;        // When client_fd was accepted, if tracing
+    bool http2;               // Clients may speak HTTP/2
+    unsigned http2_streams;   // Concurrent streams on an HTTP/2 connection
+    bool stream;              // client_fd is a stream of an HTTP/2 connection
+    struct iostring http2_settings; // Of a request to upgrade to h2c
 };
 
 /*
- * Initialize a proxy data structure and start listening.
+ * Set the buffer sizes on a socket that is about to listen or connect, so the
+ * TCP window is scaled for them from the start.
+ * Failures only cost performance, so they are ignored.
+ */
+static void
+tune_socket(int fd, struct tcp_options const *tcp)
+{
+    if (tcp->rcvbuf > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &tcp->rcvbuf, sizeof tcp->rcvbuf);
+    if (tcp->sndbuf > 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tcp->sndbuf, sizeof tcp->sndbuf);
+}
+
+/*
+ * Set the options for a connection that has just been accepted or connected.
+ * Quick ACK mode is not sticky, so it only helps the start of a connection.
+ */
+static void
+tune_connection(int fd, struct tcp_options const *tcp)
+{
+    int const on = 1;
+
+    if (tcp->nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+#ifdef TCP_QUICKACK
+    if (tcp->quickack)
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof on);
+#endif
+}
+
+#ifdef SO_INCOMING_CPU
+/*
+ * Whether the receive queue of a network device steers packets to other CPUs
+ * with RPS, which its rps_cpus mask in sysfs is not all zeroes for.
+ */
+static bool
+rps_enabled(char const *dev, char const *queue)
+{
+    char path[PATH_MAX], mask[256];
+    FILE *fp;
+    bool enabled = false;
+
+    snprintf(path, sizeof path, "/sys/class/net/%s/queues/%s/rps_cpus",
+             dev, queue);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return false;
+    if (fgets(mask, sizeof mask, fp) != NULL)
+        enabled = strspn(mask, "0,\n") != strlen(mask);
+    fclose(fp);
+
+    return enabled;
+}
+
+/*
+ * Whether connections can arrive on more than one CPU: a network device other
+ * than loopback has several receive queues, or spreads one with RPS. If not,
+ * pinning workers to the CPU of their connection puts them all on one CPU.
+ */
+static bool
+incoming_cpus_vary(void)
+{
+    DIR *net, *queues;
+    struct dirent *dev, *queue;
+    char path[PATH_MAX];
+    bool vary = false;
+
+    net = opendir("/sys/class/net");
+    if (net == NULL)
+        return false;
+
+    while (!vary && (dev = readdir(net)) != NULL) {
+        unsigned nrx = 0;
+
+        if (dev->d_name[0] == '.' || strcmp(dev->d_name, "lo") == SUCCESS)
+            continue;
+
+        snprintf(path, sizeof path, "/sys/class/net/%s/queues", dev->d_name);
+        queues = opendir(path);
+        if (queues == NULL)
+            continue;
+        while (!vary && (queue = readdir(queues)) != NULL)
+            if (strncmp(queue->d_name, "rx-", 3) == SUCCESS)
+                vary = ++nrx > 1 || rps_enabled(dev->d_name, queue->d_name);
+        closedir(queues);
+    }
+
+    closedir(net);
+
+    return vary;
+}
+#endif
+
+/*
+ * Run this worker on the CPU that handles its connection's packets, so the
+ * socket buffers stay in that CPU's caches. Pages are allocated on the NUMA
+ * node of the CPU that first touches them, so once the worker is pinned, the
+ * buffers it fills and the pages it copies on write are local too.
+ * Returns the CPU, or FAILURE if the worker is left to run anywhere.
+ */
+static int
+pin_worker(int fd, bool verbose)
+{
+#ifdef SO_INCOMING_CPU
+    socklen_t len = sizeof (int);
+    cpu_set_t cpus;
+    int cpu;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == FAILURE
+        || cpu < 0 || cpu >= CPU_SETSIZE)
+        return FAILURE;
+
+    // Stay within the CPUs the proxy was given.
+    if (sched_getaffinity(0, sizeof cpus, &cpus) == FAILURE
+        || !CPU_ISSET(cpu, &cpus))
+        return FAILURE;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof cpus, &cpus) == FAILURE) {
+        if (verbose)
+            perror("pin_worker(): failed to set CPU affinity");
+        return FAILURE;
+    }
+
+    if (verbose)
+        fprintf(stderr, "running on CPU %d\n", cpu);
+
+    return cpu;
+#else
+    return FAILURE;
+#endif
+}
+
+/*
+ * Count a new client connection against its client's bandwidth. The kernel
+ * also paces the connection to that bandwidth, where it can, so that it goes
+ * out smoothly rather than in bursts between waits.
+ */
+static void
+shape_connection(struct proxy *proxy, int fd)
+{
+    proxy->shape.client = shaper_connect(proxy->shaper,
+                                         proxy->client_addr.sin_addr);
+
+#ifdef SO_MAX_PACING_RATE
+    {
+        size_t const bandwidth = shaper_client_bandwidth(proxy->shaper);
+        unsigned const rate = bandwidth < UINT_MAX ? bandwidth : UINT_MAX;
+
+        if (bandwidth > 0)
+            setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof rate);
+    }
+#endif
+}
+
+/*
+ * Whether any pool in the routes has a bandwidth of its own.
+ */
+static bool
+shaped_pools(struct router const *router)
+{
+    if (router != NULL)
+        for (size_t i = 0; i < router_pools(router); ++i)
+            if (router_pool_bandwidth(router, i) > 0)
+                return true;
+
+    return false;
+}
+
+/*
+ * Estimate the memory a connection ties up while it is served: the buffers of
+ * its socket and of the socket to its server, which start out the size of the
+ * listening socket's unless they are set, and the worker serving it.
+ */
+static size_t
+connection_cost(int listen_fd, struct tcp_options const *tcp)
+{
+    int rcvbuf = tcp->rcvbuf, sndbuf = tcp->sndbuf;
+    socklen_t optlen = sizeof (int);
+
+    // Linux reports the space it allows for its bookkeeping too.
+    if (rcvbuf == 0)
+        getsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen);
+    optlen = sizeof (int);
+    if (sndbuf == 0)
+        getsockopt(listen_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen);
+
+    return WORKER_MEMORY + 2 * ((size_t)rcvbuf + sndbuf);
+}
+
+/*
+ * Let shorter transfers go first while this worker sends len bytes, if that
+ * makes it a bulk transfer.
+ * The worker's nice value goes up a step for every doubling of len over the
+ * bulk size, so the CPU goes to the shortest transfers first, while the kernel
+ * still gives every worker its share. The client's packets are queued behind
+ * those of other connections, which only matters when the link is busy.
+ * Only a privileged worker could lower its nice value again, so the client's
+ * connection is closed after the transfer, and its next request goes to a
+ * fresh worker rather than giving way as well. A stream of an HTTP/2
+ * connection has a worker of its own anyway.
+ */
+static void
+schedule_transfer(struct proxy *proxy, size_t len)
+{
+    bool const bulk = proxy->bulk_size > 0 && len >= proxy->bulk_size;
+
+    if (bulk) {
+        int nice = proxy->nice + 1;
+
+        for (size_t n = len / proxy->bulk_size;
+             n > 1 && nice < proxy->nice + BULK_NICE_MAX;
+             n >>= 1)
+            ++nice;
+
+        errno = 0;
+        if (getpriority(PRIO_PROCESS, 0) < nice && errno == 0
+            && setpriority(PRIO_PROCESS, 0, nice) == SUCCESS)
+            proxy->reniced = !proxy->stream;
+    }
+
+#ifdef SO_PRIORITY
+    if (bulk != proxy->bulk && proxy->client_fd != FAILURE) {
+        int const priority = bulk ? TC_PRIO_BULK : TC_PRIO_BESTEFFORT;
+
+        setsockopt(proxy->client_fd, SOL_SOCKET, SO_PRIORITY,
+                   &priority, sizeof priority);
+    }
+#endif
+    proxy->bulk = bulk;
+}
+
+/*
+ * Give up on reads from fd (optname SO_RCVTIMEO) or writes to fd
+ * (SO_SNDTIMEO) that wait for longer than ms milliseconds.
+ * Such a read or write fails with EAGAIN.
+ */
+static void
+set_timeout(int fd, int optname, unsigned ms)
+{
+    struct timeval const timeout = { ms / 1000, ms % 1000 * 1000 };
+
+    setsockopt(fd, SOL_SOCKET, optname, &timeout, sizeof timeout);
+}
+
+/*
+ * The header timeout left for a connection that was just accepted.
+ * One accepted before its request arrived was held by the kernel for the
+ * whole defer period first, and that counts toward the timeout.
+ */
+static unsigned
+header_timeout(struct timeouts const *timeouts, int fd)
+{
+    int pending = 0;
+
+    if (timeouts->deferred == 0
+        || ioctl(fd, FIONREAD, &pending) == FAILURE || pending > 0)
+        return timeouts->header;
+
+    // A timeout of 0 would never expire.
+    return timeouts->deferred < timeouts->header
+        ? timeouts->header - timeouts->deferred : 1;
+}
+
+/*
+ * Whether a read or write failed because it timed out.
+ */
+static bool
+timed_out(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/*
+ * Connect fd to addr, giving up after timeout milliseconds.
+ * Returns FAILURE with errno set to ETIMEDOUT if that took too long.
+ */
+static int
+connect_timeout(int fd, struct sockaddr const *addr, socklen_t addrlen,
+                unsigned timeout)
+{
+    int const flags = fcntl(fd, F_GETFL);
+
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    socklen_t len = sizeof (int);
+    int res, error = 0;
+
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    res = connect(fd, addr, addrlen);
+    if (res == FAILURE && errno == EINPROGRESS) {
+        res = poll(&pfd, 1, timeout);
+        if (res == 0) {
+            errno = ETIMEDOUT;
+            res = FAILURE;
+        }
+        else if (res != FAILURE) {
+            res = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (res != FAILURE && error != 0) {
+                errno = error;
+                res = FAILURE;
+            }
+        }
+    }
+
+    if (res != FAILURE)
+        fcntl(fd, F_SETFL, flags);
+
+    return res;
+}
+
+/*
+ * Print the settings in effect on the listening socket.
+ */
+static void
+report_listener(int fd, struct proxy_config const *config)
+{
+    int rcvbuf = 0, sndbuf = 0, defer = 0, fastopen = 0, somaxconn = SOMAXCONN;
+    socklen_t len;
+    FILE *fp;
+
+    len = sizeof rcvbuf;
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    len = sizeof sndbuf;
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+#ifdef TCP_DEFER_ACCEPT
+    len = sizeof defer;
+    getsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, &len);
+#endif
+#ifdef TCP_FASTOPEN
+    len = sizeof fastopen;
+    getsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, &len);
+#endif
+
+    // The kernel silently caps the backlog.
+    fp = fopen("/proc/sys/net/core/somaxconn", "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%d", &somaxconn) != 1)
+            somaxconn = SOMAXCONN;
+        fclose(fp);
+    }
+
+    fprintf(stderr, "backlog %d, defer accept %ds, fast open queue %d, "
+            "receive buffer %d, send buffer %d, nodelay %s, quickack %s\n",
+            config->listen_backlog < somaxconn
+                ? config->listen_backlog : somaxconn,
+            defer, fastopen, rcvbuf, sndbuf,
+            config->nodelay ? "on" : "off",
+            config->quickack ? "on" : "off");
+}
+
+/*
+ * Initialize a proxy data structure and start listening, on fd if another
+ * proxy handed over its listening socket, or else on a new one.
  */
 static int
-proxy_start(struct proxy *proxy, uint16_t port, bool verbose)
+proxy_start(struct proxy *proxy, struct proxy_config const *config, int fd)
 {
+    bool const verbose = config->verbose;
+    uint16_t const port = config->port;
     int const option = 1;
+    int const defer_accept = config->defer_accept;
+    int const fastopen = config->fastopen;
+    struct tcp_options const tcp = {
+        .nodelay = config->nodelay,
+        .quickack = config->quickack,
+        .fastopen = config->fastopen_connect,
+        .rcvbuf = config->rcvbuf,
+        .sndbuf = config->sndbuf,
+        .connect_timeout = config->connect_timeout,
+    };
 
-    int fd;
+    int poll_fd = FAILURE;
     struct sockaddr_in sa;
+    socklen_t salen = sizeof sa;
+    struct rewrite_rules fetch_rules = config->request_rules;
 
     memset(&sa, 0, sizeof sa);
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    // The cache asks for whole responses on its own conditions.
+    for (size_t i = 0; i < sizeof fetch_removed / sizeof fetch_removed[0]; ++i)
+        if (rewrite_rule(&fetch_rules, fetch_removed[i]) == FAILURE) {
+            fputs("proxy_start(): too many request header rules\n", stderr);
+            if (fd != FAILURE)
+                close(fd);
+            return FAILURE;
+        }
+
+    // The handed over socket must be listening on the same port, or the old
+    // proxy would have been run differently.
+    if (fd != FAILURE
+        && (getsockname(fd, (struct sockaddr *)&sa, &salen) == FAILURE
+            || sa.sin_family != AF_INET || ntohs(sa.sin_port) != port)) {
+        fputs("proxy_start(): not taking over a socket on another port\n",
+              stderr);
+        close(fd);
+        fd = FAILURE;
+    }
+
     if (fd == FAILURE) {
-        perror("proxy_start(): failed to create socket");
-        return FAILURE;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == FAILURE) {
+            perror("proxy_start(): failed to create socket");
+            return FAILURE;
+        }
+
+        memset(&sa, 0, sizeof sa);
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = INADDR_ANY;
+        sa.sin_port = htons(port);
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof option) == FAILURE) {
+            perror("setsockopt(): failed to set socket to reuse address\n");
+            close(fd);
+            return FAILURE;
+        }
+
+        if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == FAILURE) {
+            perror("proxy_start(): failed to bind socket");
+            close(fd);
+            return FAILURE;
+        }
     }
 
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = INADDR_ANY;
-    sa.sin_port = htons(port);
+    // Accepted sockets inherit these. Listening again on a handed over
+    // socket applies this proxy's settings to it.
+    tune_socket(fd, &tcp);
+
+#ifdef TCP_DEFER_ACCEPT
+    // Don't wake up for a connection until the request arrives.
+    if (defer_accept > 0
+        && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                      &defer_accept, sizeof defer_accept) == FAILURE)
+        perror("proxy_start(): failed to defer accepting connections");
+#endif
+
+#ifdef TCP_FASTOPEN
+    // Let clients that have connected before send the request in the SYN.
+    if (fastopen > 0
+        && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+                      &fastopen, sizeof fastopen) == FAILURE)
+        perror("proxy_start(): failed to enable TCP fast open");
+#endif
 
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof option) == FAILURE) {
-        perror("setsockopt(): failed to set socket to reuse address\n");
+    if (listen(fd, config->listen_backlog) == FAILURE) {
+        perror("proxy_start(): failed to listen on socket");
         close(fd);
         return FAILURE;
     }
 
-    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == FAILURE) {
-        perror("proxy_start(): failed to bind socket");
+    // Connections are accepted until there are none left waiting.
+    // The socket is only handed to a new proxy deliberately, when upgrading.
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == FAILURE
+        || fcntl(fd, F_SETFD, FD_CLOEXEC) == FAILURE) {
+        perror("proxy_start(): failed to make socket non-blocking");
         close(fd);
         return FAILURE;
     }
 
-    if (listen(fd, LISTEN_BACKLOG) == FAILURE) {
-        perror("proxy_start(): failed to listen on socket");
+#ifdef __linux__
+    // Should more than one process ever wait on the socket, only one of them
+    // is woken for a connection.
+    poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poll_fd == FAILURE
+        || epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &(struct epoll_event){
+#ifdef EPOLLEXCLUSIVE
+                .events = EPOLLIN | EPOLLEXCLUSIVE,
+#else
+                .events = EPOLLIN,
+#endif
+                .data.fd = fd,
+            }) == FAILURE) {
+        perror("proxy_start(): failed to watch socket");
+        if (poll_fd != FAILURE)
+            close(poll_fd);
         close(fd);
         return FAILURE;
     }
+#endif
 
-    if (verbose)
+    if (verbose) {
         fprintf(stderr, "listening on port %d\n", port);
+        report_listener(fd, config);
+    }
 
+    memset(proxy, 0, sizeof *proxy);
     proxy->listen_fd = fd;
+    proxy->poll_fd = poll_fd;
+    proxy->accept_batch = config->accept_batch;
+    proxy->drain[0] = proxy->drain[1] = FAILURE;
+    proxy->cpu_affinity = config->cpu_affinity;
+    proxy->bulk_size = config->bulk_size;
+    errno = 0;
+    proxy->nice = getpriority(PRIO_PROCESS, 0);
+    if (proxy->nice == FAILURE && errno != 0)
+        proxy->nice = 0;
+    proxy->cpu = FAILURE;
+    proxy->client_fd = FAILURE;
+    proxy->server_fd = FAILURE;
+    proxy->backend = BACKEND_REF_NONE;
+    proxy->shape = SHAPE_PATH_NONE;
+    proxy->zerocopy_min = config->zerocopy_min;
+    proxy->buffer_requests = config->buffer_requests;
+    proxy->buffer_responses = config->buffer_responses;
+    proxy->zc = (struct zerocopy)ZEROCOPY_INIT;
+    proxy->request_rules = &config->request_rules;
+    proxy->response_rules = &config->response_rules;
+    proxy->fetch_rules = fetch_rules;
+    proxy->via = config->via;
+    proxy->forwarded_for = config->forwarded_for;
+    proxy->x_cache = config->x_cache;
+    proxy->http2 = config->http2;
+    proxy->http2_streams = config->http2_streams;
+    proxy->tcp = tcp;
+    proxy->timeouts = (struct timeouts){
+        .header = config->header_timeout,
+        .keep_alive = config->keep_alive_timeout,
+        .first_byte = config->first_byte_timeout,
+        .idle = config->idle_timeout,
+        .expect = config->continue_timeout,
+#ifdef TCP_DEFER_ACCEPT
+        .deferred = config->defer_accept * 1000,
+#endif
+    };
     proxy->verbose = verbose;
 
     return SUCCESS;
 }
 
+/*
+ * Close the connection to the server, if any.
+ */
+static void
+proxy_disconnect(struct proxy *proxy)
+{
+    if (proxy->server_fd != FAILURE)
+        close(proxy->server_fd);
+    proxy->server_fd = FAILURE;
+    proxy->server_reusable = false;
+    proxy->server_keep_alive = false;
+    proxy->server_addrlen = 0;
+
+    if (proxy->backend.backend != FAILURE) {
+        router_release(proxy->router, proxy->backend);
+        proxy->backend = BACKEND_REF_NONE;
+    }
+}
+
 static void
 proxy_cleanup(struct proxy *proxy)
 {
+    if (proxy->fill.entry != NULL)
+        cache_fill_abort(proxy->cache, &proxy->fill);
+    if (proxy->revalidate.entry != NULL)
+        cache_revalidate_abort(proxy->cache, &proxy->revalidate);
+    if (proxy->admitted) {
+        limiter_disconnect(proxy->limiter, proxy->client_addr.sin_addr);
+        proxy->admitted = false;
+    }
+    if (proxy->shape.client != FAILURE) {
+        shaper_disconnect(proxy->shaper, proxy->shape.client);
+        proxy->shape.client = FAILURE;
+    }
+    budget_release(proxy->budget, proxy->charged);
+    proxy->charged = 0;
+    // A stream's worker is not a connection of its own.
+    if (proxy->client_fd != FAILURE && !proxy->stream)
+        stats_add(proxy->stats, STATS_CLOSED, 1);
+
+    if (proxy->verbose && proxy->zc.sent > 0)
+        fprintf(stderr, "sent %lu bytes in %u zero-copy sends, "
+                "%lu copied by the kernel\n",
+                proxy->zc.bytes, proxy->zc.sent, proxy->zc.copied);
+
+    // Totals for all the processes so far.
+    if (proxy->verbose)
+        transfer_report(proxy->transfer);
+    if (proxy->verbose && proxy->shaper != NULL)
+        shaper_report(proxy->shaper);
+    if (proxy->verbose && proxy->budget != NULL)
+        budget_report(proxy->budget);
+
     if (proxy->verbose)
         fputs("closing socket fds\n", stderr);
 
     close(proxy->listen_fd);
+    if (proxy->poll_fd != FAILURE)
+        close(proxy->poll_fd);
+    for (int i = 0; i < 2; ++i)
+        if (proxy->drain[i] != FAILURE)
+            close(proxy->drain[i]);
     close(proxy->client_fd);
-    close(proxy->server_fd);
+    proxy_disconnect(proxy);
 }
 
 /*
  * Connect to the server specified in a request.
- * Returns FAILURE if connection failed, otherwise a connected socket FD.
+ * With health checks, addresses that are ejected are skipped and the outcome
+ * of each attempt is recorded. The address connected to is stored in addr.
+ * Returns FAILURE if connection failed, with errno set as for the last address
+ * tried, otherwise a connected socket FD.
  */
 static int
-connect_server(char *host, char *port)
+connect_server(struct health *health, struct tcp_options const *tcp,
+               struct trace *trace, char const *host, char const *port,
+               struct sockaddr_storage *addr, socklen_t *addrlen)
 {
-    int fd, rval;
+    int const on = 1;
+
+    int fd = FAILURE, rval, error = ECONNREFUSED;
     struct addrinfo *aip, hint = {
         // hints will help addrinfo to populate addr in a specific way
         .ai_family   = AF_UNSPEC,
@@ -161,29 +846,72 @@ connect_server(char *host, char *port)
                 gai_strerror(rval));
         return FAILURE;
     }
+    trace_mark(trace, TRACE_RESOLVED);
 
     for (struct addrinfo *rp = aip; rp != NULL; rp = rp->ai_next) {
+        if (health != NULL
+            && health_ejected(health, rp->ai_addr, rp->ai_addrlen))
+            continue;
         fd = socket(rp->ai_family,
                     rp->ai_socktype,
                     rp->ai_protocol);
         if (fd == FAILURE)
             continue;
-        if (connect(fd, rp->ai_addr, rp->ai_addrlen) != FAILURE)
+        tune_socket(fd, tcp);
+#ifdef TCP_FASTOPEN_CONNECT
+        // The SYN waits for the request, and carries it if the server has
+        // handed out a fast open cookie before. The connect then succeeds
+        // at once, so a server that is down is only noticed when the request
+        // is sent, and is not tried at its other addresses.
+        if (tcp->fastopen)
+            setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                       &on, sizeof on);
+#endif
+        if (connect_timeout(fd, rp->ai_addr, rp->ai_addrlen,
+                            tcp->connect_timeout) != FAILURE) {
+            tune_connection(fd, tcp);
+            // A fast open connect proves nothing about the server yet.
+            if (health != NULL && !tcp->fastopen)
+                health_connected(health, rp->ai_addr, rp->ai_addrlen, true);
+            memcpy(addr, rp->ai_addr, rp->ai_addrlen);
+            *addrlen = rp->ai_addrlen;
             break; // success!
+        }
+        error = errno;
+        if (health != NULL)
+            health_connected(health, rp->ai_addr, rp->ai_addrlen, false);
         close(fd);
         fd = FAILURE;
     }
 
     freeaddrinfo(aip);
 
+    // Let the caller tell a timeout from other failures.
+    if (fd == FAILURE)
+        errno = error;
+
     return fd;
 }
 
 /*
- * Send an error response with a given status and reason on the socket fd.
+ * Write a buffer to the client, without copying it if it is large enough for
+ * that to pay off.
+ */
+static ssize_t
+write_client(struct proxy *proxy, void const *buf, size_t len)
+{
+    if (proxy->zerocopy_min > 0 && len >= proxy->zerocopy_min)
+        return zerocopy_send(&proxy->zc, proxy->client_fd, buf, len);
+
+    return write(proxy->client_fd, buf, len);
+}
+
+/*
+ * Send an error response with a given status and reason on the socket fd,
+ * and count it. There is no client to send it to in the background.
  */
 static ssize_t
-send_error(int client_fd, enum http_status_code status)
+send_error(struct proxy *proxy, int client_fd, enum http_status_code status)
 {
     struct iovec parts[] = {
         { // Version
@@ -215,74 +943,120 @@ send_error(int client_fd, enum http_status_code status)
         IOSTRING_TO_IOVEC(http_errors[status].body)
     };
 
+    if (client_fd == FAILURE)
+        return FAILURE;
+
+    stats_add(proxy->stats, STATS_ERRORS + status, 1);
+
     return writev(client_fd, parts, sizeof parts / sizeof (struct iovec));
 }
 
-enum {
-    PIPE_FAIL      = -2,
-    SPLICE_RX_FAIL = -3,
-    SPLICE_TX_FAIL = -4,
-    READ_FAIL      = -5,
-    WRITE_FAIL     = -6,
-    RX_SHORT       = -7
-};
+/*
+ * Format the fields this proxy adds to a message it received with the given
+ * HTTP version into buf, and return their length.
+ * Requests are also told who the client is.
+ */
+static size_t
+format_added_fields(struct proxy *proxy, struct iostring version,
+                    bool request, char *buf, size_t size)
+{
+    size_t n = 0;
+
+    // HTTP/1.1 is received as "1.1".
+    if (version.len > 5 && strncmp(version.p, "HTTP/", 5) == SUCCESS) {
+        version.p += 5;
+        version.len -= 5;
+    }
+
+    if (proxy->via != NULL)
+        n += snprintf(buf + n, size - n, "Via: %.*s %s\r\n",
+                      (int)version.len, version.p, proxy->via);
+    if (request && proxy->forwarded_for && n < size)
+        n += snprintf(buf + n, size - n, "X-Forwarded-For: %s\r\n",
+                      inet_ntoa(proxy->client_addr.sin_addr));
+
+    return n < size ? n : 0; // Better nothing than half a field.
+}
+
+/*
+ * Set extra to the fields added to a response for this client only, which are
+ * never cached, and return how many there are.
+ */
+static int
+client_fields(struct proxy *proxy, bool hit,
+              struct iovec extra[REWRITE_EXTRA_MAX])
+{
+    int n = 0;
+
+    if (proxy->x_cache)
+        extra[n++] = hit
+            ? (struct iovec){ .iov_base = "X-Cache: HIT\r\n", .iov_len = 14 }
+            : (struct iovec){ .iov_base = "X-Cache: MISS\r\n", .iov_len = 15 };
+    // A client may still send the body the server refused, so the connection
+    // can not be used for another request, nor can one this worker gave way
+    // on.
+    if (proxy->expect_body > 0 || proxy->reniced)
+        extra[n++] = (struct iovec){
+            .iov_base = "Connection: close\r\n",
+            .iov_len = 19
+        };
+    // The server's Connection field was meant for the proxy, not the client.
+    else if (proxy->client_keep_alive)
+        extra[n++] = (struct iovec){
+            .iov_base = "Connection: keep-alive\r\n",
+            .iov_len = 24
+        };
+
+    return n;
+}
 
 /*
- * Transfer len bytes from rx_fd to tx_fd.
+ * Transfer len bytes from rx_fd into the cache object being filled, and relay
+ * them to *tx_fd from the cache file as each chunk lands.
+ * Processes following the object are woken after every chunk.
  *
- * On Linux, this uses splice(2) to avoid copying the data.
- * On other platforms, splice(2) is not available so the data must be buffered
- * in userspace.
+ * On Linux, the data is spliced into the file, so it is never copied to
+ * userspace, and each chunk is sent on with transfer_file().
+ * If sending to the client fails, *tx_fd is set to FAILURE and the fill
+ * carries on for the sake of any followers.
  */
 static ssize_t
-splice_loop(int rx_fd, int tx_fd, size_t len)
+fill_loop(struct transfer *transfer, struct cache *cache,
+          struct cache_object *obj, int rx_fd, int *tx_fd, size_t len)
 {
-    ssize_t n, res, remaining = len;
+    off_t tx_offset = lseek(obj->fd, 0, SEEK_CUR);
+    size_t available = tx_offset, remaining = len;
+    ssize_t n, res = SUCCESS;
 #ifdef __linux__
-    //
-    // splice(2) is only available on Linux.
-    //
-
-    // splice(2) uses a pipe as an in-kernel "buffer" for zero-copy
-    // transfer between sockets.
-    // http://yarchive.net/comp/linux/splice.html
     int pipefd[2];
 
     if (pipe(pipefd) == FAILURE)
         return PIPE_FAIL;
 
+    transfer_count(transfer, TRANSFER_SPLICE, len);
+
     while (remaining > 0) {
-        // Move a chunk of data from the rx socket to the pipe.
-        // We want to read as much as possible without blocking.
-        // NB: INT_MAX is the maximum size allowed by splice(2).
+        // Don't read past the end of the object.
         res = splice(rx_fd, NULL,
                      pipefd[1], NULL,
-                     INT_MAX, SPLICE_F_NONBLOCK);
+                     remaining, SPLICE_F_MOVE);
         if (res == 0) {
-            // XXX: should we retry?
             res = RX_SHORT;
             break;
         }
         if (res == FAILURE) {
-            // TODO: Check for EAGAIN to retry?
             res = SPLICE_RX_FAIL;
             break;
         }
 
         n = res;
 
-        // Move a chunk of data from the pipe to the tx socket.
-        // We won't necessarily get to write the full chunk in one go,
-        // so this loops until the pipe has been completely drained.
+        // Append the chunk to the cache file.
         do {
             ssize_t const res1 = splice(pipefd[0], NULL,
-                                        tx_fd, NULL,
-                                        n, 0);
-            if (res1 == 0)
-                // XXX: should we retry?
-                break;
-            if (res1 == FAILURE) {
-                // TODO: Check for EAGAIN to retry?
+                                        obj->fd, NULL,
+                                        n, SPLICE_F_MOVE);
+            if (res1 <= 0) {
                 res = SPLICE_TX_FAIL;
                 break;
             }
@@ -291,55 +1065,371 @@ splice_loop(int rx_fd, int tx_fd, size_t len)
         } while (n);
 
         if (res < SUCCESS)
-            break; // The inner loop failed, break out of the outer loop.
-
-        remaining -= res;
-    }
-
-    close(pipefd[0]);
-    close(pipefd[1]);
-
-    if (res < SUCCESS)
-        return res;
+            break;
 #else
-    //
-    // Everything else has to copy to and from userspace.
-    //
     char buf[PIPE_SIZE];
 
+    transfer_count(transfer, TRANSFER_COPY, len);
+
     while (remaining > 0) {
-        // Buffer a chunk of data from the rx socket.
-        // We want to read as much as possible without blocking.
-        res = recv(rx_fd, buf, PIPE_SIZE, MSG_DONTWAIT);
-        if (res == 0)
-            break; // peer closed connection
+        res = recv(rx_fd, buf,
+                   remaining < sizeof buf ? remaining : sizeof buf, 0);
+        if (res == 0) {
+            res = RX_SHORT;
+            break;
+        }
         if (res == FAILURE) {
-            if (errno == EAGAIN)
-                continue;
-            return READ_FAIL;
+            res = READ_FAIL;
+            break;
         }
 
-        n = res;
-
-        // Write the buffer to the tx socket.
-        // We won't necessarily get to write the full chunk in one go,
-        // so this loops until the buffer has been completely drained.
-        do {
-            ssize_t const res1 = write(tx_fd, buf, n);
-            if (res1 == 0)
-                break; // XXX: should we retry?
+        for (n = 0; n < res; ) {
+            ssize_t const res1 = write(obj->fd, buf + n, res - n);
             if (res1 == FAILURE)
-                return WRITE_FAIL;
-            n -= res1;
-        } while (n);
+                break;
+            n += res1;
+        }
+
+        if (n < res) {
+            res = WRITE_FAIL;
+            break;
+        }
+#endif
 
+        available += res;
         remaining -= res;
+        cache_fill_progress(cache, obj, available);
+
+        if (*tx_fd != FAILURE
+            && transfer_file(transfer, obj->fd, *tx_fd, &tx_offset, res)
+               < SUCCESS)
+            *tx_fd = FAILURE;
     }
+
+#ifdef __linux__
+    close(pipefd[0]);
+    close(pipefd[1]);
 #endif
 
+    if (res < SUCCESS)
+        return res;
+
     return len;
 }
 
+/*
+ * Start TLS on a new connection to a server.
+ * Returns the socket to use in place of fd, or FAILURE after closing fd.
+ */
+static int
+secure_server(struct proxy *proxy, int fd, char const *host, char const *port)
+{
+#ifdef WITH_TLS
+    // The handshake is part of connecting.
+    set_timeout(fd, SO_RCVTIMEO, proxy->tcp.connect_timeout);
+    set_timeout(fd, SO_SNDTIMEO, proxy->tcp.connect_timeout);
+
+    return tls_connect(proxy->upstream_tls, fd, host, port);
+#else
+    if (proxy->verbose)
+        fputs("secure_server(): built without TLS support\n", stderr);
+    close(fd);
+    return FAILURE;
+#endif
+}
+
+/*
+ * Connect to the server for a request, unless the connection used for the
+ * previous request can be used again.
+ * As a reverse proxy, the server is a backend chosen from the pool the request
+ * is routed to, falling back on the others if it cannot be reached.
+ * Servers that take TLS are asked to keep connections open, since a handshake
+ * costs more than a TCP connection.
+ * Sends an error response to the client and returns FAILURE on failure.
+ */
+static int
+proxy_connect(struct proxy *proxy, struct uri uri)
+{
+    bool const verbose = proxy->verbose;
+    int const client_fd = proxy->client_fd;
+
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    char name[sizeof proxy->server_name];
+    struct tcp_options tcp = proxy->tcp;
+    uint64_t tried = 0;
+    int pool, fd = FAILURE;
+
+    // A small window keeps a fast server from filling memory with a response
+    // faster than the client takes it.
+    if (budget_pressure(proxy->budget) >= BUDGET_THROTTLE)
+        tcp.rcvbuf = THROTTLED_RCVBUF;
+
+    if (proxy->router == NULL) {
+        snprintf(host, sizeof host, "%.*s",
+                 (int)uri.authority.host.len, uri.authority.host.p);
+        snprintf(port, sizeof port, "%.*s",
+                 (int)uri.authority.port.len, uri.authority.port.p);
+        snprintf(name, sizeof name, "%s:%s", host, port);
+
+        if (proxy->server_reusable && uri_is_https(uri)
+            && strcmp(name, proxy->server_name) == SUCCESS) {
+            if (verbose)
+                fprintf(stderr, "reusing connection to %s\n", name);
+            proxy->server_reusable = false; // until the next response says so
+            proxy->server_reused = true;
+            clock_gettime(CLOCK_MONOTONIC, &proxy->sent);
+            return SUCCESS;
+        }
+
+        proxy_disconnect(proxy); // from a previous request
+        fd = connect_server(NULL, &tcp, &proxy->trace, host, port,
+                            &proxy->server_addr, &proxy->server_addrlen);
+        if (fd != FAILURE && uri_is_https(uri)) {
+            fd = secure_server(proxy, fd, host, port);
+            strcpy(proxy->server_name, name);
+            proxy->server_keep_alive = true;
+        }
+    }
+    else {
+        pool = router_match(proxy->router,
+                            uri.authority.host, uri.path_query_fragment);
+        if (pool == FAILURE) {
+            if (verbose)
+                fputs("proxy_connect(): no route for request\n", stderr);
+            send_error(proxy, client_fd, NOT_FOUND);
+            return FAILURE;
+        }
+        proxy->shape.pool = pool;
+
+        if (proxy->server_reusable
+            && router_keeps(proxy->router, proxy->backend,
+                            pool, uri.path_query_fragment)) {
+            if (verbose)
+                fputs("reusing connection to backend\n", stderr);
+            proxy->server_reusable = false; // until the next response says so
+            proxy->server_reused = true;
+            clock_gettime(CLOCK_MONOTONIC, &proxy->sent);
+            return SUCCESS;
+        }
+
+        proxy_disconnect(proxy); // from a previous request
+
+        for (;;) {
+            struct backend_ref const ref =
+                router_pick(proxy->router, pool, uri.path_query_fragment, tried);
+
+            if (ref.backend == FAILURE)
+                break; // all tried
+
+            fd = connect_server(proxy->health, &tcp, &proxy->trace,
+                                router_backend_host(proxy->router, ref),
+                                router_backend_port(proxy->router, ref),
+                                &proxy->server_addr, &proxy->server_addrlen);
+            if (fd != FAILURE && router_backend_tls(proxy->router, ref))
+                fd = secure_server(proxy, fd,
+                                   router_backend_host(proxy->router, ref),
+                                   router_backend_port(proxy->router, ref));
+            if (fd != FAILURE) {
+                proxy->backend = ref;
+                proxy->server_keep_alive = true;
+                break;
+            }
+
+            router_release(proxy->router, ref);
+            tried |= UINT64_C(1) << ref.backend;
+        }
+    }
+
+    if (fd == FAILURE) {
+        bool const timeout = errno == ETIMEDOUT || timed_out();
+
+        if (verbose)
+            fputs("proxy_connect(): failed to connect to server\n", stderr);
+        send_error(proxy, client_fd, timeout ? TIMEOUT : INTERNAL_ERROR);
+        return FAILURE;
+    }
+
+    proxy->server_fd = fd;
+    proxy->server_reused = false;
+    clock_gettime(CLOCK_MONOTONIC, &proxy->sent);
+    trace_mark(&proxy->trace, TRACE_CONNECTED);
+
+    // Sending the request and any body counts as idle time.
+    set_timeout(fd, SO_SNDTIMEO, proxy->timeouts.idle);
+
+    return SUCCESS;
+}
+
+/*
+ * Send the rest of a request body to the server, from the client or from the
+ * file it was spooled to, and uncork the server's socket.
+ * Returns FAILURE on error, otherwise the number of bytes sent.
+ */
+static ssize_t
+send_request_body(struct proxy *proxy, int spool, size_t more)
+{
+    int const server_fd = proxy->server_fd;
+
+    off_t offset = 0;
+    ssize_t const res = spool >= 0
+        ? transfer_file(proxy->transfer, spool, server_fd, &offset, more)
+        : transfer_relay(proxy->transfer, proxy->client_fd, server_fd, more);
+
+    transfer_cork(server_fd, false);
+
+    switch(res) {
+    case PIPE_FAIL:
+        perror("send_request_body: failed to create a pipe");
+        return FAILURE;
+    case SPLICE_RX_FAIL:
+        perror("send_request_body: failed to splice from client socket");
+        return FAILURE;
+    case SPLICE_TX_FAIL:
+        perror("send_request_body: failed to splice to server socket");
+        return FAILURE;
+    case READ_FAIL:
+        perror("send_request_body: failed to read from client socket");
+        return FAILURE;
+    case WRITE_FAIL:
+        perror("send_request_body: failed to write to server socket");
+        return FAILURE;
+    case RX_SHORT:
+        fputs("send_request_body: expected more data\n", stderr);
+        return FAILURE;
+    default:
+        break;
+    }
+
+    stats_add(proxy->stats, STATS_REQUEST_BYTES, more);
+
+    return more;
+}
+
+/*
+ * Wait for the server to answer a request whose body is held back.
+ * Returns false if the continue timeout expires first.
+ */
+static bool
+await_continue(struct proxy *proxy)
+{
+    struct pollfd pfd = { .fd = proxy->server_fd, .events = POLLIN };
+
+    int res;
+
+    do
+        res = poll(&pfd, 1, proxy->timeouts.expect);
+    while (res == FAILURE && errno == EINTR);
+
+    // Let the read fail if polling did.
+    return res != 0;
+}
+
+/*
+ * Send the request body held back for the server to accept it.
+ */
+static int
+send_held_body(struct proxy *proxy)
+{
+    size_t const more = proxy->expect_body;
+
+    proxy->expect_body = 0;
+    transfer_cork(proxy->server_fd, true);
+
+    return send_request_body(proxy, FAILURE, more) == FAILURE
+        ? FAILURE : SUCCESS;
+}
+
+/*
+ * Whether buf starts with the status line of an interim (1xx) response.
+ */
+static bool
+is_interim(char const *buf, size_t len)
+{
+    return len >= 10 && strncmp(buf, "HTTP/1.", 7) == SUCCESS && buf[9] == '1';
+}
+
+/*
+ * Read the start of a response from the server, waiting no longer than the
+ * first-byte timeout. The rest of it is read with the idle timeout.
+ *
+ * If the request body is held back, the server gets the continue timeout to
+ * accept it with a 100 (Continue) response, which is relayed to the client,
+ * or to refuse it with a final response. The body is sent if it accepts, or
+ * does not answer in time. Interim (1xx) responses are not passed on.
+ */
+static ssize_t
+read_response(struct proxy *proxy, char *buf, size_t len)
+{
+    int const server_fd = proxy->server_fd;
+
+    char *interim_end;
+    ssize_t res;
+    size_t n = 0;
+
+    if (proxy->expect_body > 0 && !await_continue(proxy)
+        && send_held_body(proxy) == FAILURE)
+        return FAILURE;
+
+    set_timeout(server_fd, SO_RCVTIMEO, proxy->timeouts.first_byte);
+    for (;;) {
+        res = read(server_fd, buf + n, len - n);
+        if (res <= 0)
+            return res;
+        if (n == 0) {
+            trace_mark(&proxy->trace, TRACE_FIRST_BYTE);
+            set_timeout(server_fd, SO_RCVTIMEO, proxy->timeouts.idle);
+        }
+        n += res;
+
+        while (is_interim(buf, n)
+               && (interim_end = memmem(buf, n, "\r\n\r\n", 4)) != NULL) {
+            size_t const interim_len = interim_end + 4 - buf;
+
+            if (proxy->expect_body > 0
+                && strncmp(buf + 9, "100", 3) == SUCCESS
+                && (write(proxy->client_fd, continue_response,
+                          sizeof continue_response - 1) == FAILURE
+                    || send_held_body(proxy) == FAILURE))
+                return FAILURE;
+
+            n -= interim_len;
+            memmove(buf, buf + interim_len, n);
+        }
+
+        // Wait for the rest of an interim response, or the final one.
+        if (n >= 10 && (!is_interim(buf, n) || n == len))
+            return n;
+    }
+}
+
+/*
+ * Record the status of a response from the backend for the health checks,
+ * along with how long it took since the request was sent. A status of 0
+ * stands for no response at all.
+ */
+static void
+proxy_report_response(struct proxy *proxy, int status)
+{
+    struct timespec now;
+
+    if (proxy->health == NULL || proxy->server_addrlen == 0)
+        return;
+
+    if (status == 0) {
+        health_connected(proxy->health,
+                         (struct sockaddr *)&proxy->server_addr,
+                         proxy->server_addrlen, false);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    health_response(proxy->health,
+                    (struct sockaddr *)&proxy->server_addr,
+                    proxy->server_addrlen, status,
+                    (now.tv_sec - proxy->sent.tv_sec)
+                    + (now.tv_nsec - proxy->sent.tv_nsec) / 1e9);
+}
+
 /*
  / Send the parts of the new HTTP request to the server.
  /
@@ -356,128 +1446,754 @@ splice_loop(int rx_fd, int tx_fd, size_t len)
  / while only needing to make one syscall. Likewise for Proxy-Connection.
  /
  / If more data is expected than what was in the buffer, the remaining data is
- / forwarded to the server in chunks. On Linux, this takes advantage of
- / splice(2) for zero-copy transfers. On everything else, it buffers PIPE_SIZE
- / bytes at a time.
+ / forwarded to the server with transfer_relay(), which splices long bodies on
+ / Linux and copies short ones through a buffer. A body already spooled is sent
+ / from the spool file instead. A body held back for the server to accept it
+ / is sent by read_response(), and the request is made in HTTP/1.1 so that the
+ / server knows to answer the expectation. The response may then come with a
+ / chunked body, which proxy_send_chunked() passes on.
  */
 static ssize_t
 proxy_send_request(struct proxy *proxy,
                    struct http_request_line reqln,
                    struct uri uri,
-                   struct http_header_field proxyconn,
+                   char *head_end,
                    size_t len,
-                   size_t more)
+                   size_t more,
+                   int spool)
 {
     bool const verbose = proxy->verbose;
-    int const client_fd = proxy->client_fd;
     int const server_fd = proxy->server_fd;
 
-    char * const version = reqln.end;
-    size_t const version_offset = version - reqln.method.p;
-    size_t const proxyconn_offset = proxyconn.field_name.p - version;
-    size_t const proxyconn_end_offset = proxyconn.end - reqln.method.p;
-    size_t const rest_len =
-        len - (proxyconn.valid ? proxyconn_end_offset : version_offset);
-    struct iovec const parts[] = {
-        { // Method
-            .iov_base = reqln.method.p,
-            .iov_len = reqln.method.len + 1
-        },
-        // Request path (minus proxy-to URI component)
-        IOSTRING_TO_IOVEC(uri.path_query_fragment),
-		{
-			.iov_base = " HTTP/1.0\r\n",
-			.iov_len = 11
-		},
-        { // Headers before Proxy-Connection OR The rest
-            .iov_base = version,
-            .iov_len = proxyconn.valid ? proxyconn_offset : rest_len
-        },
-        { // Headers after Proxy-Connection & Body
-            .iov_base = proxyconn.end,
-            .iov_len = rest_len
-        }
-    };
-    size_t const num_parts =
-        sizeof parts / sizeof (struct iovec) - (proxyconn.valid ? 0 : 1);
+    char * const end = reqln.method.p + len;
+    char added[NI_MAXHOST + 64];
+    size_t const added_len = format_added_fields(proxy, reqln.http_version,
+                                                 true, added, sizeof added);
+    struct rewrite rw;
 
-    if (writev(server_fd, parts, num_parts) == FAILURE) {
+    //
+    // The method, the request path (minus the proxy-to URI component), and
+    // the fields kept from the original request, with gaps for the others.
+    //
+    rewrite_init(&rw);
+    rewrite_append(&rw, reqln.method.p, reqln.method.len + 1);
+    rewrite_append(&rw, uri.path_query_fragment.p, uri.path_query_fragment.len);
+    // Ask to keep the connection open for the next request.
+    // HTTP/1.1 connections stay open unless the request says otherwise.
+    if (proxy->expect_body > 0 && proxy->server_keep_alive)
+        rewrite_append(&rw, " HTTP/1.1\r\nConnection: keep-alive\r\n", 35);
+    else if (proxy->expect_body > 0)
+        rewrite_append(&rw, " HTTP/1.1\r\nConnection: close\r\n", 30);
+    else if (proxy->server_keep_alive)
+        rewrite_append(&rw, " HTTP/1.0\r\nConnection: keep-alive\r\n", 35);
+    else
+        rewrite_append(&rw, " HTTP/1.0\r\n", 11);
+    proxy->server_http11 = proxy->expect_body > 0;
+    if (rewrite_fields(&rw, reqln.end, head_end, proxy->request_rules)
+        == FAILURE
+        || rewrite_append(&rw, added, added_len) == FAILURE
+        || rewrite_finish(&rw, head_end, end - head_end) == FAILURE) {
+        if (verbose)
+            fputs("proxy_send_request: too many fields to rewrite\n", stderr);
+        return FAILURE;
+    }
+
+    // Send the head of the request along with the start of the body.
+    if (more && proxy->expect_body == 0)
+        transfer_cork(server_fd, true);
+
+    if (writev(server_fd, rw.iov, rw.iovcnt) == FAILURE) {
         if (verbose)
             perror("proxy_send_request: failed to write request buffer");
         return FAILURE;
     }
 
+    stats_add(proxy->stats, STATS_REQUEST_BYTES, rw.len);
+
+    if (more && proxy->expect_body == 0
+        && send_request_body(proxy, spool, more) == FAILURE)
+        return FAILURE;
+
+    return rw.len + more;
+}
+
+/*
+ * Whether a request may be sent more than once to the same effect.
+ */
+static bool
+is_idempotent(struct iostring method)
+{
+    static char const * const methods[] = {
+        "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE"
+    };
+
+    for (size_t i = 0; i < sizeof methods / sizeof *methods; i++)
+        if (method.len == strlen(methods[i])
+            && strncmp(method.p, methods[i], method.len) == SUCCESS)
+            return true;
+    return false;
+}
+
+/*
+ * Whether the request sent on server_fd failed because the server had closed
+ * the connection while it was kept between requests, as servers do once it
+ * has been idle longer than they care to keep it. The request is then sent
+ * once more on a fresh connection. The server may also have closed it after
+ * acting on the request, so this only holds for idempotent requests without a
+ * body. Pass true if the request could not be sent, false if the connection
+ * gave no response.
+ */
+static bool
+proxy_stale(struct proxy const *proxy, bool sending, ssize_t res)
+{
+    if (!proxy->replay.valid || !proxy->server_reused)
+        return false;
+    if (sending)
+        return res == FAILURE && (errno == EPIPE || errno == ECONNRESET);
+    return res == 0 || (res == FAILURE && errno == ECONNRESET);
+}
+
+/*
+ * Send the request again on a new connection after proxy_stale().
+ * Sends an error response to the client and returns FAILURE on failure.
+ */
+static int
+proxy_resend(struct proxy *proxy)
+{
+    struct replay const replay = proxy->replay;
+
+    if (proxy->verbose)
+        fputs("kept connection was closed by the server, "
+              "sending the request again\n", stderr);
+
+    proxy_disconnect(proxy);
+    if (proxy_connect(proxy, replay.uri) == FAILURE)
+        return FAILURE;
+
+    if (proxy_send_request(proxy, replay.reqln, replay.uri,
+                           replay.head_end, replay.len, 0, FAILURE)
+        == FAILURE) {
+        if (proxy->verbose)
+            perror("failed to send request again");
+        send_error(proxy, proxy->client_fd, INTERNAL_ERROR);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Send an HTTP response to the client.
+ * If this process is filling the cache, the response is stored as it is sent.
+ * There is no client when filling the cache in the background.
+ * Returns FAILURE on error, otherwise the number of bytes sent.
+ */
+static ssize_t
+proxy_send_response(struct proxy *proxy, struct rewrite const *rw, size_t more)
+{
+    bool const verbose = proxy->verbose;
+    bool const background = proxy->client_fd == FAILURE;
+    int const server_fd = proxy->server_fd;
+    struct cache_object * const fill = &proxy->fill;
+
+    int client_fd = proxy->client_fd;
+    struct iovec extra[REWRITE_EXTRA_MAX];
+    int nextra, spool = FAILURE;
+
+    // Take the whole body off the server's hands first, so that a slow client
+    // does not hold up the server. Then it can go, unless it is kept for the
+    // next request.
+    if (!background && fill->entry == NULL
+        && more > 0 && more <= proxy->buffer_responses
+        && budget_pressure(proxy->budget) < BUDGET_THROTTLE
+        && budget_charge(proxy->budget, more)) {
+        spool = transfer_spool(proxy->transfer, server_fd, more);
+        if (spool < 0) {
+            budget_release(proxy->budget, more);
+            if (verbose)
+                perror("proxy_send_response: failed to spool response body");
+            send_error(proxy, client_fd, timed_out() ? TIMEOUT : BAD_GATEWAY);
+            return FAILURE;
+        }
+        if (!proxy->server_reusable)
+            proxy_disconnect(proxy);
+    }
+
+    if (fill->entry != NULL) {
+        if (writev(fill->fd, rw->iov, rw->iovcnt) != rw->len) {
+            if (verbose)
+                perror("proxy_send_response: failed to write cache file");
+            cache_fill_abort(proxy->cache, fill);
+        }
+        else
+            cache_fill_progress(proxy->cache, fill, rw->len);
+    }
+
+    if (background && fill->entry == NULL)
+        return rw->len + more; // nobody wants it
+
+    // Send the headers along with the start of the body.
+    if (!background && more)
+        transfer_cork(client_fd, true);
+
+    // An unchanged message is still one buffer, which may go without copying.
+    // It counts against the client's bandwidth like the rest of the body.
+    nextra = client_fields(proxy, false, extra);
+    if (!background)
+        transfer_pace(proxy->transfer, client_fd, rw->len);
+    if (!background
+        && (nextra == 0 && rw->iovcnt == 1
+            ? write_client(proxy, rw->iov[0].iov_base, rw->len)
+            : rewrite_write(rw, client_fd, extra, nextra)) == FAILURE) {
+        if (verbose)
+            perror("proxy_send_response: failed to write response buffer");
+        if (spool >= 0) {
+            close(spool);
+            budget_release(proxy->budget, more);
+        }
+        if (fill->entry == NULL)
+            return FAILURE;
+        // Finish filling the cache for anyone following this response.
+        client_fd = FAILURE;
+    }
+
     if (more) {
-        switch(splice_loop(client_fd, server_fd, more)) {
+        off_t offset = 0;
+        ssize_t const res = fill->entry != NULL
+            ? fill_loop(proxy->transfer, proxy->cache, fill,
+                        server_fd, &client_fd, more)
+            : spool >= 0
+            ? transfer_file(proxy->transfer, spool, client_fd, &offset, more)
+            : transfer_relay(proxy->transfer, server_fd, client_fd, more);
+
+        if (spool >= 0) {
+            close(spool);
+            budget_release(proxy->budget, more);
+        }
+        if (client_fd != FAILURE)
+            transfer_cork(client_fd, false);
+
+        switch(res) {
         case PIPE_FAIL:
-            perror("proxy_send_request: failed to create a pipe");
+            perror("proxy_send_response: failed to create a pipe");
             return FAILURE;
         case SPLICE_RX_FAIL:
-            perror("proxy_send_request: failed to splice from server socket");
+            perror("proxy_send_response: failed to splice from server socket");
             return FAILURE;
         case SPLICE_TX_FAIL:
-            perror("proxy_send_request: failed to splice to client socket");
+            perror("proxy_send_response: failed to splice to client socket");
             return FAILURE;
         case READ_FAIL:
-            perror("proxy_send_request: failed to read from server socket");
+            perror("proxy_send_response: failed to read from server socket");
             return FAILURE;
         case WRITE_FAIL:
-            perror("proxy_send_request: failed to write to client socket");
+            perror("proxy_send_response: failed to write to client socket");
             return FAILURE;
         case RX_SHORT:
-            fputs("proxy_send_request: expected more data\n", stderr);
+            perror("proxy_send_response: expected more data");
             return FAILURE;
         default:
             break;
         }
     }
 
-    return len + more;
+    if (fill->entry != NULL)
+        cache_fill_finish(proxy->cache, fill);
+
+    if (client_fd == FAILURE && !background) {
+        if (verbose)
+            fputs("proxy_send_response: client went away\n", stderr);
+        return FAILURE;
+    }
+
+    if (!background)
+        stats_add(proxy->stats, STATS_RESPONSE_BYTES, rw->len + more);
+
+    return rw->len + more;
 }
 
 /*
- * Send an HTTP response to the client.
- * Returns FAILURE on error, otherwise the number of bytes sent.
+ * Send a response with a body in the chunked transfer coding to the client as
+ * it is, following the coding to find where the body ends. The first n bytes
+ * of the body are at the end of the rewritten head.
+ * Returns FAILURE on error, otherwise the length of the body.
  */
 static ssize_t
-proxy_send_response(struct proxy *proxy, char *buf, size_t len, size_t more)
+proxy_send_chunked(struct proxy *proxy, struct rewrite const *rw,
+                   char const *body, size_t n)
 {
     bool const verbose = proxy->verbose;
-    int const client_fd = proxy->client_fd;
     int const server_fd = proxy->server_fd;
+    int const client_fd = proxy->client_fd;
+
+    struct http_chunked chunked = HTTP_CHUNKED_INIT;
+    struct iovec extra[REWRITE_EXTRA_MAX];
+    int const nextra = client_fields(proxy, false, extra);
+    char buf[RECV_BUFLEN];
+    size_t total = n;
+    ssize_t len;
 
-    if (write(client_fd, buf, len) == FAILURE) {
+    // Anything after the end of the body is as bad as a broken coding.
+    if (scan_http_chunked(&chunked, body, n) != (long long)n) {
         if (verbose)
-            perror("proxy_send_response: failed to write response buffer");
+            fputs("malformed response (invalid chunked body)\n", stderr);
+        send_error(proxy, client_fd, BAD_GATEWAY);
         return FAILURE;
     }
 
-    if (more) {
-        switch(splice_loop(server_fd, client_fd, more)) {
-        case PIPE_FAIL:
-            perror("proxy_send_response: failed to create a pipe");
-            return FAILURE;
-        case SPLICE_RX_FAIL:
-            perror("proxy_send_response: failed to splice from server socket");
+    transfer_pace(proxy->transfer, client_fd, rw->len);
+    if (rewrite_write(rw, client_fd, extra, nextra) == FAILURE) {
+        if (verbose)
+            perror("proxy_send_chunked: failed to write response buffer");
+        return FAILURE;
+    }
+
+    while (!chunked.done) {
+        len = read(server_fd, buf, sizeof buf);
+        if (len <= 0) {
+            if (verbose)
+                perror("proxy_send_chunked: expected more data");
             return FAILURE;
-        case SPLICE_TX_FAIL:
-            perror("proxy_send_response: failed to splice to client socket");
+        }
+        if (scan_http_chunked(&chunked, buf, len) != len) {
+            if (verbose)
+                fputs("malformed response (invalid chunked body)\n", stderr);
             return FAILURE;
+        }
+        // buf is read into again at once, so it is copied, not sent in place.
+        transfer_pace(proxy->transfer, client_fd, len);
+        for (ssize_t sent = 0, res; sent < len; sent += res) {
+            res = write(client_fd, buf + sent, len - sent);
+            if (res == FAILURE) {
+                if (verbose)
+                    perror("proxy_send_chunked: failed to write to client");
+                return FAILURE;
+            }
+        }
+        total += len;
+    }
+
+    transfer_count(proxy->transfer, TRANSFER_COPY, total - n);
+    stats_add(proxy->stats, STATS_RESPONSE_BYTES, rw->len + total - n);
+
+    return total;
+}
+
+/*
+ * Send a whole cached response to the client, following it as it is filled.
+ * Returns as proxy_send_cached().
+ */
+static int
+proxy_send_whole(struct proxy *proxy, struct cache_object *obj)
+{
+    bool const verbose = proxy->verbose;
+    int const client_fd = proxy->client_fd;
+
+    struct iovec extra[REWRITE_EXTRA_MAX];
+    int nextra = 0;
+    off_t offset = 0, head_end;
+    ssize_t available, extra_len = 0;
+
+    while ((available = cache_wait(proxy->cache, obj, offset)) != FAILURE) {
+        if (offset == 0) {
+            schedule_transfer(proxy, obj->total);
+            nextra = client_fields(proxy, true, extra);
+        }
+        if (available == offset) {
+            stats_add(proxy->stats, STATS_RESPONSE_BYTES, offset + extra_len);
+            return SERVED; // complete
+        }
+
+        // Fields for this client go in before the empty line ending the
+        // stored header, and are sent along with it.
+        head_end = obj->header_len - 2;
+        if (nextra > 0 && available > head_end) {
+            if (offset == 0)
+                transfer_cork(client_fd, true);
+            available = head_end;
+        }
+
+        switch (transfer_file(proxy->transfer, obj->fd, client_fd,
+                              &offset, available - offset)) {
         case READ_FAIL:
-            perror("proxy_send_response: failed to read from server socket");
+        case RX_SHORT:
+            if (verbose)
+                perror("proxy_send_whole: failed to read cache file");
             return FAILURE;
         case WRITE_FAIL:
-            perror("proxy_send_response: failed to write to client socket");
+            if (verbose)
+                perror("proxy_send_whole: failed to write to client socket");
+            return FAILURE;
+        default:
+            break;
+        }
+
+        if (nextra > 0 && offset == head_end) {
+            extra_len = writev(client_fd, extra, nextra);
+            if (extra_len == FAILURE) {
+                if (verbose)
+                    perror("proxy_send_whole: failed to write to client socket");
+                return FAILURE;
+            }
+            transfer_cork(client_fd, false);
+            nextra = 0;
+        }
+    }
+
+    if (offset != 0) {
+        if (verbose)
+            fputs("proxy_send_whole: cache fill abandoned\n", stderr);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Send len bytes of a cached object starting at offset, following the object
+ * as it is filled.
+ * Returns FAILURE if the bytes could not be sent, otherwise SUCCESS.
+ */
+static int
+send_cached_span(struct proxy *proxy, struct cache_object *obj,
+                 off_t offset, size_t len)
+{
+    bool const verbose = proxy->verbose;
+    off_t const end = offset + len;
+
+    ssize_t available;
+
+    while (offset < end) {
+        available = cache_wait(proxy->cache, obj, offset);
+        if (available == FAILURE || available <= offset) {
+            if (verbose)
+                fputs("send_cached_span: cache fill abandoned\n", stderr);
             return FAILURE;
+        }
+        if (available > end)
+            available = end;
+
+        switch (transfer_file(proxy->transfer, obj->fd, proxy->client_fd,
+                              &offset, available - offset)) {
+        case READ_FAIL:
         case RX_SHORT:
-            perror("proxy_send_response: expected more data");
+            if (verbose)
+                perror("send_cached_span: failed to read cache file");
+            return FAILURE;
+        case WRITE_FAIL:
+            if (verbose)
+                perror("send_cached_span: failed to write to client socket");
             return FAILURE;
         default:
             break;
         }
     }
 
-    return len + more;
+    stats_add(proxy->stats, STATS_RESPONSE_BYTES, len);
+
+    return SUCCESS;
+}
+
+/*
+ * Resolve byte ranges against the length of a representation, dropping the
+ * ones that cannot be satisfied.
+ * https://tools.ietf.org/html/rfc7233#section-2.1
+ * Returns the number of ranges left.
+ */
+static int
+resolve_ranges(struct http_range *ranges, int nranges, long long length)
+{
+    int n = 0;
+
+    for (int i = 0; i < nranges; ++i) {
+        struct http_range range = ranges[i];
+
+        if (range.first == FAILURE) { // suffix
+            if (range.last == 0)
+                continue;
+            range.first = range.last < length ? length - range.last : 0;
+            range.last = length - 1;
+        }
+        else if (range.first >= length)
+            continue;
+        else if (range.last == FAILURE || range.last >= length)
+            range.last = length - 1;
+
+        ranges[n++] = range;
+    }
+
+    return n;
+}
+
+/*
+ * Format the header of one part of a multipart/byteranges body.
+ */
+static int
+format_range_part(char *buf, size_t size, char const *boundary,
+                  struct http_header_field content_type,
+                  struct http_range range, long long length)
+{
+    return snprintf(buf, size,
+                    "\r\n--%s\r\n"
+                    "%s%.*s%s"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n"
+                    "\r\n",
+                    boundary,
+                    content_type.valid ? "Content-Type: " : "",
+                    content_type.valid ? (int)content_type.field_value.len : 0,
+                    content_type.valid ? content_type.field_value.p : "",
+                    content_type.valid ? "\r\n" : "",
+                    range.first, range.last, length);
+}
+
+#define RANGE_IOV_MAX 32
+
+/*
+ * Send the requested byte ranges of a cached 200 (OK) response to the client
+ * in a 206 (Partial Content) response, following the object as it is filled.
+ * Several ranges are sent as a multipart/byteranges body.
+ * Any other response, or one failing the If-Range condition, is sent whole.
+ * https://tools.ietf.org/html/rfc7233
+ * Returns as proxy_send_cached().
+ */
+static int
+proxy_send_ranges(struct proxy *proxy, struct cache_object *obj)
+{
+    bool const verbose = proxy->verbose;
+    int const client_fd = proxy->client_fd;
+
+    struct http_header_field content_type = { .valid = false };
+    struct iostring etag = { .len = 0 }, last_modified = { .len = 0 };
+    struct http_range * const ranges = proxy->ranges;
+    struct http_status_line statline;
+    struct iovec parts[RANGE_IOV_MAX], extra[REWRITE_EXTRA_MAX];
+    char head[RECV_BUFLEN], status[64], trailer[128], boundary[48];
+    char part[sizeof boundary + 256];
+    char *p, *end, *kept;
+    long long length;
+    ssize_t available = 0, res;
+    size_t n, content_length;
+    int nparts = 1, nranges, nextra = client_fields(proxy, true, extra);
+
+    // Wait for the response headers.
+    do
+        available = cache_wait(proxy->cache, obj, available);
+    while (available != FAILURE && available < obj->header_len);
+    if (available == FAILURE)
+        return SUCCESS; // nothing was sent yet
+
+    if (obj->header_len > sizeof head)
+        return proxy_send_whole(proxy, obj);
+
+    if (pread(obj->fd, head, obj->header_len, 0) != obj->header_len) {
+        if (verbose)
+            perror("proxy_send_ranges: failed to read cache file");
+        return FAILURE;
+    }
+
+    end = head + obj->header_len - 2; // final CRLF
+    statline = parse_http_status_line(head, obj->header_len, false);
+    if (!statline.valid || strncmp(statline.status_code.p, "200", 3) != SUCCESS)
+        return proxy_send_whole(proxy, obj);
+
+    length = obj->total - obj->header_len;
+    nranges = resolve_ranges(ranges, proxy->nranges, length);
+
+    //
+    // Keep the stored header fields, except those describing the body as a
+    // whole. The gaps between kept fields are skipped over with iovecs.
+    //
+    n = end - statline.end;
+    kept = p = statline.end;
+    for (struct http_header_field field;
+         p < end && nparts < RANGE_IOV_MAX;
+         n -= field.end - p, p = field.end) {
+
+        field = parse_http_header_field(p, n, false);
+
+        if (!field.valid)
+            continue;
+
+        if (http_header_field_is(field, "ETag"))
+            etag = field.field_value;
+        else if (http_header_field_is(field, "Last-Modified"))
+            last_modified = field.field_value;
+        else if (http_header_field_is(field, "Content-Type"))
+            content_type = field;
+
+        if (!http_header_field_is(field, "Content-Length")
+            && !http_header_field_is(field, "Content-Range")
+            && !(nranges > 1 && http_header_field_is(field, "Content-Type")))
+            continue;
+
+        // Replaced below.
+        parts[nparts++] = (struct iovec){ kept, p - kept };
+        kept = field.end;
+    }
+    if (nparts > RANGE_IOV_MAX - 2 - nextra)
+        return proxy_send_whole(proxy, obj); // absurd number of fields
+    parts[nparts++] = (struct iovec){ kept, end - kept };
+    for (int i = 0; i < nextra; ++i)
+        parts[nparts++] = extra[i];
+
+    //
+    // A client holding a different version of the representation wants the
+    // whole thing. Only strong entity tags are good for comparing ranges.
+    //
+    if (proxy->if_range.len != 0) {
+        struct iostring const validator =
+            proxy->if_range.p[0] == '"' ? etag : last_modified;
+
+        if (validator.len != proxy->if_range.len
+            || memcmp(validator.p, proxy->if_range.p, validator.len) != SUCCESS)
+            return proxy_send_whole(proxy, obj);
+    }
+
+    if (nranges == 0) {
+        n = snprintf(trailer, sizeof trailer,
+                     "%.*s 416 Range Not Satisfiable\r\n"
+                     "Content-Range: bytes */%lld\r\n"
+                     "Content-Length: 0\r\n"
+                     "\r\n",
+                     (int)statline.http_version.len, statline.http_version.p,
+                     length);
+        if (write(client_fd, trailer, n) == FAILURE) {
+            if (verbose)
+                perror("proxy_send_ranges: failed to write to client socket");
+            return FAILURE;
+        }
+        stats_add(proxy->stats, STATS_RESPONSE_BYTES, n);
+        return SERVED;
+    }
+
+    parts[0] = (struct iovec){
+        status,
+        snprintf(status, sizeof status, "%.*s 206 Partial Content\r\n",
+                 (int)statline.http_version.len, statline.http_version.p)
+    };
+
+    if (nranges == 1) {
+        content_length = ranges[0].last - ranges[0].first + 1;
+        n = snprintf(trailer, sizeof trailer,
+                     "Content-Range: bytes %lld-%lld/%lld\r\n"
+                     "Content-Length: %zu\r\n"
+                     "\r\n",
+                     ranges[0].first, ranges[0].last, length, content_length);
+    }
+    else {
+        snprintf(boundary, sizeof boundary, "%d-%llu",
+                 (int)getpid(), (unsigned long long)obj->generation);
+        content_length = strlen(boundary) + 8; // CRLF -- boundary -- CRLF
+        for (int i = 0; i < nranges; ++i)
+            content_length += format_range_part(part, sizeof part, boundary,
+                                                content_type, ranges[i], length)
+                + ranges[i].last - ranges[i].first + 1;
+        n = snprintf(trailer, sizeof trailer,
+                     "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "\r\n",
+                     boundary, content_length);
+    }
+    parts[nparts++] = (struct iovec){ trailer, n };
+
+    res = writev(client_fd, parts, nparts);
+    if (res == FAILURE) {
+        if (verbose)
+            perror("proxy_send_ranges: failed to write to client socket");
+        return FAILURE;
+    }
+    stats_add(proxy->stats, STATS_RESPONSE_BYTES, res);
+
+    if (nranges == 1)
+        return send_cached_span(proxy, obj, obj->header_len + ranges[0].first,
+                                content_length) == FAILURE ? FAILURE : SERVED;
+
+    for (int i = 0; i < nranges; ++i) {
+        n = format_range_part(part, sizeof part, boundary,
+                              content_type, ranges[i], length);
+        if (write(client_fd, part, n) == FAILURE
+            || send_cached_span(proxy, obj, obj->header_len + ranges[i].first,
+                                ranges[i].last - ranges[i].first + 1)
+               == FAILURE) {
+            if (verbose)
+                fputs("proxy_send_ranges: failed to send a part\n", stderr);
+            return FAILURE;
+        }
+        stats_add(proxy->stats, STATS_RESPONSE_BYTES, n);
+    }
+
+    n = snprintf(part, sizeof part, "\r\n--%s--\r\n", boundary);
+    if (write(client_fd, part, n) == FAILURE) {
+        if (verbose)
+            perror("proxy_send_ranges: failed to write to client socket");
+        return FAILURE;
+    }
+    stats_add(proxy->stats, STATS_RESPONSE_BYTES, n);
+
+    return SERVED;
+}
+
+/*
+ * Send a cached response to the client, following it as it is filled.
+ * Only the requested ranges are sent if the request had a Range header.
+ * Returns SERVED once the whole response was sent, FAILURE if sending failed,
+ * or SUCCESS if the fill was abandoned before anything was sent, in which case
+ * the request should be forwarded to the server.
+ */
+static int
+proxy_send_cached(struct proxy *proxy, struct cache_object *obj)
+{
+    int res;
+
+    if (proxy->nranges == 0)
+        return proxy_send_whole(proxy, obj);
+
+    // The parts are put together from several writes.
+    transfer_cork(proxy->client_fd, true);
+    res = proxy_send_ranges(proxy, obj);
+    transfer_cork(proxy->client_fd, false);
+
+    return res;
+}
+
+/*
+ * Compute how long a response stays fresh, from the Cache-Control max-age
+ * and s-maxage directives or the Expires and Date header fields.
+ * Failing those, a response with a Last-Modified date is fresh for a tenth of
+ * its age. https://tools.ietf.org/html/rfc7234#section-4.2.2
+ * Returns FAILURE if there is nothing to go on.
+ */
+static long
+response_lifetime(struct http_cache_control cc,
+                  time_t date, time_t expires, time_t last_modified)
+{
+    time_t const now = date != FAILURE ? date : time(NULL);
+
+    if (cc.s_maxage >= 0)
+        return cc.s_maxage;
+    if (cc.max_age >= 0)
+        return cc.max_age;
+    if (expires != FAILURE)
+        return expires > now ? expires - now : 0;
+    if (last_modified != FAILURE && last_modified < now)
+        return (now - last_modified) / 10;
+    return FAILURE;
+}
+
+/*
+ * Response status codes that may be cached without explicit freshness.
+ * https://tools.ietf.org/html/rfc7231#section-6.1
+ */
+static bool
+cacheable_status(struct iostring status_code)
+{
+    switch (strtol(status_code.p, NULL, 10)) {
+    case 200: case 203: case 204: case 300:
+    case 301: case 404: case 405: case 410:
+        return true;
+    default:
+        return false;
+    }
 }
 
 /*
@@ -495,8 +2211,15 @@ proxy_handle_response(struct proxy *proxy, char *buf, size_t len)
     char const * const end = buf + len;
     ssize_t content_length = 0;
     struct http_status_line statline = parse_http_status_line(buf, len, verbose);
-    char *p = buf;
+    struct http_cache_control cc = HTTP_CACHE_CONTROL_INIT;
+    struct cache_meta meta = { .lifetime = FAILURE };
+    time_t date = FAILURE, expires = FAILURE, last_modified = FAILURE;
+    bool has_length = false, shareable = true, keep_alive = false;
+    bool chunked = false;
+    char *p = buf, *head_end;
+    char added[NI_MAXHOST + 64];
     size_t n = len, more = 0;
+    struct rewrite rw;
 
     if (verbose)
         debug_http_status_line(statline);
@@ -504,10 +2227,12 @@ proxy_handle_response(struct proxy *proxy, char *buf, size_t len)
     if (!statline.valid) {
         if (verbose)
             fputs("malformed response (invalid status line)\n", stderr);
-        send_error(client_fd, BAD_GATEWAY);
+        send_error(proxy, client_fd, BAD_GATEWAY);
         return FAILURE;
     }
 
+    proxy_report_response(proxy, strtol(statline.status_code.p, NULL, 10));
+
     n -= statline.end - p;
     p = statline.end;
 
@@ -523,33 +2248,131 @@ proxy_handle_response(struct proxy *proxy, char *buf, size_t len)
         if (verbose)
             debug_http_header_field(field);
 
-        if (strncasecmp("Content-Length",
-                        field.field_name.p, field.field_name.len) == SUCCESS)
+        if (http_header_field_is(field, "Content-Length")) {
             content_length = strtoll(field.field_value.p, NULL, 10);
+            has_length = true;
+        }
+        else if (http_header_field_is(field, "Cache-Control"))
+            parse_http_cache_control(field.field_value, &cc);
+        else if (http_header_field_is(field, "Date"))
+            date = parse_http_date(field.field_value);
+        else if (http_header_field_is(field, "Expires")) {
+            // An invalid date means the response has already expired.
+            expires = parse_http_date(field.field_value);
+            if (expires == FAILURE)
+                expires = 0;
+        }
+        else if (http_header_field_is(field, "ETag"))
+            meta.etag = field.field_value;
+        else if (http_header_field_is(field, "Last-Modified")) {
+            meta.last_modified = field.field_value;
+            last_modified = parse_http_date(field.field_value);
+        }
+        else if (http_header_field_is(field, "Vary")
+                 || http_header_field_is(field, "Set-Cookie"))
+            // We don't keep variants, and cookies are private.
+            shareable = false;
+        else if (http_header_field_is(field, "Connection"))
+            keep_alive = http_list_has(field.field_value, keep_alive_token);
+        else if (http_header_field_is(field, "Transfer-Encoding"))
+            chunked = http_list_has(field.field_value, chunked_token);
     }
 
     // Skip over CRLF.
+    head_end = p;
     n -= 2;
     p += 2;
 
     if (p > end) {
         if (verbose)
             fputs("malformed response (too short)\n", stderr);
-        send_error(client_fd, BAD_GATEWAY);
+        send_error(proxy, client_fd, BAD_GATEWAY);
+        return FAILURE;
+    }
+
+    // The status line and the fields kept, with gaps for the others.
+    rewrite_init(&rw);
+    if (rewrite_append(&rw, buf, statline.end - buf) == FAILURE
+        || rewrite_fields(&rw, statline.end, head_end, proxy->response_rules)
+           == FAILURE
+        || rewrite_append(&rw, added,
+                          format_added_fields(proxy, statline.http_version,
+                                              false, added, sizeof added))
+           == FAILURE
+        || rewrite_finish(&rw, head_end, end - head_end) == FAILURE) {
+        if (verbose)
+            fputs("malformed response (too many fields to rewrite)\n", stderr);
+        send_error(proxy, client_fd, BAD_GATEWAY);
         return FAILURE;
     }
 
+    // Only a request sent in HTTP/1.1 gets a chunked body, which goes as it
+    // is to the HTTP/1.1 client the request came from. The connection is not
+    // used again, nor is the response cached.
+    if (chunked && proxy->server_http11 && !has_length
+        && strncmp(statline.status_code.p, "204", 3) != SUCCESS
+        && strncmp(statline.status_code.p, "304", 3) != SUCCESS) {
+        proxy->server_reusable = false;
+        if (proxy->fill.entry != NULL)
+            cache_fill_abort(proxy->cache, &proxy->fill);
+        schedule_transfer(proxy, 0);
+        return proxy_send_chunked(proxy, &rw, p, n);
+    }
+
     if (content_length < n) {
         if (verbose)
             fputs("malformed response (extra data)\n", stderr);
-        send_error(client_fd, BAD_GATEWAY);
+        send_error(proxy, client_fd, BAD_GATEWAY);
         return FAILURE;
     }
 
     // n is the amount of the body already in the buffer.
     more = content_length - n;
 
-    if (proxy_send_response(proxy, buf, len, more) == FAILURE) {
+    // The connection can be used again once the whole body has been read.
+    proxy->server_reusable = proxy->server_keep_alive && keep_alive && has_length;
+
+    meta.lifetime = response_lifetime(cc, date, expires, last_modified);
+    meta.stale_while_revalidate = cc.stale_while_revalidate;
+
+    if (proxy->revalidate.entry != NULL) {
+        if (strncmp(statline.status_code.p, "304", 3) == SUCCESS) {
+            // Not Modified: serve the cached response.
+            cache_revalidated(proxy->cache, &proxy->revalidate, &meta);
+            if (client_fd != FAILURE
+                && proxy_send_cached(proxy, &proxy->revalidate) != SERVED) {
+                cache_release(&proxy->revalidate);
+                return FAILURE;
+            }
+            cache_release(&proxy->revalidate);
+            return 0;
+        }
+
+        // Anything else replaces the cached response.
+        if (cache_refill(proxy->cache, &proxy->revalidate) != FAILURE)
+            proxy->fill = proxy->revalidate;
+        proxy->revalidate.entry = NULL;
+    }
+
+    if (proxy->fill.entry != NULL) {
+        // The cache keeps the rewritten header.
+        meta.header_len = rw.len - n;
+        meta.total = meta.header_len + content_length;
+
+        if (shareable && has_length
+            && !cc.no_store && !cc.no_cache && !cc.private
+            && cacheable_status(statline.status_code)
+            && meta.total <= cache_max_object(proxy->cache))
+            cache_fill_start(proxy->cache, &proxy->fill, &meta);
+        else
+            cache_fill_abort(proxy->cache, &proxy->fill);
+    }
+
+    schedule_transfer(proxy, content_length);
+
+    // The caller reuses buf, which may still be sent from without a copy.
+    if (proxy_send_response(proxy, &rw, more) == FAILURE
+        || zerocopy_wait(&proxy->zc, proxy->timeouts.idle) == FAILURE) {
         fputs("proxy_handle_response(): failed to send response\n", stderr);
         // If we can't send a response, there's nothing more we can do.
         proxy_cleanup(proxy);
@@ -559,9 +2382,243 @@ proxy_handle_response(struct proxy *proxy, char *buf, size_t len)
     return content_length;
 }
 
+/*
+ * Fetch the target URI for the cache with a request of our own, to fill the
+ * cache (proxy->fill) or revalidate a stale cached response (proxy->revalidate).
+ * A revalidation request is conditional on the cached validators.
+ * A 304 (Not Modified) response refreshes the cached response, which is then
+ * sent to the client. Any other response replaces the cached one.
+ * There is no client when fetching in the background.
+ * Returns SERVED on success, otherwise FAILURE.
+ */
+static int
+proxy_fetch(struct proxy *proxy, struct uri uri)
+{
+    bool const verbose = proxy->verbose;
+    int const client_fd = proxy->client_fd;
+    struct cache_object const * const obj = &proxy->revalidate;
+
+    struct iostring const version = { "HTTP/1.0", 8 };
+    struct iostring const fields = proxy->request_fields;
+
+    char host[NI_MAXHOST], port[NI_MAXSERV], buf[RECV_BUFLEN];
+    char added[NI_MAXHOST + 64];
+    char conditions[2 * CACHE_VALIDATOR_MAX + 40];
+    size_t added_len, conditions_len;
+    struct rewrite rw;
+    ssize_t len, res;
+
+    added_len = format_added_fields(proxy, version, true, added, sizeof added);
+    conditions_len = snprintf(conditions, sizeof conditions,
+                              "%s%s%s"
+                              "%s%s%s",
+                              obj->entry && obj->etag[0]
+                                  ? "If-None-Match: " : "",
+                              obj->entry ? obj->etag : "",
+                              obj->entry && obj->etag[0] ? "\r\n" : "",
+                              obj->entry && obj->last_modified[0]
+                                  ? "If-Modified-Since: " : "",
+                              obj->entry ? obj->last_modified : "",
+                              obj->entry && obj->last_modified[0]
+                                  ? "\r\n" : "");
+
+    snprintf(host, sizeof host, "%.*s",
+             (int)uri.authority.host.len, uri.authority.host.p);
+    snprintf(port, sizeof port, "%.*s",
+             (int)uri.authority.port.len, uri.authority.port.p);
+
+    // The request is made again if it meets a stale kept connection.
+    proxy->replay.valid = true;
+again:
+    if (proxy_connect(proxy, uri) == FAILURE)
+        return FAILURE;
+    proxy->server_http11 = false;
+
+    len = snprintf(buf, sizeof buf,
+                   "GET %.*s HTTP/1.0\r\n"
+                   "Host: %s:%s\r\n"
+                   "%s",
+                   (int)uri.path_query_fragment.len, uri.path_query_fragment.p,
+                   host, port,
+                   proxy->server_keep_alive ? "Connection: keep-alive\r\n" : "");
+
+    // The client's own fields go along, so that the server answers as it
+    // would the client, but the cache makes the request conditional itself.
+    rewrite_init(&rw);
+    if (rewrite_append(&rw, buf, len) == FAILURE
+        || rewrite_fields(&rw, fields.p, fields.p + fields.len,
+                          &proxy->fetch_rules) == FAILURE
+        || rewrite_append(&rw, conditions, conditions_len) == FAILURE
+        || rewrite_append(&rw, added, added_len) == FAILURE
+        || rewrite_append(&rw, "\r\n", 2) == FAILURE) {
+        if (verbose)
+            fputs("proxy_fetch(): too many fields to rewrite\n", stderr);
+        send_error(proxy, client_fd, INTERNAL_ERROR);
+        return FAILURE;
+    }
+
+    res = writev(proxy->server_fd, rw.iov, rw.iovcnt);
+    if (proxy_stale(proxy, true, res)) {
+        proxy_disconnect(proxy);
+        goto again;
+    }
+    if (res == FAILURE) {
+        if (verbose)
+            perror("proxy_fetch(): failed to send request");
+        send_error(proxy, client_fd, INTERNAL_ERROR);
+        return FAILURE;
+    }
+    stats_add(proxy->stats, STATS_REQUEST_BYTES, rw.len);
+    trace_mark(&proxy->trace, TRACE_SENT);
+
+    len = read_response(proxy, buf, sizeof buf);
+    if (proxy_stale(proxy, false, len)) {
+        proxy_disconnect(proxy);
+        goto again;
+    }
+    if (len <= 0) {
+        bool const timeout = len == FAILURE && timed_out();
+
+        if (verbose)
+            perror("proxy_fetch(): failed to receive response");
+        if (len == FAILURE)
+            proxy_report_response(proxy, 0);
+        send_error(proxy, client_fd, timeout ? TIMEOUT : BAD_GATEWAY);
+        return FAILURE;
+    }
+
+    if (proxy_handle_response(proxy, buf, len) == FAILURE)
+        return FAILURE;
+
+    return SERVED;
+}
+
+/*
+ * Fetch the target URI for the cache in a new child process, to fill the
+ * cache if fill is true or otherwise to revalidate a stale cached response.
+ * The caller keeps its own handle, which it must release (or follow) without
+ * aborting the work handed to the child.
+ * Returns FAILURE if the child could not be started.
+ */
+static int
+proxy_fetch_background(struct proxy *proxy, struct uri uri,
+                       struct cache_object *obj, bool fill)
+{
+    pid_t const parent = getpid();
+
+    int res;
+
+    if (!budget_charge(proxy->budget, proxy->connection_cost))
+        return FAILURE;
+
+    switch (fork()) {
+    case -1:
+        perror("proxy_fetch_background(): failed to fork a child process");
+        budget_release(proxy->budget, proxy->connection_cost);
+        return FAILURE;
+    case 0:
+        close(proxy->client_fd);
+        proxy->client_fd = FAILURE;
+        budget_adopt(proxy->budget, parent, proxy->connection_cost);
+        proxy->charged = proxy->connection_cost; // the parent keeps its own
+        proxy->admitted = false; // still counted by the parent
+        proxy->shape = SHAPE_PATH_NONE; // likewise
+        proxy->trace.sampled = false; // the parent traces the request
+        stats_fork(proxy->stats, proxy->cpu);
+        // The parent keeps its connection to the server.
+        if (proxy->server_fd != FAILURE)
+            close(proxy->server_fd);
+        proxy->server_fd = FAILURE;
+        proxy->server_reusable = false;
+        proxy->backend = BACKEND_REF_NONE;
+        cache_adopt(proxy->cache, obj);
+        if (fill)
+            proxy->fill = *obj;
+        else
+            proxy->revalidate = *obj;
+        res = proxy_fetch(proxy, uri);
+        proxy_cleanup(proxy);
+        exit(res == SERVED ? EXIT_SUCCESS : EXIT_FAILURE);
+    default:
+        return SUCCESS;
+    }
+}
+
+/*
+ * Look for the target of a GET request in the cache.
+ * Returns SERVED if the response was sent from the cache and FAILURE if that
+ * failed. Otherwise returns SUCCESS to go on and forward the request, in which
+ * case this process may have become the one filling the cache.
+ */
+static int
+proxy_try_cache(struct proxy *proxy, struct uri uri)
+{
+    char const * const fragment = memchr(uri.path_query_fragment.p, '#',
+                                         uri.path_query_fragment.len);
+
+    struct cache_object obj;
+    char key[CACHE_KEY_MAX];
+    int keylen, res = SUCCESS;
+
+    // The fragment is for the client only.
+    if (fragment != NULL)
+        uri.path_query_fragment.len = fragment - uri.path_query_fragment.p;
+
+    keylen = snprintf(key, sizeof key, "%.*s://%.*s:%.*s%.*s",
+                      (int)uri.scheme.len, uri.scheme.p,
+                      (int)uri.authority.host.len, uri.authority.host.p,
+                      (int)uri.authority.port.len, uri.authority.port.p,
+                      (int)uri.path_query_fragment.len,
+                      uri.path_query_fragment.p);
+    if (keylen < 0 || keylen >= sizeof key)
+        return SUCCESS;
+
+    switch (cache_lookup(proxy->cache, key, keylen, &obj)) {
+    case CACHE_MISS:
+        // Don't take on more of the cache while memory runs short.
+        if (budget_pressure(proxy->budget) >= BUDGET_SHRINK) {
+            cache_fill_abort(proxy->cache, &obj);
+            break;
+        }
+        // A range of the response is sent from the whole response, which is
+        // fetched in the background to be cached for the next request.
+        if (proxy->nranges > 0
+            && proxy_fetch_background(proxy, uri, &obj, true) != FAILURE) {
+            cache_follow(&obj);
+            res = proxy_send_cached(proxy, &obj);
+            cache_release(&obj);
+        }
+        else
+            proxy->fill = obj;
+        break;
+    case CACHE_HIT:
+        res = proxy_send_cached(proxy, &obj);
+        cache_release(&obj);
+        break;
+    case CACHE_STALE:
+        proxy->revalidate = obj;
+        res = proxy_fetch(proxy, uri);
+        break;
+    case CACHE_REFRESH:
+        res = proxy_send_cached(proxy, &obj);
+        if (res == SERVED
+            && proxy_fetch_background(proxy, uri, &obj, false) != FAILURE)
+            cache_release(&obj);
+        else
+            cache_revalidate_abort(proxy->cache, &obj);
+        break;
+    case CACHE_BYPASS:
+        break;
+    }
+
+    return res;
+}
+
 /*
  * Handle a request from the client.
- * Returns FAILURE if the request was invalid, otherwise SUCCESS.
+ * Returns FAILURE if the request was invalid, SERVED if the response was sent
+ * from the cache, UPGRADED if the client asked to switch to HTTP/2 and may,
+ * otherwise the length of the request content.
  */
 static ssize_t
 proxy_handle_request(struct proxy *proxy, char *buf, ssize_t len, size_t buflen)
@@ -569,17 +2626,24 @@ proxy_handle_request(struct proxy *proxy, char *buf, ssize_t len, size_t buflen)
     bool const verbose = proxy->verbose;
     int const client_fd = proxy->client_fd;
 
-    struct timeval const timeout = { 5, 0 };
     char const * const end = buf + len;
 
     ssize_t content_length = 0;
     struct http_request_line reqline = parse_http_request_line(buf, len,verbose);
-    struct http_header_field proxyconn = { .valid = false };
-    char htmp, ptmp, *p = buf;
+    struct iostring host = { .len = 0 };
+    bool cacheable = true, keep_alive = false, expect_continue = false;
+    bool h2c = false, spooling;
+    char *p = buf, *head_end;
     size_t n = len, more = 0;
+    int spool = FAILURE;
+    ssize_t res;
     struct uri uri;
-    struct iostring host, port;
-    int fd;
+
+    proxy->nranges = 0;
+    proxy->if_range.len = 0;
+    proxy->expect_body = 0;
+    proxy->shape.pool = FAILURE;
+    proxy->http2_settings.p = NULL;
 
     if (verbose)
         debug_http_request_line(reqline);
@@ -587,7 +2651,7 @@ proxy_handle_request(struct proxy *proxy, char *buf, ssize_t len, size_t buflen)
     if (!reqline.valid) {
         if(verbose)
             fputs("malformed request (invalid request line)\n", stderr);
-        send_error(client_fd, BAD_REQUEST);
+        send_error(proxy, client_fd, BAD_REQUEST);
         return FAILURE;
     }
 
@@ -606,36 +2670,84 @@ proxy_handle_request(struct proxy *proxy, char *buf, ssize_t len, size_t buflen)
         if (verbose)
             debug_http_header_field(field);
 
-        if (strncasecmp("Proxy-Connection",
-                        field.field_name.p, field.field_name.len) == SUCCESS)
-            proxyconn = field;
-        else if (strncasecmp("Content-Length",
-                             field.field_name.p, field.field_name.len) == SUCCESS)
+        if (http_header_field_is(field, "Connection")
+            || http_header_field_is(field, "Proxy-Connection"))
+            keep_alive = keep_alive
+                || http_list_has(field.field_value, keep_alive_token);
+        else if (http_header_field_is(field, "Host"))
+            host = field.field_value;
+        else if (http_header_field_is(field, "Content-Length"))
             content_length = strtoll(field.field_value.p, NULL, 10);
+        else if (http_header_field_is(field, "Expect"))
+            expect_continue = http_list_has(field.field_value, continue_token);
+        else if (http_header_field_is(field, "Range")) {
+            // An invalid Range header field is ignored.
+            proxy->nranges = parse_http_range(field.field_value, proxy->ranges,
+                                              HTTP_RANGES_MAX);
+            if (proxy->nranges == FAILURE)
+                proxy->nranges = 0;
+        }
+        else if (http_header_field_is(field, "If-Range"))
+            proxy->if_range = field.field_value;
+        else if (http_header_field_is(field, "Upgrade"))
+            h2c = http_list_has(field.field_value, h2c_token);
+        else if (http_header_field_is(field, "HTTP2-Settings"))
+            proxy->http2_settings = field.field_value;
+        else if (http_header_field_is(field, "Authorization")
+                 || http_header_field_is(field, "Cache-Control")
+                 || http_header_field_is(field, "Pragma")
+                 || http_header_field_is(field, "If-None-Match")
+                 || http_header_field_is(field, "If-Modified-Since"))
+            // Only plain requests share responses from the cache.
+            cacheable = false;
     }
 
+    // HTTP/1.1 connections are kept open unless the client says otherwise.
+    proxy->client_keep_alive = keep_alive
+        && reqline.http_version.len == 8
+        && strncmp(reqline.http_version.p, "HTTP/1.0", 8) == SUCCESS;
+
     // Skip over CRLF.
+    head_end = p;
     n -= 2;
     p += 2;
+    proxy->request_fields = (struct iostring){
+        .p = reqline.end,
+        .len = head_end - reqline.end,
+    };
 
     if (p > end) {
         if (verbose)
             fputs("malformed request (too short)\n", stderr);
-        send_error(client_fd, BAD_REQUEST);
+        send_error(proxy, client_fd, BAD_REQUEST);
         return FAILURE;
     }
 
     if (content_length < n) {
         if (verbose)
             fputs("malformed request (extra data)\n", stderr);
-        send_error(client_fd, BAD_REQUEST);
+        send_error(proxy, client_fd, BAD_REQUEST);
         return FAILURE;
     }
 
     // n is the amount of the body already in the buffer.
     more = content_length - n;
 
-    uri = parse_uri(reqline.request_target.p, reqline.request_target.len);
+    // The request goes on as the first stream once the connection switches.
+    // Only requests without a body are taken up on it, and never over TLS,
+    // which agrees on HTTP/2 in the handshake instead.
+    if (h2c && proxy->http2 && !proxy->stream && proxy->tls == NULL
+        && proxy->http2_settings.p != NULL && content_length == 0
+        && reqline.http_version.len == 8
+        && strncmp(reqline.http_version.p, "HTTP/1.1", 8) == SUCCESS)
+        return UPGRADED;
+
+    // A reverse proxy gets requests in origin-form.
+    if (proxy->router != NULL && reqline.request_target.p[0] == '/')
+        uri = parse_origin_form(reqline.request_target.p,
+                                reqline.request_target.len, host);
+    else
+        uri = parse_uri(reqline.request_target.p, reqline.request_target.len);
 
     if (verbose)
         debug_uri(uri);
@@ -643,58 +2755,214 @@ proxy_handle_request(struct proxy *proxy, char *buf, ssize_t len, size_t buflen)
     if (!uri.valid) {
         if (verbose)
             fputs("malformed request (invalid URI)\n", stderr);
-        send_error(client_fd, BAD_REQUEST);
+        send_error(proxy, client_fd, BAD_REQUEST);
         return FAILURE;
     }
 
-    host = uri.authority.host;
-    port = uri.authority.port;
+    trace_name(&proxy->trace, reqline.method, reqline.request_target);
+    trace_mark(&proxy->trace, TRACE_PARSED);
 
-    // Temporarily nul-terminate the host and port strings.
-    htmp = host.p[host.len];
-    host.p[host.len] = '\0';
-    ptmp = port.p[port.len];
-    if (ptmp != '\0') // The default port is already terminated (and const).
-        port.p[port.len] = '\0';
+    if (proxy->cache != NULL && cacheable && content_length == 0
+        && reqline.method.len == 3
+        && strncmp(reqline.method.p, "GET", 3) == SUCCESS) {
+        switch (proxy_try_cache(proxy, uri)) {
+        case SERVED:
+            return SERVED;
+        case FAILURE:
+            return FAILURE;
+        default:
+            break;
+        }
+    }
 
-    fd = connect_server(host.p, port.p);
-    if (fd == FAILURE) {
+    // HTTP/1.0 clients do not wait to be told to go on with the body.
+    if (reqline.http_version.len == 8
+        && strncmp(reqline.http_version.p, "HTTP/1.0", 8) == SUCCESS)
+        expect_continue = false;
+
+    // Spooling is the first thing to go when memory runs short.
+    spooling = more > 0 && more <= proxy->buffer_requests
+        && budget_pressure(proxy->budget) < BUDGET_THROTTLE
+        && budget_charge(proxy->budget, more);
+
+    // Hold the body back until the server accepts it, unless it is spooled,
+    // in which case the proxy accepts it in the server's place.
+    if (expect_continue && more > 0 && !spooling)
+        proxy->expect_body = more;
+    else if (expect_continue && more > 0
+             && write(client_fd, continue_response,
+                      sizeof continue_response - 1) == FAILURE) {
         if (verbose)
-            fputs("proxy_handle_request(): failed to connect to server\n",
-                  stderr);
-        send_error(client_fd, INTERNAL_ERROR);
+            perror("failed to send 100 (Continue)");
+        if (spooling)
+            budget_release(proxy->budget, more);
         return FAILURE;
     }
 
-    proxy->server_fd = fd;
+    // Take the whole body from the client before tying up a server with it.
+    if (spooling) {
+        spool = transfer_spool(proxy->transfer, client_fd, more);
+        if (spool < 0) {
+            budget_release(proxy->budget, more);
+            if (verbose)
+                perror("failed to spool request body");
+            if (spool != RX_SHORT)
+                send_error(proxy, client_fd,
+                           timed_out() ? REQUEST_TIMEOUT : INTERNAL_ERROR);
+            return FAILURE;
+        }
+    }
 
-    if (setsockopt(proxy->server_fd, SOL_SOCKET, SO_RCVTIMEO,
-                   &timeout, sizeof (struct timeval)) == FAILURE) {
-        if (verbose)
-            fputs("proxy_handle_request(): failed to set receive timeout\n",
-                  stderr);
+    if (proxy_connect(proxy, uri) == FAILURE) {
+        if (spool >= 0) {
+            close(spool);
+            budget_release(proxy->budget, more);
+        }
+        return FAILURE;
     }
 
-    // Restore original values.
-    host.p[host.len] = htmp;
-    if (ptmp != '\0')
-        port.p[port.len] = ptmp;
+    proxy->replay = (struct replay){
+        .valid = content_length == 0 && is_idempotent(reqline.method),
+        .reqln = reqline,
+        .uri = uri,
+        .head_end = head_end,
+        .len = len,
+    };
 
-    if (proxy_send_request(proxy,
-                           reqline,
-                           uri,
-                           proxyconn,
-                           len,
-                           more) == FAILURE) {
+    res = proxy_send_request(proxy, reqline, uri, head_end, len, more, spool);
+    if (spool >= 0) {
+        close(spool);
+        budget_release(proxy->budget, more);
+    }
+    if (proxy_stale(proxy, true, res))
+        return proxy_resend(proxy) == FAILURE ? FAILURE : content_length;
+    if (res == FAILURE) {
         if (verbose)
             perror("failed to send request");
-        send_error(client_fd, INTERNAL_ERROR);
+        send_error(proxy, client_fd, INTERNAL_ERROR);
         return FAILURE;
     }
+    trace_mark(&proxy->trace, TRACE_SENT);
 
     return content_length;
 }
 
+/*
+ * Wait for another request on a kept-alive client connection.
+ * Returns false if the keep-alive timeout expires first, or if the master has
+ * handed over to an upgraded proxy and the workers are draining.
+ */
+static bool
+await_request(struct proxy *proxy)
+{
+    struct pollfd fds[] = {
+        { .fd = proxy->client_fd, .events = POLLIN },
+        { .fd = proxy->drain[0], .events = POLLIN }, // hangs up to drain
+    };
+
+    int res;
+
+    do
+        res = poll(fds, 2, proxy->timeouts.keep_alive);
+    while (res == FAILURE && errno == EINTR);
+
+    // Let the read fail if polling did.
+    return res == FAILURE || fds[0].revents != 0;
+}
+
+static int proxy_main(struct proxy *proxy);
+
+/*
+ * Start a worker for the streams of an HTTP/2 connection: a child process
+ * proxying HTTP/1.1 on one end of a socket pair, as it would for a connection
+ * of its own.
+ * Returns the other end of the socket pair, or FAILURE.
+ */
+static int
+spawn_stream_worker(void *ctx, struct h2_session *session)
+{
+    struct proxy * const proxy = ctx;
+    pid_t const parent = getpid();
+
+    int fds[2];
+
+    if (budget_pressure(proxy->budget) == BUDGET_SHED
+        || !budget_charge(proxy->budget, proxy->connection_cost))
+        return FAILURE;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == FAILURE) {
+        perror("spawn_stream_worker(): failed to create socket pair");
+        budget_release(proxy->budget, proxy->connection_cost);
+        return FAILURE;
+    }
+
+    switch (fork()) {
+    case -1:
+        perror("spawn_stream_worker(): failed to fork a child process");
+        budget_release(proxy->budget, proxy->connection_cost);
+        close(fds[0]);
+        close(fds[1]);
+        return FAILURE;
+    case 0:
+        h2_abandon(session);
+        close(fds[0]);
+        proxy->client_fd = fds[1];
+        proxy->stream = true;
+        budget_adopt(proxy->budget, parent, proxy->connection_cost);
+        proxy->charged = proxy->connection_cost; // the parent keeps its own
+        proxy->admitted = false; // still counted by the parent
+        proxy->shape = SHAPE_PATH_NONE;
+        if (proxy->shaper != NULL) {
+            shape_connection(proxy, fds[1]);
+            transfer_shape(proxy->transfer, proxy->shaper, fds[1],
+                           &proxy->shape);
+        }
+        stats_fork(proxy->stats, proxy->cpu);
+        set_timeout(fds[1], SO_SNDTIMEO, proxy->timeouts.idle);
+        if (proxy->tracer != NULL)
+            proxy->accepted = trace_now();
+        exit(proxy_main(proxy));
+    default:
+        close(fds[1]);
+        return fds[0];
+    }
+}
+
+/*
+ * Serve the client connection as HTTP/2, having read len bytes of it into buf
+ * or, for an upgrade, the head of the request that asked for it.
+ */
+static int
+proxy_serve_http2(struct proxy *proxy, char const *buf, size_t len,
+                  bool upgrade)
+{
+    struct h2_server const server = {
+        .spawn = spawn_stream_worker,
+        .ctx = proxy,
+        .drain_fd = proxy->drain[0],
+        .idle_timeout = proxy->timeouts.keep_alive,
+        .stall_timeout = proxy->timeouts.idle,
+        .max_streams = proxy->http2_streams,
+        .absolute = proxy->router == NULL,
+        .verbose = proxy->verbose,
+    };
+    struct iostring const head = { (char *)buf, len };
+    struct iostring const none = { .len = 0 };
+
+    if (upgrade
+        && write(proxy->client_fd, switching_response,
+                 sizeof switching_response - 1) == FAILURE) {
+        if (proxy->verbose)
+            perror("failed to send 101 (Switching Protocols)");
+        return FAILURE;
+    }
+
+    return h2_serve(&server, proxy->client_fd,
+                    upgrade ? NULL : buf, upgrade ? 0 : len,
+                    upgrade ? head : none,
+                    upgrade ? proxy->http2_settings : none);
+}
+
 static int
 proxy_main(struct proxy *proxy)
 {
@@ -704,23 +2972,52 @@ proxy_main(struct proxy *proxy)
 
     int res = EXIT_SUCCESS;
     char buf[RECV_BUFLEN];
-    ssize_t len;
+    uint64_t start;
+    ssize_t len, head_len;
 
     if (verbose)
         fprintf(stderr, "proxying HTTP for client %s:%d\n",
                 inet_ntoa(client_addr.sin_addr),
                 ntohs(client_addr.sin_port));
 
-    for (;;) {
+    for (bool first = true; ; first = false) {
 
         //
         // Read a request from the client.
+        // Waiting for the first one is the header timeout, and for any more
+        // the keep-alive timeout. The body gets the idle timeout.
         //
+        // Draining workers only finish requests already on their way.
+        if (proxy->reniced) {
+            if (verbose)
+                fputs("closing connection after a bulk transfer\n", stderr);
+            break;
+        }
+        if (!first && !await_request(proxy)) {
+            if (verbose)
+                fputs("closing idle connection\n", stderr);
+            break;
+        }
+        // A kept-alive connection is not traced while it is idle.
+        start = proxy->tracer == NULL ? 0 : first ? proxy->accepted : trace_now();
+        set_timeout(client_fd, SO_RCVTIMEO,
+                    first ? proxy->timeouts.header : proxy->timeouts.keep_alive);
         len = read(client_fd, buf, sizeof buf);
+        if (len == FAILURE && timed_out()) {
+            if (verbose)
+                fputs(first ? "timed out waiting for a request\n"
+                            : "closing idle connection\n", stderr);
+            // An idle connection is just closed, as the client expects.
+            if (first) {
+                send_error(proxy, client_fd, REQUEST_TIMEOUT);
+                res = EXIT_FAILURE;
+            }
+            break;
+        }
         if (len == FAILURE) {
             if (verbose)
                 perror("failed to receive request");
-            send_error(client_fd, INTERNAL_ERROR);
+            send_error(proxy, client_fd, INTERNAL_ERROR);
             res = EXIT_FAILURE;
             break;
         }
@@ -732,10 +3029,51 @@ proxy_main(struct proxy *proxy)
             break;
         }
 
+        // An HTTP/2 client starts with its preface rather than a request.
+        // Each of its requests is counted by the worker for its stream.
+        if (first && proxy->http2 && !proxy->stream
+            && memcmp(buf, H2_PREFACE,
+                      len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN) == SUCCESS) {
+            if (proxy_serve_http2(proxy, buf, len, false) == FAILURE)
+                res = EXIT_FAILURE;
+            break;
+        }
+
+        set_timeout(client_fd, SO_RCVTIMEO, proxy->timeouts.idle);
+        stats_add(proxy->stats, STATS_REQUESTS, 1);
+
+        if (proxy->limiter != NULL
+            && !limiter_request(proxy->limiter, client_addr.sin_addr)) {
+            send_error(proxy, client_fd, TOO_MANY_REQUESTS);
+            break;
+        }
+
+        // Closing the connection gives back what it is charged.
+        if (budget_pressure(proxy->budget) == BUDGET_SHED) {
+            send_error(proxy, client_fd, SERVICE_UNAVAILABLE);
+            break;
+        }
+
+        trace_begin(proxy->tracer, &proxy->trace, start);
+
         //
         // Transform the request and send it to the server.
         //
+        head_len = len;
         len = proxy_handle_request(proxy, buf, len, sizeof buf);
+        if (len == UPGRADED) {
+            if (verbose)
+                fputs("switching to HTTP/2\n", stderr);
+            trace_end(proxy->tracer, &proxy->trace);
+            if (proxy_serve_http2(proxy, buf, head_len, true) == FAILURE)
+                res = EXIT_FAILURE;
+            break;
+        }
+        if (len == SERVED) {
+            trace_mark(&proxy->trace, TRACE_DONE);
+            trace_end(proxy->tracer, &proxy->trace);
+            continue;
+        }
         if (len == FAILURE) {
             if (verbose)
                 fputs("failed to handle request\n", stderr);
@@ -746,10 +3084,20 @@ proxy_main(struct proxy *proxy)
         //
         // Read a response from the server.
         //
-        len = read(proxy->server_fd, buf, sizeof buf);
+        len = read_response(proxy, buf, sizeof buf);
+        if (proxy_stale(proxy, false, len)) {
+            if (proxy_resend(proxy) == FAILURE) {
+                res = EXIT_FAILURE;
+                break;
+            }
+            len = read_response(proxy, buf, sizeof buf);
+        }
         if (len == FAILURE) {
             if (verbose)
                 perror("failed to receive response");
+            proxy_report_response(proxy, 0);
+            if (timed_out())
+                send_error(proxy, client_fd, TIMEOUT);
             // TODO: Add 500 Internal Error
             res = EXIT_FAILURE;
             break;
@@ -772,53 +3120,239 @@ proxy_main(struct proxy *proxy)
             break;
         }
 
+        trace_mark(&proxy->trace, TRACE_DONE);
+        trace_end(proxy->tracer, &proxy->trace);
+
+        // The server refused the body, which the client may be sending anyway.
+        if (proxy->expect_body > 0) {
+            if (verbose)
+                fputs("closing connection after a refused body\n", stderr);
+            break;
+        }
     }
 
+    // Failed requests are traced as far as they got.
+    trace_end(proxy->tracer, &proxy->trace);
+
     proxy_cleanup(proxy);
 
     return res;
 }
 
+/*
+ * Give exiting workers a moment to free the file descriptors or memory that
+ * a new connection needs, rather than spinning on the still pending one.
+ */
+static void
+accept_backoff(void)
+{
+    poll(NULL, 0, ACCEPT_BACKOFF_MS);
+}
+
+/*
+ * Try to bury any dead children, but do not block waiting for them to die.
+ * A child killed by a signal did not give back what it charged to the budget,
+ * nor count its connections as closed to the limiter, the shaper and the
+ * router.
+ * Returns whether any child was killed.
+ */
+static bool
+ward_off_zombies(struct proxy *proxy)
+{
+    bool const verbose = proxy->verbose;
+
+    int status = 0;
+    bool killed = false;
+
+    while (waitpid(0, &status, WNOHANG) > 0) {
+        if (WIFSIGNALED(status)) {
+            killed = true;
+            // TODO: More error checks!
+            switch (WTERMSIG(status)) {
+            case SIGSEGV:
+                fputs("child segfaulted\n", stderr);
+                break;
+            default:
+                fputs("child terminated\n", stderr);
+                break;
+            }
+        }
+        else if (WIFEXITED(status)
+                 && WEXITSTATUS(status) == EXIT_FAILURE
+                 && verbose) {
+            fputs("child exited with error\n", stderr);
+        }
+    }
+
+    if (killed) {
+        budget_reclaim(proxy->budget);
+        if (proxy->limiter != NULL)
+            limiter_reclaim(proxy->limiter);
+        if (proxy->shaper != NULL)
+            shaper_reclaim(proxy->shaper);
+        if (proxy->router != NULL)
+            router_reclaim(proxy->router);
+    }
+
+    return killed;
+}
+
 /*
  * Accept a connection and fork a new child.
+ * Returns DRAINED if no connection is waiting, or none can be served for now.
  */
 static int
 proxy_accept(struct proxy *proxy)
 {
     bool const verbose = proxy->verbose;
     int const listen_fd = proxy->listen_fd;
-
-    struct timeval const timeout = { 5, 0 };
+    pid_t const parent = getpid();
 
     int fd, res;
     socklen_t socklen = sizeof (struct sockaddr_in);
 
+#ifdef __linux__
+    // The listening socket is non-blocking, but the connection must not be.
+    fd = accept4(listen_fd,
+                 (struct sockaddr *)&proxy->client_addr,
+                 &socklen, SOCK_CLOEXEC);
+#else
     fd = accept(listen_fd,
                 (struct sockaddr *)&proxy->client_addr,
                 &socklen);
-    assert(socklen == sizeof (struct sockaddr_in));
+    if (fd != FAILURE)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+#endif
     if (fd == FAILURE) {
-        perror("proxy_accept(): failed to accept a connection");
-        return FAILURE;
+        switch (errno) {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        case EINTR:
+        case ECONNABORTED: // the client gave up while queued
+#ifdef __linux__
+        // Network errors already pending on the new connection.
+        case ENETDOWN:
+        case EPROTO:
+        case ENOPROTOOPT:
+        case EHOSTDOWN:
+        case ENONET:
+        case EHOSTUNREACH:
+        case EOPNOTSUPP:
+        case ENETUNREACH:
+#endif
+            return DRAINED;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            // Transient: the connection waits in the backlog meanwhile.
+            perror("proxy_accept(): failed to accept a connection");
+            accept_backoff();
+            return DRAINED;
+        default:
+            perror("proxy_accept(): failed to accept a connection");
+            return FAILURE;
+        }
     }
+    assert(socklen == sizeof (struct sockaddr_in));
+
+    if (proxy->tracer != NULL)
+        proxy->accepted = trace_now();
 
     if (verbose)
         fputs("accepted a connection\n", stderr);
 
+    // A worker killed since the last look may still count as a connection.
+    if (proxy->limiter != NULL
+        && !limiter_connect(proxy->limiter, proxy->client_addr.sin_addr)
+        && !(ward_off_zombies(proxy)
+             && limiter_connect(proxy->limiter,
+                                proxy->client_addr.sin_addr))) {
+        // Not worth a handshake when the client is speaking TLS.
+        if (proxy->tls == NULL)
+            send_error(proxy, fd, TOO_MANY_REQUESTS);
+        close(fd);
+        return SUCCESS;
+    }
+
+    // The workers' own children are not buried by the master, so what any of
+    // them were killed holding is only found by looking.
+    if (budget_pressure(proxy->budget) == BUDGET_SHED
+        && time(NULL) != proxy->reclaimed) {
+        proxy->reclaimed = time(NULL);
+        budget_reclaim(proxy->budget);
+    }
+
+    if (budget_pressure(proxy->budget) == BUDGET_SHED
+        || !budget_charge(proxy->budget, proxy->connection_cost)) {
+        if (verbose)
+            fputs("proxy_accept(): out of memory budget\n", stderr);
+        if (proxy->limiter != NULL)
+            limiter_disconnect(proxy->limiter, proxy->client_addr.sin_addr);
+        if (proxy->tls == NULL)
+            send_error(proxy, fd, SERVICE_UNAVAILABLE);
+        close(fd);
+        return SUCCESS;
+    }
+
     switch (fork()) {
     case -1:
         perror("proxy_accept(): failed to fork a child process");
+        if (proxy->limiter != NULL)
+            limiter_disconnect(proxy->limiter, proxy->client_addr.sin_addr);
+        budget_release(proxy->budget, proxy->connection_cost);
+        if (proxy->tls == NULL)
+            send_error(proxy, fd, SERVICE_UNAVAILABLE);
         close(fd);
-        return FAILURE;
+        // Out of processes or memory for now, not for good.
+        accept_backoff();
+        return DRAINED;
     case 0:
         close(listen_fd);
-        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
-                       &timeout, sizeof (struct timeval)) == FAILURE) {
-            if (verbose)
-                fputs("proxy_accept(): failed to set receive timeout\n",
-                      stderr);
+        if (proxy->poll_fd != FAILURE)
+            close(proxy->poll_fd);
+        close(proxy->drain[1]);
+        proxy->drain[1] = FAILURE;
+        // Before the worker touches any memory of its own. Loopback packets
+        // are handled on whatever CPU sent them, so they do not say where to.
+        if (proxy->cpu_affinity
+            && ntohl(proxy->client_addr.sin_addr.s_addr) >> IN_CLASSA_NSHIFT
+               != IN_LOOPBACKNET)
+            proxy->cpu = pin_worker(fd, verbose);
+        tune_connection(fd, &proxy->tcp);
+        if (proxy->shaper != NULL)
+            shape_connection(proxy, fd);
+        proxy->admitted = proxy->limiter != NULL;
+        if (proxy->admitted)
+            limiter_adopt(proxy->limiter, parent, proxy->client_addr.sin_addr);
+        budget_adopt(proxy->budget, parent, proxy->connection_cost);
+        proxy->charged = proxy->connection_cost;
+        stats_fork(proxy->stats, proxy->cpu);
+        // Background cache refreshes are not waited for.
+        signal(SIGCHLD, SIG_IGN);
+        // Only the master upgrades and dumps traces.
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGUSR2, SIG_IGN);
+        // The TLS handshake is part of sending the first request.
+        proxy->timeouts.header = header_timeout(&proxy->timeouts, fd);
+        set_timeout(fd, SO_RCVTIMEO, proxy->timeouts.header);
+        set_timeout(fd, SO_SNDTIMEO, proxy->timeouts.idle);
+#ifdef WITH_TLS
+        if (proxy->tls != NULL) {
+            fd = tls_accept(proxy->tls, fd);
+            if (fd == FAILURE) {
+                proxy_cleanup(proxy);
+                exit(EXIT_FAILURE);
+            }
+            set_timeout(fd, SO_SNDTIMEO, proxy->timeouts.idle);
         }
+#endif
         proxy->client_fd = fd;
+        if (proxy->shaper != NULL)
+            transfer_shape(proxy->transfer, proxy->shaper, fd, &proxy->shape);
+        stats_add(proxy->stats, STATS_CONNECTIONS, 1);
         res = proxy_main(proxy);
         exit(res);
     default:
@@ -828,11 +3362,23 @@ proxy_accept(struct proxy *proxy)
 }
 
 /*
- * Wait for a connection, with timeout.
+ * Wait for connections, with timeout, and accept up to a batch of them.
  */
 static int
 proxy_select(struct proxy *proxy)
 {
+    int res;
+#ifdef __linux__
+    struct epoll_event event;
+
+    res = epoll_wait(proxy->poll_fd, &event, 1, 5000);
+    if (res == FAILURE) {
+        if (errno == EINTR)
+            return SUCCESS;
+        perror("proxy_select(): epoll_wait() failed");
+        return FAILURE;
+    }
+#else
     int const listen_fd = proxy->listen_fd;
 
     struct timeval timeout = { 5, 0 };
@@ -841,64 +3387,306 @@ proxy_select(struct proxy *proxy)
     FD_ZERO(&fds);
     FD_SET(listen_fd, &fds);
 
-    if (select(listen_fd + 1, &fds, NULL, NULL, &timeout) == FAILURE) {
+    res = select(listen_fd + 1, &fds, NULL, NULL, &timeout);
+    if (res == FAILURE) {
+        if (errno == EINTR)
+            return SUCCESS;
         perror("proxy_select(): select() failed");
         return FAILURE;
     }
+#endif
+
+    if (res == 0)
+        return SUCCESS; // timeout
+
+    // Drain the backlog, up to the batch size so that children still get
+    // buried during a long burst.
+    for (unsigned i = 0; i < proxy->accept_batch; ++i) {
+        res = proxy_accept(proxy);
+        if (res == DRAINED)
+            break;
+        if (res == FAILURE)
+            return FAILURE;
+    }
+
+    return SUCCESS;
+}
 
-    if (FD_ISSET(listen_fd, &fds))
-        return proxy_accept(proxy);
+static volatile sig_atomic_t upgrade_requested, dump_requested;
+
+static void
+request_upgrade(int sig)
+{
+    upgrade_requested = 1;
+}
 
-    return SUCCESS; // timeout
+static void
+request_dump(int sig)
+{
+    dump_requested = 1;
 }
 
 /*
- * Try to bury any dead children, but do not block waiting for them to die.
+ * Hand the listening socket and the cache over to a new proxy and stop
+ * accepting connections. Workers finish the requests they have and close
+ * kept-alive connections.
+ * Returns FAILURE if the new proxy failed to start, and this one carries on.
  */
-static void
-ward_off_zombies(bool verbose)
+static int
+proxy_upgrade(struct proxy *proxy, char * const argv[])
 {
-    int status = 0;
+    struct upgrade_fds const fds = {
+        .listen_fd = proxy->listen_fd,
+        .cache_fd = proxy->cache != NULL ? cache_fd(proxy->cache) : FAILURE,
+        .stats_fd = stats_fd(proxy->stats),
+    };
 
-    while (waitpid(0, &status, WNOHANG) > 0) {
-        if (WIFSIGNALED(status)) {
-            // TODO: More error checks!
-            switch (WTERMSIG(status)) {
-            case SIGSEGV:
-                fputs("child segfaulted\n", stderr);
-                break;
-            default:
-                fputs("child terminated\n", stderr);
-                break;
-            }
-        }
-        else if (WIFEXITED(status)
-                 && WEXITSTATUS(status) == EXIT_FAILURE
-                 && verbose) {
-            fputs("child exited with error\n", stderr);
-        }
-    }
+    pid_t pid;
+
+    upgrade_requested = 0;
+
+    pid = upgrade_start(argv, &fds, proxy->verbose);
+    if (pid == FAILURE)
+        return FAILURE;
+
+    if (proxy->verbose)
+        fprintf(stderr, "handed over to proxy %d\n", (int)pid);
+
+    close(proxy->listen_fd);
+    proxy->listen_fd = FAILURE;
+    if (proxy->poll_fd != FAILURE)
+        close(proxy->poll_fd);
+    proxy->poll_fd = FAILURE;
+    close(proxy->drain[1]);
+    proxy->drain[1] = FAILURE;
+
+    // The cache belongs to the new proxy now, though our workers still use it.
+    proxy->cache = NULL;
+    // Our workers count along with the new proxy's until they are done.
+    stats_disown(proxy->stats);
+
+    return SUCCESS;
 }
 
 /*
  * Public high-level interface to run a proxy.
  */
 void
-run_proxy(uint16_t port, bool verbose)
+run_proxy(struct proxy_config const *config)
 {
+    bool const verbose = config->verbose;
+    struct health_config const health_config = {
+        .eject_time = config->eject_time,
+        .eject_latency = config->eject_latency,
+        .probe_interval = config->health_interval,
+        .probe_path = config->health_path,
+    };
+
     struct proxy proxy;
+    struct upgrade_fds handed;
+    struct sigaction sa;
+    pid_t prober = 0;
+    int upgrade;
+
+    // Take over from the old proxy if this is an upgrade.
+    upgrade = upgrade_receive(&handed, verbose);
+
+    if (proxy_start(&proxy, config, handed.listen_fd) == FAILURE)
+        errx(EXIT_FAILURE, "fatal error");
+
+    if (handed.stats_fd != FAILURE)
+        proxy.stats = stats_attach(handed.stats_fd, config->port, verbose);
+    if (proxy.stats == NULL) {
+        proxy.stats = stats_create(config->port, verbose);
+        if (proxy.stats == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+    }
+
+    proxy.transfer = transfer_create(config->splice_min, config->sendfile_min,
+                                     proxy.stats, verbose);
+    if (proxy.transfer == NULL)
+        errx(EXIT_FAILURE, "fatal error");
+
+    if (config->cache_dir != NULL && handed.cache_fd != FAILURE)
+        proxy.cache = cache_attach(handed.cache_fd,
+                                   config->cache_dir,
+                                   config->cache_entries,
+                                   config->cache_max_object,
+                                   verbose);
+    else if (handed.cache_fd != FAILURE)
+        close(handed.cache_fd);
+
+    if (config->cache_dir != NULL && proxy.cache == NULL) {
+        proxy.cache = cache_create(config->cache_dir,
+                                   config->cache_entries,
+                                   config->cache_max_object,
+                                   verbose);
+        if (proxy.cache == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+    }
+
+    if (config->memory_budget > 0) {
+        proxy.budget = budget_create(config->memory_budget, proxy.stats,
+                                     verbose);
+        if (proxy.budget == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+        proxy.connection_cost = connection_cost(proxy.listen_fd, &proxy.tcp);
+        if (verbose)
+            fprintf(stderr, "charging %zu bytes for each connection\n",
+                    proxy.connection_cost);
+    }
 
-    if (proxy_start(&proxy, port, verbose) == FAILURE)
+    if (config->rate_limit > 0 || config->max_client_conns > 0) {
+        proxy.limiter = limiter_create(LIMIT_CLIENTS,
+                                       config->rate_limit,
+                                       config->rate_burst > 0
+                                           ? config->rate_burst
+                                           : config->rate_limit,
+                                       config->max_client_conns,
+                                       verbose);
+        if (proxy.limiter == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+    }
+
+#ifndef SO_INCOMING_CPU
+    if (config->cpu_affinity)
+        errx(EXIT_FAILURE, "CPU affinity is not supported on this system");
+#else
+    if (config->cpu_affinity && !incoming_cpus_vary()) {
+        fputs("packets are received on one CPU (one receive queue, no RPS), "
+              "workers are not pinned\n", stderr);
+        proxy.cpu_affinity = false;
+    }
+#endif
+
+    if (config->tls_cert != NULL) {
+#ifdef WITH_TLS
+        proxy.tls = tls_create(config->tls_cert,
+                               config->tls_key != NULL
+                                   ? config->tls_key : config->tls_cert,
+                               config->http2, verbose);
+        if (proxy.tls == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+#else
+        errx(EXIT_FAILURE, "built without TLS support");
+#endif
+    }
+
+#ifdef WITH_TLS
+    proxy.upstream_tls = tls_create_client(config->upstream_ca, verbose);
+    if (proxy.upstream_tls == NULL)
         errx(EXIT_FAILURE, "fatal error");
+#endif
+
+    if (config->routes_file != NULL) {
+        proxy.router = router_create(config->routes_file, verbose);
+        if (proxy.router == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+
+        proxy.health = health_create(HEALTH_ADDRS, &health_config, verbose);
+        if (proxy.health == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+
+        for (struct backend_ref ref = router_next_backend(proxy.router,
+                                                          BACKEND_REF_NONE);
+             ref.backend != FAILURE;
+             ref = router_next_backend(proxy.router, ref))
+            health_register(proxy.health,
+                            router_backend_host(proxy.router, ref),
+                            router_backend_port(proxy.router, ref));
+
+        prober = health_start_prober(proxy.health);
+    }
 
-    while (proxy_select(&proxy) == SUCCESS)
-        ward_off_zombies(verbose);
+    if (config->bandwidth > 0 || config->client_bandwidth > 0
+        || shaped_pools(proxy.router)) {
+        size_t const npools =
+            proxy.router != NULL ? router_pools(proxy.router) : 0;
+
+        proxy.shaper = shaper_create(LIMIT_CLIENTS, npools,
+                                     config->bandwidth,
+                                     config->client_bandwidth,
+                                     proxy.stats, verbose);
+        if (proxy.shaper == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+        for (size_t i = 0; i < npools; ++i)
+            shaper_pool(proxy.shaper, i, router_pool_name(proxy.router, i),
+                        router_pool_bandwidth(proxy.router, i));
+    }
+
+    if (config->trace_file != NULL) {
+        proxy.tracer = tracer_create(config->trace_entries,
+                                     config->trace_sample, verbose);
+        if (proxy.tracer == NULL)
+            errx(EXIT_FAILURE, "fatal error");
+    }
+
+    // Write errors are handled where they happen.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers drain when the write end is closed. Without it, they just close
+    // idle connections when the keep-alive timeout expires.
+    if (pipe(proxy.drain) == FAILURE) {
+        perror("run_proxy(): failed to create drain pipe");
+        proxy.drain[0] = proxy.drain[1] = FAILURE;
+    }
+    else
+        for (int i = 0; i < 2; ++i)
+            fcntl(proxy.drain[i], F_SETFD, FD_CLOEXEC);
+
+    // Not restarted, so that waiting for connections is interrupted.
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = request_upgrade;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+    if (proxy.tracer != NULL) {
+        sa.sa_handler = request_dump;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+
+    // An old proxy that gave up waiting for this one is still serving.
+    if (upgrade == FAILURE || upgrade_ready(upgrade) == SUCCESS)
+        while (proxy_select(&proxy) == SUCCESS) {
+            ward_off_zombies(&proxy);
+            if (dump_requested) {
+                dump_requested = 0;
+                tracer_dump(proxy.tracer, config->trace_file);
+            }
+            if (upgrade_requested
+                && proxy_upgrade(&proxy, config->argv) == SUCCESS)
+                break;
+        }
 
     if (verbose)
         fputs("waiting for children\n", stderr);
 
+    if (prober > 0)
+        kill(prober, SIGTERM);
+
     while (wait(NULL) != FAILURE)
         ;
 
     proxy_cleanup(&proxy);
+
+    transfer_destroy(proxy.transfer);
+    stats_destroy(proxy.stats);
+    if (proxy.cache != NULL)
+        cache_destroy(proxy.cache);
+    if (proxy.limiter != NULL)
+        limiter_destroy(proxy.limiter);
+    if (proxy.shaper != NULL)
+        shaper_destroy(proxy.shaper);
+    if (proxy.budget != NULL)
+        budget_destroy(proxy.budget);
+    if (proxy.router != NULL)
+        router_destroy(proxy.router);
+    if (proxy.health != NULL)
+        health_destroy(proxy.health);
+    if (proxy.tracer != NULL)
+        tracer_destroy(proxy.tracer);
+#ifdef WITH_TLS
+    if (proxy.tls != NULL)
+        tls_destroy(proxy.tls);
+    tls_destroy(proxy.upstream_tls);
+#endif
 }
@@ -31,11 +31,132 @@
 #define _proxy_h_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "rewrite.h"
+
+/*
+ * Settings chosen on the command line.
+ */
+struct proxy_config {
+    uint16_t port;
+    bool verbose;
+
+    // The command line, run again to upgrade the proxy.
+    char * const *argv;
+
+    // Response cache, disabled when cache_dir is NULL.
+    char const *cache_dir;
+    size_t cache_entries;
+    size_t cache_max_object;
+
+    // Per-client admission limits, disabled when 0.
+    double rate_limit; // requests per second
+    double rate_burst; // requests allowed at once, rate_limit if 0
+    unsigned max_client_conns;
+
+    // Bandwidth in bytes per second for responses, unshaped when 0.
+    // Pools are given theirs in the routes file.
+    size_t bandwidth; // for all the clients together
+    size_t client_bandwidth; // for each client
+
+    // Reverse proxy routes, disabled when routes_file is NULL.
+    char const *routes_file;
+
+    // Backend health checks, for reverse proxies.
+    unsigned health_interval; // seconds between probes, 0 for none
+    char const *health_path; // to probe with HTTP, or NULL for TCP only
+    unsigned eject_time; // seconds a failing backend is first ejected for
+    unsigned eject_latency; // milliseconds of average latency, 0 for no limit
+
+    // TLS termination, disabled when tls_cert is NULL.
+    char const *tls_cert; // PEM certificate chain
+    char const *tls_key;  // PEM private key, or NULL if it is in tls_cert
+
+    // Extra certificate authorities trusted for https servers, or NULL.
+    char const *upstream_ca;
+
+    // Header rewriting. Hop-by-hop fields are always removed.
+    struct rewrite_rules request_rules, response_rules;
+    char const *via; // name of this proxy in Via fields, or NULL for none
+    bool forwarded_for; // tell servers the client address in X-Forwarded-For
+    bool x_cache; // tell clients whether a response came from the cache
+
+    // Request tracing, disabled when trace_file is NULL.
+    char const *trace_file; // dumped to on SIGUSR1
+    size_t trace_entries; // traces kept
+    unsigned trace_sample; // one in this many requests is traced
+
+    // Bodies of at most this many bytes are spooled before they are sent on,
+    // so a slow client does not hold up a server, 0 for none.
+    size_t buffer_requests; // before connecting to the server
+    size_t buffer_responses; // before sending the response to the client
+
+    // Buffers of at least this many bytes are sent with MSG_ZEROCOPY, 0 never.
+    size_t zerocopy_min;
+
+    // Timeouts for each phase of a request, in milliseconds.
+    unsigned header_timeout; // for the first request on a connection
+    unsigned keep_alive_timeout; // for each request after that
+    unsigned connect_timeout; // for a connection to a server, TLS included
+    unsigned first_byte_timeout; // for the server to start responding
+    unsigned idle_timeout; // for each read or write of a body
+    unsigned continue_timeout; // for a server to accept a request body
+
+    // TCP tuning.
+    int listen_backlog;
+    unsigned accept_batch; // most connections accepted at once
+    unsigned defer_accept; // seconds to wait for a request to accept, 0 never
+    unsigned fastopen; // pending TCP fast opens allowed from clients, 0 none
+    bool fastopen_connect; // to servers, hiding failed connects until a write
+    bool nodelay; // disable Nagle's algorithm
+    bool quickack; // don't delay the first ACKs of a connection
+    int rcvbuf, sndbuf; // socket buffer sizes, 0 for the kernel's own
+
+    // Run each worker on the CPU its connection's packets arrive on.
+    bool cpu_affinity;
+
+    // Transfers of at least this many bytes give way to shorter ones, 0 never.
+    size_t bulk_size;
+
+    // Bytes of buffers held for connections at once, unlimited when 0.
+    size_t memory_budget;
+
+    // HTTP/2 for clients, with prior knowledge, by upgrade or through ALPN.
+    bool http2;
+    unsigned http2_streams; // concurrent streams allowed on a connection
+
+    // Transfers of at least this many bytes are spliced, or sent from files
+    // with sendfile(2), rather than copied. Calibrated at startup when 0.
+    size_t splice_min;
+    size_t sendfile_min;
+};
+
+#define PROXY_CONFIG_DEFAULTS {                 \
+        .cache_entries = 4096,                  \
+        .cache_max_object = 64 * 1024 * 1024,   \
+        .eject_time = 10,                       \
+        .trace_entries = 4096,                  \
+        .trace_sample = 1,                      \
+        .header_timeout = 5000,                 \
+        .keep_alive_timeout = 5000,             \
+        .connect_timeout = 3000,                \
+        .first_byte_timeout = 5000,             \
+        .idle_timeout = 5000,                   \
+        .continue_timeout = 1000,               \
+        .listen_backlog = 1024,                 \
+        .accept_batch = 64,                     \
+        .defer_accept = 1,                      \
+        .fastopen = 256,                        \
+        .nodelay = true,                        \
+        .quickack = true,                       \
+        .http2_streams = 256,                   \
+    }
+
 /*
- * Run a proxy listening on the given port.
+ * Run a proxy with the given configuration.
  */
-void run_proxy(uint16_t port, bool verbose);
+void run_proxy(struct proxy_config const *config);
 
 #endif // _proxy_h_
@@ -0,0 +1,257 @@
+/*
+ * rewrite.c
+ * Implementation of rewriting the header fields of messages passing through.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "rewrite.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define CONNECTION_FIELDS_MAX 8 // Connection fields honored in a message
+
+#define IOSTRING_LITERAL(s) { .p = s, .len = sizeof s - 1 }
+
+static struct iostring const hop_by_hop[] = {
+    IOSTRING_LITERAL("Connection"),
+    IOSTRING_LITERAL("Keep-Alive"),
+    IOSTRING_LITERAL("Proxy-Authenticate"),
+    IOSTRING_LITERAL("Proxy-Authorization"),
+    IOSTRING_LITERAL("Proxy-Connection"),
+    IOSTRING_LITERAL("TE"),
+    IOSTRING_LITERAL("Upgrade"),
+};
+
+/*
+ * Field names are tokens: no white space, separators or control characters.
+ */
+static bool
+valid_name(char const *name, size_t len)
+{
+    if (len == 0)
+        return false;
+
+    for (size_t i = 0; i < len; ++i)
+        if ((unsigned char)name[i] <= ' ' || (unsigned char)name[i] >= 127
+            || strchr("\"(),/:;<=>?@[\\]{}", name[i]) != NULL)
+            return false;
+
+    return true;
+}
+
+static bool
+same_name(struct iostring a, struct iostring b)
+{
+    return a.len == b.len && strncasecmp(a.p, b.p, a.len) == 0;
+}
+
+/*
+ * Check whether the field named name is left out of the rewritten message.
+ */
+static bool
+removed(struct iostring name,
+        struct iostring const *connection, size_t nconnection,
+        struct rewrite_rules const *rules)
+{
+    for (size_t i = 0; i < sizeof hop_by_hop / sizeof hop_by_hop[0]; ++i)
+        if (same_name(name, hop_by_hop[i]))
+            return true;
+
+    for (size_t i = 0; i < nconnection; ++i)
+        if (http_list_has(connection[i], name))
+            return true;
+
+    for (size_t i = 0; i < rules->nremove; ++i)
+        if (same_name(name, rules->remove[i]))
+            return true;
+
+    return false;
+}
+
+int
+rewrite_rule(struct rewrite_rules *rules, char const *rule)
+{
+    char const *colon, *value;
+    char *add;
+    size_t len;
+
+    // Fields must not sneak in more lines.
+    if (strpbrk(rule, "\r\n") != NULL)
+        return FAILURE;
+
+    if (rule[0] == '-') {
+        len = strlen(rule + 1);
+        if (!valid_name(rule + 1, len) || rules->nremove == REWRITE_RULES_MAX)
+            return FAILURE;
+        rules->remove[rules->nremove++] = (struct iostring){
+            .p = (char *)rule + 1,
+            .len = len,
+        };
+        return SUCCESS;
+    }
+
+    colon = strchr(rule, ':');
+    if (colon == NULL || !valid_name(rule, colon - rule))
+        return FAILURE;
+
+    // The proxy sends its own Connection field for each hop, and a second one
+    // would contradict it.
+    for (size_t i = 0; i < sizeof hop_by_hop / sizeof hop_by_hop[0]; ++i)
+        if (same_name((struct iostring){ .p = (char *)rule,
+                                         .len = colon - rule },
+                      hop_by_hop[i]))
+            return FAILURE;
+
+    value = colon + 1;
+    while (*value == ' ' || *value == '\t')
+        ++value;
+
+    // NAME: VALUE CRLF
+    len = (colon - rule) + 2 + strlen(value) + 2;
+    add = realloc(rules->add.p, rules->add.len + len + 1);
+    if (add == NULL) {
+        perror("rewrite_rule(): failed to allocate fields");
+        return FAILURE;
+    }
+    snprintf(add + rules->add.len, len + 1, "%.*s: %s\r\n",
+             (int)(colon - rule), rule, value);
+    rules->add.p = add;
+    rules->add.len += len;
+
+    return SUCCESS;
+}
+
+void
+rewrite_init(struct rewrite *rw)
+{
+    rw->iovcnt = 0;
+    rw->len = 0;
+    rw->head_iov = 0;
+    rw->head_off = 0;
+}
+
+int
+rewrite_append(struct rewrite *rw, void const *p, size_t len)
+{
+    if (len == 0)
+        return SUCCESS;
+
+    // Whatever directly follows the last piece extends it.
+    if (rw->iovcnt > 0
+        && (char const *)rw->iov[rw->iovcnt - 1].iov_base
+           + rw->iov[rw->iovcnt - 1].iov_len == p)
+        rw->iov[rw->iovcnt - 1].iov_len += len;
+    else if (rw->iovcnt < REWRITE_IOV_MAX)
+        rw->iov[rw->iovcnt++] = (struct iovec){
+            .iov_base = (void *)p,
+            .iov_len = len,
+        };
+    else
+        return FAILURE;
+
+    rw->len += len;
+
+    return SUCCESS;
+}
+
+int
+rewrite_fields(struct rewrite *rw, char *fields, char *end,
+               struct rewrite_rules const *rules)
+{
+    struct iostring connection[CONNECTION_FIELDS_MAX];
+    size_t nconnection = 0;
+    struct http_header_field field;
+
+    // The fields a Connection field lists may come before it.
+    for (char *p = fields; p < end; p = field.end) {
+        field = parse_http_header_field(p, end - p, false);
+        if (http_header_field_is(field, "Connection")
+            && nconnection < CONNECTION_FIELDS_MAX)
+            connection[nconnection++] = field.field_value;
+    }
+
+    // Anything that is not a valid field is passed on as it is.
+    for (char *p = fields; p < end; p = field.end) {
+        field = parse_http_header_field(p, end - p, false);
+        if ((!field.valid
+             || !removed(field.field_name, connection, nconnection, rules))
+            && rewrite_append(rw, p, field.end - p) == FAILURE)
+            return FAILURE;
+    }
+
+    return rewrite_append(rw, rules->add.p, rules->add.len);
+}
+
+int
+rewrite_finish(struct rewrite *rw, char *end, size_t len)
+{
+    struct iovec const *last = rw->iovcnt > 0 ? &rw->iov[rw->iovcnt - 1] : NULL;
+
+    if (last != NULL && (char *)last->iov_base + last->iov_len == end) {
+        rw->head_iov = rw->iovcnt - 1;
+        rw->head_off = last->iov_len;
+    }
+    else {
+        rw->head_iov = rw->iovcnt;
+        rw->head_off = 0;
+    }
+
+    return rewrite_append(rw, end, len);
+}
+
+ssize_t
+rewrite_write(struct rewrite const *rw, int fd,
+              struct iovec const *extra, int nextra)
+{
+    struct iovec iov[REWRITE_IOV_MAX + REWRITE_EXTRA_MAX + 1];
+    struct iovec const *split = &rw->iov[rw->head_iov];
+    int n = rw->head_iov;
+
+    if (nextra == 0)
+        return writev(fd, rw->iov, rw->iovcnt);
+
+    // Split the piece with the end of the header around the extra fields.
+    memcpy(iov, rw->iov, n * sizeof iov[0]);
+    if (rw->head_off > 0)
+        iov[n++] = (struct iovec){ split->iov_base, rw->head_off };
+    memcpy(&iov[n], extra, nextra * sizeof iov[0]);
+    n += nextra;
+    iov[n++] = (struct iovec){
+        (char *)split->iov_base + rw->head_off,
+        split->iov_len - rw->head_off
+    };
+    memcpy(&iov[n], split + 1,
+           (rw->iovcnt - rw->head_iov - 1) * sizeof iov[0]);
+    n += rw->iovcnt - rw->head_iov - 1;
+
+    return writev(fd, iov, n);
+}
@@ -0,0 +1,124 @@
+/*
+ * rewrite.h
+ * Interface to rewriting the header fields of messages passing through.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _rewrite_h_
+#define _rewrite_h_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "iostring.h"
+
+/*
+ * A message is rewritten without copying it. The rewritten message is a list
+ * of iovecs over the buffer it was received in, with gaps where fields are
+ * removed and inserts where fields are added, ready for writev(2).
+ *
+ * Hop-by-hop fields only concern the connection they arrived on, so they are
+ * always removed: Connection and the fields it lists, Keep-Alive,
+ * Proxy-Authenticate, Proxy-Authorization, Proxy-Connection, TE and Upgrade.
+ * Transfer-Encoding and Trailer stay, because bodies are relayed as they are.
+ *
+ * Rules from the command line remove and add more fields. They are compiled
+ * once, before any messages are rewritten.
+ */
+
+#define REWRITE_RULES_MAX 32 // Fields removed by rules
+#define REWRITE_IOV_MAX 64   // Pieces of a rewritten message
+#define REWRITE_EXTRA_MAX 4  // Fields added by rewrite_write()
+
+/*
+ * Compiled rules for the messages going one way through the proxy.
+ */
+struct rewrite_rules {
+    size_t nremove;
+    struct iostring remove[REWRITE_RULES_MAX]; // Names of fields to remove
+    struct iostring add; // Fields to add, each ending with CRLF
+};
+
+/*
+ * A rewritten message.
+ */
+struct rewrite {
+    struct iovec iov[REWRITE_IOV_MAX];
+    int iovcnt;
+    size_t len;
+    // Where the empty line ending the header is, to insert more fields.
+    int head_iov;
+    size_t head_off;
+};
+
+/*
+ * Compile a rule into rules. "-NAME" removes every NAME field, and
+ * "NAME: VALUE" adds a field. Both together replace NAME fields.
+ * Hop-by-hop fields are the proxy's own to add.
+ * Returns -1 if the rule is not valid, or there are too many rules.
+ */
+int rewrite_rule(struct rewrite_rules *rules, char const *rule);
+
+/*
+ * Start an empty rewritten message.
+ */
+void rewrite_init(struct rewrite *rw);
+
+/*
+ * Append len bytes at p to the message, either a part of the original message
+ * that is kept or something inserted.
+ * Returns -1 if the message is in too many pieces.
+ */
+int rewrite_append(struct rewrite *rw, void const *p, size_t len);
+
+/*
+ * Append the header fields from fields up to end, the empty line ending the
+ * header, leaving out hop-by-hop fields and those removed by rules, then
+ * append the fields added by rules.
+ * Returns -1 if the message is in too many pieces.
+ */
+int rewrite_fields(struct rewrite *rw, char *fields, char *end,
+                   struct rewrite_rules const *rules);
+
+/*
+ * Append the empty line ending the header at end, and the len - 2 bytes of
+ * the body after it.
+ * Returns -1 if the message is in too many pieces.
+ */
+int rewrite_finish(struct rewrite *rw, char *end, size_t len);
+
+/*
+ * Write the message to fd with writev(2), with the nextra fields in extra added
+ * to the end of the header, at most REWRITE_EXTRA_MAX of them.
+ * Returns the number of bytes written, or -1 on failure.
+ */
+ssize_t rewrite_write(struct rewrite const *rw, int fd,
+                      struct iovec const *extra, int nextra);
+
+#endif // _rewrite_h_
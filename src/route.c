@@ -0,0 +1,695 @@
+/*
+ * route.c
+ * Implementation of the reverse proxy routes and backend pools.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "route.h"
+
+#include <netdb.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define ROUTE_NAME_MAX 32
+#define ROUTE_HOST_MAX 256
+#define ROUTE_ROUTES_MAX 128
+#define POOL_BACKENDS_MAX 64 // Must fit in the tried mask of router_pick().
+#define RING_POINTS 40 // Points on the hash ring per backend
+#define ROUTE_HOLDERS 16384 // Processes whose connections are told apart
+#define ROUTE_PROBE 8 // Number of slots searched for a process or a free slot
+
+enum balance {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONN,
+    BALANCE_P2C,
+    BALANCE_HASH
+};
+
+static char const * const balance_names[] = {
+    [BALANCE_ROUND_ROBIN] = "roundrobin",
+    [BALANCE_LEAST_CONN] = "leastconn",
+    [BALANCE_P2C] = "p2c",
+    [BALANCE_HASH] = "hash",
+};
+
+struct backend {
+    _Atomic unsigned conns; // Open connections from all the processes
+    char host[ROUTE_HOST_MAX];
+    char port[NI_MAXSERV];
+    bool tls; // Connect with TLS
+};
+
+struct ring_point {
+    uint32_t hash;
+    uint32_t backend;
+};
+
+struct pool {
+    _Atomic unsigned next; // Round robin position
+    char name[ROUTE_NAME_MAX];
+    enum balance balance;
+    size_t bandwidth; // Bytes per second, 0 for any
+    size_t nbackends;
+    struct backend backends[POOL_BACKENDS_MAX];
+    struct ring_point ring[POOL_BACKENDS_MAX * RING_POINTS]; // Sorted by hash
+};
+
+struct route {
+    char host[ROUTE_HOST_MAX]; // "*" matches any host
+    char prefix[ROUTE_HOST_MAX];
+    size_t prefixlen;
+    int pool;
+};
+
+struct route_holder {
+    pid_t pid; // 0 if the slot is unused
+    struct backend_ref ref;
+    unsigned conns; // Connections to the backend the process counted
+};
+
+struct router {
+    shm_lock_t lock; // Only for the holders, the counts themselves are atomic
+    bool verbose;
+    size_t nroutes, npools;
+    struct shm_region region;
+    struct route routes[ROUTE_ROUTES_MAX];
+    struct route_holder holders[ROUTE_HOLDERS];
+    struct pool pools[];
+};
+
+/*
+ * FNV-1a, 32 bits, with the MurmurHash3 finalizer so that keys differing only
+ * in their last few characters still land all over the hash ring.
+ */
+static uint32_t
+route_hash(char const *p, size_t len)
+{
+    uint32_t h = 0x811c9dc5U;
+
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)p[i];
+        h *= 0x01000193U;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static int
+ring_point_cmp(void const *a, void const *b)
+{
+    struct ring_point const *x = a, *y = b;
+
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/*
+ * Place every backend of a pool at several points on its hash ring.
+ */
+static void
+pool_build_ring(struct pool *pool)
+{
+    size_t n = 0;
+
+    for (size_t b = 0; b < pool->nbackends; ++b) {
+        struct backend const * const backend = &pool->backends[b];
+
+        for (int i = 0; i < RING_POINTS; ++i) {
+            char point[ROUTE_HOST_MAX + NI_MAXSERV + 16];
+            int const len = snprintf(point, sizeof point, "%s:%s-%d",
+                                     backend->host, backend->port, i);
+
+            pool->ring[n].hash = route_hash(point, len);
+            pool->ring[n].backend = b;
+            ++n;
+        }
+    }
+
+    qsort(pool->ring, n, sizeof pool->ring[0], ring_point_cmp);
+}
+
+/*
+ * Parse a size with an optional K, M or G suffix.
+ * Returns FAILURE if it is not one.
+ */
+static int
+parse_size(char const *s, size_t *size)
+{
+    unsigned long long n;
+    char *end;
+
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'G': case 'g':
+        n *= 1024;
+        /* FALLTHROUGH */
+    case 'M': case 'm':
+        n *= 1024;
+        /* FALLTHROUGH */
+    case 'K': case 'k':
+        n *= 1024;
+        ++end;
+        break;
+    }
+    if (errno != 0 || end == s || *end != '\0')
+        return FAILURE;
+
+    *size = n;
+
+    return SUCCESS;
+}
+
+/*
+ * Parse "pool NAME BALANCE [bandwidth=SIZE] [https://]HOST[:PORT]..." after
+ * the keyword.
+ * Returns an error message, or NULL on success.
+ */
+static char const *
+parse_pool(struct pool *pool, char **save)
+{
+    char *name = strtok_r(NULL, " \t", save);
+    char *balance = strtok_r(NULL, " \t", save);
+    char *addr;
+
+    if (name == NULL || balance == NULL)
+        return "expected pool NAME BALANCE [bandwidth=SIZE] "
+            "[https://]HOST[:PORT]...";
+
+    memset(pool, 0, sizeof *pool);
+
+    if (strlen(name) >= sizeof pool->name)
+        return "pool name too long";
+    strcpy(pool->name, name);
+
+    for (pool->balance = 0;
+         pool->balance < sizeof balance_names / sizeof balance_names[0];
+         ++pool->balance)
+        if (strcmp(balance, balance_names[pool->balance]) == SUCCESS)
+            break;
+    if (pool->balance == sizeof balance_names / sizeof balance_names[0])
+        return "expected roundrobin, leastconn, p2c or hash";
+
+    while ((addr = strtok_r(NULL, " \t", save)) != NULL) {
+        struct backend * const backend = &pool->backends[pool->nbackends];
+        char *colon;
+        char const *port = "80";
+
+        if (strncmp(addr, "bandwidth=", 10) == SUCCESS) {
+            if (pool->nbackends > 0
+                || parse_size(addr + 10, &pool->bandwidth) == FAILURE)
+                return "expected bandwidth=SIZE before the backends";
+            continue;
+        }
+
+        if (pool->nbackends == POOL_BACKENDS_MAX)
+            return "too many backends";
+
+        backend->tls = strncmp(addr, "https://", 8) == SUCCESS;
+        if (backend->tls) {
+            addr += 8;
+            port = "443";
+        }
+
+        // An IPv6 address is bracketed to set it apart from the port.
+        if (*addr == '[') {
+            colon = strchr(++addr, ']');
+            if (colon == NULL || (colon[1] != '\0' && colon[1] != ':'))
+                return "invalid backend address";
+            *colon++ = '\0';
+            if (*colon == ':')
+                port = colon + 1;
+        }
+        else if ((colon = strchr(addr, ':')) != NULL) {
+            if (strchr(colon + 1, ':') != NULL)
+                return "IPv6 backend addresses must be in brackets";
+            *colon = '\0';
+            port = colon + 1;
+        }
+        if (*addr == '\0' || *port == '\0'
+            || strlen(addr) >= sizeof backend->host
+            || strlen(port) >= sizeof backend->port)
+            return "invalid backend address";
+        strcpy(backend->host, addr);
+        strcpy(backend->port, port);
+        ++pool->nbackends;
+    }
+
+    if (pool->nbackends == 0)
+        return "pool has no backends";
+
+    pool_build_ring(pool);
+
+    return NULL;
+}
+
+/*
+ * Parse "route HOST|* PATH-PREFIX POOL" after the keyword.
+ * Returns an error message, or NULL on success.
+ */
+static char const *
+parse_route(struct route *route, struct pool const *pools, size_t npools,
+            char **save)
+{
+    char *host = strtok_r(NULL, " \t", save);
+    char *prefix = strtok_r(NULL, " \t", save);
+    char *pool = strtok_r(NULL, " \t", save);
+
+    if (host == NULL || prefix == NULL || pool == NULL
+        || strtok_r(NULL, " \t", save) != NULL)
+        return "expected route HOST|* PATH-PREFIX POOL";
+
+    if (strlen(host) >= sizeof route->host
+        || strlen(prefix) >= sizeof route->prefix || *prefix != '/')
+        return "invalid route";
+    strcpy(route->host, host);
+    strcpy(route->prefix, prefix);
+    route->prefixlen = strlen(prefix);
+
+    for (route->pool = 0; route->pool < npools; ++route->pool)
+        if (strcmp(pool, pools[route->pool].name) == SUCCESS)
+            return NULL;
+
+    return "pool must be defined before it is used";
+}
+
+struct router *
+router_create(char const *path, bool verbose)
+{
+    struct router *router = NULL;
+    struct route routes[ROUTE_ROUTES_MAX];
+    struct pool *pools = NULL;
+    struct shm_region region;
+    size_t nroutes = 0, npools = 0, lineno = 0, linecap = 0;
+    char const *error = NULL;
+    char *line = NULL;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("router_create(): failed to open routes file");
+        return NULL;
+    }
+
+    while (error == NULL && getline(&line, &linecap, fp) != FAILURE) {
+        char *save, *keyword;
+
+        ++lineno;
+        line[strcspn(line, "#\r\n")] = '\0';
+        keyword = strtok_r(line, " \t", &save);
+        if (keyword == NULL)
+            continue; // blank line
+
+        if (strcmp(keyword, "pool") == SUCCESS) {
+            struct pool * const grown =
+                realloc(pools, (npools + 1) * sizeof *pools);
+            if (grown == NULL) {
+                error = strerror(errno);
+                break;
+            }
+            pools = grown;
+            error = parse_pool(&pools[npools], &save);
+            for (size_t i = 0; error == NULL && i < npools; ++i)
+                if (strcmp(pools[i].name, pools[npools].name) == SUCCESS)
+                    error = "duplicate pool";
+            ++npools;
+        }
+        else if (strcmp(keyword, "route") == SUCCESS) {
+            if (nroutes == ROUTE_ROUTES_MAX)
+                error = "too many routes";
+            else
+                error = parse_route(&routes[nroutes++], pools, npools, &save);
+        }
+        else
+            error = "expected pool or route";
+    }
+
+    if (error == NULL && ferror(fp))
+        error = strerror(errno);
+    if (error == NULL && nroutes == 0)
+        error = "no routes";
+
+    if (error != NULL)
+        fprintf(stderr, "%s:%zu: %s\n", path, lineno, error);
+
+    free(line);
+    fclose(fp);
+
+    if (error == NULL
+        && shm_create(&region, "proxy-routes",
+                      sizeof *router + npools * sizeof *pools) != FAILURE) {
+        router = region.base;
+        atomic_flag_clear(&router->lock);
+        router->verbose = verbose;
+        router->nroutes = nroutes;
+        router->npools = npools;
+        router->region = region;
+        memcpy(router->routes, routes, nroutes * sizeof *routes);
+        memcpy(router->pools, pools, npools * sizeof *pools);
+
+        if (verbose)
+            fprintf(stderr, "routing to %zu pools by %zu routes from %s\n",
+                    npools, nroutes, path);
+    }
+
+    free(pools);
+
+    return router;
+}
+
+void
+router_destroy(struct router *router)
+{
+    struct shm_region region = router->region;
+
+    shm_destroy(&region);
+}
+
+int
+router_match(struct router const *router,
+             struct iostring host, struct iostring path)
+{
+    for (size_t i = 0; i < router->nroutes; ++i) {
+        struct route const * const route = &router->routes[i];
+
+        if (strcmp(route->host, "*") != SUCCESS
+            && (strlen(route->host) != host.len
+                || strncasecmp(route->host, host.p, host.len) != SUCCESS))
+            continue;
+
+        if (path.len >= route->prefixlen
+            && memcmp(path.p, route->prefix, route->prefixlen) == SUCCESS)
+            return route->pool;
+    }
+
+    return FAILURE;
+}
+
+/*
+ * A random number for this process.
+ */
+static unsigned
+route_random(void)
+{
+    static unsigned seed;
+    static pid_t seeded;
+
+    if (seeded != getpid()) {
+        seeded = getpid();
+        seed = seeded ^ time(NULL);
+    }
+
+    return rand_r(&seed);
+}
+
+/*
+ * The untried backend after the first ring point at or after the key.
+ */
+static int
+pool_pick_hash(struct pool const *pool, uint32_t key, uint64_t tried)
+{
+    size_t const npoints = pool->nbackends * RING_POINTS;
+
+    size_t lo = 0, hi = npoints;
+
+    while (lo < hi) {
+        size_t const mid = lo + (hi - lo) / 2;
+
+        if (pool->ring[mid].hash < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = 0; i < npoints; ++i) {
+        uint32_t const b = pool->ring[(lo + i) % npoints].backend;
+
+        if (!(tried & (UINT64_C(1) << b)))
+            return b;
+    }
+
+    return FAILURE;
+}
+
+/*
+ * Find the slot for the connections a process counted to a backend, taking
+ * over a free one if it has none. A slot is free if it is unused or counts no
+ * connections.
+ * Returns NULL if there is no room, in which case the connections are only
+ * counted for the backend.
+ * Called with the lock held.
+ */
+static struct route_holder *
+route_holder(struct router *router, pid_t pid, struct backend_ref ref)
+{
+    uint32_t const hash = (uint32_t)pid * 0x9e3779b1U;
+
+    struct route_holder *victim = NULL;
+
+    for (size_t i = 0; i < ROUTE_PROBE; ++i) {
+        struct route_holder * const h =
+            &router->holders[(hash + i) % ROUTE_HOLDERS];
+
+        if (h->pid == pid
+            && h->ref.pool == ref.pool && h->ref.backend == ref.backend)
+            return h;
+        if (victim == NULL && (h->pid == 0 || h->conns == 0))
+            victim = h;
+    }
+
+    if (victim != NULL) {
+        victim->pid = pid;
+        victim->ref = ref;
+        victim->conns = 0;
+    }
+
+    return victim;
+}
+
+/*
+ * Count a connection to a backend for this process, or count it as closed if
+ * delta is -1.
+ */
+static void
+route_hold(struct router *router, struct backend_ref ref, int delta)
+{
+    struct route_holder *h;
+
+    shm_lock(&router->lock);
+    h = route_holder(router, getpid(), ref);
+    if (h != NULL && (delta > 0 || h->conns > 0))
+        h->conns += delta;
+    shm_unlock(&router->lock);
+}
+
+struct backend_ref
+router_pick(struct router *router, int pool_index,
+            struct iostring key, uint64_t tried)
+{
+    struct pool * const pool = &router->pools[pool_index];
+    size_t const n = pool->nbackends;
+
+    size_t untried[POOL_BACKENDS_MAX], nuntried = 0;
+    unsigned start;
+    int pick = FAILURE;
+
+    for (size_t b = 0; b < n; ++b)
+        if (!(tried & (UINT64_C(1) << b)))
+            untried[nuntried++] = b;
+
+    if (nuntried == 0)
+        return (struct backend_ref){ pool_index, FAILURE };
+
+    switch (pool->balance) {
+    case BALANCE_ROUND_ROBIN:
+        start = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+        pick = untried[start % nuntried];
+        break;
+    case BALANCE_LEAST_CONN:
+        // Start at the round robin position to spread out ties.
+        start = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+        for (size_t i = 0; i < nuntried; ++i) {
+            int const b = untried[(start + i) % nuntried];
+
+            if (pick == FAILURE
+                || atomic_load_explicit(&pool->backends[b].conns,
+                                        memory_order_relaxed)
+                   < atomic_load_explicit(&pool->backends[pick].conns,
+                                          memory_order_relaxed))
+                pick = b;
+        }
+        break;
+    case BALANCE_P2C:
+        start = route_random() % nuntried;
+        pick = untried[start];
+        if (nuntried > 1) {
+            // Any other untried backend.
+            int const other =
+                untried[(start + 1 + route_random() % (nuntried - 1))
+                        % nuntried];
+
+            if (atomic_load_explicit(&pool->backends[other].conns,
+                                     memory_order_relaxed)
+                < atomic_load_explicit(&pool->backends[pick].conns,
+                                       memory_order_relaxed))
+                pick = other;
+        }
+        break;
+    case BALANCE_HASH:
+        pick = pool_pick_hash(pool, route_hash(key.p, key.len),
+                              tried);
+        break;
+    }
+
+    atomic_fetch_add_explicit(&pool->backends[pick].conns, 1,
+                              memory_order_relaxed);
+    route_hold(router, (struct backend_ref){ pool_index, pick }, 1);
+
+    if (router->verbose)
+        fprintf(stderr, "pool %s: chose backend %s:%s\n", pool->name,
+                pool->backends[pick].host, pool->backends[pick].port);
+
+    return (struct backend_ref){ pool_index, pick };
+}
+
+bool
+router_keeps(struct router const *router, struct backend_ref ref,
+             int pool, struct iostring key)
+{
+    if (ref.pool != pool)
+        return false;
+
+    // Any backend will do, except for the one a key hashes to.
+    return router->pools[pool].balance != BALANCE_HASH
+        || pool_pick_hash(&router->pools[pool],
+                          route_hash(key.p, key.len), 0)
+           == ref.backend;
+}
+
+void
+router_release(struct router *router, struct backend_ref ref)
+{
+    route_hold(router, ref, -1);
+    atomic_fetch_sub_explicit(&router->pools[ref.pool].backends[ref.backend].conns,
+                              1, memory_order_relaxed);
+}
+
+void
+router_reclaim(struct router *router)
+{
+    unsigned long reclaimed = 0;
+
+    // Processes are looked for without the lock: only a live process changes
+    // its own slots, and a slot is only taken over once it counts nothing.
+    for (size_t i = 0; i < ROUTE_HOLDERS; ++i) {
+        struct route_holder * const h = &router->holders[i];
+        pid_t const pid = h->pid;
+
+        if (pid == 0 || h->conns == 0
+            || kill(pid, 0) == SUCCESS || errno != ESRCH)
+            continue;
+
+        shm_lock(&router->lock);
+        if (h->pid == pid) {
+            atomic_fetch_sub_explicit(
+                &router->pools[h->ref.pool].backends[h->ref.backend].conns,
+                h->conns, memory_order_relaxed);
+            reclaimed += h->conns;
+            h->conns = 0;
+        }
+        shm_unlock(&router->lock);
+    }
+
+    if (reclaimed > 0 && router->verbose)
+        fprintf(stderr, "router_reclaim(): %lu backend connections closed for "
+                "processes that are gone\n", reclaimed);
+}
+
+size_t
+router_pools(struct router const *router)
+{
+    return router->npools;
+}
+
+char const *
+router_pool_name(struct router const *router, int pool)
+{
+    return router->pools[pool].name;
+}
+
+size_t
+router_pool_bandwidth(struct router const *router, int pool)
+{
+    return router->pools[pool].bandwidth;
+}
+
+char const *
+router_backend_host(struct router const *router, struct backend_ref ref)
+{
+    return router->pools[ref.pool].backends[ref.backend].host;
+}
+
+char const *
+router_backend_port(struct router const *router, struct backend_ref ref)
+{
+    return router->pools[ref.pool].backends[ref.backend].port;
+}
+
+bool
+router_backend_tls(struct router const *router, struct backend_ref ref)
+{
+    return router->pools[ref.pool].backends[ref.backend].tls;
+}
+
+struct backend_ref
+router_next_backend(struct router const *router, struct backend_ref ref)
+{
+    if (ref.pool == FAILURE)
+        ref.pool = 0;
+
+    for (++ref.backend; ref.pool < router->npools; ++ref.pool, ref.backend = 0)
+        if (ref.backend < router->pools[ref.pool].nbackends)
+            return ref;
+
+    return BACKEND_REF_NONE;
+}
@@ -0,0 +1,154 @@
+/*
+ * route.h
+ * Interface to the reverse proxy routes and backend pools.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _route_h_
+#define _route_h_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "iostring.h"
+
+/*
+ * In reverse proxy mode, requests are routed by their Host header field and
+ * path to a pool of backend servers, read from a routes file like this:
+ *
+ *   # pool NAME BALANCE [bandwidth=SIZE] [https://]HOST[:PORT]...
+ *   pool app leastconn 10.0.0.1:8080 10.0.0.2:8080 10.0.0.3:8080
+ *   pool static hash bandwidth=50M 10.0.0.4 10.0.0.5
+ *   pool auth roundrobin https://auth.internal
+ *   pool v6 p2c [2001:db8::1]:8080 [2001:db8::2]:8080
+ *
+ *   # route HOST|* PATH-PREFIX POOL
+ *   route www.example.com /static/ static
+ *   route * / app
+ *
+ * Backends written with https:// are connected to with TLS, on port 443 unless
+ * another is given. IPv6 addresses are written in brackets, both for backends
+ * and for route hosts, as they are in Host header fields. The first route
+ * matching a request wins. A pool spreads requests over its backends in one of
+ * these ways:
+ *   roundrobin  each backend in turn
+ *   leastconn   the backend with the fewest open connections
+ *   p2c         the less busy of two backends picked at random
+ *   hash        consistent hashing of the path, so that requests for a path
+ *               keep going to the same backend as long as it is up
+ *
+ * The routes live in shared memory, so the connection counts and round robin
+ * position are shared by all the child processes. Connections are also
+ * counted for the process that counted them, so that those of a process
+ * killed before it could count them as closed can be.
+ */
+
+struct router;
+
+/*
+ * A backend chosen for a request.
+ */
+struct backend_ref {
+    int pool, backend; // -1 if none
+};
+
+#define BACKEND_REF_NONE ((struct backend_ref){ -1, -1 })
+
+/*
+ * Read routes and pools from the file at path.
+ * Returns NULL on failure.
+ */
+struct router *router_create(char const *path, bool verbose);
+
+/*
+ * Release the shared routes.
+ */
+void router_destroy(struct router *router);
+
+/*
+ * Find the pool for a request by its host (without the port) and path.
+ * Returns -1 if no route matches.
+ */
+int router_match(struct router const *router,
+                 struct iostring host, struct iostring path);
+
+/*
+ * The number of pools, and the name of a pool and the bandwidth in bytes per
+ * second its responses are shaped to, 0 for any.
+ */
+size_t router_pools(struct router const *router);
+char const *router_pool_name(struct router const *router, int pool);
+size_t router_pool_bandwidth(struct router const *router, int pool);
+
+/*
+ * Choose a backend from a pool, skipping the ones whose bits are set in
+ * tried (bit n for backend n), and count a connection to it.
+ * The key is what the hash policy hashes.
+ * Returns a reference with backend -1 if every backend was tried.
+ */
+struct backend_ref router_pick(struct router *router, int pool,
+                               struct iostring key, uint64_t tried);
+
+/*
+ * Whether a request for a pool with the given key may be sent on an open
+ * connection to the backend ref, rather than one chosen by router_pick().
+ */
+bool router_keeps(struct router const *router, struct backend_ref ref,
+                  int pool, struct iostring key);
+
+/*
+ * Count a connection to a backend as closed.
+ */
+void router_release(struct router *router, struct backend_ref ref);
+
+/*
+ * Count the backend connections of processes that are gone as closed, such as
+ * those of workers killed by a signal. Only the master calls this.
+ */
+void router_reclaim(struct router *router);
+
+/*
+ * The nul-terminated host name and port of a backend.
+ */
+char const *router_backend_host(struct router const *router,
+                                struct backend_ref ref);
+char const *router_backend_port(struct router const *router,
+                                struct backend_ref ref);
+
+/*
+ * Whether a backend is connected to with TLS.
+ */
+bool router_backend_tls(struct router const *router, struct backend_ref ref);
+
+/*
+ * Iterate over every backend of every pool, starting from BACKEND_REF_NONE.
+ * Returns BACKEND_REF_NONE after the last backend.
+ */
+struct backend_ref router_next_backend(struct router const *router,
+                                       struct backend_ref ref);
+
+#endif // _route_h_
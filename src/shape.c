@@ -0,0 +1,393 @@
+/*
+ * shape.c
+ * Implementation of the bandwidth shaper.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "shape.h"
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm.h"
+#include "stats.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define SHAPE_PROBE 8 // Number of slots searched for a client or a free slot.
+#define SHAPE_NAME_MAX 32
+#define SHAPE_BURST 0.1 // Seconds of bandwidth a bucket holds
+#define SHAPE_HOLDERS 16384 // Processes whose connections are told apart
+
+struct shape_bucket {
+    double rate, burst;  // Bytes per second, and the most tokens held
+    double tokens;       // Below 0 while in debt
+    double updated;      // When tokens was last brought up to date
+    unsigned long bytes; // Sent in the class so far
+};
+
+struct shape_pool {
+    char name[SHAPE_NAME_MAX];
+    struct shape_bucket bucket;
+};
+
+struct shape_client {
+    in_addr_t addr; // INADDR_ANY if the slot is unused
+    unsigned conns;
+    struct shape_bucket bucket;
+};
+
+struct shape_holder {
+    pid_t pid; // 0 if the slot is unused
+    int client;
+    unsigned conns; // Connections of the client the process counted
+};
+
+struct shaper {
+    shm_lock_t lock;
+    bool verbose;
+    struct stats *stats;
+    size_t client_bandwidth;
+    size_t npools, nclients;
+    struct shm_region region;
+    struct shape_bucket link;
+    struct shape_pool *pools; // After the clients
+    struct shape_holder holders[SHAPE_HOLDERS];
+    struct shape_client clients[];
+};
+
+/*
+ * Seconds on a clock shared by all the processes, which never goes back.
+ */
+static double
+shape_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Start a bucket off full.
+ */
+static void
+shape_init(struct shape_bucket *bucket, size_t bandwidth, double now)
+{
+    bucket->rate = bandwidth;
+    // Room for at least one chunk, or nothing would ever be sent.
+    bucket->burst = bandwidth * SHAPE_BURST;
+    if (bucket->burst < SHAPE_QUANTUM)
+        bucket->burst = SHAPE_QUANTUM;
+    bucket->tokens = bucket->burst;
+    bucket->updated = now;
+}
+
+/*
+ * Bring the tokens in a bucket up to date.
+ */
+static void
+shape_refill(struct shape_bucket *bucket, double now)
+{
+    bucket->tokens += (now - bucket->updated) * bucket->rate;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->updated = now;
+}
+
+struct shaper *
+shaper_create(size_t nclients, size_t npools,
+              size_t bandwidth, size_t client_bandwidth,
+              struct stats *stats, bool verbose)
+{
+    size_t const clients_len = nclients * sizeof (struct shape_client);
+
+    struct shm_region region;
+    struct shaper *shaper;
+    double const now = shape_now();
+
+    if (shm_create(&region, "proxy-shaper",
+                   sizeof *shaper + clients_len
+                   + npools * sizeof (struct shape_pool)) == FAILURE)
+        return NULL;
+
+    shaper = region.base;
+    atomic_flag_clear(&shaper->lock);
+    shaper->verbose = verbose;
+    shaper->stats = stats;
+    shaper->client_bandwidth = client_bandwidth;
+    shaper->npools = npools;
+    shaper->nclients = nclients;
+    shaper->region = region;
+    shaper->pools = (struct shape_pool *)((char *)shaper->clients + clients_len);
+    shape_init(&shaper->link, bandwidth, now);
+
+    if (verbose) {
+        if (bandwidth > 0)
+            fprintf(stderr, "shaping the link to %zu bytes/s\n", bandwidth);
+        if (client_bandwidth > 0)
+            fprintf(stderr, "shaping clients to %zu bytes/s\n",
+                    client_bandwidth);
+    }
+
+    return shaper;
+}
+
+void
+shaper_destroy(struct shaper *shaper)
+{
+    struct shm_region region = shaper->region;
+
+    shm_destroy(&region);
+}
+
+void
+shaper_pool(struct shaper *shaper, int pool, char const *name,
+            size_t bandwidth)
+{
+    struct shape_pool * const p = &shaper->pools[pool];
+
+    snprintf(p->name, sizeof p->name, "%s", name);
+    shape_init(&p->bucket, bandwidth, shape_now());
+
+    if (shaper->verbose && bandwidth > 0)
+        fprintf(stderr, "shaping pool %s to %zu bytes/s\n", name, bandwidth);
+}
+
+/*
+ * Find the slot for a client, taking over a free one if it is new.
+ * A slot is free if it is unused or its client could be forgotten without
+ * changing anything, i.e. it has no connections and a full bucket.
+ * Returns NULL if there is no room for the client.
+ * Called with the lock held.
+ */
+static struct shape_client *
+shape_find(struct shaper *shaper, in_addr_t addr, double now)
+{
+    uint32_t const hash = (uint32_t)addr * 0x9e3779b1U;
+
+    struct shape_client *victim = NULL;
+
+    for (size_t i = 0; i < SHAPE_PROBE; ++i) {
+        struct shape_client * const c =
+            &shaper->clients[(hash + i) % shaper->nclients];
+
+        if (c->addr == addr)
+            return c;
+
+        if (victim != NULL)
+            continue;
+        if (c->addr == INADDR_ANY)
+            victim = c;
+        else if (c->conns == 0) {
+            shape_refill(&c->bucket, now);
+            if (c->bucket.tokens >= c->bucket.burst || c->bucket.rate == 0)
+                victim = c;
+        }
+    }
+
+    if (victim != NULL) {
+        victim->addr = addr;
+        victim->conns = 0;
+        shape_init(&victim->bucket, shaper->client_bandwidth, now);
+        victim->bucket.bytes = 0;
+    }
+
+    return victim;
+}
+
+/*
+ * Find the slot for the connections a process counted for a client, taking
+ * over a free one if it has none. A slot is free if it is unused or counts no
+ * connections.
+ * Returns NULL if there is no room, in which case the connections are only
+ * counted for the client.
+ * Called with the lock held.
+ */
+static struct shape_holder *
+shape_holder(struct shaper *shaper, pid_t pid, int client)
+{
+    uint32_t const hash = (uint32_t)pid * 0x9e3779b1U;
+
+    struct shape_holder *victim = NULL;
+
+    for (size_t i = 0; i < SHAPE_PROBE; ++i) {
+        struct shape_holder * const h =
+            &shaper->holders[(hash + i) % SHAPE_HOLDERS];
+
+        if (h->pid == pid && h->client == client)
+            return h;
+        if (victim == NULL && (h->pid == 0 || h->conns == 0))
+            victim = h;
+    }
+
+    if (victim != NULL) {
+        victim->pid = pid;
+        victim->client = client;
+        victim->conns = 0;
+    }
+
+    return victim;
+}
+
+int
+shaper_connect(struct shaper *shaper, struct in_addr addr)
+{
+    struct shape_client *client;
+    int slot = FAILURE;
+
+    shm_lock(&shaper->lock);
+    client = shape_find(shaper, addr.s_addr, shape_now());
+    if (client != NULL) {
+        struct shape_holder *h;
+
+        ++client->conns;
+        slot = client - shaper->clients;
+        h = shape_holder(shaper, getpid(), slot);
+        if (h != NULL)
+            ++h->conns;
+    }
+    shm_unlock(&shaper->lock);
+
+    return slot;
+}
+
+void
+shaper_disconnect(struct shaper *shaper, int client)
+{
+    struct shape_holder *h;
+
+    shm_lock(&shaper->lock);
+    h = shape_holder(shaper, getpid(), client);
+    if (h != NULL && h->conns > 0)
+        --h->conns;
+    if (shaper->clients[client].conns > 0)
+        --shaper->clients[client].conns;
+    shm_unlock(&shaper->lock);
+}
+
+void
+shaper_reclaim(struct shaper *shaper)
+{
+    unsigned long reclaimed = 0;
+
+    // Processes are looked for without the lock: only a live process changes
+    // its own slots, and a slot is only taken over once it counts nothing.
+    for (size_t i = 0; i < SHAPE_HOLDERS; ++i) {
+        struct shape_holder * const h = &shaper->holders[i];
+        pid_t const pid = h->pid;
+
+        if (pid == 0 || h->conns == 0
+            || kill(pid, 0) == SUCCESS || errno != ESRCH)
+            continue;
+
+        shm_lock(&shaper->lock);
+        if (h->pid == pid) {
+            struct shape_client * const c = &shaper->clients[h->client];
+
+            c->conns -= h->conns < c->conns ? h->conns : c->conns;
+            reclaimed += h->conns;
+            h->conns = 0;
+        }
+        shm_unlock(&shaper->lock);
+    }
+
+    if (reclaimed > 0 && shaper->verbose)
+        fprintf(stderr, "shaper_reclaim(): %lu connections closed for "
+                "processes that are gone\n", reclaimed);
+}
+
+size_t
+shaper_client_bandwidth(struct shaper const *shaper)
+{
+    size_t const link = shaper->link.rate;
+
+    if (shaper->client_bandwidth == 0)
+        return link;
+
+    return link == 0 || shaper->client_bandwidth < link
+        ? shaper->client_bandwidth : link;
+}
+
+void
+shaper_take(struct shaper *shaper, struct shape_path const *path, size_t len)
+{
+    double const now = shape_now();
+
+    struct shape_bucket *buckets[3];
+    double wait = 0;
+    int n = 0;
+
+    buckets[n++] = &shaper->link;
+    if (path->pool != FAILURE && (size_t)path->pool < shaper->npools)
+        buckets[n++] = &shaper->pools[path->pool].bucket;
+    if (path->client != FAILURE)
+        buckets[n++] = &shaper->clients[path->client].bucket;
+
+    shm_lock(&shaper->lock);
+    for (int i = 0; i < n; ++i) {
+        struct shape_bucket * const bucket = buckets[i];
+
+        bucket->bytes += len;
+        if (bucket->rate == 0)
+            continue;
+        shape_refill(bucket, now);
+        bucket->tokens -= len;
+        if (bucket->tokens < 0 && -bucket->tokens / bucket->rate > wait)
+            wait = -bucket->tokens / bucket->rate;
+    }
+    shm_unlock(&shaper->lock);
+
+    stats_add(shaper->stats, STATS_SHAPED_BYTES, len);
+
+    if (wait > 0) {
+        struct timespec ts = {
+            .tv_sec = wait,
+            .tv_nsec = (wait - (time_t)wait) * 1e9
+        };
+
+        while (nanosleep(&ts, &ts) == FAILURE && errno == EINTR)
+            ;
+        stats_add(shaper->stats, STATS_SHAPED_WAIT, wait * 1e6);
+    }
+}
+
+void
+shaper_report(struct shaper const *shaper)
+{
+    fprintf(stderr, "shaped %lu bytes in all\n", shaper->link.bytes);
+    for (size_t i = 0; i < shaper->npools; ++i)
+        fprintf(stderr, "shaped %lu bytes from pool %s\n",
+                shaper->pools[i].bucket.bytes, shaper->pools[i].name);
+}
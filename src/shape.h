@@ -0,0 +1,129 @@
+/*
+ * shape.h
+ * Interface to the bandwidth shaper.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _shape_h_
+#define _shape_h_
+
+#include <netinet/in.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * Responses are sent to clients no faster than the bandwidth given to each
+ * class of traffic they belong to. The classes nest: every response counts
+ * against the link as a whole, against the pool of backends it came from,
+ * and against the client it goes to, across all of the client's connections.
+ *
+ * Each class is a token bucket in shared memory, filling at its bandwidth in
+ * bytes per second up to a tenth of a second's worth. A chunk of a transfer
+ * takes its size from every bucket on its way, going into debt if it has to,
+ * and the sender then waits until none of them is in debt any more. Transfers
+ * sharing a class so take turns at its bandwidth, and a class nobody else is
+ * using lends a transfer no more than its own bandwidth.
+ *
+ * The bytes sent in each class are counted. Clients are forgotten once their
+ * last connection closes, so the table only needs room for the clients
+ * connected at once. If it fills up anyway, new clients go unshaped on their
+ * own, but still count against their pools and the link. Connections are also
+ * counted for the process that counted them, so that a client whose workers
+ * were killed is forgotten all the same.
+ */
+
+#define SHAPE_QUANTUM (64 * 1024) // Most bytes sent at a time while shaped
+
+struct shaper;
+struct stats;
+
+/*
+ * Where a transfer is charged: a client slot from shaper_connect() and a pool,
+ * either of which may be -1 for none.
+ */
+struct shape_path {
+    int client;
+    int pool;
+};
+
+#define SHAPE_PATH_NONE ((struct shape_path){ -1, -1 })
+
+/*
+ * Create a shaper for a link of the given bandwidth, with npools pool classes
+ * and at most nclients clients of client_bandwidth each. A bandwidth of 0 is
+ * not limited. The time spent waiting is counted in stats.
+ * Returns NULL on failure.
+ */
+struct shaper *shaper_create(size_t nclients, size_t npools,
+                             size_t bandwidth, size_t client_bandwidth,
+                             struct stats *stats, bool verbose);
+
+/*
+ * Release the shared buckets.
+ */
+void shaper_destroy(struct shaper *shaper);
+
+/*
+ * Name a pool class and give it a bandwidth, 0 for none.
+ */
+void shaper_pool(struct shaper *shaper, int pool, char const *name,
+                 size_t bandwidth);
+
+/*
+ * Count a new connection from addr.
+ * Returns the client's slot, or -1 if there is no room for the client.
+ */
+int shaper_connect(struct shaper *shaper, struct in_addr addr);
+
+/*
+ * Count a connection of the client in a slot as closed.
+ */
+void shaper_disconnect(struct shaper *shaper, int client);
+
+/*
+ * Count the connections of processes that are gone as closed, such as those
+ * of workers killed by a signal. Only the master calls this.
+ */
+void shaper_reclaim(struct shaper *shaper);
+
+/*
+ * The bandwidth a single connection of a client gets at most, 0 for any.
+ */
+size_t shaper_client_bandwidth(struct shaper const *shaper);
+
+/*
+ * Charge len bytes to the classes on path, and wait until they may be sent.
+ */
+void shaper_take(struct shaper *shaper, struct shape_path const *path,
+                 size_t len);
+
+/*
+ * Print the bytes sent in each class to stderr.
+ */
+void shaper_report(struct shaper const *shaper);
+
+#endif // _shape_h_
@@ -0,0 +1,210 @@
+/*
+ * shm.c
+ * Implementation of the shared memory regions used by the proxy processes.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "shm.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#ifndef __linux__
+/*
+ * Without memfd_create(2), use an anonymous POSIX shared memory object.
+ */
+static int
+shm_anon_open(char const *name)
+{
+    char path[64];
+    int fd;
+
+    snprintf(path, sizeof path, "/proxy-%s.%d", name, (int)getpid());
+
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != FAILURE)
+        shm_unlink(path);
+
+    return fd;
+}
+#endif
+
+int
+shm_create(struct shm_region *region, char const *name, size_t len)
+{
+    long const pagesize = sysconf(_SC_PAGESIZE);
+
+    int fd;
+    void *base;
+
+    // Round up to a whole number of pages.
+    len = (len + pagesize - 1) & ~(size_t)(pagesize - 1);
+
+#ifdef __linux__
+    fd = memfd_create(name, MFD_CLOEXEC);
+#else
+    fd = shm_anon_open(name);
+#endif
+    if (fd == FAILURE) {
+        perror("shm_create(): failed to create shared memory object");
+        return FAILURE;
+    }
+
+    if (ftruncate(fd, len) == FAILURE) {
+        perror("shm_create(): failed to size shared memory object");
+        close(fd);
+        return FAILURE;
+    }
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("shm_create(): failed to map shared memory object");
+        close(fd);
+        return FAILURE;
+    }
+
+    region->fd = fd;
+    region->len = len;
+    region->base = base;
+
+    return SUCCESS;
+}
+
+int
+shm_create_named(struct shm_region *region, char const *name, size_t len)
+{
+    long const pagesize = sysconf(_SC_PAGESIZE);
+
+    int fd;
+    void *base;
+
+    len = (len + pagesize - 1) & ~(size_t)(pagesize - 1);
+
+    // Left over by a proxy that did not exit cleanly.
+    shm_unlink(name);
+
+    // Readable by anyone, for monitoring.
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == FAILURE) {
+        perror("shm_create_named(): failed to create shared memory object");
+        return FAILURE;
+    }
+
+    if (ftruncate(fd, len) == FAILURE) {
+        perror("shm_create_named(): failed to size shared memory object");
+        shm_unlink(name);
+        close(fd);
+        return FAILURE;
+    }
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("shm_create_named(): failed to map shared memory object");
+        shm_unlink(name);
+        close(fd);
+        return FAILURE;
+    }
+
+    region->fd = fd;
+    region->len = len;
+    region->base = base;
+
+    return SUCCESS;
+}
+
+int
+shm_open_named(struct shm_region *region, char const *name)
+{
+    struct stat sb;
+    void *base;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == FAILURE)
+        return FAILURE;
+
+    if (fstat(fd, &sb) == FAILURE) {
+        close(fd);
+        return FAILURE;
+    }
+
+    base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return FAILURE;
+    }
+
+    region->fd = fd;
+    region->len = sb.st_size;
+    region->base = base;
+
+    return SUCCESS;
+}
+
+int
+shm_attach(struct shm_region *region, int fd)
+{
+    struct stat sb;
+    void *base;
+
+    if (fstat(fd, &sb) == FAILURE) {
+        perror("shm_attach(): failed to stat shared memory object");
+        close(fd);
+        return FAILURE;
+    }
+
+    base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("shm_attach(): failed to map shared memory object");
+        close(fd);
+        return FAILURE;
+    }
+
+    region->fd = fd;
+    region->len = sb.st_size;
+    region->base = base;
+
+    return SUCCESS;
+}
+
+void
+shm_destroy(struct shm_region *region)
+{
+    if (region->base != NULL)
+        munmap(region->base, region->len);
+    if (region->fd != FAILURE)
+        close(region->fd);
+
+    region->base = NULL;
+    region->fd = FAILURE;
+    region->len = 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * shm.h
+ * Interface to the shared memory regions used by the proxy processes.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _shm_h_
+#define _shm_h_
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/*
+ * A shared memory region is created by the master process before forking, so
+ * every child maps the same pages at the same address.
+ * The region is backed by a file descriptor rather than an anonymous mapping
+ * so that it can be handed to another process.
+ */
+struct shm_region {
+    int fd;
+    size_t len;
+    void *base;
+};
+
+/*
+ * Create a zero-filled shared memory region of at least len bytes.
+ * The name is only used for debugging (it shows up in /proc/PID/maps).
+ * Returns -1 on failure, 0 otherwise.
+ */
+int shm_create(struct shm_region *region, char const *name, size_t len);
+
+/*
+ * Map a region created by another process, which handed over its file
+ * descriptor. The region takes ownership of fd.
+ * Returns -1 on failure, 0 otherwise.
+ */
+int shm_attach(struct shm_region *region, int fd);
+
+/*
+ * Create a zero-filled shared memory region of at least len bytes with a name
+ * other programs can open it by, replacing any left over with the same name.
+ * The name is a POSIX shared memory object name, starting with a slash.
+ * Returns -1 on failure, 0 otherwise.
+ */
+int shm_create_named(struct shm_region *region, char const *name, size_t len);
+
+/*
+ * Map a region created by shm_create_named(), read-only.
+ * Returns -1 on failure, 0 otherwise.
+ */
+int shm_open_named(struct shm_region *region, char const *name);
+
+/*
+ * Unmap the region and close its file descriptor.
+ */
+void shm_destroy(struct shm_region *region);
+
+/*
+ * A spinlock that lives in shared memory.
+ * Critical sections guarded by these locks must be short and must not block.
+ */
+typedef atomic_flag shm_lock_t;
+
+#define SHM_LOCK_INITIALIZER ATOMIC_FLAG_INIT
+
+static inline void
+shm_lock(shm_lock_t *lock)
+{
+    while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire))
+        sched_yield();
+}
+
+static inline void
+shm_unlock(shm_lock_t *lock)
+{
+    atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+#endif // _shm_h_
@@ -0,0 +1,282 @@
+/*
+ * stats.c
+ * Implementation of the shared statistics of the proxy processes.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "stats.h"
+
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define STATS_MAGIC 0x70787374 // "pxst"
+
+struct stats_block {
+    _Alignas(STATS_LINE) atomic_ulong counters[STATS_COUNTERS];
+};
+
+/*
+ * The layout of the segment, which the proxy-stat tool relies on.
+ */
+struct stats_segment {
+    uint32_t magic;
+    uint32_t ncounters; // STATS_COUNTERS, in case the layout changes
+    uint32_t nblocks;   // STATS_BLOCKS, likewise
+    uint32_t ngauges;   // STATS_GAUGES, likewise
+    pid_t pid;          // Of the master process, which may be upgraded
+    double started;
+    struct stats_block blocks[STATS_BLOCKS];
+    _Alignas(STATS_LINE) atomic_ulong gauges[STATS_GAUGES];
+};
+
+/*
+ * A process's handle on the segment.
+ */
+struct stats {
+    bool owner; // The name is removed with the segment
+    char name[32];
+    struct shm_region region;
+    struct stats_segment *segment;
+    struct stats_block *block; // Counted in by this process
+};
+
+/*
+ * Allocate a handle on a segment named after port.
+ */
+static struct stats *
+stats_new(uint16_t port)
+{
+    struct stats *stats = calloc(1, sizeof *stats);
+
+    if (stats == NULL) {
+        perror("stats: failed to allocate statistics");
+        return NULL;
+    }
+
+    snprintf(stats->name, sizeof stats->name, "/proxy-stats.%u", port);
+
+    return stats;
+}
+
+/*
+ * Check the segment was laid out by this build of the proxy.
+ */
+static bool
+stats_valid(struct stats const *stats)
+{
+    struct stats_segment const * const segment = stats->region.base;
+
+    return stats->region.len >= sizeof *segment
+        && segment->magic == STATS_MAGIC
+        && segment->ncounters == STATS_COUNTERS
+        && segment->nblocks == STATS_BLOCKS
+        && segment->ngauges == STATS_GAUGES;
+}
+
+struct stats *
+stats_create(uint16_t port, bool verbose)
+{
+    struct stats *stats = stats_new(port);
+    struct timespec now;
+
+    if (stats == NULL)
+        return NULL;
+
+    if (shm_create_named(&stats->region, stats->name,
+                         sizeof *stats->segment) == FAILURE) {
+        free(stats);
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    stats->owner = true;
+    stats->segment = stats->region.base;
+    stats->segment->magic = STATS_MAGIC;
+    stats->segment->ncounters = STATS_COUNTERS;
+    stats->segment->nblocks = STATS_BLOCKS;
+    stats->segment->ngauges = STATS_GAUGES;
+    stats->segment->pid = getpid();
+    stats->segment->started = now.tv_sec + now.tv_nsec / 1e9;
+    for (int i = 0; i < STATS_BLOCKS; ++i)
+        for (int j = 0; j < STATS_COUNTERS; ++j)
+            atomic_init(&stats->segment->blocks[i].counters[j], 0);
+    for (int i = 0; i < STATS_GAUGES; ++i)
+        atomic_init(&stats->segment->gauges[i], 0);
+    stats_fork(stats, FAILURE);
+
+    if (verbose)
+        fprintf(stderr, "counting statistics in %s\n", stats->name);
+
+    return stats;
+}
+
+struct stats *
+stats_attach(int fd, uint16_t port, bool verbose)
+{
+    struct stats *stats = stats_new(port);
+
+    if (stats == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    if (shm_attach(&stats->region, fd) == FAILURE) {
+        free(stats);
+        return NULL;
+    }
+
+    if (!stats_valid(stats)) {
+        if (verbose)
+            fputs("stats_attach(): statistics do not match, starting over\n",
+                  stderr);
+        shm_destroy(&stats->region);
+        free(stats);
+        return NULL;
+    }
+
+    stats->owner = true;
+    stats->segment = stats->region.base;
+    stats->segment->pid = getpid();
+    stats_fork(stats, FAILURE);
+
+    if (verbose)
+        fprintf(stderr, "took over the statistics in %s\n", stats->name);
+
+    return stats;
+}
+
+struct stats *
+stats_open(uint16_t port)
+{
+    struct stats *stats = stats_new(port);
+    int error;
+
+    if (stats == NULL)
+        return NULL;
+
+    if (shm_open_named(&stats->region, stats->name) == FAILURE) {
+        error = errno;
+        free(stats);
+        errno = error;
+        return NULL;
+    }
+
+    if (!stats_valid(stats)) {
+        shm_destroy(&stats->region);
+        free(stats);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    stats->segment = stats->region.base;
+
+    return stats;
+}
+
+int
+stats_fd(struct stats const *stats)
+{
+    return stats->region.fd;
+}
+
+void
+stats_disown(struct stats *stats)
+{
+    stats->owner = false;
+}
+
+void
+stats_destroy(struct stats *stats)
+{
+    if (stats->owner)
+        shm_unlink(stats->name);
+    shm_destroy(&stats->region);
+    free(stats);
+}
+
+void
+stats_fork(struct stats *stats, int cpu)
+{
+    stats->block = &stats->segment->blocks[(cpu >= 0 ? cpu : getpid())
+                                           % STATS_BLOCKS];
+}
+
+void
+stats_add(struct stats *stats, enum stats_counter counter, unsigned long n)
+{
+    atomic_fetch_add_explicit(&stats->block->counters[counter], n,
+                              memory_order_relaxed);
+}
+
+void
+stats_set(struct stats *stats, enum stats_gauge gauge, unsigned long n)
+{
+    atomic_store_explicit(&stats->segment->gauges[gauge], n,
+                          memory_order_relaxed);
+}
+
+void
+stats_gauges(struct stats const *stats, unsigned long levels[STATS_GAUGES])
+{
+    for (int i = 0; i < STATS_GAUGES; ++i)
+        levels[i] = atomic_load_explicit(&stats->segment->gauges[i],
+                                         memory_order_relaxed);
+}
+
+void
+stats_total(struct stats const *stats, unsigned long totals[STATS_COUNTERS])
+{
+    memset(totals, 0, STATS_COUNTERS * sizeof totals[0]);
+
+    for (int i = 0; i < STATS_BLOCKS; ++i)
+        for (int j = 0; j < STATS_COUNTERS; ++j)
+            totals[j] += atomic_load_explicit(
+                &stats->segment->blocks[i].counters[j], memory_order_relaxed);
+}
+
+double
+stats_started(struct stats const *stats)
+{
+    return stats->segment->started;
+}
+
+pid_t
+stats_pid(struct stats const *stats)
+{
+    return stats->segment->pid;
+}
@@ -0,0 +1,158 @@
+/*
+ * stats.h
+ * Interface to the shared statistics of the proxy processes.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _stats_h_
+#define _stats_h_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "transfer.h"
+
+/*
+ * Each connection is served by a child process that exits when it is done,
+ * so counters are kept in a shared memory segment that outlives them. The
+ * segment is named after the port the proxy listens on, so the proxy-stat
+ * tool can open it and watch the counters without bothering the proxy.
+ *
+ * The counters are split into blocks, each on its own cache lines, and every
+ * process counts in the block picked by its CPU, or its process ID if it may
+ * run on any CPU. Processes on different CPUs then rarely write to the same
+ * cache line. Readers add up the blocks.
+ */
+
+#define STATS_BLOCKS 64 // Blocks of counters in the segment
+#define STATS_LINE 64   // Bytes in a cache line
+
+enum stats_counter {
+    STATS_CONNECTIONS,    // Client connections served
+    STATS_CLOSED,         // Client connections closed since
+    STATS_REQUESTS,       // Requests read from clients
+    STATS_REQUEST_BYTES,  // Bytes of requests sent on to servers
+    STATS_RESPONSE_BYTES, // Bytes of responses sent to clients
+    STATS_ERRORS,         // Error responses, by enum http_status_code
+    STATS_TRANSFERS = STATS_ERRORS + STATUS_COUNT, // By enum transfer_path
+    STATS_TRANSFER_BYTES = STATS_TRANSFERS + TRANSFER_PATHS, // Likewise
+    STATS_SHAPED_BYTES = STATS_TRANSFER_BYTES + TRANSFER_PATHS, // Paced
+    STATS_SHAPED_WAIT,    // Microseconds waited for bandwidth
+    STATS_COUNTERS
+};
+
+/*
+ * Gauges hold a level rather than a count, so they are kept once for the whole
+ * segment and set rather than added to.
+ */
+enum stats_gauge {
+    STATS_MEMORY,      // Bytes charged to the memory budget
+    STATS_MEMORY_PEAK, // The most ever charged at once
+    STATS_GAUGES
+};
+
+struct stats;
+
+/*
+ * Create the segment for a proxy listening on port.
+ * Returns NULL on failure.
+ */
+struct stats *stats_create(uint16_t port, bool verbose);
+
+/*
+ * Take over the segment of another proxy process, which handed over its file
+ * descriptor (see stats_fd()). Counting carries on where it left off.
+ * Returns NULL if the segment does not match this build of the proxy, in which
+ * case the file descriptor is closed.
+ */
+struct stats *stats_attach(int fd, uint16_t port, bool verbose);
+
+/*
+ * Open the segment of the proxy listening on port, to read the counters.
+ * Returns NULL on failure, with errno set.
+ */
+struct stats *stats_open(uint16_t port);
+
+/*
+ * The file descriptor of the segment, to hand to another process.
+ */
+int stats_fd(struct stats const *stats);
+
+/*
+ * Leave the segment's name to the process it was handed to, rather than
+ * removing it in stats_destroy().
+ */
+void stats_disown(struct stats *stats);
+
+/*
+ * Release the segment.
+ */
+void stats_destroy(struct stats *stats);
+
+/*
+ * Pick the block this process counts in. Must be called after forking.
+ * A process pinned to a CPU counts in the block for the CPU, otherwise cpu is
+ * -1 and the block is picked by process ID.
+ */
+void stats_fork(struct stats *stats, int cpu);
+
+/*
+ * Add n to a counter.
+ */
+void stats_add(struct stats *stats, enum stats_counter counter, unsigned long n);
+
+/*
+ * Set a gauge to n.
+ */
+void stats_set(struct stats *stats, enum stats_gauge gauge, unsigned long n);
+
+/*
+ * Read the gauges into levels.
+ */
+void stats_gauges(struct stats const *stats,
+                  unsigned long levels[STATS_GAUGES]);
+
+/*
+ * Add up the blocks into totals.
+ */
+void stats_total(struct stats const *stats,
+                 unsigned long totals[STATS_COUNTERS]);
+
+/*
+ * Seconds on CLOCK_MONOTONIC when the segment was created.
+ */
+double stats_started(struct stats const *stats);
+
+/*
+ * The process ID of the proxy counting in the segment. A proxy killed by a
+ * signal leaves its segment behind until the next one on the port starts.
+ */
+pid_t stats_pid(struct stats const *stats);
+
+#endif // _stats_h_
@@ -0,0 +1,579 @@
+/*
+ * tls.c
+ * Implementation of TLS termination for client connections.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "tls.h"
+
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include "fds.h"
+#include "shm.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define TLS_SESSIONS 1024 // Sessions kept in the shared cache
+#define TLS_SESSION_KEY_MAX 256 // Session ID, or HOST:PORT for upstreams
+#define TLS_SESSION_DER_MAX 2048 // Larger sessions are not cached
+#define TLS_PUMP_BUFLEN 16384 // The largest TLS record
+#define TLS_TICKET_WAIT_MS 100 // For a server's session tickets after kTLS
+
+/*
+ * A serialized session, found by its session ID when we are the server, or
+ * by the address of the server when we are the client.
+ */
+struct tls_session {
+    unsigned key_len; // 0 if the slot is unused
+    unsigned char key[TLS_SESSION_KEY_MAX];
+    time_t expires;
+    unsigned der_len;
+    unsigned char der[TLS_SESSION_DER_MAX];
+};
+
+struct tls_cache {
+    shm_lock_t lock;
+    struct shm_region region;
+    struct tls_session sessions[TLS_SESSIONS];
+};
+
+struct tls {
+    bool verbose;
+    SSL_CTX *ctx;
+    struct tls_cache *cache;
+};
+
+/*
+ * FNV-1a, to pick the one slot a session can be in.
+ */
+static struct tls_session *
+tls_session_slot(struct tls_cache *cache, unsigned char const *key, size_t len)
+{
+    uint32_t h = 0x811c9dc5;
+
+    for (size_t i = 0; i < len; ++i) {
+        h ^= key[i];
+        h *= 0x01000193;
+    }
+
+    return &cache->sessions[h % TLS_SESSIONS];
+}
+
+/*
+ * Store a session under key, replacing whatever was in its slot.
+ */
+static void
+tls_session_put(struct tls_cache *cache, unsigned char const *key, size_t len,
+                SSL_SESSION *sess)
+{
+    struct tls_session * const slot = tls_session_slot(cache, key, len);
+
+    unsigned char der[TLS_SESSION_DER_MAX], *p = der;
+    int der_len;
+
+    der_len = i2d_SSL_SESSION(sess, NULL);
+    if (der_len <= 0 || der_len > sizeof der
+        || len == 0 || len > sizeof slot->key)
+        return;
+    i2d_SSL_SESSION(sess, &p);
+
+    shm_lock(&cache->lock);
+    slot->key_len = len;
+    memcpy(slot->key, key, len);
+    slot->expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+    slot->der_len = der_len;
+    memcpy(slot->der, der, der_len);
+    shm_unlock(&cache->lock);
+}
+
+/*
+ * Find the session stored under key.
+ * Returns a new session the caller must free, or NULL if there is none.
+ */
+static SSL_SESSION *
+tls_session_find(struct tls_cache *cache, unsigned char const *key, size_t len)
+{
+    struct tls_session * const slot = tls_session_slot(cache, key, len);
+
+    unsigned char der[TLS_SESSION_DER_MAX];
+    unsigned char const *p = der;
+    unsigned der_len = 0;
+
+    shm_lock(&cache->lock);
+    if (slot->key_len == len && memcmp(slot->key, key, len) == SUCCESS
+        && slot->expires > time(NULL)) {
+        der_len = slot->der_len;
+        memcpy(der, slot->der, der_len);
+    }
+    shm_unlock(&cache->lock);
+
+    if (der_len == 0)
+        return NULL;
+
+    return d2i_SSL_SESSION(NULL, &p, der_len);
+}
+
+static int
+tls_session_new(SSL *ssl, SSL_SESSION *sess)
+{
+    struct tls const *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    char const *server = SSL_get_app_data(ssl);
+
+    unsigned char const *id;
+    unsigned id_len;
+
+    if (server != NULL)
+        tls_session_put(tls->cache, (unsigned char const *)server,
+                        strlen(server), sess);
+    else {
+        id = SSL_SESSION_get_id(sess, &id_len);
+        tls_session_put(tls->cache, id, id_len, sess);
+    }
+
+    return 0; // The session was copied, OpenSSL keeps its reference.
+}
+
+static SSL_SESSION *
+tls_session_get(SSL *ssl, unsigned char const *id, int id_len, int *copy)
+{
+    struct tls const *tls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    *copy = 0;
+
+    return tls_session_find(tls->cache, id, id_len);
+}
+
+static void
+tls_session_remove(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    struct tls const *tls = SSL_CTX_get_app_data(ctx);
+
+    struct tls_session *slot;
+    unsigned id_len;
+    unsigned char const *id = SSL_SESSION_get_id(sess, &id_len);
+
+    slot = tls_session_slot(tls->cache, id, id_len);
+
+    shm_lock(&tls->cache->lock);
+    if (slot->key_len == id_len && memcmp(slot->key, id, id_len) == SUCCESS)
+        slot->key_len = 0;
+    shm_unlock(&tls->cache->lock);
+}
+
+/*
+ * Wrap a context with a shared session cache.
+ * Frees ctx on failure.
+ */
+static struct tls *
+tls_new(SSL_CTX *ctx, bool verbose)
+{
+    struct shm_region region;
+    struct tls *tls;
+
+    tls = calloc(1, sizeof *tls);
+    if (tls == NULL) {
+        perror("tls_new(): failed to allocate context");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    if (shm_create(&region, "proxy-tls-sessions", sizeof *tls->cache) == FAILURE) {
+        SSL_CTX_free(ctx);
+        free(tls);
+        return NULL;
+    }
+    tls->cache = region.base;
+    atomic_flag_clear(&tls->cache->lock);
+    tls->cache->region = region;
+
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_sess_set_new_cb(ctx, tls_session_new);
+    SSL_CTX_set_app_data(ctx, tls);
+
+    tls->ctx = ctx;
+    tls->verbose = verbose;
+
+    return tls;
+}
+
+/*
+ * Pick HTTP/2 over HTTP/1.1 when the client offers both.
+ */
+static int
+tls_select_alpn(SSL *ssl, unsigned char const **out, unsigned char *outlen,
+                unsigned char const *in, unsigned inlen, void *arg)
+{
+    static unsigned char const protos[] = "\x02h2\x08http/1.1";
+
+    // Without a protocol in common, carry on as if nothing was offered.
+    if (SSL_select_next_proto((unsigned char **)out, outlen,
+                              protos, sizeof protos - 1, in, inlen)
+        != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+struct tls *
+tls_create(char const *cert_file, char const *key_file, bool http2,
+           bool verbose)
+{
+    static unsigned char const sid_ctx[] = "proxy";
+
+    struct tls *tls;
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL
+        || SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) != 1
+        || SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1
+        || SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof sid_ctx - 1) != 1) {
+        fputs("tls_create(): failed to set up TLS context\n", stderr);
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    // The internal cache would only be seen by one child.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER
+                                        | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_get_cb(ctx, tls_session_get);
+    SSL_CTX_sess_set_remove_cb(ctx, tls_session_remove);
+
+    if (http2)
+        SSL_CTX_set_alpn_select_cb(ctx, tls_select_alpn, NULL);
+
+    tls = tls_new(ctx, verbose);
+    if (tls != NULL && verbose)
+        fprintf(stderr, "terminating TLS with certificate %s\n", cert_file);
+
+    return tls;
+}
+
+struct tls *
+tls_create_client(char const *ca_file, bool verbose)
+{
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL
+        || SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) != 1
+        || SSL_CTX_set_default_verify_paths(ctx) != 1
+        || (ca_file != NULL
+            && SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1)) {
+        fputs("tls_create_client(): failed to set up TLS context\n", stderr);
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    // Sessions are looked up by server in tls_connect().
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+                                        | SSL_SESS_CACHE_NO_INTERNAL);
+
+    return tls_new(ctx, verbose);
+}
+
+void
+tls_destroy(struct tls *tls)
+{
+    struct shm_region region = tls->cache->region;
+
+    SSL_CTX_free(tls->ctx);
+    shm_destroy(&region);
+    free(tls);
+}
+
+static int
+write_all(int fd, char const *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t const n = write(fd, buf, len);
+
+        if (n == FAILURE)
+            return FAILURE;
+        buf += n;
+        len -= n;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Move data between the TLS connection on fd and the plaintext socket until
+ * both sides are done.
+ */
+static void
+tls_pump(SSL *ssl, int fd, int plain)
+{
+    struct pollfd pfds[] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = plain, .events = POLLIN },
+    };
+    char buf[TLS_PUMP_BUFLEN];
+    int n;
+
+    // Come back from SSL_read() after records without data, such as session
+    // tickets, rather than blocking while the other side has something.
+    SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);
+
+    for (;;) {
+        // OpenSSL may already have read more than it returned.
+        if (SSL_pending(ssl) > 0)
+            pfds[0].revents = POLLIN, pfds[1].revents = 0;
+        else if (poll(pfds, 2, -1) == FAILURE) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfds[0].revents != 0) {
+            n = SSL_read(ssl, buf, sizeof buf);
+            if (n > 0) {
+                if (write_all(plain, buf, n) == FAILURE)
+                    break;
+            }
+            else if (SSL_get_error(ssl, n) != SSL_ERROR_WANT_READ) {
+                // The peer is done sending.
+                shutdown(plain, SHUT_WR);
+                pfds[0].fd = FAILURE;
+            }
+        }
+
+        if (pfds[1].revents != 0) {
+            n = read(plain, buf, sizeof buf);
+            if (n <= 0) {
+                // The proxy is done with the connection.
+                SSL_shutdown(ssl);
+                break;
+            }
+            if (SSL_write(ssl, buf, n) <= 0)
+                break;
+        }
+    }
+}
+
+/*
+ * Close every descriptor above stderr other than a and b.
+ */
+static void
+close_all_but(int a, int b)
+{
+    int const lo = a < b ? a : b, hi = a < b ? b : a;
+
+    if (lo > STDERR_FILENO + 1)
+        close_fds(STDERR_FILENO + 1, lo - 1);
+    if (hi > lo + 1)
+        close_fds(lo + 1, hi - 1);
+    close_fds(hi + 1, FAILURE);
+}
+
+#ifdef SSL_OP_ENABLE_KTLS
+/*
+ * A TLS 1.3 server sends its session tickets after the handshake is done on
+ * our side, so they would reach the kernel, not OpenSSL, once the record
+ * layer is handed over, and there would be no session to resume next time.
+ * Give OpenSSL until the first ticket, or a moment, to take them in. A
+ * resumed session stays good to resume again, so that only costs a round
+ * trip on full handshakes. HTTP servers do not speak first, so there is
+ * nothing else to read yet.
+ */
+static void
+tls_await_ticket(SSL *ssl, int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    char c;
+    int n;
+
+    if (SSL_version(ssl) < TLS1_3_VERSION || SSL_session_reused(ssl))
+        return;
+
+    SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);
+    while (!SSL_SESSION_has_ticket(SSL_get0_session(ssl))
+           && poll(&pfd, 1, TLS_TICKET_WAIT_MS) == 1) {
+        n = SSL_peek(ssl, &c, 1);
+        if (n > 0 || SSL_get_error(ssl, n) != SSL_ERROR_WANT_READ)
+            break;
+    }
+}
+#endif
+
+/*
+ * Free a connection that carries on elsewhere (in the kernel or in another
+ * process). OpenSSL would otherwise take the session for a broken one and
+ * drop it from the cache.
+ */
+static void
+tls_release(SSL *ssl)
+{
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(ssl);
+}
+
+/*
+ * Hand over a connection after the handshake, to the kernel if it can do the
+ * record layer both ways, or else to a relay process.
+ * Returns the socket to use for plaintext, or -1 on failure.
+ */
+static int
+tls_handoff(struct tls *tls, SSL *ssl, int fd)
+{
+    bool const verbose = tls->verbose;
+
+    int pair[2];
+
+    if (verbose)
+        fprintf(stderr, "TLS handshake done (%s, %s%s)\n",
+                SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+                SSL_session_reused(ssl) ? ", resumed" : "");
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))
+        && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        if (verbose)
+            fputs("kernel TLS enabled\n", stderr);
+        if (!SSL_is_server(ssl))
+            tls_await_ticket(ssl, fd);
+        tls_release(ssl);
+        return fd;
+    }
+#endif
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == FAILURE) {
+        perror("tls_handoff(): failed to create socket pair");
+        SSL_free(ssl);
+        close(fd);
+        return FAILURE;
+    }
+
+    switch (fork()) {
+    case -1:
+        perror("tls_handoff(): failed to fork a child process");
+        close(pair[0]);
+        close(pair[1]);
+        SSL_free(ssl);
+        close(fd);
+        return FAILURE;
+    case 0:
+        // The shared memory stays mapped, other connections must not stay open.
+        close_all_but(fd, pair[0]);
+        tls_pump(ssl, fd, pair[0]);
+        SSL_free(ssl);
+        exit(EXIT_SUCCESS);
+    default:
+        if (verbose)
+            fputs("relaying TLS records in userspace\n", stderr);
+        close(pair[0]);
+        tls_release(ssl);
+        close(fd);
+        return pair[1];
+    }
+}
+
+int
+tls_accept(struct tls *tls, int fd)
+{
+    SSL *ssl;
+
+    ssl = SSL_new(tls->ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+        if (tls->verbose) {
+            fputs("tls_accept(): handshake failed\n", stderr);
+            ERR_print_errors_fp(stderr);
+        }
+        SSL_free(ssl);
+        close(fd);
+        return FAILURE;
+    }
+
+    return tls_handoff(tls, ssl, fd);
+}
+
+int
+tls_connect(struct tls *tls, int fd, char const *host, char const *port)
+{
+    char server[TLS_SESSION_KEY_MAX];
+    struct in6_addr ip;
+    bool const literal = inet_pton(AF_INET, host, &ip) == 1
+        || inet_pton(AF_INET6, host, &ip) == 1;
+    SSL_SESSION *sess;
+    SSL *ssl;
+
+    // The server key lives as long as the connection: the relay process
+    // runs within this call.
+    snprintf(server, sizeof server, "%s:%s", host, port);
+
+    ssl = SSL_new(tls->ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1
+        || (literal ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host)
+            : SSL_set_tlsext_host_name(ssl, host) && SSL_set1_host(ssl, host))
+           != 1) {
+        fputs("tls_connect(): failed to set up connection\n", stderr);
+        SSL_free(ssl);
+        close(fd);
+        return FAILURE;
+    }
+    SSL_set_app_data(ssl, server);
+
+    sess = tls_session_find(tls->cache, (unsigned char *)server, strlen(server));
+    if (sess != NULL) {
+        SSL_set_session(ssl, sess);
+        SSL_SESSION_free(sess);
+    }
+
+    if (SSL_connect(ssl) != 1) {
+        if (tls->verbose) {
+            fprintf(stderr, "tls_connect(): handshake with %s failed\n", server);
+            ERR_print_errors_fp(stderr);
+        }
+        SSL_free(ssl);
+        close(fd);
+        return FAILURE;
+    }
+
+    return tls_handoff(tls, ssl, fd);
+}
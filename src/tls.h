@@ -0,0 +1,92 @@
+/*
+ * tls.h
+ * Interface to TLS termination for client connections.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _tls_h_
+#define _tls_h_
+
+#include <stdbool.h>
+
+/*
+ * TLS is terminated for clients and originated to servers the same way.
+ *
+ * The handshake is done with OpenSSL in the child process serving the
+ * connection. If the kernel can take over the record layer in both directions
+ * (kTLS), the socket is then used as it is: reads return plaintext and writes,
+ * including splice(2) and sendfile(2), are encrypted by the kernel.
+ *
+ * Otherwise the child forks a process that moves records between the socket
+ * and OpenSSL, and hands back one end of a socket pair carrying plaintext, so
+ * the rest of the proxy never needs to know the difference.
+ *
+ * Sessions can be resumed in any child: the ticket keys are made before the
+ * children are forked, and sessions without tickets are kept in shared memory.
+ * So are the sessions from servers, for the next connection to each one. A
+ * TLS 1.3 server's session tickets come after the handshake, and are waited
+ * for before the kernel takes over a connection that was not resumed.
+ */
+
+struct tls;
+
+/*
+ * Create a server context with the certificate chain and private key in the
+ * given PEM files. With http2, clients that offer HTTP/2 in ALPN are told to
+ * go ahead with it.
+ * Returns NULL on failure.
+ */
+struct tls *tls_create(char const *cert_file, char const *key_file,
+                       bool http2, bool verbose);
+
+/*
+ * Create a client context, trusting the system's certificate authorities and
+ * those in ca_file if it is not NULL.
+ * Returns NULL on failure.
+ */
+struct tls *tls_create_client(char const *ca_file, bool verbose);
+
+/*
+ * Release the context and its shared session cache.
+ */
+void tls_destroy(struct tls *tls);
+
+/*
+ * Do the server side of the handshake on a connected socket.
+ * Returns a socket carrying plaintext for the connection, which may be fd
+ * itself, or -1 on failure. Either way fd belongs to TLS from here on.
+ */
+int tls_accept(struct tls *tls, int fd);
+
+/*
+ * Do the client side of the handshake with the server at host and port on a
+ * connected socket, checking the server's certificate against host and
+ * resuming the last session with the same server if there is one.
+ * Returns as tls_accept() does.
+ */
+int tls_connect(struct tls *tls, int fd, char const *host, char const *port);
+
+#endif // _tls_h_
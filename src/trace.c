@@ -0,0 +1,292 @@
+/*
+ * trace.c
+ * Implementation of the per-request phase tracing.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "trace.h"
+
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+/*
+ * A slot in the ring buffer.
+ * The slot for the nth trace has a seq of 2n+1 while it is being written and
+ * 2n+2 once it is complete, so the master can tell a torn or overwritten entry
+ * without making the writers wait for it.
+ */
+struct trace_entry {
+    atomic_uint_fast64_t seq;
+    pid_t pid;
+    uint64_t t[TRACE_PHASES];
+    char name[TRACE_NAME_MAX];
+};
+
+struct tracer {
+    bool verbose;
+    unsigned sample;
+    pid_t pid; // of the master, which the children are shown as threads of
+    size_t nentries;
+    atomic_uint_fast64_t requests; // Requests seen, for sampling
+    atomic_uint_fast64_t next; // Number of the next trace to be added
+    struct shm_region region;
+    struct trace_entry entries[];
+};
+
+/*
+ * What each request was doing until it reached a phase, shown as a slice
+ * ending at that phase.
+ */
+static char const * const phase_names[TRACE_PHASES] = {
+    [TRACE_PARSED] = "read request",
+    [TRACE_RESOLVED] = "resolve",
+    [TRACE_CONNECTED] = "connect",
+    [TRACE_SENT] = "send request",
+    [TRACE_FIRST_BYTE] = "wait for response",
+    [TRACE_DONE] = "send response",
+};
+
+struct tracer *
+tracer_create(size_t nentries, unsigned sample, bool verbose)
+{
+    struct shm_region region;
+    struct tracer *tracer;
+
+    if (shm_create(&region, "proxy-trace",
+                   sizeof *tracer + nentries * sizeof tracer->entries[0])
+        == FAILURE)
+        return NULL;
+
+    tracer = region.base;
+    tracer->verbose = verbose;
+    tracer->sample = sample;
+    tracer->pid = getpid();
+    tracer->nentries = nentries;
+    atomic_init(&tracer->requests, 0);
+    atomic_init(&tracer->next, 0);
+    tracer->region = region;
+    for (size_t i = 0; i < nentries; ++i)
+        atomic_init(&tracer->entries[i].seq, 0);
+
+    if (verbose)
+        fprintf(stderr, "tracing 1 in %u requests, keeping the last %zu\n",
+                sample, nentries);
+
+    return tracer;
+}
+
+void
+tracer_destroy(struct tracer *tracer)
+{
+    struct shm_region region = tracer->region;
+
+    shm_destroy(&region);
+}
+
+void
+trace_begin(struct tracer *tracer, struct trace *trace, uint64_t start)
+{
+    trace->sampled = tracer != NULL
+        && atomic_fetch_add_explicit(&tracer->requests, 1,
+                                     memory_order_relaxed)
+           % tracer->sample == 0;
+    if (!trace->sampled)
+        return;
+
+    memset(trace->t, 0, sizeof trace->t);
+    trace->t[TRACE_ACCEPTED] = start;
+    trace->name[0] = '\0';
+}
+
+void
+trace_name(struct trace *trace, struct iostring method, struct iostring target)
+{
+    if (trace->sampled)
+        snprintf(trace->name, sizeof trace->name, "%.*s %.*s",
+                 (int)method.len, method.p, (int)target.len, target.p);
+}
+
+void
+trace_end(struct tracer *tracer, struct trace *trace)
+{
+    struct trace_entry *entry;
+    uint_fast64_t n;
+
+    if (!trace->sampled)
+        return;
+    trace->sampled = false;
+
+    n = atomic_fetch_add_explicit(&tracer->next, 1, memory_order_relaxed);
+    entry = &tracer->entries[n % tracer->nentries];
+
+    atomic_store_explicit(&entry->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->pid = getpid();
+    memcpy(entry->t, trace->t, sizeof entry->t);
+    memcpy(entry->name, trace->name, sizeof entry->name);
+    atomic_store_explicit(&entry->seq, 2 * n + 2, memory_order_release);
+}
+
+/*
+ * Copy the nth trace out of the ring buffer.
+ * Returns false if it has been overwritten, or is still being written.
+ */
+static bool
+trace_read(struct tracer *tracer, uint_fast64_t n, struct trace_entry *copy)
+{
+    struct trace_entry *entry = &tracer->entries[n % tracer->nentries];
+
+    if (atomic_load_explicit(&entry->seq, memory_order_acquire) != 2 * n + 2)
+        return false;
+
+    copy->pid = entry->pid;
+    memcpy(copy->t, entry->t, sizeof copy->t);
+    memcpy(copy->name, entry->name, sizeof copy->name);
+    atomic_thread_fence(memory_order_acquire);
+
+    return atomic_load_explicit(&entry->seq, memory_order_relaxed) == 2 * n + 2;
+}
+
+/*
+ * Write a string as the contents of a JSON string.
+ */
+static void
+write_json_string(FILE *f, char const *s)
+{
+    for (unsigned char c; (c = *s) != '\0'; ++s)
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+}
+
+/*
+ * Write a complete ("X") event, with times in microseconds as the format has
+ * it, keeping the nanoseconds as a fraction.
+ */
+static void
+write_event(FILE *f, char const *name, char const *cat, pid_t pid, pid_t tid,
+            uint64_t start, uint64_t end, char const *args)
+{
+    uint64_t const dur = end > start ? end - start : 0;
+
+    fputs(",\n{\"name\":\"", f);
+    write_json_string(f, name);
+    fprintf(f, "\",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+            "\"pid\":%d,\"tid\":%d%s}",
+            cat, start / 1000, (unsigned)(start % 1000),
+            dur / 1000, (unsigned)(dur % 1000), (int)pid, (int)tid, args);
+}
+
+int
+tracer_dump(struct tracer *tracer, char const *path)
+{
+    uint_fast64_t const next =
+        atomic_load_explicit(&tracer->next, memory_order_acquire);
+    uint_fast64_t const first =
+        next > tracer->nentries ? next - tracer->nentries : 0;
+
+    char tmp[PATH_MAX];
+    struct trace_entry entry;
+    size_t dumped = 0;
+    FILE *f;
+
+    // Readers never see a partly written file.
+    if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= sizeof tmp) {
+        fprintf(stderr, "tracer_dump(): path too long: %s\n", path);
+        return FAILURE;
+    }
+
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror("tracer_dump(): failed to open trace file");
+        return FAILURE;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"proxy\"}}", (int)tracer->pid);
+
+    for (uint_fast64_t n = first; n < next; ++n) {
+        uint64_t prev;
+        int last = TRACE_ACCEPTED;
+
+        if (!trace_read(tracer, n, &entry))
+            continue;
+
+        for (int i = TRACE_ACCEPTED; i < TRACE_PHASES; ++i)
+            if (entry.t[i] != 0)
+                last = i;
+
+        // The whole request, with a slice for each phase it went through.
+        write_event(f, entry.name[0] != '\0' ? entry.name : "request",
+                    "request", tracer->pid, entry.pid,
+                    entry.t[TRACE_ACCEPTED], entry.t[last],
+                    last == TRACE_DONE ? ",\"args\":{\"complete\":true}"
+                                       : ",\"args\":{\"complete\":false}");
+        prev = entry.t[TRACE_ACCEPTED];
+        for (int i = TRACE_ACCEPTED + 1; i <= last; ++i) {
+            if (entry.t[i] == 0)
+                continue;
+            write_event(f, phase_names[i], "phase", tracer->pid, entry.pid,
+                        prev, entry.t[i], "");
+            prev = entry.t[i];
+        }
+        ++dumped;
+    }
+
+    fputs("\n]}\n", f);
+
+    if (fclose(f) == EOF) {
+        perror("tracer_dump(): failed to write trace file");
+        unlink(tmp);
+        return FAILURE;
+    }
+
+    if (rename(tmp, path) == FAILURE) {
+        perror("tracer_dump(): failed to replace trace file");
+        unlink(tmp);
+        return FAILURE;
+    }
+
+    if (tracer->verbose)
+        fprintf(stderr, "dumped %zu traces to %s\n", dumped, path);
+
+    return SUCCESS;
+}
@@ -0,0 +1,138 @@
+/*
+ * trace.h
+ * Interface to the per-request phase tracing.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _trace_h_
+#define _trace_h_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "iostring.h"
+
+/*
+ * A sample of the requests are traced: each child process notes when its
+ * request reaches each phase, and the trace is added to a ring buffer in
+ * shared memory when the request is done. The oldest traces are overwritten
+ * as new ones come in, so tracing can be left on.
+ *
+ * The master dumps the ring buffer to a file in the Chrome trace event
+ * format, which chrome://tracing and https://ui.perfetto.dev can show.
+ */
+
+#define TRACE_NAME_MAX 96
+
+/*
+ * The phases of a request, in the order they are reached.
+ * Phases that do not apply to a request are skipped, e.g. the server is not
+ * contacted for a cache hit and is not connected to again on a kept-alive
+ * connection.
+ */
+enum trace_phase {
+    TRACE_ACCEPTED,   // The connection was accepted, or the request arrived
+    TRACE_PARSED,     // The request was read and parsed
+    TRACE_RESOLVED,   // The server's address was looked up
+    TRACE_CONNECTED,  // The server was connected to
+    TRACE_SENT,       // The request was sent to the server
+    TRACE_FIRST_BYTE, // The start of the response was received
+    TRACE_DONE,       // The last byte of the response was sent
+    TRACE_PHASES
+};
+
+struct tracer;
+
+/*
+ * The trace of the request a child process is working on.
+ */
+struct trace {
+    bool sampled; // Nothing is noted unless the request is sampled
+    uint64_t t[TRACE_PHASES]; // Nanoseconds on CLOCK_MONOTONIC, 0 if skipped
+    char name[TRACE_NAME_MAX]; // Method and target of the request
+};
+
+/*
+ * Create a ring buffer for the last nentries traces, tracing one request in
+ * every sample.
+ * Returns NULL on failure.
+ */
+struct tracer *tracer_create(size_t nentries, unsigned sample, bool verbose);
+
+/*
+ * Release the ring buffer.
+ */
+void tracer_destroy(struct tracer *tracer);
+
+/*
+ * The current time, as noted in traces.
+ */
+static inline uint64_t
+trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Start the trace of a request that reached TRACE_ACCEPTED at start, if it is
+ * sampled. The tracer may be NULL if tracing is disabled.
+ */
+void trace_begin(struct tracer *tracer, struct trace *trace, uint64_t start);
+
+/*
+ * Name a trace after the request's method and target.
+ */
+void trace_name(struct trace *trace,
+                struct iostring method, struct iostring target);
+
+/*
+ * Note that the request reached a phase.
+ */
+static inline void
+trace_mark(struct trace *trace, enum trace_phase phase)
+{
+    if (trace->sampled)
+        trace->t[phase] = trace_now();
+}
+
+/*
+ * Add the trace to the ring buffer, if it was sampled, and stop tracing.
+ */
+void trace_end(struct tracer *tracer, struct trace *trace);
+
+/*
+ * Write the traces in the ring buffer to the file at path, replacing it.
+ * Returns -1 on failure, 0 otherwise.
+ */
+int tracer_dump(struct tracer *tracer, char const *path);
+
+#endif // _trace_h_
@@ -0,0 +1,688 @@
+/*
+ * transfer.c
+ * Implementation of moving bytes between file descriptors.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "transfer.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+/* splice(2) and sendfile(2) are only available on Linux. */
+#include <sys/sendfile.h>
+#endif
+
+#include "shape.h"
+#include "stats.h"
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#ifndef MSG_MORE
+#define MSG_MORE 0 // Linux only
+#endif
+
+#define COPY_BUFLEN 16384 // Bytes copied at a time
+
+#define CALIBRATE_MIN 256 // Smallest transfer timed
+#define CALIBRATE_MAX (64 * 1024) // Largest transfer timed
+#define CALIBRATE_REPS 32 // Transfers timed at a time
+#define CALIBRATE_ROUNDS 3 // Best of this many times is kept
+#define CALIBRATE_SOCKBUF (1024 * 1024) // So timed transfers never block
+
+struct transfer {
+    size_t splice_min, sendfile_min;
+    struct stats *stats;
+    struct shaper *shaper;         // NULL if no transfers are shaped
+    int shaped_fd;                 // Transfers to this socket are shaped
+    struct shape_path const *path; // And charged to these classes
+};
+
+static char const * const path_names[TRANSFER_PATHS] = {
+    [TRANSFER_COPY] = "copied",
+    [TRANSFER_SPLICE] = "spliced",
+    [TRANSFER_SENDFILE] = "sent with sendfile",
+};
+
+/*
+ * The most of what remains of a transfer to move at once, if it is shaped,
+ * or otherwise max.
+ */
+static size_t
+chunk(struct transfer const *shaped, size_t remaining, size_t max)
+{
+    if (shaped != NULL && max > SHAPE_QUANTUM)
+        max = SHAPE_QUANTUM;
+
+    return remaining < max ? remaining : max;
+}
+
+/*
+ * Wait for the bandwidth to send a chunk of len bytes, if the transfer is
+ * shaped.
+ */
+static void
+pace(struct transfer const *shaped, size_t len)
+{
+    if (shaped != NULL)
+        shaper_take(shaped->shaper, shaped->path, len);
+}
+
+/*
+ * Move len bytes from rx_fd to tx_fd through a buffer in userspace.
+ * Never reads past len, so whatever follows is left on rx_fd.
+ * The loops take the transfer settings if the transfer is shaped, or NULL.
+ */
+static ssize_t
+copy_loop(int rx_fd, int tx_fd, size_t len, struct transfer const *shaped)
+{
+    char buf[COPY_BUFLEN];
+    size_t remaining = len;
+
+    while (remaining > 0) {
+        ssize_t const res = read(rx_fd, buf,
+                                 chunk(shaped, remaining, sizeof buf));
+        if (res == 0)
+            return RX_SHORT; // peer closed connection
+        if (res == FAILURE)
+            return READ_FAIL;
+
+        pace(shaped, res);
+
+        // We won't necessarily get to write the full chunk in one go,
+        // so this loops until the buffer has been completely drained.
+        // Until the last chunk, tell the kernel there is more to come so it
+        // only sends full segments.
+        for (ssize_t n = 0; n < res; ) {
+            ssize_t const res1 = send(tx_fd, buf + n, res - n,
+                                      remaining > (size_t)res ? MSG_MORE : 0);
+            if (res1 == FAILURE)
+                return WRITE_FAIL;
+            n += res1;
+        }
+
+        remaining -= res;
+    }
+
+    return len;
+}
+
+/*
+ * Send len bytes of a file from *offset through a buffer in userspace.
+ */
+static ssize_t
+pread_loop(int file_fd, int tx_fd, off_t *offset, size_t len,
+           struct transfer const *shaped)
+{
+    char buf[COPY_BUFLEN];
+    size_t remaining = len;
+
+    while (remaining > 0) {
+        ssize_t const res = pread(file_fd, buf,
+                                  chunk(shaped, remaining, sizeof buf),
+                                  *offset);
+        if (res == 0)
+            return RX_SHORT; // the file is shorter than expected
+        if (res == FAILURE)
+            return READ_FAIL;
+
+        pace(shaped, res);
+
+        for (ssize_t n = 0; n < res; ) {
+            ssize_t const res1 = send(tx_fd, buf + n, res - n,
+                                      remaining > (size_t)res ? MSG_MORE : 0);
+            if (res1 == FAILURE)
+                return WRITE_FAIL;
+            n += res1;
+        }
+
+        *offset += res;
+        remaining -= res;
+    }
+
+    return len;
+}
+
+#ifdef __linux__
+/*
+ * Move len bytes from rx_fd to tx_fd with splice(2).
+ */
+static ssize_t
+splice_loop(int rx_fd, int tx_fd, size_t len, struct transfer const *shaped)
+{
+    ssize_t n, res = SUCCESS;
+    size_t remaining = len;
+    unsigned more;
+
+    // splice(2) uses a pipe as an in-kernel "buffer" for zero-copy
+    // transfer between sockets.
+    // http://yarchive.net/comp/linux/splice.html
+    int pipefd[2];
+
+    if (pipe(pipefd) == FAILURE)
+        return PIPE_FAIL;
+
+    while (remaining > 0) {
+        // Move a chunk of data from the rx socket to the pipe.
+        // The pipe is empty here, so this only blocks until the socket has
+        // something to read. TCP sockets never take SPLICE_F_NONBLOCK into
+        // account, but the socket pair behind a TLS connection does.
+        // Don't read past the end of the transfer.
+        // NB: INT_MAX is the maximum size allowed by splice(2).
+        res = splice(rx_fd, NULL,
+                     pipefd[1], NULL,
+                     chunk(shaped, remaining, INT_MAX), 0);
+        if (res == 0) {
+            res = RX_SHORT;
+            break;
+        }
+        if (res == FAILURE) {
+            res = SPLICE_RX_FAIL;
+            break;
+        }
+
+        n = res;
+        pace(shaped, n);
+
+        // Move a chunk of data from the pipe to the tx socket.
+        // We won't necessarily get to write the full chunk in one go,
+        // so this loops until the pipe has been completely drained.
+        // Until the last chunk, tell the kernel there is more to come so it
+        // only sends full segments.
+        more = remaining > (size_t)res ? SPLICE_F_MORE : 0;
+        do {
+            ssize_t const res1 = splice(pipefd[0], NULL,
+                                        tx_fd, NULL,
+                                        n, more);
+            if (res1 <= 0) {
+                res = SPLICE_TX_FAIL;
+                break;
+            }
+
+            n -= res1;
+        } while (n);
+
+        if (res < SUCCESS)
+            break; // The inner loop failed, break out of the outer loop.
+
+        remaining -= res;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    if (res < SUCCESS)
+        return res;
+
+    return len;
+}
+
+/*
+ * Send len bytes of a file from *offset with sendfile(2).
+ */
+static ssize_t
+sendfile_loop(int file_fd, int tx_fd, off_t *offset, size_t len,
+              struct transfer const *shaped)
+{
+    size_t remaining = len;
+
+    while (remaining > 0) {
+        ssize_t const res = sendfile(tx_fd, file_fd, offset,
+                                     chunk(shaped, remaining, remaining));
+        if (res == 0)
+            return RX_SHORT; // the file is shorter than expected
+        if (res == FAILURE)
+            return WRITE_FAIL;
+        // The kernel has it already, so the next chunk waits instead.
+        pace(shaped, res);
+        remaining -= res;
+    }
+
+    return len;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Connect a pair of TCP sockets over loopback.
+ * fds[0] is the end that was connected, fds[1] the end that was accepted.
+ */
+static int
+loopback_pair(int fds[2])
+{
+    int const bufsize = CALIBRATE_SOCKBUF, option = 1;
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t salen = sizeof sa;
+    int listen_fd;
+
+    fds[0] = fds[1] = FAILURE;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == FAILURE)
+        return FAILURE;
+
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] == FAILURE) {
+        close(listen_fd);
+        return FAILURE;
+    }
+
+    // The buffer sizes must be set before connecting for the TCP window to
+    // make use of them. The accepted socket inherits them.
+    setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof bufsize);
+    setsockopt(listen_fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof bufsize);
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof bufsize);
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof bufsize);
+
+    if (bind(listen_fd, (struct sockaddr *)&sa, sizeof sa) == FAILURE
+        || listen(listen_fd, 1) == FAILURE
+        || getsockname(listen_fd, (struct sockaddr *)&sa, &salen) == FAILURE
+        || connect(fds[0], (struct sockaddr *)&sa, salen) == FAILURE
+        || (fds[1] = accept(listen_fd, NULL, NULL)) == FAILURE) {
+        close(fds[0]);
+        close(listen_fd);
+        return FAILURE;
+    }
+
+    close(listen_fd);
+
+    // Don't let Nagle's algorithm hold back the tail of a transfer.
+    for (int i = 0; i < 2; ++i)
+        setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &option, sizeof option);
+
+    return SUCCESS;
+}
+
+/*
+ * The sockets and file the calibration moves bytes between: whatever is
+ * written to src can be relayed from rx to tx, and then read back from sink.
+ */
+struct bench {
+    int src, rx, tx, sink;
+    int file_fd; // CALIBRATE_MAX bytes
+    char buf[CALIBRATE_MAX];
+};
+
+/*
+ * Time moving size bytes CALIBRATE_REPS times by the given path.
+ * Relays are timed when file is false, sending the file otherwise.
+ * Returns the best time in seconds, or a negative number on failure.
+ */
+static double
+bench_time(struct bench *bench, size_t size, enum transfer_path path,
+           bool file)
+{
+    double best = -1;
+
+    for (int round = 0; round < CALIBRATE_ROUNDS; ++round) {
+        double elapsed = 0;
+
+        for (int rep = 0; rep < CALIBRATE_REPS; ++rep) {
+            off_t offset = 0;
+            double start;
+            ssize_t res;
+
+            if (!file && write(bench->src, bench->buf, size) != size)
+                return -1;
+
+            start = now();
+            if (file)
+                res = path == TRANSFER_COPY
+                    ? pread_loop(bench->file_fd, bench->tx, &offset, size,
+                                 NULL)
+                    : sendfile_loop(bench->file_fd, bench->tx, &offset, size,
+                                    NULL);
+            else
+                res = path == TRANSFER_COPY
+                    ? copy_loop(bench->rx, bench->tx, size, NULL)
+                    : splice_loop(bench->rx, bench->tx, size, NULL);
+            elapsed += now() - start;
+
+            if (res != size)
+                return -1;
+
+            for (size_t n = 0; n < size; ) {
+                ssize_t const res1 = read(bench->sink, bench->buf, size - n);
+                if (res1 <= 0)
+                    return -1;
+                n += res1;
+            }
+        }
+
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+/*
+ * Find the smallest transfer size from which the zero-copy path is never
+ * slower than copying, halving from CALIBRATE_MAX.
+ * If copying always wins, the zero-copy path is left for transfers too large
+ * to have been timed.
+ * Returns 0 on failure.
+ */
+static size_t
+bench_threshold(struct bench *bench, enum transfer_path path, bool file)
+{
+    size_t threshold = CALIBRATE_MAX * 2;
+
+    for (size_t size = CALIBRATE_MAX; size >= CALIBRATE_MIN; size /= 2) {
+        double const copy = bench_time(bench, size, TRANSFER_COPY, file);
+        double const zerocopy = bench_time(bench, size, path, file);
+
+        if (copy < 0 || zerocopy < 0)
+            return 0;
+        if (zerocopy > copy)
+            break;
+        threshold = size;
+    }
+
+    return threshold;
+}
+
+/*
+ * Time both ways of relaying between sockets and of sending a file, and set
+ * the thresholds that have not been given.
+ */
+static int
+calibrate(struct transfer *transfer)
+{
+    static struct bench bench; // too large for the stack
+    int in[2], out[2];
+    int res = FAILURE;
+
+    if (loopback_pair(in) == FAILURE)
+        return FAILURE;
+    if (loopback_pair(out) == FAILURE) {
+        close(in[0]);
+        close(in[1]);
+        return FAILURE;
+    }
+
+    bench.src = in[0];
+    bench.rx = in[1];
+    bench.tx = out[0];
+    bench.sink = out[1];
+    memset(bench.buf, 'x', sizeof bench.buf);
+
+    bench.file_fd = memfd_create("proxy-calibrate", MFD_CLOEXEC);
+    if (bench.file_fd == FAILURE
+        || write(bench.file_fd, bench.buf, sizeof bench.buf) != sizeof bench.buf)
+        goto out;
+
+    if (transfer->splice_min == 0
+        && (transfer->splice_min =
+            bench_threshold(&bench, TRANSFER_SPLICE, false)) == 0)
+        goto out;
+
+    if (transfer->sendfile_min == 0
+        && (transfer->sendfile_min =
+            bench_threshold(&bench, TRANSFER_SENDFILE, true)) == 0)
+        goto out;
+
+    res = SUCCESS;
+
+ out:
+    if (bench.file_fd != FAILURE)
+        close(bench.file_fd);
+    for (int i = 0; i < 2; ++i) {
+        close(in[i]);
+        close(out[i]);
+    }
+
+    return res;
+}
+#endif
+
+struct transfer *
+transfer_create(size_t splice_min, size_t sendfile_min, struct stats *stats,
+                bool verbose)
+{
+    struct transfer *transfer;
+
+    transfer = malloc(sizeof *transfer);
+    if (transfer == NULL) {
+        perror("transfer_create(): failed to allocate transfer settings");
+        return NULL;
+    }
+
+    transfer->splice_min = splice_min;
+    transfer->sendfile_min = sendfile_min;
+    transfer->stats = stats;
+    transfer->shaper = NULL;
+
+#ifdef __linux__
+    if ((splice_min == 0 || sendfile_min == 0)
+        && calibrate(transfer) == FAILURE) {
+        perror("transfer_create(): calibration failed");
+        // Fall back to zero-copy for anything but the smallest transfers.
+        if (transfer->splice_min == 0)
+            transfer->splice_min = CALIBRATE_MIN;
+        if (transfer->sendfile_min == 0)
+            transfer->sendfile_min = CALIBRATE_MIN;
+    }
+
+    if (verbose)
+        fprintf(stderr, "splicing transfers of %zu bytes or more, "
+                "using sendfile for %zu bytes or more\n",
+                transfer->splice_min, transfer->sendfile_min);
+#else
+    // Everything else has to copy to and from userspace.
+    transfer->splice_min = transfer->sendfile_min = SIZE_MAX;
+#endif
+
+    return transfer;
+}
+
+void
+transfer_destroy(struct transfer *transfer)
+{
+    free(transfer);
+}
+
+void
+transfer_count(struct transfer *transfer, enum transfer_path path, size_t len)
+{
+    stats_add(transfer->stats, STATS_TRANSFERS + path, 1);
+    stats_add(transfer->stats, STATS_TRANSFER_BYTES + path, len);
+}
+
+/*
+ * The transfer settings if transfers to tx_fd are shaped, otherwise NULL.
+ */
+static struct transfer const *
+shaped(struct transfer const *transfer, int tx_fd)
+{
+    return transfer->shaper != NULL && tx_fd == transfer->shaped_fd
+        ? transfer : NULL;
+}
+
+ssize_t
+transfer_relay(struct transfer *transfer, int rx_fd, int tx_fd, size_t len)
+{
+#ifdef __linux__
+    if (len >= transfer->splice_min) {
+        transfer_count(transfer, TRANSFER_SPLICE, len);
+        return splice_loop(rx_fd, tx_fd, len, shaped(transfer, tx_fd));
+    }
+#endif
+
+    transfer_count(transfer, TRANSFER_COPY, len);
+    return copy_loop(rx_fd, tx_fd, len, shaped(transfer, tx_fd));
+}
+
+ssize_t
+transfer_file(struct transfer *transfer, int file_fd, int tx_fd,
+              off_t *offset, size_t len)
+{
+#ifdef __linux__
+    if (len >= transfer->sendfile_min) {
+        transfer_count(transfer, TRANSFER_SENDFILE, len);
+        return sendfile_loop(file_fd, tx_fd, offset, len,
+                             shaped(transfer, tx_fd));
+    }
+#endif
+
+    transfer_count(transfer, TRANSFER_COPY, len);
+    return pread_loop(file_fd, tx_fd, offset, len, shaped(transfer, tx_fd));
+}
+
+void
+transfer_shape(struct transfer *transfer, struct shaper *shaper, int fd,
+               struct shape_path const *path)
+{
+    transfer->shaper = shaper;
+    transfer->shaped_fd = fd;
+    transfer->path = path;
+}
+
+void
+transfer_pace(struct transfer const *transfer, int tx_fd, size_t len)
+{
+    pace(shaped(transfer, tx_fd), len);
+}
+
+/*
+ * Create an anonymous file to spool into.
+ */
+static int
+spool_file(void)
+{
+#ifdef __linux__
+    return memfd_create("proxy-spool", MFD_CLOEXEC);
+#else
+    FILE *fp = tmpfile();
+    int fd;
+
+    if (fp == NULL)
+        return FAILURE;
+    fd = dup(fileno(fp));
+    fclose(fp);
+    if (fd != FAILURE)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+#endif
+}
+
+int
+transfer_spool(struct transfer *transfer, int rx_fd, size_t len)
+{
+    int fd, res = SUCCESS, error;
+    size_t n = 0;
+    char *base;
+
+    fd = spool_file();
+    if (fd == FAILURE)
+        return SPOOL_FAIL;
+
+    // Read straight into the file's pages, rather than through a buffer.
+    if (ftruncate(fd, len) == FAILURE
+        || (base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+           == MAP_FAILED) {
+        close(fd);
+        return SPOOL_FAIL;
+    }
+
+    transfer_count(transfer, TRANSFER_COPY, len);
+
+    while (n < len) {
+        ssize_t const got = read(rx_fd, base + n, len - n);
+
+        if (got == 0) {
+            res = RX_SHORT; // peer closed connection
+            break;
+        }
+        if (got == FAILURE) {
+            res = READ_FAIL;
+            break;
+        }
+        n += got;
+    }
+
+    // The caller may want to know why a read failed.
+    error = errno;
+    munmap(base, len);
+    if (res != SUCCESS) {
+        close(fd);
+        errno = error;
+        return res;
+    }
+
+    return fd;
+}
+
+void
+transfer_cork(int fd, bool cork)
+{
+    int const option = cork;
+
+#if defined(TCP_CORK)
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &option, sizeof option);
+#elif defined(TCP_NOPUSH)
+    setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &option, sizeof option);
+#endif
+}
+
+void
+transfer_report(struct transfer const *transfer)
+{
+    unsigned long totals[STATS_COUNTERS];
+
+    stats_total(transfer->stats, totals);
+
+    for (int path = 0; path < TRANSFER_PATHS; ++path)
+        fprintf(stderr, "%s %lu bytes in %lu transfers\n", path_names[path],
+                totals[STATS_TRANSFER_BYTES + path],
+                totals[STATS_TRANSFERS + path]);
+}
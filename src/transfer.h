@@ -0,0 +1,159 @@
+/*
+ * transfer.h
+ * Interface to moving bytes between file descriptors.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _transfer_h_
+#define _transfer_h_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * Bodies are relayed between sockets and sent from cache files without
+ * looking at them. There is more than one way to do that, and which is
+ * cheapest depends on how much there is to move:
+ *
+ * - copy: read(2) into a buffer and write(2) it out again. The bytes are
+ *   copied twice, but it only takes two system calls.
+ * - splice: move the bytes through a pipe without copying them (Linux). Each
+ *   transfer needs a pipe and at least two splice(2) calls per chunk.
+ * - sendfile: send a file straight from the page cache (Linux).
+ *
+ * A body can also be spooled: read as fast as its sender can send it into an
+ * anonymous file, to be sent on from there at whatever pace the receiver
+ * takes it. The sender is then free to go.
+ *
+ * Each transfer takes the zero-copy path only if it is at least as long as
+ * a threshold. Unless given, the thresholds are found when the proxy starts
+ * by timing both ways over a loopback connection.
+ *
+ * The number of transfers and bytes that took each path are counted in the
+ * shared statistics.
+ *
+ * Transfers to one socket can be shaped (see shape.h), moving a chunk at a
+ * time and waiting for bandwidth before sending each one on.
+ *
+ * Whichever the path, the kernel is told when more of a transfer is to come,
+ * so that it sends full segments rather than a small one per chunk. A socket
+ * can also be corked while a response is put together from several pieces.
+ */
+
+enum transfer_path {
+    TRANSFER_COPY,
+    TRANSFER_SPLICE,
+    TRANSFER_SENDFILE,
+    TRANSFER_PATHS
+};
+
+/*
+ * Failures, as returned by transfer_relay() and transfer_file().
+ */
+enum {
+    PIPE_FAIL      = -2,
+    SPLICE_RX_FAIL = -3,
+    SPLICE_TX_FAIL = -4,
+    READ_FAIL      = -5,
+    WRITE_FAIL     = -6,
+    RX_SHORT       = -7,
+    SPOOL_FAIL     = -8
+};
+
+struct shape_path;
+struct shaper;
+struct stats;
+struct transfer;
+
+/*
+ * Settle the thresholds: transfers of at least splice_min bytes between
+ * sockets are spliced and files of at least sendfile_min bytes are sent with
+ * sendfile(2). A threshold of 0 is calibrated. Transfers are counted in stats.
+ * Returns NULL on failure.
+ */
+struct transfer *transfer_create(size_t splice_min, size_t sendfile_min,
+                                 struct stats *stats, bool verbose);
+
+/*
+ * Release the transfer settings.
+ */
+void transfer_destroy(struct transfer *transfer);
+
+/*
+ * Transfer len bytes from rx_fd to the socket tx_fd.
+ * Returns len, or one of the failures above.
+ */
+ssize_t transfer_relay(struct transfer *transfer, int rx_fd, int tx_fd,
+                       size_t len);
+
+/*
+ * Transfer len bytes of a file to the socket tx_fd, starting at *offset, which is
+ * advanced past the bytes sent.
+ * Returns len, or one of the failures above.
+ */
+ssize_t transfer_file(struct transfer *transfer, int file_fd, int tx_fd,
+                      off_t *offset, size_t len);
+
+/*
+ * Read len bytes from rx_fd into a new anonymous file, to be sent on with
+ * transfer_file(). The file is kept in memory where the system allows.
+ * Returns the file descriptor, or one of the failures above.
+ */
+int transfer_spool(struct transfer *transfer, int rx_fd, size_t len);
+
+/*
+ * Shape the transfers to the socket fd with shaper, charging them to *path,
+ * which is read at each chunk, so it can change from one response to the next.
+ */
+void transfer_shape(struct transfer *transfer, struct shaper *shaper, int fd,
+                    struct shape_path const *path);
+
+/*
+ * Wait for the bandwidth to send len bytes to tx_fd some other way, such as
+ * from a buffer of the caller's, if transfers to tx_fd are shaped.
+ */
+void transfer_pace(struct transfer const *transfer, int tx_fd, size_t len);
+
+/*
+ * Hold back partial segments on the TCP socket fd while cork is true, and
+ * send whatever is left once it is false. Other sockets are left alone.
+ */
+void transfer_cork(int fd, bool cork);
+
+/*
+ * Count len bytes moved some other way.
+ */
+void transfer_count(struct transfer *transfer, enum transfer_path path,
+                    size_t len);
+
+/*
+ * Print the counters, totalled over all processes, to stderr.
+ */
+void transfer_report(struct transfer const *transfer);
+
+#endif // _transfer_h_
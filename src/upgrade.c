@@ -0,0 +1,290 @@
+/*
+ * upgrade.c
+ * Implementation of handing a running proxy over to a new one.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "upgrade.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+#define UPGRADE_ENV "PROXY_UPGRADE_FD" // The new proxy's end of the channel
+#define UPGRADE_TIMEOUT 10 // Seconds to wait for the new proxy to be ready
+#define UPGRADE_FDS_MAX 3  // File descriptors in struct upgrade_fds
+
+/*
+ * Send the file descriptors in fds that are not -1 with SCM_RIGHTS.
+ * The struct itself goes along as the message, so the receiver knows which
+ * ones they are.
+ */
+static int
+send_fds(int channel, struct upgrade_fds const *fds)
+{
+    int const all[UPGRADE_FDS_MAX] = {
+        fds->listen_fd, fds->cache_fd, fds->stats_fd
+    };
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof all)];
+    } control;
+    struct iovec iov = { .iov_base = (void *)fds, .iov_len = sizeof *fds };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    int sent[UPGRADE_FDS_MAX];
+    size_t nfds = 0;
+
+    for (size_t i = 0; i < UPGRADE_FDS_MAX; ++i)
+        if (all[i] != FAILURE)
+            sent[nfds++] = all[i];
+
+    if (nfds > 0) {
+        memset(&control, 0, sizeof control);
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof (int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof (int));
+        memcpy(CMSG_DATA(cmsg), sent, nfds * sizeof (int));
+    }
+
+    if (sendmsg(channel, &msg, 0) != sizeof *fds) {
+        perror("upgrade_start(): failed to hand over file descriptors");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Receive the file descriptors sent by send_fds() into fds.
+ */
+static int
+receive_fds(int channel, struct upgrade_fds *fds)
+{
+    int * const all[UPGRADE_FDS_MAX] = {
+        &fds->listen_fd, &fds->cache_fd, &fds->stats_fd
+    };
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(UPGRADE_FDS_MAX * sizeof (int))];
+    } control;
+    struct upgrade_fds sent;
+    struct iovec iov = { .iov_base = &sent, .iov_len = sizeof sent };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof control.buf,
+    };
+    struct cmsghdr *cmsg;
+    int received[UPGRADE_FDS_MAX];
+    size_t nfds = 0, next = 0;
+    ssize_t len;
+    int flags = 0;
+
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    len = recvmsg(channel, &msg, flags);
+    if (len == FAILURE) {
+        perror("upgrade_receive(): failed to receive file descriptors");
+        return FAILURE;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+            memcpy(received, CMSG_DATA(cmsg), nfds * sizeof (int));
+        }
+
+    // Match the descriptors up with the ones the old proxy had.
+    memcpy(fds, &sent, sizeof *fds);
+    for (size_t i = 0; i < UPGRADE_FDS_MAX; ++i)
+        if (*all[i] != FAILURE)
+            *all[i] = next < nfds ? received[next++] : FAILURE;
+
+    if (len != sizeof sent || (msg.msg_flags & MSG_CTRUNC) || next != nfds) {
+        fputs("upgrade_receive(): bad hand over from the old proxy\n", stderr);
+        for (size_t i = 0; i < nfds; ++i)
+            close(received[i]);
+        for (size_t i = 0; i < UPGRADE_FDS_MAX; ++i)
+            *all[i] = FAILURE;
+        return FAILURE;
+    }
+
+#ifndef MSG_CMSG_CLOEXEC
+    for (size_t i = 0; i < nfds; ++i)
+        fcntl(received[i], F_SETFD, FD_CLOEXEC);
+#endif
+
+    return SUCCESS;
+}
+
+/*
+ * Run argv with the channel to the old proxy in the environment.
+ */
+static void
+run_new_proxy(char * const argv[], int channel)
+{
+    char env[16];
+
+    snprintf(env, sizeof env, "%d", channel);
+    if (setenv(UPGRADE_ENV, env, 1) == FAILURE) {
+        perror("upgrade_start(): failed to set environment");
+        _exit(EXIT_FAILURE);
+    }
+
+    execvp(argv[0], argv);
+    perror("upgrade_start(): failed to run the new proxy");
+    _exit(EXIT_FAILURE);
+}
+
+pid_t
+upgrade_start(char * const argv[], struct upgrade_fds const *fds, bool verbose)
+{
+    struct timeval const timeout = { UPGRADE_TIMEOUT, 0 };
+
+    int channel[2];
+    pid_t pid;
+    ssize_t len;
+
+    if (verbose)
+        fprintf(stderr, "upgrading to %s\n", argv[0]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == FAILURE) {
+        perror("upgrade_start(): failed to create socket pair");
+        return FAILURE;
+    }
+
+    switch (pid = fork()) {
+    case -1:
+        perror("upgrade_start(): failed to fork a child process");
+        close(channel[0]);
+        close(channel[1]);
+        return FAILURE;
+    case 0:
+        // Fork again, so the new proxy is orphaned rather than our child.
+        close(channel[0]);
+        switch (fork()) {
+        case -1:
+            perror("upgrade_start(): failed to fork the new proxy");
+            _exit(EXIT_FAILURE);
+        case 0:
+            run_new_proxy(argv, channel[1]);
+            /* NOTREACHED */
+        default:
+            _exit(EXIT_SUCCESS);
+        }
+    default:
+        close(channel[1]);
+        waitpid(pid, NULL, 0);
+    }
+
+    // The new proxy answers with its process ID once it is ready.
+    if (send_fds(channel[0], fds) == FAILURE
+        || setsockopt(channel[0], SOL_SOCKET, SO_RCVTIMEO,
+                      &timeout, sizeof timeout) == FAILURE) {
+        close(channel[0]);
+        return FAILURE;
+    }
+    len = read(channel[0], &pid, sizeof pid);
+    close(channel[0]);
+    if (len != sizeof pid) {
+        fputs("upgrade_start(): the new proxy failed to start\n", stderr);
+        return FAILURE;
+    }
+
+    return pid;
+}
+
+int
+upgrade_receive(struct upgrade_fds *fds, bool verbose)
+{
+    char const *env = getenv(UPGRADE_ENV);
+
+    char *end;
+    long channel;
+
+    fds->listen_fd = FAILURE;
+    fds->cache_fd = FAILURE;
+    fds->stats_fd = FAILURE;
+
+    if (env == NULL)
+        return FAILURE;
+
+    channel = strtol(env, &end, 10);
+    if (end == env || *end != '\0' || channel < 0 || channel > INT_MAX) {
+        fprintf(stderr, "upgrade_receive(): invalid channel: %s\n", env);
+        unsetenv(UPGRADE_ENV);
+        return FAILURE;
+    }
+    // Not for whatever this proxy runs.
+    unsetenv(UPGRADE_ENV);
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+    if (receive_fds(channel, fds) == FAILURE) {
+        close(channel);
+        return FAILURE;
+    }
+
+    if (verbose)
+        fputs("taking over from the old proxy\n", stderr);
+
+    return channel;
+}
+
+int
+upgrade_ready(int channel)
+{
+    pid_t const pid = getpid();
+
+    ssize_t len;
+
+    len = write(channel, &pid, sizeof pid);
+    close(channel);
+    if (len != sizeof pid) {
+        perror("upgrade_ready(): the old proxy gave up waiting");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
@@ -0,0 +1,81 @@
+/*
+ * upgrade.h
+ * Interface to handing a running proxy over to a new one.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _upgrade_h_
+#define _upgrade_h_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+
+/*
+ * A proxy is upgraded by running its program again, from the same path with
+ * the same arguments, so that whatever binary is installed there now takes
+ * over. The old proxy hands its listening socket and shared regions to the new
+ * one over a UNIX socket, so no connection is refused and the cache stays warm.
+ * Once the new proxy is ready, the old one stops accepting connections and
+ * exits when its children have finished with the ones they have.
+ *
+ * The new proxy is not a child of the old one, which would otherwise wait for
+ * it to exit along with the rest of its children.
+ */
+
+/*
+ * The file descriptors handed from one proxy to the next.
+ * Any of them may be -1 if there is nothing to hand over.
+ */
+struct upgrade_fds {
+    int listen_fd; // The listening socket
+    int cache_fd;  // The shared index of the response cache
+    int stats_fd;  // The shared statistics
+};
+
+/*
+ * Run argv as a new proxy and hand it fds.
+ * Returns the process ID of the new proxy once it is ready to accept
+ * connections, or -1 if it failed to start.
+ */
+pid_t upgrade_start(char * const argv[], struct upgrade_fds const *fds,
+                    bool verbose);
+
+/*
+ * Receive the file descriptors handed over by the proxy being upgraded, if this
+ * proxy was started by upgrade_start().
+ * Returns a channel to pass to upgrade_ready(), or -1 if there is nothing to
+ * take over, in which case all of fds are set to -1.
+ */
+int upgrade_receive(struct upgrade_fds *fds, bool verbose);
+
+/*
+ * Tell the old proxy this one is ready to accept connections, and close the
+ * channel. Returns -1 if the old proxy gave up waiting, and is still serving.
+ */
+int upgrade_ready(int channel);
+
+#endif // _upgrade_h_
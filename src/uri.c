@@ -31,6 +31,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 
 /*
@@ -108,6 +109,10 @@ parse_uri(char *buf, size_t len)
             return site;
         }
     }
+    else if (uri_is_https(site)) {
+        site.authority.port.p = (char *)"443"; // XXX: not ideal...
+        site.authority.port.len = 3;
+    }
     else {
         site.authority.port.p = (char *)"80"; // XXX: not ideal...
         site.authority.port.len = 2;
@@ -128,6 +133,63 @@ parse_uri(char *buf, size_t len)
     return site;
 }
 
+struct uri
+parse_origin_form(char *buf, size_t len, struct iostring host)
+{
+    struct uri site = { .end = buf + len };
+    char *after = host.p, *colon;
+
+    if (len == 0 || *buf != '/') {
+        fputs("warning: invalid uri (not in origin-form)\n", stderr);
+        return site;
+    }
+
+    site.scheme.p = (char *)"http"; // XXX: not ideal...
+    site.scheme.len = 4;
+
+    site.authority.host = host;
+    // An IPv6 address is in brackets, with colons of its own before the port.
+    if (host.len != 0 && *host.p == '[') {
+        after = memchr(host.p, ']', host.len);
+        if (after == NULL
+            || (++after != host.p + host.len && *after != ':')) {
+            fputs("warning: invalid uri (bad IPv6 host)\n", stderr);
+            return site;
+        }
+    }
+    colon = host.len != 0
+        ? memchr(after, ':', host.p + host.len - after) : NULL;
+    if (colon != NULL && colon + 1 != host.p + host.len) {
+        site.authority.host.len = colon - host.p;
+        site.authority.port.p = colon + 1;
+        site.authority.port.len = host.p + host.len - (colon + 1);
+    }
+    else {
+        if (colon != NULL)
+            site.authority.host.len = colon - host.p;
+        site.authority.port.p = (char *)"80"; // XXX: not ideal...
+        site.authority.port.len = 2;
+    }
+
+    if (site.authority.host.len == 0) {
+        fputs("warning: invalid uri (empty host)\n", stderr);
+        return site;
+    }
+
+    site.path_query_fragment.p = buf;
+    site.path_query_fragment.len = len;
+
+    site.valid = true;
+
+    return site;
+}
+
+bool
+uri_is_https(struct uri uri)
+{
+    return uri.scheme.len == 5 && strncasecmp(uri.scheme.p, "https", 5) == 0;
+}
+
 void
 debug_uri(struct uri uri)
 {
@@ -53,7 +53,8 @@ struct uri {
  * Parse the given memory region for an HTTP request line.
  * ! Assumes the format scheme://host[:port][path?query#fragment]
  * ! The scheme://host portion must be present.
- * ! If the port is not specified, the string constant "80" is used.
+ * ! If the port is not specified, the string constant "443" is used for https
+ *   and "80" for anything else.
  * ! If the path_query_fragment is empty, the string constant "/" is used.
  * ! Assumes the path, query, and fragment portion of the URL to be the tail
  *   of the URI after the optional port.
@@ -64,6 +65,25 @@ struct uri {
  */
 struct uri parse_uri(char *buf, size_t len);
 
+/*
+ * Make a URI from a request target in origin-form and the Host header field
+ * value, as received by a reverse proxy.
+ * ! Assumes the format /path?query#fragment for the target and host[:port]
+ *   for the Host header field value, where an IPv6 host is in brackets,
+ *   which are kept.
+ * ! The scheme is the string constant "http".
+ * ! If the port is not specified, the string constant "80" is used.
+ * If the target is not in origin-form or the host is empty,
+ * the .valid member of the returned data structure will be false.
+ */
+struct uri parse_origin_form(char *buf, size_t len, struct iostring host);
+
+/*
+ * Whether the scheme of a valid URI is https, meaning the server must be
+ * connected to with TLS.
+ */
+bool uri_is_https(struct uri uri);
+
 /*
  * Print the contents of the given data structure to stdout.
  * If the data structure is valid, all of its iostring fields are printed.
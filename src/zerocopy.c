@@ -0,0 +1,184 @@
+/*
+ * zerocopy.c
+ * Implementation of zero-copy sends of buffers in memory.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "zerocopy.h"
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+enum { SUCCESS = 0, FAILURE = -1 };
+
+/*
+ * Plain old write(2) until all of the buffer is sent.
+ */
+static ssize_t
+write_all(int fd, char const *buf, size_t len)
+{
+    for (size_t n = 0; n < len; ) {
+        ssize_t const res = write(fd, buf + n, len - n);
+        if (res == FAILURE)
+            return FAILURE;
+        n += res;
+    }
+
+    return len;
+}
+
+#ifdef MSG_ZEROCOPY
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Read the completions on the error queue of the socket, waiting up to
+ * timeout_ms milliseconds in all for every send to be done.
+ * Returns FAILURE if the socket failed or the wait timed out.
+ */
+static int
+zerocopy_reap(struct zerocopy *zc, unsigned timeout_ms)
+{
+    long long const deadline = now_ms() + timeout_ms;
+
+    while (zc->done != zc->sent) {
+        char control[128];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof control,
+        };
+        struct pollfd pfd = { .fd = zc->fd };
+        long long left;
+
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) == FAILURE) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return FAILURE;
+            left = deadline - now_ms();
+            // The error queue makes the socket poll with POLLERR.
+            if (left <= 0 || poll(&pfd, 1, left) != 1) {
+                errno = EAGAIN;
+                return FAILURE;
+            }
+            continue;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+             cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err const *serr;
+
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6
+                     && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            serr = (struct sock_extended_err const *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY
+                || serr->ee_errno != 0)
+                continue;
+
+            // Sends ee_info through ee_data are done.
+            zc->done = serr->ee_data + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                ++zc->copied;
+                zc->enabled = false; // Not worth it on this socket.
+            }
+        }
+    }
+
+    return SUCCESS;
+}
+#endif
+
+ssize_t
+zerocopy_send(struct zerocopy *zc, int fd, void const *buf, size_t len)
+{
+#ifdef MSG_ZEROCOPY
+    int const one = 1;
+
+    char const *p = buf;
+    size_t n = 0;
+
+    if (zc->fd != fd) {
+        *zc = (struct zerocopy)ZEROCOPY_INIT;
+        zc->fd = fd;
+        zc->enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY,
+                                 &one, sizeof one) == SUCCESS;
+    }
+
+    // Take whatever completions are already in, without waiting for more.
+    if (zerocopy_reap(zc, 0) == FAILURE && errno != EAGAIN)
+        return FAILURE;
+
+    while (zc->enabled && n < len) {
+        ssize_t const res = send(fd, p + n, len - n, MSG_ZEROCOPY);
+        if (res == FAILURE) {
+            if (errno != ENOBUFS)
+                return FAILURE;
+            break; // Out of memory to pin pages: copy the rest.
+        }
+        ++zc->sent;
+        zc->bytes += res;
+        n += res;
+    }
+
+    if (n < len && write_all(fd, p + n, len - n) == FAILURE)
+        return FAILURE;
+
+    return len;
+#else
+    return write_all(fd, buf, len);
+#endif
+}
+
+int
+zerocopy_wait(struct zerocopy *zc, unsigned timeout_ms)
+{
+#ifdef MSG_ZEROCOPY
+    if (zc->fd == -1)
+        return SUCCESS;
+
+    return zerocopy_reap(zc, timeout_ms);
+#else
+    return SUCCESS;
+#endif
+}
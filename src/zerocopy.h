@@ -0,0 +1,77 @@
+/*
+ * zerocopy.h
+ * Interface to zero-copy sends of buffers in memory.
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef _zerocopy_h_
+#define _zerocopy_h_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * With MSG_ZEROCOPY (Linux), the kernel sends straight from the pages of the
+ * buffer instead of copying it into socket buffers first. The buffer must not
+ * change until the kernel reports on the socket's error queue that it is done
+ * with it, which takes until the peer has acknowledged the data.
+ * zerocopy_send() only takes the completions already reported, so a caller
+ * waits with zerocopy_wait() just before changing or freeing the buffer.
+ *
+ * Pinning the pages and reaping the completions costs more than copying a
+ * small buffer, so only large buffers are worth it. When the kernel has to
+ * copy anyway (over loopback, for one), zero-copy is turned off for the
+ * socket.
+ */
+
+struct zerocopy {
+    int fd; // -1 until enabled on a socket
+    bool enabled;
+    uint32_t sent, done; // Send calls made and completed
+    unsigned long bytes, copied; // Bytes sent, completions the kernel copied
+};
+
+#define ZEROCOPY_INIT { .fd = -1 }
+
+/*
+ * Send the whole buffer on fd, the same way as write(2) in a loop, but without
+ * copying it if possible. The buffer must be left alone until zerocopy_wait().
+ * Returns len, or -1 on failure.
+ */
+ssize_t zerocopy_send(struct zerocopy *zc, int fd, void const *buf, size_t len);
+
+/*
+ * Wait up to timeout_ms milliseconds for the kernel to be done with every
+ * buffer sent so far.
+ * Returns 0, or -1 if the socket failed or the wait timed out, in which case
+ * the buffers are still in use and the socket should be closed.
+ */
+int zerocopy_wait(struct zerocopy *zc, unsigned timeout_ms);
+
+#endif // _zerocopy_h_
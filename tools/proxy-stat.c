@@ -0,0 +1,241 @@
+/*
+ * proxy-stat.c
+ * Report the statistics of a running proxy, in the manner of vmstat(8).
+ */
+
+/*
+  MIT License
+
+  Copyright (c) 2018 Ryan Moeller
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "stats.h"
+#include "transfer.h"
+
+#define HEADER_EVERY 20 // Lines between repeated headers
+
+static char const * const path_names[TRANSFER_PATHS] = {
+    [TRANSFER_COPY] = "copy",
+    [TRANSFER_SPLICE] = "splice",
+    [TRANSFER_SENDFILE] = "sendfile",
+};
+
+static void usage(char const * const progname, int status)
+{
+    printf("usage: %s [-i SECONDS] [-c COUNT] PORT, where\n", progname);
+    printf("\t-i SECONDS to report every SECONDS (default 1)\n");
+    printf("\t-c COUNT to stop after COUNT reports (default never)\n");
+    printf("  PORT is the port the proxy listens on.\n");
+    printf("The first report is averaged since the proxy started, the rest\n"
+           "over each interval. Rates are per second.\n");
+
+    exit(status);
+}
+
+/*
+ * Seconds on the clock the proxy notes when it started.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Whether the proxy counting in the segment is still running.
+ */
+static bool running(struct stats const *stats)
+{
+    pid_t const pid = stats_pid(stats);
+
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+/*
+ * Format a rate of bytes to fit in a column, with a k, M, or G suffix.
+ */
+static char const *format_bytes(char *buf, size_t size, double rate)
+{
+    static char const suffixes[] = " kMG";
+
+    int i = 0;
+
+    while (rate >= 10000 && i < sizeof suffixes - 2) {
+        rate /= 1024;
+        ++i;
+    }
+    if (i == 0)
+        snprintf(buf, size, "%.0f", rate);
+    else
+        snprintf(buf, size, "%.0f%c", rate, suffixes[i]);
+
+    return buf;
+}
+
+static void print_header(void)
+{
+    printf("%6s %7s %7s %7s", "conns", "req/s", "recv/s", "sent/s");
+    for (int i = 0; i < STATUS_COUNT; ++i)
+        printf(" %4.*s", (int)http_errors[i].status.len,
+               http_errors[i].status.p);
+    for (int i = 0; i < TRANSFER_PATHS; ++i)
+        printf(" %8s", path_names[i]);
+    printf(" %7s %5s %6s %6s\n", "shaped", "wait", "mem", "peak");
+}
+
+/*
+ * Print the counters that changed from before to after over secs seconds,
+ * and the levels of the gauges.
+ */
+static void print_rates(unsigned long const *before,
+                        unsigned long const *after,
+                        unsigned long const *levels, double secs)
+{
+    char buf[16];
+
+#define RATE(counter) ((after[counter] - before[counter]) / secs)
+
+    printf("%6lu %7.0f", after[STATS_CONNECTIONS] - after[STATS_CLOSED],
+           RATE(STATS_REQUESTS));
+    printf(" %7s", format_bytes(buf, sizeof buf, RATE(STATS_REQUEST_BYTES)));
+    printf(" %7s", format_bytes(buf, sizeof buf, RATE(STATS_RESPONSE_BYTES)));
+    for (int i = 0; i < STATUS_COUNT; ++i)
+        printf(" %4.0f", RATE(STATS_ERRORS + i));
+    for (int i = 0; i < TRANSFER_PATHS; ++i)
+        printf(" %8s", format_bytes(buf, sizeof buf,
+                                    RATE(STATS_TRANSFER_BYTES + i)));
+    // Milliseconds spent waiting for bandwidth per second, over all workers.
+    printf(" %7s %5.0f",
+           format_bytes(buf, sizeof buf, RATE(STATS_SHAPED_BYTES)),
+           RATE(STATS_SHAPED_WAIT) / 1000);
+    printf(" %6s", format_bytes(buf, sizeof buf, levels[STATS_MEMORY]));
+    printf(" %6s\n", format_bytes(buf, sizeof buf, levels[STATS_MEMORY_PEAK]));
+
+#undef RATE
+}
+
+/*
+ * Main entry point.
+ * Opens the statistics of the proxy on the given port and reports them until
+ * interrupted.
+ */
+int main(int argc, char * const argv[])
+{
+    unsigned long counters[2][STATS_COUNTERS];
+    unsigned long levels[STATS_GAUGES];
+    unsigned interval = 1;
+    long count = -1;
+    double then, started;
+    struct stats *stats;
+    char *end;
+    int opt, port;
+
+    while (-1 != (opt = getopt(argc, argv, "hi:c:"))) {
+        switch (opt) {
+        case 'h':
+            usage(argv[0], EXIT_SUCCESS);
+        case 'i':
+            interval = strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || interval == 0) {
+                fprintf(stderr, "invalid interval: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            count = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || count <= 0) {
+                fprintf(stderr, "invalid count: %s\n", optarg);
+                usage(argv[0], EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage(argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 1)
+        usage(argv[0], EXIT_FAILURE);
+
+    port = atoi(argv[optind]);
+    if (port <= 0 || port > UINT16_MAX) {
+        fprintf(stderr, "invalid port: %s\n", argv[optind]);
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    stats = stats_open(port);
+    if (stats == NULL) {
+        fprintf(stderr, "no statistics for a proxy on port %d: %s\n",
+                port, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (!running(stats)) {
+        fprintf(stderr, "the proxy on port %d is not running\n", port);
+        return EXIT_FAILURE;
+    }
+
+    // The first report covers everything since the proxy started.
+    memset(counters[0], 0, sizeof counters[0]);
+    started = stats_started(stats);
+    then = now();
+    stats_total(stats, counters[1]);
+
+    for (long line = 0; count < 0 || line < count; ++line) {
+        unsigned long *before = counters[line % 2];
+        unsigned long *after = counters[(line + 1) % 2];
+        double t = then, secs;
+
+        if (line > 0) {
+            sleep(interval);
+            if (!running(stats)) {
+                fprintf(stderr, "the proxy on port %d has exited\n", port);
+                break;
+            }
+            stats_total(stats, after);
+            t = now();
+        }
+        secs = t - (line > 0 ? then : started);
+        then = t;
+
+        if (line % HEADER_EVERY == 0)
+            print_header();
+        stats_gauges(stats, levels);
+        print_rates(before, after, levels, secs > 0 ? secs : 1);
+        fflush(stdout);
+    }
+
+    stats_destroy(stats);
+
+    return EXIT_SUCCESS;
+}